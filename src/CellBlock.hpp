@@ -0,0 +1,79 @@
+#ifndef CZI_EXPRESSION_MATRIX2_CELL_BLOCK_HPP
+#define CZI_EXPRESSION_MATRIX2_CELL_BLOCK_HPP
+
+
+// Class CellBlock is a staging area for a block of cells
+// (for example, all the cells of a plate) read from input files
+// but not yet added to the expression matrix.
+// The expression counts are in compressed sparse row (CSR) format,
+// in the form expected by ExpressionMatrix::addCellBlock:
+// the expression counts for cell i are at positions
+// indptr[i] through indptr[i+1]-1 of geneIndexes and values,
+// and geneIndexes are indexes into geneNames.
+
+// A CellBlock does not refer to the expression matrix,
+// so it can be filled by a worker thread while other threads
+// are adding cells to the expression matrix.
+
+#include "cstdint.hpp"
+#include "string.hpp"
+#include "utility.hpp"
+#include "vector.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        class CellBlock;
+    }
+}
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::CellBlock {
+public:
+    vector<string> geneNames;
+    vector<string> cellNames;
+    vector< pair<string, string> > cellMetaData;    // Added to all cells.
+    vector<uint64_t> indptr;
+    vector<uint32_t> geneIndexes;
+    vector<float> values;
+
+    size_t cellCount() const
+    {
+        return cellNames.size();
+    }
+
+    // Start a new cell.
+    void beginCell(const string& cellName)
+    {
+        if(indptr.empty()) {
+            indptr.push_back(0);
+        }
+        cellNames.push_back(cellName);
+        indptr.push_back(indptr.back());
+    }
+
+    // Add an expression count to the last cell.
+    void addExpressionCount(uint32_t geneIndex, float value)
+    {
+        geneIndexes.push_back(geneIndex);
+        values.push_back(value);
+        ++indptr.back();
+    }
+
+    // Remove the last cell.
+    void removeLastCell()
+    {
+        cellNames.pop_back();
+        indptr.pop_back();
+        geneIndexes.resize(indptr.back());
+        values.resize(indptr.back());
+    }
+
+    // Release all memory.
+    void clear()
+    {
+        *this = CellBlock();
+    }
+};
+
+#endif
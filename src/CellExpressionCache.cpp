@@ -0,0 +1,254 @@
+// Class CellExpressionCache stores a compact copy of the expression counts
+// of a cell set, restricted to a gene set.
+// See CellExpressionCache.hpp for more information.
+
+#include "CellExpressionCache.hpp"
+#include "CZI_ASSERT.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include "algorithm.hpp"
+#include <cmath>
+#include "stdexcept.hpp"
+
+
+
+// Create a new CellExpressionCache for a given gene set and cell set.
+CellExpressionCache::CellExpressionCache(
+    const string& name,
+    const GeneSet& geneSet,
+    const CellSet& cellSet,
+    const CellExpressionCounts& globalExpressionCounts,
+    bool quantize)
+{
+    // Sanity checks.
+    CZI_ASSERT(std::is_sorted(geneSet.begin(), geneSet.end()));
+    if(quantize && geneSet.size() > (1ULL << (32 - quantizedCodeBits))) {
+        throw runtime_error("Gene set is too large for a quantized cell expression cache.");
+    }
+
+    const CellId cellCount = CellId(cellSet.size());
+    info.createNew(name + "-Info");
+    info->cellCount = cellCount;
+    info->geneCount = geneSet.size();
+    info->isQuantized = quantize;
+    geneSet.makeCopy(this->geneSet, name + "-GeneSet");
+    cellSet.makeCopy(this->cellSet, name + "-CellSet");
+    cellInfo.createNew(name + "-CellInfo", cellCount);
+    counts.createNew(name + "-Counts");
+    quantizedCounts.createNew(name + "-QuantizedCounts");
+
+    // Loop over cells in the cell set.
+    vector< pair<GeneId, float> > cellCounts;
+    for(CellId localCellId=0; localCellId!=cellCount; localCellId++) {
+        const CellId globalCellId = cellSet[localCellId];
+
+        // Gather the expression counts of this cell for genes in the gene set.
+        cellCounts.clear();
+        for(const auto& p: globalExpressionCounts[globalCellId]) {
+            const GeneId localGeneId = geneSet.getLocalGeneId(p.first);
+            if(localGeneId != invalidGeneId) {
+                cellCounts.push_back(make_pair(localGeneId, p.second));
+            }
+        }
+
+        CellInfo& cellInfo0 = cellInfo[localCellId];
+        cellInfo0.sum1 = 0.;
+        cellInfo0.sum2 = 0.;
+        cellInfo0.scale = 1.;
+        cellInfo0.hasLogarithmicCodes = false;
+
+        if(!quantize) {
+            counts.appendVector();
+            for(const auto& p: cellCounts) {
+                const float count = p.second;
+                counts.append(p);
+                cellInfo0.sum1 += count;
+                cellInfo0.sum2 += count*count;
+            }
+        } else {
+
+            // Decide whether to use linear or logarithmic codes for this cell,
+            // and compute the scale factor.
+            float maxCount = 0.;
+            bool isExact = true;
+            for(const auto& p: cellCounts) {
+                maxCount = max(maxCount, p.second);
+                if(p.second != std::floor(p.second)) {
+                    isExact = false;
+                }
+            }
+            const double maxCode = double(quantizedCodeMask);
+            if(!isExact || maxCount > maxCode) {
+                cellInfo0.hasLogarithmicCodes = true;
+                cellInfo0.scale = maxCount / getDecodingTable(true).back();
+            }
+
+            // Store the quantized counts.
+            const DecodingTable& decodingTable = getDecodingTable(cellInfo0.hasLogarithmicCodes);
+            quantizedCounts.appendVector();
+            for(const auto& p: cellCounts) {
+                const double x = double(p.second) / double(cellInfo0.scale);
+                const double codeValue = cellInfo0.hasLogarithmicCodes ?
+                    std::log1p(max(0., x)) / logarithmicCodeStep() : x;
+                const uint32_t code = uint32_t(min(maxCode, std::round(codeValue)));
+                quantizedCounts.append((uint32_t(p.first) << quantizedCodeBits) | code);
+                const float count = decodingTable[code] * cellInfo0.scale;
+                cellInfo0.sum1 += count;
+                cellInfo0.sum2 += count*count;
+            }
+        }
+    }
+}
+
+
+
+// Access an existing CellExpressionCache.
+CellExpressionCache::CellExpressionCache(const string& name)
+{
+    info.accessExistingReadOnly(name + "-Info");
+    geneSet.accessExisting(name + "-GeneSet", true);
+    cellSet.accessExistingReadOnly(name + "-CellSet");
+    cellInfo.accessExistingReadOnly(name + "-CellInfo");
+    counts.accessExistingReadOnly(name + "-Counts");
+    quantizedCounts.accessExistingReadOnly(name + "-QuantizedCounts");
+}
+
+
+
+// Remove the memory mapped files.
+void CellExpressionCache::remove()
+{
+    quantizedCounts.remove();
+    counts.remove();
+    cellInfo.remove();
+    cellSet.remove();
+    geneSet.remove();
+    info.remove();
+}
+
+
+
+// Return true if this cache was created for the given gene set and cell set.
+bool CellExpressionCache::isConsistentWith(const GeneSet& geneSetArgument, const CellSet& cellSetArgument) const
+{
+    return
+        geneSet == geneSetArgument &&
+        cellSet.size() == cellSetArgument.size() &&
+        std::equal(cellSet.begin(), cellSet.end(), cellSetArgument.begin());
+}
+
+
+
+// Return the values represented by each code, for linear or logarithmic codes.
+// The tables are computed the first time they are needed.
+double CellExpressionCache::logarithmicCodeStep()
+{
+    return std::log(65536.) / double(quantizedCodeMask);
+}
+const CellExpressionCache::DecodingTable& CellExpressionCache::getDecodingTable(bool hasLogarithmicCodes)
+{
+    static const DecodingTable linearTable = []()
+    {
+        DecodingTable table;
+        for(size_t code=0; code<table.size(); code++) {
+            table[code] = float(code);
+        }
+        return table;
+    }();
+    static const DecodingTable logarithmicTable = []()
+    {
+        DecodingTable table;
+        for(size_t code=0; code<table.size(); code++) {
+            table[code] = float(std::expm1(double(code) * logarithmicCodeStep()));
+        }
+        return table;
+    }();
+    return hasLogarithmicCodes ? logarithmicTable : linearTable;
+}
+
+
+
+// Compute the similarities between a cell and a list of other cells.
+// The scalar products are accumulated in order of increasing gene id,
+// so for an unquantized cache the result is identical
+// to ExpressionMatrixSubset::computeCellSimilarity.
+void CellExpressionCache::computeCellSimilarities(
+    CellId localCellId0,
+    const vector<CellId>& localCellIds1,
+    vector<float>& dense,
+    vector<double>& similarities) const
+{
+    CZI_ASSERT(dense.size() == geneCount());
+    similarities.resize(localCellIds1.size());
+
+    if(!isQuantized()) {
+        for(const auto& p: counts[localCellId0]) {
+            dense[p.first] = p.second;
+        }
+        for(size_t i=0; i<localCellIds1.size(); i++) {
+            const CellId localCellId1 = localCellIds1[i];
+            double scalarProduct = 0.;
+            for(const auto& p: counts[localCellId1]) {
+                scalarProduct += dense[p.first] * p.second;
+            }
+            similarities[i] = computeCellSimilarity(localCellId0, localCellId1, scalarProduct);
+        }
+        for(const auto& p: counts[localCellId0]) {
+            dense[p.first] = 0.;
+        }
+    } else {
+        const CellInfo& cellInfo0 = cellInfo[localCellId0];
+        const float scale0 = cellInfo0.scale;
+        const DecodingTable& decodingTable0 = getDecodingTable(cellInfo0.hasLogarithmicCodes);
+        for(const uint32_t x: quantizedCounts[localCellId0]) {
+            dense[x >> quantizedCodeBits] = decodingTable0[x & quantizedCodeMask] * scale0;
+        }
+        for(size_t i=0; i<localCellIds1.size(); i++) {
+            const CellId localCellId1 = localCellIds1[i];
+            const CellInfo& cellInfo1 = cellInfo[localCellId1];
+            const float scale1 = cellInfo1.scale;
+            const DecodingTable& decodingTable1 = getDecodingTable(cellInfo1.hasLogarithmicCodes);
+            double scalarProduct = 0.;
+            for(const uint32_t x: quantizedCounts[localCellId1]) {
+                scalarProduct += dense[x >> quantizedCodeBits] * (decodingTable1[x & quantizedCodeMask] * scale1);
+            }
+            similarities[i] = computeCellSimilarity(localCellId0, localCellId1, scalarProduct);
+        }
+        for(const uint32_t x: quantizedCounts[localCellId0]) {
+            dense[x >> quantizedCodeBits] = 0.;
+        }
+    }
+}
+
+
+
+// Compute the similarity between two cells.
+double CellExpressionCache::computeCellSimilarity(CellId localCellId0, CellId localCellId1) const
+{
+    const vector<CellId> localCellIds1(1, localCellId1);
+    vector<float> dense(geneCount(), 0.);
+    vector<double> similarities;
+    computeCellSimilarities(localCellId0, localCellIds1, dense, similarities);
+    return similarities.front();
+}
+
+
+
+// Compute the similarity given the scalar product of the expression counts.
+// This uses the same formula as ExpressionMatrixSubset::computeCellSimilarity.
+double CellExpressionCache::computeCellSimilarity(
+    CellId localCellId0,
+    CellId localCellId1,
+    double scalarProduct) const
+{
+    const double n = double(geneCount());
+    const CellInfo& cell0Info = cellInfo[localCellId0];
+    const CellInfo& cell1Info = cellInfo[localCellId1];
+    const double numerator = n*scalarProduct - cell0Info.sum1*cell1Info.sum1;
+    const double denominator = sqrt(
+            (n*cell0Info.sum2 - cell0Info.sum1*cell0Info.sum1) *
+            (n*cell1Info.sum2 - cell1Info.sum1*cell1Info.sum1)
+            );
+    return numerator / denominator;
+}
@@ -0,0 +1,156 @@
+#ifndef CZI_EXPRESSION_MATRIX2_CELL_EXPRESSION_CACHE_HPP
+#define CZI_EXPRESSION_MATRIX2_CELL_EXPRESSION_CACHE_HPP
+
+
+// Class CellExpressionCache stores a compact copy of the expression counts
+// of the cells of a cell set, restricted to the genes of a gene set,
+// together with precomputed sums and sums of squares.
+// It is used to compute cell similarities quickly, for example
+// to rerank by exact similarity the candidate neighbors found using LSH.
+// Unlike ExpressionMatrix::computeCellSimilarity, this does not need
+// the global expression counts (which include genes not in the gene set)
+// or the Cell objects, so it uses a fraction of the memory bandwidth.
+
+// Two storage formats are available:
+// - Unquantized: each expression count is stored as a float
+//   together with its local gene id (8 bytes per count).
+//   Similarities are the same as computed by ExpressionMatrixSubset.
+// - Quantized: each expression count is stored as an 8-bit code
+//   packed with a 24-bit local gene id (4 bytes per count).
+//   If all counts of a cell are integers no greater than 255,
+//   the code is the count itself, so the counts are stored exactly.
+//   Otherwise, the code is logarithmic: the stored count is
+//   scale*(exp(code*logarithmicCodeStep)-1), with a per-cell scale
+//   chosen so the largest count of the cell gets code 255.
+//   Rounding the code changes log(1+count/scale) by at most
+//   logarithmicCodeStep/2, so the relative error of a count
+//   is at most 2.2%*(1+scale/count): about 2.2% for counts much
+//   larger than the scale, and at most 4.4% for counts no smaller than
+//   the scale, that is, within a factor 65535 of the largest count of the cell.
+//   Counts smaller than about scale/45 are rounded to zero.
+
+// The cache also stores copies of the gene set and cell set used to create it,
+// so users can check that it is consistent with the gene set
+// and cell set they are working with (see isConsistentWith).
+
+// The cache is stored in memory mapped files, so it can be
+// accessed again cheaply after it is created.
+
+#include "CellSets.hpp"
+#include "GeneSet.hpp"
+#include "Ids.hpp"
+#include "MemoryMappedObject.hpp"
+#include "MemoryMappedVector.hpp"
+#include "MemoryMappedVectorOfVectors.hpp"
+
+#include "array.hpp"
+#include "cstddef.hpp"
+#include "cstdint.hpp"
+#include "string.hpp"
+#include "utility.hpp"
+#include "vector.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        class CellExpressionCache;
+    }
+}
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::CellExpressionCache {
+public:
+
+    // Create a new CellExpressionCache for a given gene set and cell set.
+    using CellExpressionCounts = MemoryMapped::VectorOfVectors<pair<GeneId, float>, uint64_t>;
+    CellExpressionCache(
+        const string& name,                 // Name prefix for memory mapped files.
+        const GeneSet&,
+        const CellSet&,
+        const CellExpressionCounts& globalExpressionCounts,
+        bool quantize);                     // If true, store counts as 8-bit codes.
+
+    // Access an existing CellExpressionCache.
+    CellExpressionCache(
+        const string& name);                // Name prefix for memory mapped files.
+
+    // Remove the memory mapped files.
+    void remove();
+
+    CellId cellCount() const
+    {
+        return CellId(info->cellCount);
+    }
+    GeneId geneCount() const
+    {
+        return GeneId(info->geneCount);
+    }
+    bool isQuantized() const
+    {
+        return info->isQuantized;
+    }
+
+    // Return true if this cache was created for the given gene set and cell set.
+    bool isConsistentWith(const GeneSet&, const CellSet&) const;
+
+    // Compute the similarities between a cell and a list of other cells,
+    // all identified by their ids local to the cell set.
+    // The expression counts of localCellId0 are expanded in dense form
+    // into a work area owned by the caller, and the expression counts
+    // of each of the other cells are used to gather from it.
+    // This way there are no branches to merge sparse vectors.
+    // The work area must have size geneCount() and all zeros,
+    // and is left in the same state on return.
+    void computeCellSimilarities(
+        CellId localCellId0,
+        const vector<CellId>& localCellIds1,
+        vector<float>& dense,
+        vector<double>& similarities) const;
+
+    // Compute the similarity between two cells.
+    double computeCellSimilarity(CellId localCellId0, CellId localCellId1) const;
+
+private:
+
+    class Info {
+    public:
+        size_t cellCount;
+        size_t geneCount;
+        bool isQuantized;
+    };
+    MemoryMapped::Object<Info> info;
+
+    // Copies of the gene set and cell set used to create the cache.
+    GeneSet geneSet;
+    CellSet cellSet;
+
+    // Sums, sums of squares, and scale factor for each cell.
+    // For quantized caches, the sums are computed from the stored counts.
+    class CellInfo {
+    public:
+        double sum1;
+        double sum2;
+        float scale;
+        bool hasLogarithmicCodes;
+    };
+    MemoryMapped::Vector<CellInfo> cellInfo;
+
+    // The expression counts of each cell, sorted by local gene id.
+    // Only one of these is used, depending on isQuantized.
+    MemoryMapped::VectorOfVectors<pair<GeneId, float>, uint64_t> counts;
+    MemoryMapped::VectorOfVectors<uint32_t, uint64_t> quantizedCounts;
+    static const size_t quantizedCodeBits = 8;
+    static const uint32_t quantizedCodeMask = (1U << quantizedCodeBits) - 1U;
+
+    // The values represented by each code, for linear and logarithmic codes.
+    // The largest logarithmic code represents 65535 (before scaling),
+    // so logarithmicCodeStep is log(65536)/255.
+    using DecodingTable = array<float, quantizedCodeMask + 1>;
+    static const DecodingTable& getDecodingTable(bool hasLogarithmicCodes);
+    static double logarithmicCodeStep();
+
+    // Compute the similarity given the scalar product.
+    double computeCellSimilarity(CellId localCellId0, CellId localCellId1, double scalarProduct) const;
+};
+
+#endif
@@ -0,0 +1,250 @@
+// Class CellMetaDataColumns stores the cell meta data in columnar form.
+// See CellMetaDataColumns.hpp for more information.
+
+#include "CellMetaDataColumns.hpp"
+#include "filesystem.hpp"
+#include "algorithm.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include "stdexcept.hpp"
+
+
+
+const StringId CellMetaDataColumns::invalidStringId;
+
+
+
+void CellMetaDataColumns::createNew(const string& directoryNameArgument)
+{
+    directoryName = directoryNameArgument;
+    info.createNew(directoryName + "/CellMetaDataColumns-Info");
+    info->cellCount = 0;
+    columns.clear();
+}
+
+
+
+void CellMetaDataColumns::accessExisting(
+    const string& directoryNameArgument,
+    StringId nameCount,
+    bool readWriteAccess)
+{
+    directoryName = directoryNameArgument;
+    info.accessExisting(directoryName + "/CellMetaDataColumns-Info", readWriteAccess);
+    columns.clear();
+    columns.resize(nameCount);
+    for(StringId nameId=0; nameId!=nameCount; nameId++) {
+        const string name = columnName(nameId);
+        if(filesystem::exists(name + "-Values")) {
+            const shared_ptr<Column> column = make_shared<Column>();
+            column->values.accessExisting(name + "-Values", readWriteAccess);
+            column->numericValues.accessExisting(name + "-NumericValues", readWriteAccess);
+
+            // appendCell extends the columns before incrementing the cell count,
+            // so if it was interrupted the columns can have an extra entry.
+            // Ignore it, or remove it if we have write access.
+            // This must be tolerated because the ingestion rollback
+            // (see ExpressionMatrix::rollBackIngestion) runs after this.
+            if(column->values.size() < cellCount() || column->numericValues.size() < cellCount()) {
+                throw runtime_error("Cell meta data column " + name + " is shorter than the number of cells.");
+            }
+            if(readWriteAccess) {
+                column->values.resize(cellCount());
+                column->numericValues.resize(cellCount());
+            }
+            columns[nameId] = column;
+        }
+    }
+}
+
+
+
+void CellMetaDataColumns::syncToDisk()
+{
+    for(const auto& column: columns) {
+        if(column) {
+            column->values.syncToDisk();
+            column->numericValues.syncToDisk();
+        }
+    }
+    info.syncToDisk();
+}
+
+
+
+// Add a cell with no meta data.
+void CellMetaDataColumns::appendCell()
+{
+    for(const auto& column: columns) {
+        if(column) {
+            column->values.push_back(invalidStringId);
+            column->numericValues.push_back(std::numeric_limits<double>::quiet_NaN());
+        }
+    }
+    ++info->cellCount;
+}
+
+
+
+// Set the value of a meta data field for a cell.
+void CellMetaDataColumns::set(
+    CellId cellId,
+    StringId nameId,
+    StringId valueId,
+    const char* valueBegin,
+    const char* valueEnd)
+{
+    CZI_ASSERT(cellId < cellCount());
+    if(!hasColumn(nameId)) {
+        if(valueId == invalidStringId) {
+            return;
+        }
+        createColumn(nameId);
+    }
+    Column& column = *columns[nameId];
+    column.values[cellId] = valueId;
+    column.numericValues[cellId] = (valueId == invalidStringId) ?
+        std::numeric_limits<double>::quiet_NaN() :
+        parseNumericValue(valueBegin, valueEnd);
+}
+
+
+
+void CellMetaDataColumns::truncate(CellId cellCountArgument, StringId nameCount)
+{
+    CZI_ASSERT(cellCountArgument <= cellCount());
+    for(StringId nameId=0; nameId<StringId(columns.size()); nameId++) {
+        const shared_ptr<Column>& column = columns[nameId];
+        if(!column) {
+            continue;
+        }
+        if(nameId < nameCount) {
+            column->values.resize(cellCountArgument);
+            column->numericValues.resize(cellCountArgument);
+        } else {
+            column->values.remove();
+            column->numericValues.remove();
+        }
+    }
+    if(columns.size() > nameCount) {
+        columns.resize(nameCount);
+    }
+    info->cellCount = cellCountArgument;
+}
+
+
+
+// Convert a meta data value to a double.
+// Only decimal numbers with an optional sign, decimal point, and exponent
+// are accepted, plus "inf" and "infinity" (any case, optional sign),
+// as lexical_cast<double> did before the columns were introduced.
+// Unlike strtod, this does not allow leading white space or hexadecimal
+// numbers. "nan" and values that overflow return NaN, which means
+// "not numeric": createCellSetUsingNumericMetaData skips these cells
+// (with lexical_cast a "nan" value used to pass any bounds check).
+// The meta data strings are not null terminated, so strtod runs on
+// a copy in a stack buffer. Longer values cannot be valid numbers
+// in practice and are handled via a string.
+double CellMetaDataColumns::parseNumericValue(const char* begin, const char* end)
+{
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+
+    // Infinity, with an optional sign.
+    const char* p = begin;
+    if(p!=end && (*p=='+' || *p=='-')) {
+        ++p;
+    }
+    const size_t length = size_t(end - p);
+    if(length==3 || length==8) {
+        static const char infinity[] = "infinity";
+        bool isInfinity = true;
+        for(size_t i=0; i<length; i++) {
+            if(std::tolower(static_cast<unsigned char>(p[i])) != infinity[i]) {
+                isInfinity = false;
+                break;
+            }
+        }
+        if(isInfinity) {
+            return (*begin=='-') ? -std::numeric_limits<double>::infinity() : std::numeric_limits<double>::infinity();
+        }
+    }
+
+    // Decimal number.
+    if(begin == end) {
+        return nan;
+    }
+    for(p=begin; p!=end; ++p) {
+        const char c = *p;
+        if(!((c>='0' && c<='9') || c=='+' || c=='-' || c=='.' || c=='e' || c=='E')) {
+            return nan;
+        }
+    }
+    const size_t n = size_t(end - begin);
+    char buffer[64];
+    string longValue;
+    const char* s;
+    if(n < sizeof(buffer)) {
+        std::copy(begin, end, buffer);
+        buffer[n] = 0;
+        s = buffer;
+    } else {
+        longValue.assign(begin, end);
+        s = longValue.c_str();
+    }
+    char* parseEnd;
+    const double value = std::strtod(s, &parseEnd);
+    if(parseEnd != s + n || !std::isfinite(value)) {
+        return nan;
+    }
+    return value;
+}
+
+
+
+string CellMetaDataColumns::columnName(StringId nameId) const
+{
+    return directoryName + "/CellMetaDataColumn-" + lexical_cast<string>(nameId);
+}
+
+
+
+// Create the column for a meta data name, with no values for any cell.
+// Both files are created under temporary names, then renamed,
+// -Values last. accessExisting only looks at columns with a -Values file,
+// so if this is interrupted the partial column is ignored.
+void CellMetaDataColumns::createColumn(StringId nameId)
+{
+    if(columns.size() <= nameId) {
+        columns.resize(nameId + 1);
+    }
+    const shared_ptr<Column> column = make_shared<Column>();
+    const string name = columnName(nameId);
+    column->values.createNew(name + "-Values-tmp", cellCount());
+    fill(column->values.begin(), column->values.end(), invalidStringId);
+    column->numericValues.createNew(name + "-NumericValues-tmp", cellCount());
+    fill(column->numericValues.begin(), column->numericValues.end(), std::numeric_limits<double>::quiet_NaN());
+    column->values.close();
+    column->numericValues.close();
+    filesystem::rename(name + "-NumericValues-tmp", name + "-NumericValues");
+    filesystem::rename(name + "-Values-tmp", name + "-Values");
+    column->values.accessExisting(name + "-Values", true);
+    column->numericValues.accessExisting(name + "-NumericValues", true);
+    columns[nameId] = column;
+}
+
+
+
+// Remove the column for a meta data name, if it exists.
+void CellMetaDataColumns::removeColumn(StringId nameId)
+{
+    if(!hasColumn(nameId)) {
+        return;
+    }
+    columns[nameId]->values.remove();
+    columns[nameId]->numericValues.remove();
+    columns[nameId].reset();
+}
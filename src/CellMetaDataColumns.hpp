@@ -0,0 +1,122 @@
+#ifndef CZI_EXPRESSION_MATRIX2_CELL_META_DATA_COLUMNS_HPP
+#define CZI_EXPRESSION_MATRIX2_CELL_META_DATA_COLUMNS_HPP
+
+
+// Class CellMetaDataColumns stores the cell meta data in columnar form:
+// for each meta data name, a vector indexed by CellId containing
+// the StringId of the value of that meta data field for each cell,
+// or invalidStringId if the cell does not have that field.
+// Each column also stores the value of the field converted to a double,
+// or NaN if the value is missing or not numeric.
+
+// This is a copy of the information stored in ExpressionMatrix::cellMetaData,
+// which is kept up to date by the ExpressionMatrix functions that modify it.
+// It is used by queries that need one meta data field for many cells,
+// which then become sequential scans of the column for that field.
+
+// A column is only created when a cell gets a value for its meta data name.
+// All columns always have one entry per cell.
+// There is no column for CellName, which is already stored in
+// ExpressionMatrix::cellNames and is always the first meta data entry of a cell.
+
+#include "Ids.hpp"
+#include "MemoryMappedObject.hpp"
+#include "MemoryMappedVector.hpp"
+
+#include "cstdint.hpp"
+#include <limits>
+#include "memory.hpp"
+#include "string.hpp"
+#include "vector.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        class CellMetaDataColumns;
+    }
+}
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::CellMetaDataColumns {
+public:
+
+    static const StringId invalidStringId = std::numeric_limits<StringId>::max();
+
+    // Create or access the columns stored in a given directory.
+    // The name count is the number of meta data names in the expression matrix.
+    void createNew(const string& directoryName);
+    void accessExisting(const string& directoryName, StringId nameCount, bool readWriteAccess);
+    bool isOpen() const
+    {
+        return info.isOpen;
+    }
+    void syncToDisk();
+
+    // Return the number of cells.
+    CellId cellCount() const
+    {
+        return CellId(info->cellCount);
+    }
+
+    // Add a cell with no meta data.
+    void appendCell();
+
+    // Set the value of a meta data field for a cell.
+    // Use invalidStringId to remove the field from the cell.
+    // The value string is used to compute the numeric value.
+    void set(CellId, StringId nameId, StringId valueId, const char* valueBegin, const char* valueEnd);
+
+    // Remove the column for a meta data name, if it exists.
+    void removeColumn(StringId nameId);
+
+    // Keep only the first cellCount cells and the columns
+    // for the first nameCount meta data names.
+    void truncate(CellId cellCount, StringId nameCount);
+
+    // Return true if there is a column for a given meta data name.
+    bool hasColumn(StringId nameId) const
+    {
+        return nameId < columns.size() && columns[nameId];
+    }
+
+    // Access the value StringIds or numeric values of the column
+    // for a given meta data name. The column must exist.
+    const MemoryMapped::Vector<StringId>& values(StringId nameId) const
+    {
+        return columns[nameId]->values;
+    }
+    const MemoryMapped::Vector<double>& numericValues(StringId nameId) const
+    {
+        return columns[nameId]->numericValues;
+    }
+
+    // Return the value StringId of a meta data field for a cell,
+    // or invalidStringId if the cell does not have that field.
+    StringId getValueId(CellId cellId, StringId nameId) const
+    {
+        return hasColumn(nameId) ? columns[nameId]->values[cellId] : invalidStringId;
+    }
+
+    // Convert a meta data value to a double.
+    // Returns NaN if the value is not a decimal number or (signed) "inf"/"infinity".
+    static double parseNumericValue(const char* begin, const char* end);
+
+private:
+    string directoryName;
+    class Info {
+    public:
+        uint64_t cellCount;
+    };
+    MemoryMapped::Object<Info> info;
+
+    class Column {
+    public:
+        MemoryMapped::Vector<StringId> values;
+        MemoryMapped::Vector<double> numericValues;
+    };
+    vector< shared_ptr<Column> > columns;   // Indexed by the StringId of the meta data name.
+    string columnName(StringId nameId) const;
+    void createColumn(StringId nameId);
+};
+
+#endif
@@ -0,0 +1,590 @@
+// Compressed bitmap representation of cell sets.
+// See CellSetBitmap.hpp for more information.
+
+#include "CellSetBitmap.hpp"
+#include "CZI_ASSERT.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include "algorithm.hpp"
+#include "iostream.hpp"
+#include "iterator.hpp"
+#include <random>
+
+// The SIMD kernels are only compiled for x86-64 using gcc or compatible compilers.
+// They are compiled using target attributes, so the rest of the code
+// does not require AVX2 or AVX-512 support from the cpu.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CZI_EXPRESSION_MATRIX2_CELL_SET_BITMAP_X86 1
+#include <immintrin.h>
+#else
+#define CZI_EXPRESSION_MATRIX2_CELL_SET_BITMAP_X86 0
+#endif
+
+
+
+// Kernels for operations between two bitmap containers.
+// Each operation combines x and y word by word, stores the result in x,
+// and returns the number of bits set in the result.
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace CellSetBitmapKernels {
+
+            enum class Operation {intersection, union_, difference};
+
+            using Function = uint64_t (*)(uint64_t* x, const uint64_t* y, uint64_t wordCount);
+            class Kernel {
+            public:
+                const char* name;
+                Function intersection;
+                Function union_;
+                Function difference;
+            };
+
+            // Return all the kernels supported by the cpu,
+            // in order of increasing speed.
+            // The first one is always the portable kernel.
+            vector<Kernel> getSupportedKernels();
+
+            // Return the kernel selected at run time (the fastest supported one).
+            const Kernel& getKernel();
+        }
+    }
+}
+using namespace CellSetBitmapKernels;
+
+
+
+// The portable kernel.
+// When compiled with -O3 the loop is vectorized using SSE instructions.
+template<Operation operation> static uint64_t combinePortable(
+    uint64_t* x,
+    const uint64_t* y,
+    uint64_t wordCount)
+{
+    uint64_t count = 0;
+    for(uint64_t i=0; i<wordCount; i++) {
+        uint64_t z = 0;
+        switch(operation) {
+        case Operation::intersection:   z = x[i] & y[i]; break;
+        case Operation::union_:         z = x[i] | y[i]; break;
+        case Operation::difference:     z = x[i] & ~y[i]; break;
+        }
+        x[i] = z;
+        count += __builtin_popcountll(z);
+    }
+    return count;
+}
+
+
+
+#if CZI_EXPRESSION_MATRIX2_CELL_SET_BITMAP_X86
+
+// The AVX2 kernel.
+// Population counts use the nibble lookup table method,
+// as in the AVX2 kernel in mismatchCounts.cpp.
+template<Operation operation> __attribute__((target("avx2")))
+static uint64_t combineAvx2(
+    uint64_t* x,
+    const uint64_t* y,
+    uint64_t wordCount)
+{
+    const __m256i lookup = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowMask = _mm256_set1_epi8(0x0f);
+    __m256i sum = _mm256_setzero_si256();
+
+    uint64_t i = 0;
+    for(; i+4<=wordCount; i+=4) {
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x+i));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(y+i));
+        __m256i v = a;
+        switch(operation) {
+        case Operation::intersection:   v = _mm256_and_si256(a, b); break;
+        case Operation::union_:         v = _mm256_or_si256(a, b); break;
+        case Operation::difference:     v = _mm256_andnot_si256(b, a); break;
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(x+i), v);
+        const __m256i low = _mm256_and_si256(v, lowMask);
+        const __m256i high = _mm256_and_si256(_mm256_srli_epi16(v, 4), lowMask);
+        const __m256i byteCounts = _mm256_add_epi8(
+            _mm256_shuffle_epi8(lookup, low),
+            _mm256_shuffle_epi8(lookup, high));
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(byteCounts, _mm256_setzero_si256()));
+    }
+
+    uint64_t count =
+        uint64_t(_mm256_extract_epi64(sum, 0)) +
+        uint64_t(_mm256_extract_epi64(sum, 1)) +
+        uint64_t(_mm256_extract_epi64(sum, 2)) +
+        uint64_t(_mm256_extract_epi64(sum, 3));
+    if(i < wordCount) {
+        count += combinePortable<operation>(x+i, y+i, wordCount-i);
+    }
+    return count;
+}
+
+
+
+// The AVX-512 kernel, using the VPOPCNTDQ instruction.
+template<Operation operation> __attribute__((target("avx512f,avx512vpopcntdq")))
+static uint64_t combineAvx512(
+    uint64_t* x,
+    const uint64_t* y,
+    uint64_t wordCount)
+{
+    // The difference uses and/xor rather than _mm512_andnot_si512,
+    // which in some versions of gcc is implemented using _mm512_undefined_epi32
+    // and causes spurious -Wmaybe-uninitialized warnings.
+    // The compiler still generates a single vpandn instruction.
+    const __m512i allOnes = _mm512_set1_epi64(-1);
+    __m512i sum = _mm512_setzero_si512();
+    uint64_t i = 0;
+    for(; i+8<=wordCount; i+=8) {
+        const __m512i a = _mm512_loadu_si512(x+i);
+        const __m512i b = _mm512_loadu_si512(y+i);
+        const __m512i v =
+            operation == Operation::intersection ? _mm512_and_si512(a, b) :
+            operation == Operation::union_ ? _mm512_or_si512(a, b) :
+            _mm512_and_si512(a, _mm512_xor_si512(b, allOnes));
+        _mm512_storeu_si512(x+i, v);
+        sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(v));
+    }
+
+    // Reduce through memory rather than with _mm512_reduce_add_epi64,
+    // which is not available in older compilers.
+    alignas(64) uint64_t lanes[8];
+    _mm512_store_si512(lanes, sum);
+    uint64_t count = 0;
+    for(int lane=0; lane<8; lane++) {
+        count += lanes[lane];
+    }
+    if(i < wordCount) {
+        count += combinePortable<operation>(x+i, y+i, wordCount-i);
+    }
+    return count;
+}
+
+#endif
+
+
+
+vector<Kernel> CellSetBitmapKernels::getSupportedKernels()
+{
+    vector<Kernel> kernels;
+    kernels.push_back(Kernel({"portable",
+        combinePortable<Operation::intersection>,
+        combinePortable<Operation::union_>,
+        combinePortable<Operation::difference>}));
+
+#if CZI_EXPRESSION_MATRIX2_CELL_SET_BITMAP_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        kernels.push_back(Kernel({"avx2",
+            combineAvx2<Operation::intersection>,
+            combineAvx2<Operation::union_>,
+            combineAvx2<Operation::difference>}));
+    }
+    if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")) {
+        kernels.push_back(Kernel({"avx512vpopcntdq",
+            combineAvx512<Operation::intersection>,
+            combineAvx512<Operation::union_>,
+            combineAvx512<Operation::difference>}));
+    }
+#endif
+
+    return kernels;
+}
+
+
+
+// Return the kernel selected at run time.
+// The selection is done only once, the first time this is called.
+const Kernel& CellSetBitmapKernels::getKernel()
+{
+    static const Kernel kernel = getSupportedKernels().back();
+    return kernel;
+}
+
+
+
+string ChanZuckerberg::ExpressionMatrix2::getCellSetBitmapKernelName()
+{
+    return getKernel().name;
+}
+
+
+
+// Bit operations on a bitmap container.
+static inline bool testBit(const uint64_t* bitmap, uint16_t i)
+{
+    return (bitmap[i >> 6] & (uint64_t(1) << (i & 63))) != 0;
+}
+static inline void setBit(uint64_t* bitmap, uint16_t i)
+{
+    bitmap[i >> 6] |= (uint64_t(1) << (i & 63));
+}
+static inline void clearBit(uint64_t* bitmap, uint16_t i)
+{
+    bitmap[i >> 6] &= ~(uint64_t(1) << (i & 63));
+}
+
+
+
+CellSetBitmap::CellSetBitmap(const CellId* begin, const CellId* end)
+{
+    CZI_ASSERT(std::is_sorted(begin, end));
+
+    // Loop over chunks.
+    for(const CellId* chunkBegin=begin; chunkBegin!=end; ) {
+        const uint16_t key = uint16_t(*chunkBegin >> chunkBits);
+        // The last possible chunk extends to the end of the CellId range.
+        const CellId* chunkEnd = (key == 0xffff) ? end :
+            std::lower_bound(chunkBegin, end, CellId(key + 1) << chunkBits);
+
+        containers.resize(containers.size() + 1);
+        Container& container = containers.back();
+        container.key = key;
+        container.cardinality = uint32_t(chunkEnd - chunkBegin);
+        if(container.cardinality > maxArraySize) {
+            container.bitmap.resize(wordCount, 0);
+            for(const CellId* it=chunkBegin; it!=chunkEnd; ++it) {
+                setBit(container.bitmap.data(), uint16_t(*it));
+            }
+        } else {
+            container.array.reserve(container.cardinality);
+            for(const CellId* it=chunkBegin; it!=chunkEnd; ++it) {
+                container.array.push_back(uint16_t(*it));
+            }
+        }
+        chunkBegin = chunkEnd;
+    }
+}
+
+
+
+size_t CellSetBitmap::size() const
+{
+    size_t n = 0;
+    for(const Container& container: containers) {
+        n += container.cardinality;
+    }
+    return n;
+}
+
+
+
+void CellSetBitmap::getCellIds(vector<CellId>& cellIds) const
+{
+    cellIds.reserve(cellIds.size() + size());
+    for(const Container& container: containers) {
+        const CellId high = CellId(container.key) << chunkBits;
+        if(container.isBitmap()) {
+            for(uint32_t i=0; i<wordCount; i++) {
+                uint64_t word = container.bitmap[i];
+                while(word) {
+                    cellIds.push_back(high + CellId(64*i) + CellId(__builtin_ctzll(word)));
+                    word &= word - 1;   // Clear the lowest bit set.
+                }
+            }
+        } else {
+            for(const uint16_t low: container.array) {
+                cellIds.push_back(high + low);
+            }
+        }
+    }
+}
+
+
+
+void CellSetBitmap::Container::convertToArray()
+{
+    vector<uint16_t> newArray;
+    newArray.reserve(cardinality);
+    for(uint32_t i=0; i<wordCount; i++) {
+        uint64_t word = bitmap[i];
+        while(word) {
+            newArray.push_back(uint16_t(64*i + __builtin_ctzll(word)));
+            word &= word - 1;
+        }
+    }
+    array.swap(newArray);
+    vector<uint64_t>().swap(bitmap);
+}
+
+
+
+void CellSetBitmap::Container::convertToBitmap()
+{
+    bitmap.resize(wordCount, 0);
+    for(const uint16_t low: array) {
+        setBit(bitmap.data(), low);
+    }
+    vector<uint16_t>().swap(array);
+}
+
+
+
+void CellSetBitmap::Container::normalize()
+{
+    if(isBitmap()) {
+        if(cardinality <= maxArraySize) {
+            convertToArray();
+        }
+    } else {
+        if(cardinality > maxArraySize) {
+            convertToBitmap();
+        }
+    }
+}
+
+
+
+void CellSetBitmap::intersect(Container& x, const Container& y)
+{
+    if(x.isBitmap() && y.isBitmap()) {
+        x.cardinality = uint32_t(getKernel().intersection(x.bitmap.data(), y.bitmap.data(), wordCount));
+    } else if(x.isBitmap()) {
+        vector<uint16_t> newArray;
+        for(const uint16_t low: y.array) {
+            if(testBit(x.bitmap.data(), low)) {
+                newArray.push_back(low);
+            }
+        }
+        vector<uint64_t>().swap(x.bitmap);
+        x.array.swap(newArray);
+        x.cardinality = uint32_t(x.array.size());
+    } else if(y.isBitmap()) {
+        x.array.erase(std::remove_if(x.array.begin(), x.array.end(),
+            [&y](uint16_t low) {return !testBit(y.bitmap.data(), low);}), x.array.end());
+        x.cardinality = uint32_t(x.array.size());
+    } else {
+        vector<uint16_t> newArray;
+        std::set_intersection(
+            x.array.begin(), x.array.end(),
+            y.array.begin(), y.array.end(),
+            back_inserter(newArray));
+        x.array.swap(newArray);
+        x.cardinality = uint32_t(x.array.size());
+    }
+    x.normalize();
+}
+
+
+
+void CellSetBitmap::unite(Container& x, const Container& y)
+{
+    // If the result could be too large for an array, use a bitmap.
+    if(!x.isBitmap() && (y.isBitmap() || x.cardinality + y.cardinality > maxArraySize)) {
+        x.convertToBitmap();
+    }
+
+    if(x.isBitmap() && y.isBitmap()) {
+        x.cardinality = uint32_t(getKernel().union_(x.bitmap.data(), y.bitmap.data(), wordCount));
+    } else if(x.isBitmap()) {
+        for(const uint16_t low: y.array) {
+            if(!testBit(x.bitmap.data(), low)) {
+                setBit(x.bitmap.data(), low);
+                ++x.cardinality;
+            }
+        }
+    } else {
+        vector<uint16_t> newArray;
+        std::set_union(
+            x.array.begin(), x.array.end(),
+            y.array.begin(), y.array.end(),
+            back_inserter(newArray));
+        x.array.swap(newArray);
+        x.cardinality = uint32_t(x.array.size());
+    }
+    x.normalize();
+}
+
+
+
+void CellSetBitmap::subtract(Container& x, const Container& y)
+{
+    if(x.isBitmap() && y.isBitmap()) {
+        x.cardinality = uint32_t(getKernel().difference(x.bitmap.data(), y.bitmap.data(), wordCount));
+    } else if(x.isBitmap()) {
+        for(const uint16_t low: y.array) {
+            if(testBit(x.bitmap.data(), low)) {
+                clearBit(x.bitmap.data(), low);
+                --x.cardinality;
+            }
+        }
+    } else if(y.isBitmap()) {
+        x.array.erase(std::remove_if(x.array.begin(), x.array.end(),
+            [&y](uint16_t low) {return testBit(y.bitmap.data(), low);}), x.array.end());
+        x.cardinality = uint32_t(x.array.size());
+    } else {
+        vector<uint16_t> newArray;
+        std::set_difference(
+            x.array.begin(), x.array.end(),
+            y.array.begin(), y.array.end(),
+            back_inserter(newArray));
+        x.array.swap(newArray);
+        x.cardinality = uint32_t(x.array.size());
+    }
+    x.normalize();
+}
+
+
+
+void CellSetBitmap::intersectWith(const CellSetBitmap& that)
+{
+    // Only keys present in both sets survive.
+    vector<Container> newContainers;
+    auto it = that.containers.begin();
+    for(Container& container: containers) {
+        while(it!=that.containers.end() && it->key<container.key) {
+            ++it;
+        }
+        if(it == that.containers.end()) {
+            break;
+        }
+        if(it->key == container.key) {
+            intersect(container, *it);
+            if(container.cardinality) {
+                newContainers.push_back(std::move(container));
+            }
+        }
+    }
+    containers.swap(newContainers);
+}
+
+
+
+void CellSetBitmap::unionWith(const CellSetBitmap& that)
+{
+    vector<Container> newContainers;
+    auto it0 = containers.begin();
+    auto it1 = that.containers.begin();
+    while(it0!=containers.end() || it1!=that.containers.end()) {
+        if(it1==that.containers.end() || (it0!=containers.end() && it0->key<it1->key)) {
+            newContainers.push_back(std::move(*it0++));
+        } else if(it0==containers.end() || it1->key<it0->key) {
+            newContainers.push_back(*it1++);
+        } else {
+            unite(*it0, *it1++);
+            newContainers.push_back(std::move(*it0++));
+        }
+    }
+    containers.swap(newContainers);
+}
+
+
+
+void CellSetBitmap::subtract(const CellSetBitmap& that)
+{
+    vector<Container> newContainers;
+    auto it = that.containers.begin();
+    for(Container& container: containers) {
+        while(it!=that.containers.end() && it->key<container.key) {
+            ++it;
+        }
+        if(it!=that.containers.end() && it->key==container.key) {
+            subtract(container, *it);
+        }
+        if(container.cardinality) {
+            newContainers.push_back(std::move(container));
+        }
+    }
+    containers.swap(newContainers);
+}
+
+
+
+void ChanZuckerberg::ExpressionMatrix2::testCellSetBitmap()
+{
+    cout << "Selected cell set bitmap kernel is " << getCellSetBitmapKernelName() << endl;
+
+    // Generate random sets of different densities
+    // and check the results of all operations between them.
+    std::mt19937 randomGenerator(231);
+    const CellId cellCount = 300000;
+    const vector<double> densities = {0.0001, 0.01, 0.05, 0.2, 0.9};
+    for(const double density0: densities) {
+        for(const double density1: densities) {
+            vector<CellId> x0;
+            vector<CellId> x1;
+            std::uniform_real_distribution<double> uniform;
+            for(CellId cellId=0; cellId<cellCount; cellId++) {
+                // Vary the density along the range, so we get different
+                // container types for the same set.
+                const double factor = ((cellId>>16) & 1) ? 1. : 0.1;
+                if(uniform(randomGenerator) < density0*factor) {
+                    x0.push_back(cellId);
+                }
+                if(uniform(randomGenerator) < density1) {
+                    x1.push_back(cellId);
+                }
+            }
+            const CellSetBitmap y0(x0.data(), x0.data()+x0.size());
+            const CellSetBitmap y1(x1.data(), x1.data()+x1.size());
+            vector<CellId> cellIds;
+            y0.getCellIds(cellIds);
+            CZI_ASSERT(cellIds == x0);
+            CZI_ASSERT(y0.size() == x0.size());
+
+            vector<CellId> expected;
+            std::set_intersection(x0.begin(), x0.end(), x1.begin(), x1.end(), back_inserter(expected));
+            CellSetBitmap y = y0;
+            y.intersectWith(y1);
+            cellIds.clear();
+            y.getCellIds(cellIds);
+            CZI_ASSERT(cellIds == expected);
+            CZI_ASSERT(y.size() == expected.size());
+
+            expected.clear();
+            std::set_union(x0.begin(), x0.end(), x1.begin(), x1.end(), back_inserter(expected));
+            y = y0;
+            y.unionWith(y1);
+            cellIds.clear();
+            y.getCellIds(cellIds);
+            CZI_ASSERT(cellIds == expected);
+            CZI_ASSERT(y.size() == expected.size());
+
+            expected.clear();
+            std::set_difference(x0.begin(), x0.end(), x1.begin(), x1.end(), back_inserter(expected));
+            y = y0;
+            y.subtract(y1);
+            cellIds.clear();
+            y.getCellIds(cellIds);
+            CZI_ASSERT(cellIds == expected);
+            CZI_ASSERT(y.size() == expected.size());
+        }
+    }
+
+    // Check that all kernels give the same results.
+    const vector<Kernel> kernels = getSupportedKernels();
+    for(uint64_t wordCount=1; wordCount<=40; wordCount++) {
+        vector<uint64_t> x(wordCount);
+        vector<uint64_t> y(wordCount);
+        for(uint64_t& word: x) {
+            word = (uint64_t(randomGenerator()) << 32) + randomGenerator();
+        }
+        for(uint64_t& word: y) {
+            word = (uint64_t(randomGenerator()) << 32) + randomGenerator();
+        }
+        for(const Kernel& kernel: kernels) {
+            for(int i=0; i<3; i++) {
+                const Function expectedFunction =
+                    (i==0) ? kernels.front().intersection : ((i==1) ? kernels.front().union_ : kernels.front().difference);
+                const Function function =
+                    (i==0) ? kernel.intersection : ((i==1) ? kernel.union_ : kernel.difference);
+                vector<uint64_t> expected = x;
+                vector<uint64_t> z = x;
+                const uint64_t expectedCount = expectedFunction(expected.data(), y.data(), wordCount);
+                const uint64_t count = function(z.data(), y.data(), wordCount);
+                CZI_ASSERT(z == expected);
+                CZI_ASSERT(count == expectedCount);
+            }
+        }
+    }
+
+    for(const Kernel& kernel: kernels) {
+        cout << "Cell set bitmap kernel " << kernel.name << " passed." << endl;
+    }
+}
@@ -0,0 +1,118 @@
+#ifndef CZI_EXPRESSION_MATRIX2_CELL_SET_BITMAP_HPP
+#define CZI_EXPRESSION_MATRIX2_CELL_SET_BITMAP_HPP
+
+
+// Class CellSetBitmap is a compressed bitmap representation of a set of cells,
+// used to compute intersections, unions, and differences of large cell sets.
+// Cell sets are stored on disk as sorted vectors of cell ids (see CellSets.hpp).
+// A CellSetBitmap is created from them when needed,
+// and converted back to a sorted vector of cell ids with getCellIds.
+
+// The representation is similar to Roaring bitmaps
+// (D. Lemire et al., "Roaring Bitmaps: Implementation of an Optimized
+// Software Library", Software: Practice and Experience 48 (2018)).
+// The cell ids are partitioned into chunks of 2^16 consecutive ids,
+// using the high 16 bits of the cell id. Each non-empty chunk is stored
+// in a container that uses one of two forms, chosen automatically
+// depending on the number of cells in the chunk:
+// - A sorted vector of the low 16 bits of each cell id,
+//   if the chunk contains at most maxArraySize cells.
+// - A bitmap of 2^16 bits (1024 64-bit words) otherwise.
+// Both forms use at most 8 KB per chunk.
+// Operations between two bitmap containers are done one word at a time
+// using SIMD instructions, if supported by the cpu
+// (see combinePortable, combineAvx2, combineAvx512 in CellSetBitmap.cpp).
+
+#include "Ids.hpp"
+
+#include "cstddef.hpp"
+#include "cstdint.hpp"
+#include "string.hpp"
+#include "vector.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        class CellSetBitmap;
+
+        // Return the name of the kernel selected at run time
+        // for operations between bitmap containers.
+        string getCellSetBitmapKernelName();
+
+        // Unit test: check CellSetBitmap operations against
+        // std::set_intersection, std::set_union, std::set_difference.
+        void testCellSetBitmap();
+    }
+}
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::CellSetBitmap {
+public:
+
+    // Create an empty set.
+    CellSetBitmap() {}
+
+    // Create a set from a range of cell ids sorted in increasing order,
+    // without duplicates.
+    CellSetBitmap(const CellId* begin, const CellId* end);
+
+    // Return the number of cells in the set.
+    size_t size() const;
+
+    // Store the cell ids in the set, sorted, at the end of the given vector.
+    void getCellIds(vector<CellId>&) const;
+
+    // Set operations. The result is stored in this set.
+    void intersectWith(const CellSetBitmap&);
+    void unionWith(const CellSetBitmap&);
+    void subtract(const CellSetBitmap&);
+
+    // Return true if set operations should use bitmaps rather than
+    // merging sorted vectors, that is, if the input sets contain on average
+    // at least 1/16 of the cells (the bitmaps are created for each operation).
+    static bool isPreferred(
+        size_t totalSize,   // Total number of cells in all the input sets.
+        size_t setCount,    // Number of input sets.
+        CellId cellCount)   // Number of cells in the expression matrix.
+    {
+        return 16*totalSize >= setCount*size_t(cellCount);
+    }
+
+private:
+
+    // Chunks contain 2^16 cell ids.
+    static const uint32_t chunkBits = 16;
+    static const uint32_t chunkSize = uint32_t(1) << chunkBits;
+    static const uint32_t wordCount = chunkSize / 64;
+
+    // A chunk with more than this number of cells is stored as a bitmap.
+    static const uint32_t maxArraySize = 4096;
+
+    class Container {
+    public:
+        uint16_t key;               // The high 16 bits of the cell ids in this chunk.
+        uint32_t cardinality = 0;   // The number of cells in this chunk.
+        vector<uint16_t> array;     // Used if cardinality <= maxArraySize.
+        vector<uint64_t> bitmap;    // Used if cardinality > maxArraySize.
+        bool isBitmap() const
+        {
+            return !bitmap.empty();
+        }
+
+        // Switch to the form appropriate for the current cardinality.
+        void convertToArray();
+        void convertToBitmap();
+        void normalize();
+    };
+
+    // The containers, sorted by key.
+    vector<Container> containers;
+
+    // Operations between two containers with the same key.
+    // The result is stored in the first container.
+    static void intersect(Container&, const Container&);
+    static void unite(Container&, const Container&);
+    static void subtract(Container&, const Container&);
+};
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef CZI_EXPRESSION_MATRIX2_COMPRESSED_EXPRESSION_COUNTS_HPP
+#define CZI_EXPRESSION_MATRIX2_COMPRESSED_EXPRESSION_COUNTS_HPP
+
+
+// Class CompressedExpressionCounts stores the expression counts of each cell
+// in a compressed format, typically using 2 or 3 bytes for each non-zero
+// expression count instead of the 8 bytes used by a pair<GeneId, float>.
+// This reduces the amount of memory (page cache) needed by computations
+// that loop over the expression counts of many cells.
+
+// The expression counts of each cell are stored as a sequence of bytes.
+// Each non-zero expression count is encoded as two variable length
+// unsigned integers (7 bits per byte, with the high bit set on all bytes
+// except the last):
+// - The difference between its GeneId and the GeneId of the previous
+//   expression count for the same cell (or 0 for the first one).
+// - 2*count, if count is a small non-negative integer (the usual case for UMI counts).
+//   Otherwise, 1 followed by the 4 bytes of the float count.
+// Decoding is done on the fly with class Decoder, or one cell at a time
+// with decode, a faster block decoder, so there is never a need
+// to decompress the entire matrix.
+
+#include "Ids.hpp"
+#include "MemoryMappedVectorOfVectors.hpp"
+
+#include "cstdint.hpp"
+#include <cstring>
+#include "string.hpp"
+#include "utility.hpp"
+#include "vector.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        class CompressedExpressionCounts;
+    }
+}
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::CompressedExpressionCounts {
+public:
+
+    void createNew(const string& name)
+    {
+        data.createNew(name);
+    }
+    void accessExisting(const string& name, bool readWriteAccess)
+    {
+        data.accessExisting(name, readWriteAccess);
+    }
+    void close()
+    {
+        data.close();
+    }
+    void remove()
+    {
+        data.remove();
+    }
+    void syncToDisk()
+    {
+        data.syncToDisk();
+    }
+    bool isOpen() const
+    {
+        return data.isOpen();
+    }
+
+    // The number of cells.
+    CellId size() const
+    {
+        return CellId(data.size());
+    }
+
+    // The total number of bytes used by the compressed expression counts.
+    uint64_t byteCount() const
+    {
+        return data.totalSize();
+    }
+
+    // Remove cells at the end, keeping the first n.
+    void truncate(CellId n)
+    {
+        data.truncate(n);
+    }
+
+    // Encode and append the expression counts of a new cell.
+    // They must be sorted by GeneId.
+    void append(const pair<GeneId, float>* begin, const pair<GeneId, float>* end);
+
+    // Decode the expression counts of a cell, sorted by GeneId.
+    // This is faster than using class Decoder.
+    void decode(CellId, vector< pair<GeneId, float> >&) const;
+
+    // Class used to decode the expression counts of a cell one at a time,
+    // sorted by GeneId.
+    class Decoder {
+    public:
+        Decoder(const uint8_t* begin, const uint8_t* end) : p(begin), end(end)
+        {
+            next();
+        }
+        bool isValid() const
+        {
+            return valid;
+        }
+        GeneId geneId = 0;
+        float count = 0.;
+        void next()
+        {
+            valid = (p != end);
+            if(valid) {
+                geneId += GeneId(decodeInteger(p));
+                const uint32_t x = decodeInteger(p);
+                if((x & 1) == 0) {
+                    count = float(x >> 1);
+                } else {
+                    std::memcpy(&count, p, sizeof(count));
+                    p += sizeof(count);
+                }
+            }
+        }
+    private:
+        const uint8_t* p;
+        const uint8_t* end;
+        bool valid = false;
+    };
+    Decoder decoder(CellId cellId) const
+    {
+        return Decoder(data.begin(cellId), data.end(cellId));
+    }
+
+private:
+    MemoryMapped::VectorOfVectors<uint8_t, uint64_t> data;
+
+    // The largest count that is encoded as an integer.
+    // Not all larger integers can be represented exactly as a float.
+    static const uint32_t maxIntegerCount = uint32_t(1) << 24;
+
+    static void encodeInteger(uint32_t, vector<uint8_t>&);
+    static uint32_t decodeInteger(const uint8_t*& p)
+    {
+        // Fast path for the usual case of one byte.
+        uint32_t x = *p++;
+        if(x < 0x80) {
+            return x;
+        }
+        x &= 0x7f;
+        int shift = 7;
+        while(true) {
+            const uint32_t b = *p++;
+            x |= (b & 0x7f) << shift;
+            if(b < 0x80) {
+                return x;
+            }
+            shift += 7;
+        }
+    }
+};
+
+#endif
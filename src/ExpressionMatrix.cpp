@@ -1,9 +1,11 @@
 #include "ExpressionMatrix.hpp"
 #include "CellGraph.hpp"
+#include "CellSetBitmap.hpp"
 #include "ClusterGraph.hpp"
 #include "filesystem.hpp"
 #include "orderPairs.hpp"
 #include "randIndex.hpp"
+#include "runThreads.hpp"
 #include "SimilarPairs.hpp"
 #include "timestamp.hpp"
 #include "tokenize.hpp"
@@ -34,7 +36,8 @@ using namespace ExpressionMatrix2;
 // expression matrix stored in the directory will be overwritten by the new one.
 ExpressionMatrix::ExpressionMatrix(
     const string& directoryName,
-    const ExpressionMatrixCreationParameters& parameters) :
+    const ExpressionMatrixCreationParameters& parameters,
+    const vector<ExpressionMatrixMappingPolicy>& mappingPolicies) :
     directoryName(directoryName)
 {
     // If directory already exists, don't do anything.
@@ -43,6 +46,7 @@ ExpressionMatrix::ExpressionMatrix(
     if(filesystem::exists(directoryName)) {
         throw runtime_error("Directory " + directoryName + " already exists.");
     }
+    setMappingPolicies(mappingPolicies);
 
     // Create the directory. This guarantees that we start with an empty directory.
     filesystem::createDirectory(directoryName);
@@ -59,6 +63,7 @@ ExpressionMatrix::ExpressionMatrix(
     cellMetaDataNames.createNew(directoryName + "/" + "CellMetaDataNames", parameters.cellMetaDataNameCapacity);
     cellMetaDataValues.createNew(directoryName + "/" + "CellMetaDataValues", parameters.cellMetaDataValueCapacity);
     cellMetaDataNamesUsageCount.createNew(directoryName + "/" + "CellMetaDataNamesUsageCount");
+    cellMetaDataColumns.createNew(directoryName);
     cellExpressionCounts.createNew(directoryName + "/" + "CellExpressionCounts");
 
     // Initialize the CellSets.
@@ -69,6 +74,10 @@ ExpressionMatrix::ExpressionMatrix(
     // Initialize the gene sets.
     geneSets["AllGenes"].createNew(directoryName + "/GeneSet-AllGenes");
 
+    // Create the ingestion checkpoint.
+    ingestionCheckpoint.createNew(directoryName + "/IngestionCheckpoint");
+    ingestionCheckpoint->isActive = 0;
+
     // Sanity checks.
     CZI_ASSERT(cellNames.size() == cells.size());
     CZI_ASSERT(cellMetaData.size() == cells.size());
@@ -85,7 +94,8 @@ ExpressionMatrix::ExpressionMatrix(
     uint64_t cellMetaDataNameCapacity,
     uint64_t cellMetaDataValueCapacity,
     uint64_t geneMetaDataNameCapacity,
-    uint64_t geneMetaDataValueCapacity
+    uint64_t geneMetaDataValueCapacity,
+    const vector<ExpressionMatrixMappingPolicy>& mappingPolicies
     ) :
     ExpressionMatrix(
         directoryName,
@@ -93,7 +103,8 @@ ExpressionMatrix::ExpressionMatrix(
             geneCapacity, cellCapacity,
             cellMetaDataNameCapacity, cellMetaDataValueCapacity,
             geneMetaDataNameCapacity, geneMetaDataValueCapacity
-            ))
+            ),
+        mappingPolicies)
 {
 }
 
@@ -118,10 +129,32 @@ ExpressionMatrixCreationParameters::ExpressionMatrixCreationParameters(
 
 
 
+ExpressionMatrixMappingPolicy::ExpressionMatrixMappingPolicy(
+    const string& fileNamePrefix,
+    const string& accessPattern,
+    bool useHugePages,
+    bool willNeed,
+    bool interleave
+    ) :
+    fileNamePrefix(fileNamePrefix),
+    accessPattern(accessPattern),
+    useHugePages(useHugePages),
+    willNeed(willNeed),
+    interleave(interleave)
+{
+}
+
+
+
 // Access a previously created expression matrix stored in the specified directory.
-ExpressionMatrix::ExpressionMatrix(const string& directoryName, bool allowReadOnly) :
+ExpressionMatrix::ExpressionMatrix(
+    const string& directoryName,
+    bool allowReadOnly,
+    const vector<ExpressionMatrixMappingPolicy>& mappingPolicies) :
     directoryName(directoryName)
 {
+    setMappingPolicies(mappingPolicies);
+
     // Access the binary data with read-write access, so we can add new cells
     // and perform other operations that change the state on disk.
 
@@ -137,6 +170,7 @@ ExpressionMatrix::ExpressionMatrix(const string& directoryName, bool allowReadOn
     cellMetaDataNames.accessExistingReadWrite(directoryName + "/" + "CellMetaDataNames", allowReadOnly);
     cellMetaDataValues.accessExistingReadWrite(directoryName + "/" + "CellMetaDataValues", allowReadOnly);
     cellMetaDataNamesUsageCount.accessExistingReadWrite(directoryName + "/" + "CellMetaDataNamesUsageCount", allowReadOnly);
+    accessCellMetaDataColumns(cells.isOpenWithWriteAccess);
     cellExpressionCounts.accessExistingReadWrite(directoryName + "/" + "CellExpressionCounts", allowReadOnly);
     cellSets.accessExisting(directoryName, allowReadOnly);
     if(!cellSets.exists("AllCells")) {
@@ -160,6 +194,34 @@ ExpressionMatrix::ExpressionMatrix(const string& directoryName, bool allowReadOn
         throw runtime_error("Gene set \"AllGenes\" is missing.");
     }
 
+    // Access the compressed expression counts, if they were created.
+    // During ingestion they are appended before the Cell objects,
+    // so if they have fewer cells they are incomplete
+    // (createCompressedExpressionCounts was interrupted).
+    if(filesystem::exists(directoryName + "/CompressedCellExpressionCounts.toc")) {
+        compressedCellExpressionCounts.accessExisting(directoryName + "/CompressedCellExpressionCounts",
+            cells.isOpenWithWriteAccess);
+        if(compressedCellExpressionCounts.size() < cells.size()) {
+            dropInconsistentCompressedExpressionCounts();
+        }
+    }
+
+    // Access the gene expression index, if one was created.
+    if(filesystem::exists(directoryName + "/GeneExpressionIndex-Info")) {
+        geneExpressionIndex.accessExisting(directoryName + "/GeneExpressionIndex");
+    }
+
+    // If an ingestion was interrupted, roll back to its last checkpoint.
+    accessIngestionCheckpoint(cells.isOpenWithWriteAccess);
+
+    // Append to the gene expression index the cells that are not in the stored index.
+    updateGeneExpressionIndex();
+
+    // The compressed expression counts must now cover exactly the same cells.
+    if(compressedCellExpressionCounts.isOpen() && compressedCellExpressionCounts.size() != cells.size()) {
+        dropInconsistentCompressedExpressionCounts();
+    }
+
 
 
     // Sanity checks.
@@ -185,7 +247,7 @@ ExpressionMatrix::ExpressionMatrix(const string& directoryName, bool allowReadOn
 // This changes the metaData vector so the CellName entry is the first entry.
 // It also changes the expression counts - it sorts them by decreasing count.
 CellId ExpressionMatrix::addCell(
-    const vector< pair<string, string> >& metaDataArgument,
+    const vector< pair<string, string> >& metaData,
     const vector< pair<string, float> >& expressionCounts)
 {
 #if 0
@@ -200,6 +262,71 @@ CellId ExpressionMatrix::addCell(
     }
 #endif
 
+    // Check the cell name before adding any genes,
+    // so a cell that is rejected does not leave behind new genes.
+    // addCellUsingGeneIds repeats these checks and prints more details.
+    bool cellNameWasFound = false;
+    for(const auto& p: metaData) {
+        if(p.first == "CellName") {
+            cellNameWasFound = true;
+            if(cellNames(p.second) != invalidCellId) {
+                throw runtime_error("Cell name " + p.second + " already exists.");
+            }
+            break;
+        }
+    }
+    if(!cellNameWasFound) {
+        throw std::runtime_error("CellName missing from cell meta data.");
+    }
+
+    // Convert gene names to gene ids without adding any genes.
+    vector<string> cellGeneNames;
+    cellGeneNames.reserve(expressionCounts.size());
+    for(const auto& p: expressionCounts) {
+        cellGeneNames.push_back(p.first);
+    }
+    vector<GeneId> geneIdTable;
+    vector<string> newGeneNames;
+    getGeneIdTable(cellGeneNames, geneIdTable, newGeneNames);
+
+    // Validate the expression counts before adding any genes.
+    vector< pair<GeneId, float> > geneIdExpressionCounts;
+    geneIdExpressionCounts.reserve(expressionCounts.size());
+    vector<GeneId> cellGeneIds;
+    for(size_t i=0; i<expressionCounts.size(); i++) {
+        const float count = expressionCounts[i].second;
+        if(count < 0.) {
+            throw runtime_error("Negative expression count encountered.");
+        }
+        if(count != 0.) {
+            cellGeneIds.push_back(geneIdTable[i]);
+        }
+        geneIdExpressionCounts.push_back(make_pair(geneIdTable[i], count));
+    }
+    sort(cellGeneIds.begin(), cellGeneIds.end());
+    const auto itDuplicate = adjacent_find(cellGeneIds.begin(), cellGeneIds.end());
+    if(itDuplicate != cellGeneIds.end()) {
+        const GeneId geneId = *itDuplicate;
+        throw runtime_error("Duplicate expression count for gene " +
+            (geneId < geneCount() ? geneName(geneId) : newGeneNames[geneId - geneCount()]));
+    }
+
+    // The cell is valid. Add the genes that don't exist yet.
+    for(const string& newGeneName: newGeneNames) {
+        addGene(newGeneName);
+    }
+
+    return addCellUsingGeneIds(metaData, geneIdExpressionCounts);
+}
+
+
+
+// Version of addCell that takes expression counts as pairs (GeneId, count),
+// for genes that were already added.
+CellId ExpressionMatrix::addCellUsingGeneIds(
+    const vector< pair<string, string> >& metaDataArgument,
+    const vector< pair<GeneId, float> >& expressionCounts)
+{
     // Make a writable copy of the meta data.
     // We will need it to move the cell name to the beginning.
     vector< pair<string, string> > metaData = metaDataArgument;
@@ -236,6 +363,23 @@ CellId ExpressionMatrix::addCell(
         throw runtime_error("Cell name " + cellName + " already exists.");
     }
 
+    // Validate the expression counts before changing anything.
+    vector<GeneId> cellGeneIds;
+    for(const auto& p: expressionCounts) {
+        CZI_ASSERT(p.first < geneCount());
+        if(p.second < 0.) {
+            throw runtime_error("Negative expression count encountered.");
+        }
+        if(p.second != 0.) {
+            cellGeneIds.push_back(p.first);
+        }
+    }
+    sort(cellGeneIds.begin(), cellGeneIds.end());
+    const auto itDuplicate = adjacent_find(cellGeneIds.begin(), cellGeneIds.end());
+    if(itDuplicate != cellGeneIds.end()) {
+        throw runtime_error("Duplicate expression count for cell " + cellName + " gene " + geneNames[*itDuplicate]);
+    }
+
     // Store the cell name.
     cellNameStringId = cellNames[cellName];
 
@@ -260,47 +404,41 @@ CellId ExpressionMatrix::addCell(
 
 
     // Store the expression counts.
-    Cell cell;
-    cell.sum1 = 0.;
-    cell.sum2 = 0.;
     cellExpressionCounts.appendVector();
     for(const auto& p: expressionCounts) {
-        const string& geneName = p.first;
-        addGene(geneName);
-        const StringId geneId = geneNames(geneName);
-        CZI_ASSERT(geneId != geneNames.invalidStringId);
-        const float value = p.second;
-        if(value < 0.) {
-            throw runtime_error("Negative expression count encountered.");
-        }
-        if(value == 0.) {
+        if(p.second == 0.) {
             continue;
         }
-        cell.sum1 += value;
-        cell.sum2 += value*value;
-        cellExpressionCounts.append(make_pair(geneId, value));
+        cellExpressionCounts.append(p);
     }
-    cell.norm2 = sqrt(cell.sum2);
-    cell.norm1Inverse = 1./cell.norm1();
-    cell.norm2Inverse = 1./cell.norm2;
 
     // Sort the expression counts we just stored by GeneId.
     const auto storedExpressionCounts = cellExpressionCounts[cellExpressionCounts.size()-1];
     sort(storedExpressionCounts.begin(), storedExpressionCounts.end());
 
+    // Compute the cell statistics, unless an ingestion function will compute them later.
+    Cell cell;
+    if(deferCellStatistics) {
+        clearCellStatistics(cell);
+    } else {
+        computeCellStatistics(storedExpressionCounts.begin(), storedExpressionCounts.end(),
+            std::numeric_limits<double>::infinity(), cell);
+    }
 
 
-    // Verify that all the gene ids in the expression counts we just stored are distinct.
-    for(size_t i = 1; i < storedExpressionCounts.size(); i++) {
-        if(storedExpressionCounts[i - 1].first == storedExpressionCounts[i].first) {
-            const string duplicateGeneName = geneNames[storedExpressionCounts[i].first];
-            throw runtime_error("Duplicate expression count for cell " + cellName + " gene " + duplicateGeneName);
-        }
+    // Also store them in compressed form, if requested.
+    if(compressedCellExpressionCounts.isOpen()) {
+        compressedCellExpressionCounts.append(storedExpressionCounts.begin(), storedExpressionCounts.end());
     }
 
     // Add this cell to the AllCells set.
     cellSets.cellSets["AllCells"]->push_back(CellId(cells.size()));
 
+    // Add its meta data to the cell meta data columns.
+    if(cellMetaDataColumns.isOpen()) {
+        appendCellToCellMetaDataColumns(CellId(cells.size()));
+    }
+
     // Store fixed size information for this cell.
     cells.push_back(cell);
 
@@ -311,12 +449,383 @@ CellId ExpressionMatrix::addCell(
     CZI_ASSERT(cellExpressionCounts.size() == cells.size());
     CZI_ASSERT(cellSets.cellSets["AllCells"]->size() == cells.size());
 
+    // Append the new cells to the gene expression index.
+    // Ingestion functions do this when they end.
+    if(!deferCellStatistics) {
+        updateGeneExpressionIndex();
+    }
+
     // Done.
     return cellNameStringId;
 }
 
 
 
+// Add a block of cells with expression counts stored in
+// compressed sparse row (CSR) format.
+// Gene names are resolved once for the entire block.
+void ExpressionMatrix::addCellBlock(
+    const vector<string>& blockGeneNames,
+    const vector<string>& blockCellNames,
+    const vector< pair<string, string> >& blockCellMetaData,
+    const uint64_t* indptr,
+    const uint32_t* geneIndexes,
+    const float* values)
+{
+    vector<GeneId> geneIdTable;
+    vector<string> newGeneNames;
+    getGeneIdTable(blockGeneNames, geneIdTable, newGeneNames);
+    addCellBlock(blockCellNames, blockCellMetaData, indptr, geneIndexes, values,
+        geneIdTable.data(), geneIdTable.size(), 0, &newGeneNames);
+}
+
+
+
+// Convert gene names to gene ids without adding any genes.
+// Genes that don't exist yet are stored in newGeneNames
+// and get the gene ids they will have once added in that order.
+void ExpressionMatrix::getGeneIdTable(
+    const vector<string>& blockGeneNames,
+    vector<GeneId>& geneIdTable,
+    vector<string>& newGeneNames)
+{
+    geneIdTable.clear();
+    geneIdTable.reserve(blockGeneNames.size());
+    newGeneNames.clear();
+    map<string, GeneId> newGeneIds;
+    for(const string& geneName: blockGeneNames) {
+        const StringId stringId = geneNames(geneName);
+        if(stringId != geneNames.invalidStringId) {
+            geneIdTable.push_back(GeneId(stringId));
+            continue;
+        }
+        const auto it = newGeneIds.insert(make_pair(geneName, GeneId(geneCount() + newGeneNames.size()))).first;
+        if(it->second == geneCount() + newGeneNames.size()) {
+            newGeneNames.push_back(geneName);
+        }
+        geneIdTable.push_back(it->second);
+    }
+}
+
+
+
+// Version of addCellBlock that takes GeneIds for genes that were already added.
+void ExpressionMatrix::addCellBlockUsingGeneIds(
+    const vector<string>& blockCellNames,
+    const vector< pair<string, string> >& blockCellMetaData,
+    const uint64_t* indptr,
+    const GeneId* geneIds,
+    const float* values)
+{
+    addCellBlock(blockCellNames, blockCellMetaData, indptr, geneIds, values, 0, 0);
+}
+
+
+
+// Common code for addCellBlock and addCellBlockUsingGeneIds.
+void ExpressionMatrix::addCellBlock(
+    const vector<string>& blockCellNames,
+    const vector< pair<string, string> >& blockCellMetaData,
+    const uint64_t* indptr,
+    const uint32_t* geneIndexes,
+    const float* values,
+    const GeneId* geneIdTable,
+    size_t geneIdTableSize,
+    const vector< vector< pair<string, string> > >* perCellMetaData,
+    const vector<string>* newGeneNames)
+{
+    const size_t blockCellCount = blockCellNames.size();
+    if(blockCellCount == 0) {
+        return;
+    }
+    CZI_ASSERT(indptr);
+    if(size_t(cells.size()) + blockCellCount >= size_t(std::numeric_limits<CellId>::max())) {
+        throw runtime_error("Too many cells.");
+    }
+    for(const auto& p: blockCellMetaData) {
+        if(p.first == "CellName") {
+            throw runtime_error("CellName cannot be specified as meta data for a block of cells.");
+        }
+    }
+    if(perCellMetaData) {
+        CZI_ASSERT(perCellMetaData->size() == blockCellCount);
+        for(const auto& v: *perCellMetaData) {
+            for(const auto& p: v) {
+                if(p.first == "CellName") {
+                    throw runtime_error("CellName cannot be specified as per-cell meta data for a block of cells.");
+                }
+            }
+        }
+    }
+
+
+
+    // Validate the entire block before changing anything.
+    // Genes in newGeneNames don't exist yet, but their gene ids are valid.
+    const size_t validGeneCount = geneCount() + (newGeneNames ? newGeneNames->size() : 0);
+    const auto blockGeneName = [&](GeneId geneId)
+    {
+        return geneId < geneCount() ? geneName(geneId) : (*newGeneNames)[geneId - geneCount()];
+    };
+    if(indptr[0] != 0) {
+        throw runtime_error("Expression counts for a block of cells must begin at position 0.");
+    }
+    vector<GeneId> cellGeneIds;
+    for(size_t i=0; i<blockCellCount; i++) {
+        const uint64_t begin = indptr[i];
+        const uint64_t end = indptr[i+1];
+        if(end < begin) {
+            throw runtime_error("Expression count positions for a block of cells are not in increasing order.");
+        }
+
+        // Check gene ids and values, and look for duplicate genes.
+        cellGeneIds.clear();
+        for(uint64_t j=begin; j!=end; j++) {
+            const uint32_t geneIndex = geneIndexes[j];
+            GeneId geneId;
+            if(geneIdTable) {
+                if(geneIndex >= geneIdTableSize) {
+                    throw runtime_error("Invalid gene index for cell " + blockCellNames[i]);
+                }
+                geneId = geneIdTable[geneIndex];
+            } else {
+                geneId = geneIndex;
+            }
+            if(geneId >= validGeneCount) {
+                throw runtime_error("Invalid gene id for cell " + blockCellNames[i]);
+            }
+            if(!(values[j] >= 0.)) {
+                throw runtime_error("Negative or invalid expression count encountered for cell " + blockCellNames[i]);
+            }
+            if(values[j] != 0.) {
+                cellGeneIds.push_back(geneId);
+            }
+        }
+        sort(cellGeneIds.begin(), cellGeneIds.end());
+        const auto it = adjacent_find(cellGeneIds.begin(), cellGeneIds.end());
+        if(it != cellGeneIds.end()) {
+            throw runtime_error("Duplicate expression count for cell " + blockCellNames[i] + " gene " + blockGeneName(*it));
+        }
+
+        // Check that we don't already have this cell name.
+        if(cellNames(blockCellNames[i]) != invalidCellId) {
+            throw runtime_error("Cell name " + blockCellNames[i] + " already exists.");
+        }
+    }
+
+    // Check that cell names in the block are distinct.
+    {
+        vector<const string*> sortedCellNames;
+        sortedCellNames.reserve(blockCellCount);
+        for(const string& cellName: blockCellNames) {
+            sortedCellNames.push_back(&cellName);
+        }
+        const auto lessThan = [](const string* x, const string* y) {return *x < *y;};
+        const auto equal = [](const string* x, const string* y) {return *x == *y;};
+        sort(sortedCellNames.begin(), sortedCellNames.end(), lessThan);
+        const auto it = adjacent_find(sortedCellNames.begin(), sortedCellNames.end(), equal);
+        if(it != sortedCellNames.end()) {
+            throw runtime_error("Cell name " + **it + " appears more than once in a block of cells.");
+        }
+    }
+
+
+
+    // The block is valid. Add the genes that don't exist yet.
+    if(newGeneNames) {
+        for(const string& newGeneName: *newGeneNames) {
+            addGene(newGeneName);
+        }
+        CZI_ASSERT(geneCount() == validGeneCount);
+    }
+
+
+
+    // Get the StringIds for the meta data, which are the same for all cells in the block.
+    const StringId cellNameNameId = cellMetaDataNames["CellName"];
+    vector< pair<StringId, StringId> > sharedMetaData;
+    for(const auto& p: blockCellMetaData) {
+        sharedMetaData.push_back(make_pair(cellMetaDataNames[p.first], cellMetaDataValues[p.second]));
+    }
+
+    // Add the cells.
+    auto& allCells = *cellSets.cellSets["AllCells"];
+    vector< pair<GeneId, float> > cellExpressionCounts0;
+    for(size_t i=0; i<blockCellCount; i++) {
+        const CellId cellId = CellId(cells.size());
+
+        // Store the cell name.
+        const StringId cellNameStringId = cellNames[blockCellNames[i]];
+        CZI_ASSERT(cellNameStringId == cellId);
+
+        // Store the cell meta data.
+        cellMetaData.push_back();
+        incrementCellMetaDataNameUsageCount(cellNameNameId);
+        cellMetaData.push_back(make_pair(cellNameNameId, cellMetaDataValues[blockCellNames[i]]));
+        for(const auto& p: sharedMetaData) {
+            incrementCellMetaDataNameUsageCount(p.first);
+            cellMetaData.push_back(p);
+        }
+        if(perCellMetaData) {
+            for(const auto& p: (*perCellMetaData)[i]) {
+                const StringId nameId = cellMetaDataNames[p.first];
+                incrementCellMetaDataNameUsageCount(nameId);
+                cellMetaData.push_back(make_pair(nameId, cellMetaDataValues[p.second]));
+            }
+        }
+
+        // Gather the non-zero expression counts, sorted by GeneId.
+        cellExpressionCounts0.clear();
+        for(uint64_t j=indptr[i]; j!=indptr[i+1]; j++) {
+            const float value = values[j];
+            if(value != 0.) {
+                const GeneId geneId = geneIdTable ? geneIdTable[geneIndexes[j]] : geneIndexes[j];
+                cellExpressionCounts0.push_back(make_pair(geneId, value));
+            }
+        }
+        sort(cellExpressionCounts0.begin(), cellExpressionCounts0.end());
+
+        // Store the expression counts.
+        cellExpressionCounts.appendVector();
+        for(const auto& p: cellExpressionCounts0) {
+            cellExpressionCounts.append(p);
+        }
+        if(compressedCellExpressionCounts.isOpen()) {
+            compressedCellExpressionCounts.append(cellExpressionCounts0.data(),
+                cellExpressionCounts0.data() + cellExpressionCounts0.size());
+        }
+        Cell cell;
+        if(deferCellStatistics) {
+            clearCellStatistics(cell);
+        } else {
+            computeCellStatistics(cellExpressionCounts0.data(),
+                cellExpressionCounts0.data() + cellExpressionCounts0.size(),
+                std::numeric_limits<double>::infinity(), cell);
+        }
+
+        // Add this cell to the AllCells set and store fixed size information for this cell.
+        allCells.push_back(cellId);
+        cells.push_back(cell);
+        if(cellMetaDataColumns.isOpen()) {
+            appendCellToCellMetaDataColumns(cellId);
+        }
+    }
+
+    // Sanity checks.
+    CZI_ASSERT(cellNames.size() == cells.size());
+    CZI_ASSERT(cellMetaData.size() == cells.size());
+    CZI_ASSERT(cellExpressionCounts.size() == cells.size());
+    CZI_ASSERT(allCells.size() == cells.size());
+
+    // Append the new cells to the gene expression index.
+    // Ingestion functions do this when they end.
+    if(!deferCellStatistics) {
+        updateGeneExpressionIndex();
+    }
+}
+
+
+
+// Recompute the statistics stored in the Cell object of each cell
+// from the expression counts, using multiple threads.
+void ExpressionMatrix::computeCellStatistics(
+    size_t threadCount,
+    double largeExpressionCountThreshold)
+{
+    computeCellStatistics(0, CellId(cells.size()), threadCount, largeExpressionCountThreshold);
+}
+
+
+
+// Recompute the statistics stored in the Cell object
+// for cells with ids in [begin, end).
+void ExpressionMatrix::computeCellStatistics(
+    CellId begin,
+    CellId end,
+    size_t threadCount,
+    double largeExpressionCountThreshold)
+{
+    CZI_ASSERT(begin <= end);
+    CZI_ASSERT(end <= cells.size());
+    threadCount = getThreadCount(threadCount);
+    BatchDispatcher batchDispatcher(end - begin, 1000);
+    runThreads(threadCount, [&](size_t)
+    {
+        size_t batchBegin, batchEnd;
+        while(batchDispatcher.getBatch(batchBegin, batchEnd)) {
+            for(CellId cellId=CellId(begin+batchBegin); cellId!=CellId(begin+batchEnd); cellId++) {
+                computeCellStatistics(
+                    cellExpressionCounts.begin(cellId),
+                    cellExpressionCounts.end(cellId),
+                    largeExpressionCountThreshold,
+                    cells[cellId]);
+            }
+        }
+    });
+}
+
+
+
+// Compute the statistics for one cell.
+// The sums use four independent accumulators, so the additions
+// are not serialized by the latency of a single accumulator.
+void ExpressionMatrix::computeCellStatistics(
+    const pair<GeneId, float>* begin,
+    const pair<GeneId, float>* end,
+    double largeExpressionCountThreshold,
+    Cell& cell)
+{
+    double sum1[4] = {0., 0., 0., 0.};
+    double sum2[4] = {0., 0., 0., 0.};
+    const size_t n = size_t(end - begin);
+    const size_t n4 = n & ~size_t(3);
+    for(size_t i=0; i!=n4; i+=4) {
+        for(size_t k=0; k<4; k++) {
+            const double x = begin[i+k].second;
+            sum1[k] += x;
+            sum2[k] += x * x;
+        }
+    }
+    for(size_t i=n4; i!=n; i++) {
+        const double x = begin[i].second;
+        sum1[0] += x;
+        sum2[0] += x * x;
+    }
+    cell.sum1 = (sum1[0] + sum1[1]) + (sum1[2] + sum1[3]);
+    cell.sum2 = (sum2[0] + sum2[1]) + (sum2[2] + sum2[3]);
+    cell.norm2 = sqrt(cell.sum2);
+    cell.norm1Inverse = 1./cell.norm1();
+    cell.norm2Inverse = 1./cell.norm2;
+
+    // Large expression counts are rare, so this does not need to be fast.
+    cell.sum1LargeExpressionCounts = 0.;
+    cell.sum2LargeExpressionCounts = 0.;
+    for(const pair<GeneId, float>* it=begin; it!=end; ++it) {
+        const double x = it->second;
+        if(x >= largeExpressionCountThreshold) {
+            cell.sum1LargeExpressionCounts += x;
+            cell.sum2LargeExpressionCounts += x * x;
+        }
+    }
+}
+
+
+
+// Set the cell statistics to zero, for cells
+// whose statistics will be computed later.
+void ExpressionMatrix::clearCellStatistics(Cell& cell)
+{
+    cell.sum1 = 0.;
+    cell.sum2 = 0.;
+    cell.norm2 = 0.;
+    cell.norm1Inverse = 0.;
+    cell.norm2Inverse = 0.;
+    cell.sum1LargeExpressionCounts = 0.;
+    cell.sum2LargeExpressionCounts = 0.;
+}
+
+
+
 // Version of addCell that takes JSON as input.
 // The expected JSON can be constructed using Python code modeled from the following:
 // import json
@@ -369,33 +878,18 @@ CellId ExpressionMatrix::addCellFromJson(const string& jsonString)
 
 
 
-// Add cells from data in files with fields separated by commas or by other separators.
-// This is a bit messy, but all of this is necessary to allow
-// some flexibility in the contents of the input files.
-// For example:
-// - The first token of the first line of each input file
-//   is optional (and ignored is present).
-// - Each of the input files can use a different separator.
-// - The input files can have Unix or Windows line ends.
-// - Expression counts can contain leading and trailing blanks.
-// - The ordering of cells is not necessarily the same
-//   in the two input files.
-// - Some cells can be present in only one input file.
-//   Only cells present both in the cell meta data file
-//   and in the expression count file are kept.
-// See ExpressionMatrix.hpp for usage information.
-void ExpressionMatrix::addCells(
-    const string& expressionCountsFileName,
-    const string& expressionCountsFileSeparators,
+// Read the cell meta data file used by addCells.
+// On return:
+// - metaDataNames contains the meta data names, beginning with "CellName".
+// - metaDataInFile contains the meta data for each cell in the file, in the same order as metaDataNames.
+// - metaDataInFileMap maps each cell name to its index in metaDataInFile.
+void ExpressionMatrix::readCellMetaDataFile(
     const string& cellMetaDataFileName,
     const string& cellMetaDataFileSeparators,
-    const vector< pair<string, string> >& additionalCellMetaData // Added to all cells.
-    )
+    vector<string>& metaDataNames,
+    vector< vector<string> >& metaDataInFile,
+    map<string, CellId>& metaDataInFileMap)
 {
-    cout << timestamp << "Begin addCells: " << cellCount() <<" cells, "
-        << geneCount() << " genes." << endl;
-
-
     // Get the number of meta data fields.
     const size_t metaDataCount =
         countTokensInSecondLine(cellMetaDataFileName, cellMetaDataFileSeparators);
@@ -424,7 +918,7 @@ void ExpressionMatrix::addCells(
     tokenize(cellMetaDataFileSeparators, line, tokens, false);
 
     // Get the meta data names.
-    vector<string> metaDataNames;
+    metaDataNames.clear();
     metaDataNames.push_back("CellName");
     if(tokens.size() == metaDataCount) {
         copy(
@@ -446,8 +940,8 @@ void ExpressionMatrix::addCells(
 
     // Read the rest of the cell meta data file.
     // Store the meta data in a map keyed by the cell name.
-    vector< vector<string> > metaDataInFile;    // Indexed by CellId within the file
-    map<string, CellId> metaDataInFileMap;      // Map from cell name to CellId.
+    metaDataInFile.clear();
+    metaDataInFileMap.clear();
     while(true) {
 
         // Read a line.
@@ -492,6 +986,46 @@ void ExpressionMatrix::addCells(
     CZI_ASSERT(metaDataInFile.size() == metaDataInFileMap.size());
     cout << "Cell meta data file " << cellMetaDataFileName <<
         " contains meta data for " << metaDataInFile.size() << " cells." << endl;
+}
+
+
+
+// Add cells from data in files with fields separated by commas or by other separators.
+// This is a bit messy, but all of this is necessary to allow
+// some flexibility in the contents of the input files.
+// For example:
+// - The first token of the first line of each input file
+//   is optional (and ignored is present).
+// - Each of the input files can use a different separator.
+// - The input files can have Unix or Windows line ends.
+// - Expression counts can contain leading and trailing blanks.
+// - The ordering of cells is not necessarily the same
+//   in the two input files.
+// - Some cells can be present in only one input file.
+//   Only cells present both in the cell meta data file
+//   and in the expression count file are kept.
+// See ExpressionMatrix.hpp for usage information.
+// This is the old version that reads the expression counts file sequentially.
+void ExpressionMatrix::addCellsOld2(
+    const string& expressionCountsFileName,
+    const string& expressionCountsFileSeparators,
+    const string& cellMetaDataFileName,
+    const string& cellMetaDataFileSeparators,
+    const vector< pair<string, string> >& additionalCellMetaData // Added to all cells.
+    )
+{
+    cout << timestamp << "Begin addCellsOld2: " << cellCount() <<" cells, "
+        << geneCount() << " genes." << endl;
+
+
+    // Read the cell meta data file.
+    vector<string> metaDataNames;
+    vector< vector<string> > metaDataInFile;    // Indexed by CellId within the file
+    map<string, CellId> metaDataInFileMap;      // Map from cell name to CellId.
+    readCellMetaDataFile(cellMetaDataFileName, cellMetaDataFileSeparators,
+        metaDataNames, metaDataInFile, metaDataInFileMap);
+    string line;
+    vector<string> tokens;
 
 
 
@@ -655,7 +1189,7 @@ void ExpressionMatrix::addCells(
         addCell(metaDataForOneCell, countsForOneCell);
     }
 
-    cout << timestamp << "End addCells: " << cellCount() <<" cells, "
+    cout << timestamp << "End addCellsOld2: " << cellCount() <<" cells, "
         << geneCount() << " genes." << endl;
 }
 
@@ -895,21 +1429,124 @@ string ExpressionMatrix::getCellMetaData(CellId cellId, const string& name) cons
 }
 string ExpressionMatrix::getCellMetaData(CellId cellId, StringId nameId) const
 {
+    const StringId valueId = getCellMetaDataValueId(cellId, nameId);
+    if(valueId == cellMetaDataValues.invalidStringId) {
+        return "";
+    } else {
+        return cellMetaDataValues[valueId];
+    }
+}
+
+
+
+// Return the value StringId of a meta data field for a cell,
+// or invalidStringId if the cell does not have that field.
+StringId ExpressionMatrix::getCellMetaDataValueId(CellId cellId, StringId nameId) const
+{
+    if(cellMetaDataColumns.isOpen()) {
+        if(cellMetaDataColumns.hasColumn(nameId)) {
+            return cellMetaDataColumns.getValueId(cellId, nameId);
+        }
+
+        // There is no column for CellName, which is always the first
+        // meta data entry of a cell. Other names without a column
+        // are not used by any cell.
+        const auto it = cellMetaData.begin(cellId);
+        if(it != cellMetaData.end(cellId) && (*it).first == nameId) {
+            return (*it).second;
+        }
+        return cellMetaDataValues.invalidStringId;
+    }
 
     // Scan the name/value pairs for this cell, looking for nameId.
     for(const auto& metaDataPair: cellMetaData[cellId]) {
         if(metaDataPair.first == nameId) {
-            const StringId valueId = metaDataPair.second;
-            if(valueId == cellMetaDataValues.invalidStringId) {
-                return "";  // Should never happen, but just in case.
-            } else {
-                return cellMetaDataValues[valueId];
-            }
+            return metaDataPair.second;
+        }
+    }
+
+    // We did not find it.
+    return cellMetaDataValues.invalidStringId;
+}
+
+
+
+// Return the value of a meta data field for a cell converted to a double,
+// or NaN if the cell does not have that field or its value is not numeric.
+double ExpressionMatrix::getCellMetaDataNumericValue(CellId cellId, StringId nameId) const
+{
+    if(cellMetaDataColumns.isOpen() && cellMetaDataColumns.hasColumn(nameId)) {
+        return cellMetaDataColumns.numericValues(nameId)[cellId];
+    }
+    const StringId valueId = getCellMetaDataValueId(cellId, nameId);
+    if(valueId == cellMetaDataValues.invalidStringId) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+    const auto value = cellMetaDataValues(valueId);
+    return CellMetaDataColumns::parseNumericValue(value.begin(), value.end());
+}
+
+
+
+// Access the cell meta data columns. If they don't exist
+// (expression matrices created before they were introduced),
+// create them from cellMetaData if we have write access.
+void ExpressionMatrix::accessCellMetaDataColumns(bool readWriteAccess)
+{
+    if(filesystem::exists(directoryName + "/CellMetaDataColumns-Info")) {
+        cellMetaDataColumns.accessExisting(directoryName, StringId(cellMetaDataNames.size()), readWriteAccess);
+
+        // Remove the CellName column created by earlier versions.
+        const StringId cellNameNameId = cellMetaDataNames("CellName");
+        if(readWriteAccess && cellNameNameId != cellMetaDataNames.invalidStringId) {
+            cellMetaDataColumns.removeColumn(cellNameNameId);
         }
+        return;
+    }
+    if(!readWriteAccess) {
+        return;
+    }
+    cout << timestamp << "Creating cell meta data columns." << endl;
+    cellMetaDataColumns.createNew(directoryName);
+    for(CellId cellId=0; cellId!=CellId(cellMetaData.size()); cellId++) {
+        appendCellToCellMetaDataColumns(cellId);
     }
+    cellMetaDataColumns.syncToDisk();
+}
+
+
 
-    // We did not find it. Return an empty string.
-    return "";
+// Add to the cell meta data columns a cell whose meta data were already stored
+// in cellMetaData. The first entry is CellName, which does not get a column.
+void ExpressionMatrix::appendCellToCellMetaDataColumns(CellId cellId)
+{
+    CZI_ASSERT(cellId == cellMetaDataColumns.cellCount());
+    cellMetaDataColumns.appendCell();
+    const auto begin = cellMetaData.begin(cellId);
+    const auto end = cellMetaData.end(cellId);
+    for(auto it=begin; it!=end; ++it) {
+        if(it != begin) {
+            setCellMetaDataColumnValue(cellId, (*it).first, (*it).second);
+        }
+    }
+}
+
+
+
+void ExpressionMatrix::setCellMetaDataColumnValue(CellId cellId, StringId nameId, StringId valueId)
+{
+    if(cellNameMetaDataNameId == cellMetaDataNames.invalidStringId) {
+        cellNameMetaDataNameId = cellMetaDataNames("CellName");
+    }
+    if(nameId == cellNameMetaDataNameId) {
+        return;
+    }
+    if(valueId == cellMetaDataValues.invalidStringId) {
+        cellMetaDataColumns.set(cellId, nameId, valueId, 0, 0);
+    } else {
+        const auto value = cellMetaDataValues(valueId);
+        cellMetaDataColumns.set(cellId, nameId, valueId, value.begin(), value.end());
+    }
 }
 
 
@@ -963,6 +1600,9 @@ void ExpressionMatrix::setCellMetaData(CellId cellId, StringId nameId, StringId
     for(auto& p: cellMetaData[cellId]) {
         if(p.first == nameId) {
             p.second = valueId; // The name already exists. replace the value.
+            if(cellMetaDataColumns.isOpen()) {
+                setCellMetaDataColumnValue(cellId, nameId, valueId);
+            }
             return;
         }
     }
@@ -970,6 +1610,9 @@ void ExpressionMatrix::setCellMetaData(CellId cellId, StringId nameId, StringId
     // The name did not exist for this cell. Add this (name, value) pair.
     cellMetaData.push_back(cellId, make_pair(nameId, valueId));
     incrementCellMetaDataNameUsageCount(nameId);
+    if(cellMetaDataColumns.isOpen()) {
+        setCellMetaDataColumnValue(cellId, nameId, valueId);
+    }
 }
 
 
@@ -1027,6 +1670,9 @@ void ExpressionMatrix::removeCellMetaData(
             if((*it).first == metaDataNameId) {
                 decrementCellMetaDataNameUsageCount(metaDataNameId);
                 cellMetaData.erase(it);
+                if(cellMetaDataColumns.isOpen()) {
+                    setCellMetaDataColumnValue(cellId, metaDataNameId, cellMetaDataValues.invalidStringId);
+                }
                 break;
             }
         }
@@ -1036,6 +1682,23 @@ void ExpressionMatrix::removeCellMetaData(
 
 
 
+// Store the cell and gene meta data contiguously.
+void ExpressionMatrix::compactMetaData()
+{
+    if(!cells.isOpenWithWriteAccess) {
+        throw runtime_error("Expression matrix in " + directoryName + " was not accessed with write access.");
+    }
+    cout << timestamp << "Compacting meta data for " << cellCount() << " cells and " <<
+        geneCount() << " genes." << endl;
+    cellMetaData.compact();
+    geneMetaData.compact();
+    cellMetaData.syncToDisk();
+    geneMetaData.syncToDisk();
+    cout << timestamp << "Done compacting meta data." << endl;
+}
+
+
+
 // Get the expression count for a given cell and gene.
 // This can be zero.
 float ExpressionMatrix::getCellExpressionCount(CellId cellId, GeneId geneId) const
@@ -1088,11 +1751,9 @@ vector< pair<GeneId, float> > ExpressionMatrix::getCellExpressionCounts(CellId c
 // Some of the returned counts can be zero.
 vector<float> ExpressionMatrix::getCellsExpressionCount(const vector<CellId>& cellIds, GeneId geneId) const
 {
-    vector<float> returnVector;
-    returnVector.reserve(cellIds.size());
-    for(const CellId cellId: cellIds) {
-        returnVector.push_back(getCellExpressionCount(cellId, geneId));
-    }
+    CZI_ASSERT(geneId < geneCount());
+    vector<float> returnVector(cellIds.size());
+    getExpressionCountsForGene(geneId, cellIds.data(), cellIds.data() + cellIds.size(), returnVector.data());
     return returnVector;
 }
 
@@ -1113,6 +1774,93 @@ vector<float> ExpressionMatrix::getCellsExpressionCount(const vector<CellId>& ce
 
 
 
+void ExpressionMatrix::createCompressedExpressionCounts()
+{
+    if(!cells.isOpenWithWriteAccess) {
+        throw runtime_error("Expression matrix in " + directoryName + " was not accessed with write access.");
+    }
+    if(compressedCellExpressionCounts.isOpen()) {
+        return;
+    }
+    cout << timestamp << "Compressing the expression counts of " << cellCount() << " cells." << endl;
+    compressedCellExpressionCounts.createNew(directoryName + "/CompressedCellExpressionCounts");
+    for(CellId cellId=0; cellId!=cellCount(); cellId++) {
+        compressedCellExpressionCounts.append(cellExpressionCounts.begin(cellId), cellExpressionCounts.end(cellId));
+    }
+    compressedCellExpressionCounts.syncToDisk();
+    cout << timestamp << "Compressed " << cellExpressionCounts.totalSize() << " expression counts from " <<
+        cellExpressionCounts.totalSize() * sizeof(pair<GeneId, float>) << " to " <<
+        compressedCellExpressionCounts.byteCount() << " bytes." << endl;
+}
+
+
+
+void ExpressionMatrix::removeCompressedExpressionCounts()
+{
+    if(compressedCellExpressionCounts.isOpen()) {
+        compressedCellExpressionCounts.remove();
+    }
+}
+
+
+
+// Stop using compressed expression counts that don't cover the same cells
+// as the expression matrix. With write access they are removed,
+// and can be created again using createCompressedExpressionCounts.
+void ExpressionMatrix::dropInconsistentCompressedExpressionCounts()
+{
+    cout << "The compressed expression counts in " << directoryName <<
+        " have " << compressedCellExpressionCounts.size() << " cells instead of " << cells.size() <<
+        " and will not be used." << endl;
+    if(cells.isOpenWithWriteAccess) {
+        compressedCellExpressionCounts.remove();
+    } else {
+        compressedCellExpressionCounts.close();
+    }
+}
+
+
+
+void ExpressionMatrix::setMappingPolicy(
+    const string& fileNamePrefix,
+    const string& accessPattern,
+    bool useHugePages,
+    bool willNeed,
+    bool interleave)
+{
+    MemoryMapped::MappingPolicy policy;
+    if(accessPattern == "normal") {
+        policy.accessPattern = MemoryMapped::MappingPolicy::AccessPattern::normal;
+    } else if(accessPattern == "random") {
+        policy.accessPattern = MemoryMapped::MappingPolicy::AccessPattern::random;
+    } else if(accessPattern == "sequential") {
+        policy.accessPattern = MemoryMapped::MappingPolicy::AccessPattern::sequential;
+    } else {
+        throw runtime_error("Invalid access pattern " + accessPattern +
+            ". Must be normal, random, or sequential.");
+    }
+    policy.useHugePages = useHugePages;
+    policy.willNeed = willNeed;
+    policy.interleave = interleave;
+    mappingPolicies.set(directoryName + "/" + fileNamePrefix, policy);
+}
+
+
+
+void ExpressionMatrix::setMappingPolicies(const vector<ExpressionMatrixMappingPolicy>& policies)
+{
+    for(const ExpressionMatrixMappingPolicy& policy: policies) {
+        setMappingPolicy(
+            policy.fileNamePrefix,
+            policy.accessPattern,
+            policy.useHugePages,
+            policy.willNeed,
+            policy.interleave);
+    }
+}
+
+
+
 // Get all the non-zero expression counts for a specified set of cells.
 // Each position in the returned vector has the counts for
 // the cell at the same position in the input vector.
@@ -1309,16 +2057,21 @@ void ExpressionMatrix::histogramMetaData(
     StringId metaDataNameId,
     vector< pair<string, size_t> >& sortedHistogram) const
 {
-    // Create the histogram.
-    map<string, size_t> histogram;
+    // Count the cells for each value StringId. This avoids
+    // creating a string for each cell.
+    map<StringId, size_t> valueIdHistogram;
     for(const CellId cellId: cellSet) {
-        const string metaDataValue = getCellMetaData(cellId, metaDataNameId);
-        const auto it = histogram.find(metaDataValue);
-        if(it == histogram.end()) {
-            histogram.insert(make_pair(metaDataValue, 1));
-        } else {
-            ++(it->second);
-        }
+        ++valueIdHistogram[getCellMetaDataValueId(cellId, metaDataNameId)];
+    }
+
+    // Create the histogram. Cells without this meta data field
+    // are counted with an empty value.
+    map<string, size_t> histogram;
+    for(const auto& p: valueIdHistogram) {
+        const StringId valueId = p.first;
+        const string metaDataValue =
+            (valueId == cellMetaDataValues.invalidStringId) ? string() : string(cellMetaDataValues[valueId]);
+        histogram[metaDataValue] += p.second;
     }
 
 
@@ -1404,26 +2157,42 @@ pair<double, double> ExpressionMatrix::computeMetaDataRandIndex(
 double ExpressionMatrix::computeCellSimilarity(CellId cellId0, CellId cellId1) const
 {
     // Compute the scalar product of the expression counts for the two cells.
-    typedef pair<GeneId, float>const* Iterator;
-    const Iterator begin0 = cellExpressionCounts.begin(cellId0);
-    const Iterator end0 = cellExpressionCounts.end(cellId0);
-    const Iterator begin1 = cellExpressionCounts.begin(cellId1);
-    const Iterator end1 = cellExpressionCounts.end(cellId1);
-    Iterator it0 = begin0;
-    Iterator it1 = begin1;
     double scalarProduct = 0.;
-    while((it0 != end0) && (it1 != end1)) {
-        const GeneId geneId0 = it0->first;
-        const GeneId geneId1 = it1->first;
-
-        if(geneId0 < geneId1) {
-            ++it0;
-        } else if(geneId1 < geneId0) {
-            ++it1;
-        } else {
-            scalarProduct += it0->second * it1->second;
-            ++it0;
-            ++it1;
+    if(compressedCellExpressionCounts.isOpen()) {
+        auto decoder0 = compressedCellExpressionCounts.decoder(cellId0);
+        auto decoder1 = compressedCellExpressionCounts.decoder(cellId1);
+        while(decoder0.isValid() && decoder1.isValid()) {
+            if(decoder0.geneId < decoder1.geneId) {
+                decoder0.next();
+            } else if(decoder1.geneId < decoder0.geneId) {
+                decoder1.next();
+            } else {
+                scalarProduct += decoder0.count * decoder1.count;
+                decoder0.next();
+                decoder1.next();
+            }
+        }
+    } else {
+        typedef pair<GeneId, float>const* Iterator;
+        const Iterator begin0 = cellExpressionCounts.begin(cellId0);
+        const Iterator end0 = cellExpressionCounts.end(cellId0);
+        const Iterator begin1 = cellExpressionCounts.begin(cellId1);
+        const Iterator end1 = cellExpressionCounts.end(cellId1);
+        Iterator it0 = begin0;
+        Iterator it1 = begin1;
+        while((it0 != end0) && (it1 != end1)) {
+            const GeneId geneId0 = it0->first;
+            const GeneId geneId1 = it1->first;
+
+            if(geneId0 < geneId1) {
+                ++it0;
+            } else if(geneId1 < geneId0) {
+                ++it1;
+            } else {
+                scalarProduct += it0->second * it1->second;
+                ++it0;
+                ++it1;
+            }
         }
     }
 
@@ -1476,55 +2245,87 @@ double ExpressionMatrix::computeCellSimilarity(
     CellId cellId0,
     CellId cellId1) const
 {
-    // Compute the scalar product of the expression counts for the two cells,
+    // Compute the sums we need to compute the correlation coefficient,
     // taking into account only genes in this gene set.
-    typedef pair<GeneId, float>const* Iterator;
-    const Iterator begin0 = cellExpressionCounts.begin(cellId0);
-    const Iterator end0 = cellExpressionCounts.end(cellId0);
-    const Iterator begin1 = cellExpressionCounts.begin(cellId1);
-    const Iterator end1 = cellExpressionCounts.end(cellId1);
-    Iterator it0 = begin0;
-    Iterator it1 = begin1;
     double sum01 = 0.;
-    while((it0 != end0) && (it1 != end1)) {
-        const GeneId geneId0 = it0->first;
-        const GeneId geneId1 = it1->first;
-
-        if(geneId0 < geneId1) {
-            ++it0;
-        } else if(geneId1 < geneId0) {
-            ++it1;
-        } else {
-            // Here, geneId0==geneId1.
-            if(geneSet.contains(geneId0)) {
-                sum01 += it0->second * it1->second;
+    double sum0 = 0.;
+    double sum00 = 0.;
+    double sum1 = 0.;
+    double sum11 = 0.;
+    if(compressedCellExpressionCounts.isOpen()) {
+
+        // Decode the two cells on the fly, computing all sums in a single pass.
+        auto decoder0 = compressedCellExpressionCounts.decoder(cellId0);
+        auto decoder1 = compressedCellExpressionCounts.decoder(cellId1);
+        while(decoder0.isValid() || decoder1.isValid()) {
+            const GeneId geneId0 = decoder0.isValid() ? decoder0.geneId : invalidGeneId;
+            const GeneId geneId1 = decoder1.isValid() ? decoder1.geneId : invalidGeneId;
+            const GeneId geneId = min(geneId0, geneId1);
+            const bool isInGeneSet = geneSet.contains(geneId);
+            const float count0 = (geneId0 == geneId) ? decoder0.count : 0.f;
+            const float count1 = (geneId1 == geneId) ? decoder1.count : 0.f;
+            if(isInGeneSet) {
+                sum0 += count0;
+                sum00 += count0*count0;
+                sum1 += count1;
+                sum11 += count1*count1;
+                sum01 += count0 * count1;
+            }
+            if(geneId0 == geneId) {
+                decoder0.next();
+            }
+            if(geneId1 == geneId) {
+                decoder1.next();
             }
-            ++it0;
-            ++it1;
         }
-    }
 
+    } else {
 
+        // Compute the scalar product of the expression counts for the two cells,
+        // taking into account only genes in this gene set.
+        typedef pair<GeneId, float>const* Iterator;
+        const Iterator begin0 = cellExpressionCounts.begin(cellId0);
+        const Iterator end0 = cellExpressionCounts.end(cellId0);
+        const Iterator begin1 = cellExpressionCounts.begin(cellId1);
+        const Iterator end1 = cellExpressionCounts.end(cellId1);
+        Iterator it0 = begin0;
+        Iterator it1 = begin1;
+        while((it0 != end0) && (it1 != end1)) {
+            const GeneId geneId0 = it0->first;
+            const GeneId geneId1 = it1->first;
+
+            if(geneId0 < geneId1) {
+                ++it0;
+            } else if(geneId1 < geneId0) {
+                ++it1;
+            } else {
+                // Here, geneId0==geneId1.
+                if(geneSet.contains(geneId0)) {
+                    sum01 += it0->second * it1->second;
+                }
+                ++it0;
+                ++it1;
+            }
+        }
 
-    // Compute the other sums we need to compute the correlation coefficient.
-    double sum0 = 0.;
-    double sum00 = 0.;
-    for(it0=begin0; it0!=end0; ++it0) {
-        const GeneId geneId0 = it0->first;
-        if(geneSet.contains(geneId0)) {
-            const auto& count = it0->second;
-            sum0 += count;
-            sum00 += count*count;
+
+
+        // Compute the other sums we need to compute the correlation coefficient.
+        for(it0=begin0; it0!=end0; ++it0) {
+            const GeneId geneId0 = it0->first;
+            if(geneSet.contains(geneId0)) {
+                const auto& count = it0->second;
+                sum0 += count;
+                sum00 += count*count;
+            }
         }
-    }
-    double sum1 = 0.;
-    double sum11 = 0.;
-    for(it1=begin1; it1!=end1; ++it1) {
-        const GeneId geneId1 = it1->first;
-        if(geneSet.contains(geneId1)) {
-            const auto& count = it1->second;
-            sum1 += count;
-            sum11 += count*count;
+        for(it1=begin1; it1!=end1; ++it1) {
+            const GeneId geneId1 = it1->first;
+            if(geneSet.contains(geneId1)) {
+                const auto& count = it1->second;
+                sum1 += count;
+                sum11 += count*count;
+            }
         }
     }
 
@@ -1584,29 +2385,38 @@ void ExpressionMatrix::createCellSetUsingMetaData(
 
 
     // Find the cells that belong to the new cell set.
+    // If the meta data name or (for an exact match) the value
+    // don't exist, no cells match.
     vector<CellId> cellSet;
-
-    // Loop over all cells.
-    for(CellId cellId=0; cellId<cells.size(); cellId++) {
-
-        // Loop over the meta data fields for this cell.
-        const auto metaData = cellMetaData[cellId];
-        for(const pair<StringId, StringId>& p: metaData) {
-
-            // If the meta data name is not the specified one, skip.
-            if(!cellMetaDataNames.equal(p.first, metaDataFieldName)) {
+    const StringId nameId = cellMetaDataNames(metaDataFieldName);
+    const StringId matchValueId = useRegex ? cellMetaDataValues.invalidStringId : cellMetaDataValues(matchString);
+    if(nameId != cellMetaDataNames.invalidStringId &&
+        (useRegex || matchValueId != cellMetaDataValues.invalidStringId)) {
+
+        // For regular expression matching, remember the result
+        // for each value StringId, so each distinct value is only matched once.
+        map<StringId, bool> regexMatches;
+
+        // Loop over all cells.
+        for(CellId cellId=0; cellId<cells.size(); cellId++) {
+            const StringId valueId = getCellMetaDataValueId(cellId, nameId);
+            if(valueId == cellMetaDataValues.invalidStringId) {
                 continue;
             }
 
             // Figure out if this cell should be included in the new cell set.
-            const auto metaDataValue = cellMetaDataValues(p.second);
             bool includeThisCell;
             if(useRegex) {
-                includeThisCell = std::regex_match(metaDataValue.begin(), metaDataValue.end(), regex);
+                const auto it = regexMatches.find(valueId);
+                if(it == regexMatches.end()) {
+                    const auto metaDataValue = cellMetaDataValues(valueId);
+                    includeThisCell = std::regex_match(metaDataValue.begin(), metaDataValue.end(), regex);
+                    regexMatches.insert(make_pair(valueId, includeThisCell));
+                } else {
+                    includeThisCell = it->second;
+                }
             } else {
-                includeThisCell =
-                    (metaDataValue.size() == matchString.size()) &&
-                    equal(matchString.begin(), matchString.end(), metaDataValue.begin());
+                includeThisCell = (valueId == matchValueId);
             }
 
             // If the meta data value matches the given string or regular expression,
@@ -1614,10 +2424,6 @@ void ExpressionMatrix::createCellSetUsingMetaData(
             if(includeThisCell) {
                 cellSet.push_back(cellId);
             }
-
-            // We don't need to check the remaining meta data fields,
-            // since we found the one we were looking for.
-            break;
         }
     }
 
@@ -1671,7 +2477,31 @@ void ExpressionMatrix::createCellSetIntersectionOrUnion(const string& commaSepar
         }
     }
 
-    // Compute the intersection or union.
+    // If the input sets are dense, compute the intersection or union using bitmaps.
+    size_t totalSize = 0;
+    for(const string& inputSetName: inputSetsNames) {
+        totalSize += cellSets.cellSets[inputSetName]->size();
+    }
+    if(CellSetBitmap::isPreferred(totalSize, inputSetsNames.size(), CellId(cells.size()))) {
+        CellSetBitmap outputBitmap;
+        for(size_t i=0; i<inputSetsNames.size(); i++) {
+            const auto& inputSet = *cellSets.cellSets[inputSetsNames[i]];
+            const CellSetBitmap inputBitmap(inputSet.begin(), inputSet.end());
+            if(i == 0) {
+                outputBitmap = inputBitmap;
+            } else if(doUnion) {
+                outputBitmap.unionWith(inputBitmap);
+            } else {
+                outputBitmap.intersectWith(inputBitmap);
+            }
+        }
+        vector<CellId> outputSet;
+        outputBitmap.getCellIds(outputSet);
+        cellSets.addCellSet(outputSetName, outputSet);
+        return;
+    }
+
+    // Otherwise, compute the intersection or union by merging the sorted cell ids.
     vector<CellId> outputSet;
     for(size_t i=0; i<inputSetsNames.size(); i++) {
         const string& inputSetName = inputSetsNames[i];
@@ -1729,12 +2559,18 @@ void ExpressionMatrix::createCellSetDifference(
 
 
 
-    // Compute the difference.
+    // Compute the difference, using bitmaps if the input sets are dense.
     vector<CellId> outputSet;
-    std::set_difference(
-        inputSet0.begin(), inputSet0.end(),
-        inputSet1.begin(), inputSet1.end(),
-        back_inserter(outputSet));
+    if(CellSetBitmap::isPreferred(inputSet0.size() + inputSet1.size(), 2, CellId(cells.size()))) {
+        CellSetBitmap outputBitmap(inputSet0.begin(), inputSet0.end());
+        outputBitmap.subtract(CellSetBitmap(inputSet1.begin(), inputSet1.end()));
+        outputBitmap.getCellIds(outputSet);
+    } else {
+        std::set_difference(
+            inputSet0.begin(), inputSet0.end(),
+            inputSet1.begin(), inputSet1.end(),
+            back_inserter(outputSet));
+    }
 
 
 
@@ -1974,11 +2810,11 @@ float ExpressionMatrix::computeGeneInformationContent(
     // Create a vector of expression counts for this gene and for all cells in the cell set,
     // using the requested normalization.
     // Note that we use the normalization defined using all genes.
-    vector<float> count;
-    count.reserve(cellSet.size());
-    for(const CellId cellId : cellSet) {
-        const Cell& cell = cells[cellId];
-        float c = getCellExpressionCount(cellId, geneId);
+    vector<float> count(cellSet.size());
+    getExpressionCountsForGene(geneId, cellSet.begin(), cellSet.end(), count.data());
+    for(size_t i=0; i!=count.size(); i++) {
+        const Cell& cell = cells[cellSet[i]];
+        float& c = count[i];
         switch(normalizationMethod) {
         case NormalizationMethod::L1:
             c *= float(cell.norm1Inverse);
@@ -1989,7 +2825,6 @@ float ExpressionMatrix::computeGeneInformationContent(
         default:
             break;
         }
-        count.push_back(c);
     }
 
 
@@ -6,10 +6,16 @@
 // CZI.
 #include "Cell.hpp"
 #include "CellGraph.hpp"
+#include "CellMetaDataColumns.hpp"
 #include "CellSets.hpp"
+#include "CompressedExpressionCounts.hpp"
+#include "GeneExpressionIndex.hpp"
 #include "GeneSet.hpp"
 #include "HttpServer.hpp"
 #include "Ids.hpp"
+#include "MemoryAsContainer.hpp"
+#include "MemoryMappedObject.hpp"
+#include "MemoryMappedPolicy.hpp"
 #include "MemoryMappedVector.hpp"
 #include "MemoryMappedVectorOfLists.hpp"
 #include "MemoryMappedVectorOfVectors.hpp"
@@ -17,6 +23,8 @@
 #include "NormalizationMethod.hpp"
 
 // Standard library.
+#include <exception>
+#include <functional>
 #include <limits>
 #include "map.hpp"
 #include "memory.hpp"
@@ -27,15 +35,18 @@ namespace ChanZuckerberg {
     namespace ExpressionMatrix2 {
 
         class BitSet;
+        class CellBlock;
         class CellGraph;
         class CellGraphInformation;
         class ClusterGraph;
         class ClusterGraphCreationParameters;
         class ExpressionMatrix;
         class ExpressionMatrixCreationParameters;
+        class ExpressionMatrixMappingPolicy;
         class ExpressionMatrixSubset;
         class GeneGraph;
         class Lsh;
+        class LshBuckets;
         class ServerParameters;
         class SimilarPairs;
         class SignatureGraph;
@@ -57,20 +68,17 @@ namespace pybind11 {
 class ChanZuckerberg::ExpressionMatrix2::ExpressionMatrixCreationParameters {
 public:
 
-    // The following parameters control the capacity of various hash tables
+    // The following parameters control the initial capacity of various hash tables
     // use to store strings.
-    // These capacities are hard limits: after the capacity is reached,
-    // inserting a new element triggers an endless loop
-    // (because we use open addressing hash tables without rehashing and without checks).
-    // For good performance of these hash tables, these capacities
-    // should equal at least twice the actual expected number of strings
-    // of each type that will be stored.
-    uint64_t geneCapacity = 1<<18;              // Controls the maximum number of genes.
-    uint64_t cellCapacity = 1<<24;              // Controls the maximum number of cells.
-    uint64_t cellMetaDataNameCapacity = 1<<16;  // Controls the maximum number of distinct cell meta data name strings.
-    uint64_t cellMetaDataValueCapacity = 1<<28; // Controls the maximum number of distinct cell meta data value strings.
-    uint64_t geneMetaDataNameCapacity = 1<<16;  // Controls the maximum number of distinct gene meta data name strings.
-    uint64_t geneMetaDataValueCapacity = 1<<20; // Controls the maximum number of distinct gene meta data value strings.
+    // These are only initial sizes: the hash tables grow automatically
+    // (with a rehash of all strings stored) when their load factor
+    // would exceed 1/2, so these capacities are not limits.
+    uint64_t geneCapacity = 1<<16;              // Initial capacity for genes.
+    uint64_t cellCapacity = 1<<16;              // Initial capacity for cells.
+    uint64_t cellMetaDataNameCapacity = 1<<10;  // Initial capacity for distinct cell meta data name strings.
+    uint64_t cellMetaDataValueCapacity = 1<<16; // Initial capacity for distinct cell meta data value strings.
+    uint64_t geneMetaDataNameCapacity = 1<<10;  // Initial capacity for distinct gene meta data name strings.
+    uint64_t geneMetaDataValueCapacity = 1<<16; // Initial capacity for distinct gene meta data value strings.
 
     ExpressionMatrixCreationParameters(
         uint64_t geneCapacity,
@@ -84,6 +92,29 @@ public:
 
 
 
+// Class used to specify a mapping policy for the memory mapped files
+// of an ExpressionMatrix with names beginning with a given prefix.
+// See ExpressionMatrix::setMappingPolicy and MemoryMappedPolicy.hpp.
+class ChanZuckerberg::ExpressionMatrix2::ExpressionMatrixMappingPolicy {
+public:
+    string fileNamePrefix;
+    string accessPattern = "normal";    // "normal", "random", or "sequential".
+    bool useHugePages = false;
+    bool willNeed = false;
+    bool interleave = false;
+
+    ExpressionMatrixMappingPolicy() {}
+    ExpressionMatrixMappingPolicy(
+        const string& fileNamePrefix,
+        const string& accessPattern,
+        bool useHugePages,
+        bool willNeed,
+        bool interleave
+        );
+};
+
+
+
 // Class used to store information about a cell graph.
 class ChanZuckerberg::ExpressionMatrix2::CellGraphInformation {
 public:
@@ -118,7 +149,12 @@ public:
     // will be stored in the specified directory. If the directory does not exist,
     // it will be created. If the directory already exists, any previous
     // expression matrix stored in the directory will be overwritten by the new one.
-    ExpressionMatrix(const string& directoryName, const ExpressionMatrixCreationParameters&);
+    // The mapping policies are set before any file is mapped
+    // (see setMappingPolicy).
+    ExpressionMatrix(
+        const string& directoryName,
+        const ExpressionMatrixCreationParameters&,
+        const vector<ExpressionMatrixMappingPolicy>& mappingPolicies = vector<ExpressionMatrixMappingPolicy>());
     ExpressionMatrix(
         const string& directoryName,
         uint64_t geneCapacity,
@@ -126,11 +162,15 @@ public:
         uint64_t cellMetaDataNameCapacity,
         uint64_t cellMetaDataValueCapacity,
         uint64_t geneMetaDataNameCapacity,
-        uint64_t geneMetaDataValueCapacity
+        uint64_t geneMetaDataValueCapacity,
+        const vector<ExpressionMatrixMappingPolicy>& mappingPolicies = vector<ExpressionMatrixMappingPolicy>()
     );
 
     // Access a previously created expression matrix stored in the specified directory.
-    ExpressionMatrix(const string& directoryName, bool allowReadOnly);
+    ExpressionMatrix(
+        const string& directoryName,
+        bool allowReadOnly,
+        const vector<ExpressionMatrixMappingPolicy>& mappingPolicies = vector<ExpressionMatrixMappingPolicy>());
 
     // Add a gene.
     // Returns true if the gene was added, false if it was already present.
@@ -149,6 +189,44 @@ public:
         const vector< pair<string, float> >& expressionCounts
         );
 
+    // Version of addCell that takes expression counts as pairs (GeneId, count)
+    // for genes that were already added.
+    // This avoids converting gene ids to gene names and back
+    // when adding many cells that use the same genes.
+    CellId addCellUsingGeneIds(
+        const vector< pair<string, string> >& metaData,
+        const vector< pair<GeneId, float> >& expressionCounts
+        );
+
+    // Add a block of cells with expression counts stored in
+    // compressed sparse row (CSR) format:
+    // the expression counts for cell i are at positions
+    // indptr[i] through indptr[i+1]-1 of geneIndexes and values,
+    // and geneIndexes are indexes into the geneNames vector.
+    // Gene names are resolved once for the entire block,
+    // so there is no per-count string hashing. Genes that don't exist yet
+    // are added after the block has been validated.
+    // The same meta data is added to all cells, in addition to "CellName".
+    // The entire block is validated before any cell is added,
+    // so if an exception is thrown the expression matrix is not modified.
+    void addCellBlock(
+        const vector<string>& geneNames,
+        const vector<string>& cellNames,
+        const vector< pair<string, string> >& cellMetaData,  // Added to all cells.
+        const uint64_t* indptr,                                 // Size cellNames.size()+1.
+        const uint32_t* geneIndexes,                            // Size indptr[cellNames.size()].
+        const float* values                                     // Size indptr[cellNames.size()].
+        );
+
+    // Version of addCellBlock that takes GeneIds for genes that were already added.
+    void addCellBlockUsingGeneIds(
+        const vector<string>& cellNames,
+        const vector< pair<string, string> >& cellMetaData,  // Added to all cells.
+        const uint64_t* indptr,                                 // Size cellNames.size()+1.
+        const GeneId* geneIds,                                  // Size indptr[cellNames.size()].
+        const float* values                                     // Size indptr[cellNames.size()].
+        );
+
     // Version of addCell that takes JSON as input.
     // The expected JSON can be constructed using Python code modeled from the following:
     // import json
@@ -157,6 +235,64 @@ public:
     // Note that the cellName metaData entry is required.
     CellId addCellFromJson(const string& jsonString);
 
+    // Add cells from a file in JSON lines format, containing one cell per line,
+    // in the same format used by addCellFromJson.
+    // The file can be compressed with gzip.
+    // Cells are added in blocks of up to batchSize cells using addCellBlock.
+    // A line that cannot be used (invalid JSON, missing CellName,
+    // duplicate cell name, invalid expression count, etc.)
+    // is reported and skipped, without affecting other lines.
+    // Returns the number of cells added.
+    // See ExpressionMatrixJson.cpp for more information.
+    size_t addCellsFromJsonLines(const string& fileName, size_t batchSize = 10000);
+
+    // Recompute the statistics stored in the Cell object of each cell
+    // (sums, norms, and inverse norms of the expression counts)
+    // from the stored expression counts, using multiple threads.
+    // Expression counts greater than or equal to largeExpressionCountThreshold
+    // are used to compute sum1LargeExpressionCounts and sum2LargeExpressionCounts
+    // (by default no expression count is considered large).
+    // Ingestion functions don't compute these statistics as each cell is added.
+    // Instead they call this for the cells they added, at each ingestion checkpoint.
+    void computeCellStatistics(
+        size_t threadCount = 0,
+        double largeExpressionCountThreshold = std::numeric_limits<double>::infinity());
+
+    // Create or remove the gene expression index, a gene-major copy of the
+    // expression counts used to speed up queries that need the expression
+    // counts of a gene for many cells.
+    // Once created, cells added later are appended incrementally
+    // to an overlay of the index kept in memory. Ingestion functions
+    // merge the overlay into the stored index when it becomes large.
+    // Cells added with addCell or addCellBlock are only merged
+    // by calling createGeneExpressionIndex again. See GeneExpressionIndex.hpp.
+    void createGeneExpressionIndex(size_t threadCount = 0);
+    void removeGeneExpressionIndex();
+
+    // Create or remove a compressed copy of the expression counts.
+    // Once created, it is kept up to date as cells are added,
+    // and it is used instead of the uncompressed expression counts by
+    // computeCellSimilarity and when creating expression matrix subsets.
+    // See CompressedExpressionCounts.hpp.
+    void createCompressedExpressionCounts();
+    void removeCompressedExpressionCounts();
+
+    // Set the mapping policy for the memory mapped files of this expression matrix
+    // with names beginning with the given prefix, for example
+    // "CellExpressionCounts" or "Lsh-" (use an empty prefix for all files).
+    // The policy is applied to files already open and to files opened later,
+    // and is removed when this expression matrix is destroyed.
+    // To avoid moving pages that are already in memory,
+    // pass the policies to the constructor instead.
+    // accessPattern can be "normal", "random", or "sequential".
+    // See MemoryMappedPolicy.hpp.
+    void setMappingPolicy(
+        const string& fileNamePrefix,
+        const string& accessPattern,
+        bool useHugePages,
+        bool willNeed,
+        bool interleave);
+
 
 
     /*******************************************************************************
@@ -182,6 +318,11 @@ public:
 
     If a cell name is present in only one of the files, that cell is ignored.
 
+    The expression counts file is memory mapped and parsed by multiple threads
+    in two passes: the first pass counts the non-zero expression counts of each cell,
+    and the second pass stores them. This way, the expression counts are never
+    stored in dense form, and the file is never loaded in memory in its entirety.
+
     An example of the two files follow:
 
     Expression counts file:
@@ -197,6 +338,16 @@ public:
 
     *******************************************************************************/
     void addCells(
+        const string& expressionCountsFileName,
+        const string& expressionCountsFileSeparators,
+        const string& metaDataFileName,
+        const string& metaDataFileSeparators,
+        const vector< pair<string, string> >& additionalCellMetaData, // Added to all cells.
+        size_t threadCount = 0  // Number of threads used to parse the expression counts file.
+        );
+    // Old version that reads the expression counts file sequentially
+    // and keeps all expression counts in memory before adding cells.
+    void addCellsOld2(
         const string& expressionCountsFileName,
         const string& expressionCountsFileSeparators,
         const string& metaDataFileName,
@@ -257,6 +408,30 @@ public:
 #endif
 
 
+
+    // Add cells from an expression matrix in Matrix Market format
+    // (matrix.mtx, features.tsv or genes.tsv, and barcodes.tsv),
+    // as created by the 10X Genomics pipeline.
+    // The files can be compressed with gzip.
+    // See the top of ExpressionMatrixMtx.cpp for more information.
+    void addCellsFromMtx(
+        const string& matrixFileName,
+        const string& featuresFileName,
+        const string& barcodesFileName,
+        const string& cellNamePrefix,
+        const vector< pair<string, string> > cellMetaData,  // Added to all cells.
+        double totalExpressionCountThreshold);
+
+    // Add cells from a directory created by the 10X Genomics pipeline,
+    // containing matrix.mtx.gz, features.tsv.gz, and barcodes.tsv.gz
+    // (or, for older versions, matrix.mtx, genes.tsv, and barcodes.tsv).
+    void addCellsFrom10xDirectory(
+        const string& directoryName,
+        const string& cellNamePrefix,
+        const vector< pair<string, string> > cellMetaData,  // Added to all cells.
+        double totalExpressionCountThreshold);
+
+
     // Add cells from files created by the BioHub pipeline.
     // See top of ExpressionMatrixBioHub.cpp for a detailed description
     // of the expected formats.
@@ -276,9 +451,12 @@ public:
     // September 2017, 10X Genomics data.
     // See top of ExpressionMatrixBioHub.cpp for details.
 #ifndef CZI_EXPRESSION_MATRIX2_SKIP_HDF5
+    // Plates are downloaded and read using threadCount threads
+    // (0 = one per virtual processor), as for addCellsFromHdf5Batch.
     void addCellsFromBioHub2(
         const string& platesFileName,    // The name of the file containing per-plate meta data.
-        double totalExpressionCountThreshold
+        double totalExpressionCountThreshold,
+        size_t threadCount = 0
         );
 #endif
 
@@ -290,6 +468,27 @@ public:
         const vector<pair<string, string> >& plateMetaData  // Meta data that will be added to all cells.
         );
 
+    // Batch versions of addCellsFromHdf5 and addCellsFromBioHub3
+    // for a list of plate files that are already local.
+    // Plates are read concurrently by worker threads into staging buffers,
+    // and the cells are added by the calling thread in the order in which
+    // the plates are specified, so the CellIds assigned do not depend
+    // on the number of threads. See addCellBlocksInParallel.
+    // The vector arguments must all have the same length (one entry per plate).
+#ifndef CZI_EXPRESSION_MATRIX2_SKIP_HDF5
+    void addCellsFromHdf5Batch(
+        const vector<string>& fileNames,
+        const vector<string>& cellNamePrefixes,
+        const vector< vector< pair<string, string> > >& cellMetaData,  // Added to all cells of each plate.
+        double totalExpressionCountThreshold,
+        size_t threadCount = 0);
+#endif
+    void addCellsFromBioHub3Batch(
+        const vector<string>& expressionCountsFileNames,
+        const string& expressionCountsFileSeparators,
+        const vector< vector< pair<string, string> > >& plateMetaData, // Added to all cells of each plate.
+        size_t threadCount = 0);
+
 
 
 
@@ -334,6 +533,13 @@ public:
     // Remove a meta data field for all cells of a given cell set.
     void removeCellMetaData(const string& cellSetName, const string& metaDataName);
 
+    // Store the cell and gene meta data contiguously, without linked list nodes,
+    // so functions that scan the meta data of many cells read contiguous memory.
+    // Meta data added or modified later are stored in linked lists
+    // until the next call. Best called after adding cells.
+    // See MemoryMappedVectorOfLists.hpp.
+    void compactMetaData();
+
     // Compute a sorted histogram of a given meta data field.
     void histogramMetaData(
         const CellSet& cellSet,
@@ -406,15 +612,20 @@ public:
 
     // Find similar cell pairs by looping over all pairs,
     // taking into account only genes in the specified gene set.
-    // This is O(N**2) slow because it loops over cell pairs.
-    // It typically takes of the order of 20 microseconds per pair.
+    // This is O(N**2) slow because it loops over cell pairs,
+    // but it computes exact similarities.
+    // The pairs are processed in blocks using the specified
+    // number of threads (0 to use all hardware threads).
+    // Each ordered pair is computed separately, and the best k pairs
+    // of each cell are stored for that cell only.
 
     void findSimilarPairs0(
         const string& geneSetName,  // The name of the gene set to be used.
         const string& cellSetName,  // The name of the cell set to be used.
         const string& name,         // The name of the SimilarPairs object to be created.
         size_t k,                   // The maximum number of similar pairs to be stored for each cell.
-        double similarityThreshold
+        double similarityThreshold,
+        size_t threadCount          // The number of threads to use.
         );
     void findSimilarPairs0(
         ostream& out,
@@ -422,7 +633,8 @@ public:
         const string& cellSetName,  // The name of the cell set to be used.
         const string& name,         // The name of the SimilarPairs object to be created.
         size_t k,                   // The maximum number of similar pairs to be stored for each cell.
-        double similarityThreshold
+        double similarityThreshold,
+        size_t threadCount          // The number of threads to use.
         );
 
 
@@ -433,7 +645,11 @@ public:
     // but much faster than findSimilarPairs0.
     // It typically takes of the order of 15 nanoseconds per pair
     // (for lshCount=1024, which guarantees rms error 0.05 or better
-    // on computed similarities).
+    // on computed similarities) on a single thread.
+    // The pairs are processed in cache-sized tiles on threadCount threads
+    // (0 to use all available hardware threads).
+    // The result does not depend on the number of threads,
+    // and this is used as the reference for compareSimilarPairs.
     void findSimilarPairs4(
         const string& geneSetName,      // The name of the gene set to be used.
         const string& cellSetName,      // The name of the cell set to be used.
@@ -441,7 +657,8 @@ public:
         size_t k,                       // The maximum number of similar pairs to be stored for each cell.
         double similarityThreshold,     // The minimum similarity for a pair to be stored.
         size_t lshCount,                // The number of LSH vectors to use.
-        unsigned int seed               // The seed used to generate the LSH vectors.
+        unsigned int seed,              // The seed used to generate the LSH vectors.
+        size_t threadCount              // The number of threads to use.
         );
     void findSimilarPairs4(
         ostream&,
@@ -451,7 +668,8 @@ public:
         size_t k,                       // The maximum number of similar pairs to be stored for each cell.
         double similarityThreshold,     // The minimum similarity for a pair to be stored.
         size_t lshCount,                // The number of LSH vectors to use.
-        unsigned int seed               // The seed used to generate the LSH vectors.
+        unsigned int seed,              // The seed used to generate the LSH vectors.
+        size_t threadCount              // The number of threads to use.
         );
 #if CZI_EXPRESSION_MATRIX2_BUILD_FOR_GPU
     void findSimilarPairs4Gpu(
@@ -524,6 +742,14 @@ public:
 
     // Find similar cell pairs using the full LSH algorithm, without looping over all pairs.
     // Like findSimilarPairs5, but using variable lsh slice length.
+    // The candidate neighbors of each cell are checked using
+    // the specified number of threads (0 to use all hardware threads).
+    // The assignment of cells to buckets is stored on disk (see LshBuckets.hpp)
+    // and reused by later calls for the same Lsh object and bucket parameters.
+    // If cellExpressionCacheName is not empty, the best rerankCount
+    // candidates of each cell found using LSH are reranked by exact similarity
+    // computed using that CellExpressionCache (see createCellExpressionCache),
+    // and the stored similarities are exact.
     // This is prototype code.
     void findSimilarPairs7(
         const string& geneSetName,      // The name of the gene set to be used.
@@ -534,8 +760,51 @@ public:
         double similarityThreshold,     // The minimum similarity for a pair to be stored.
         const vector<int>& lshSliceLengths, // The number of bits in each LSH signature slice, in decreasing order.
         CellId maxCheck,                // Maximum number of cells to consider for each cell.
-        size_t log2BucketCount
+        size_t log2BucketCount,
+        const string& cellExpressionCacheName,  // If not empty, the CellExpressionCache used to rerank candidates.
+        size_t rerankCount,             // The number of LSH candidates of each cell to rerank.
+        size_t threadCount              // The number of threads to use.
+    );
+
+    // Find similar cell pairs using multi-probe LSH.
+    // Like findSimilarPairs7, but using a single slice length
+    // and also probing, for each slice, the buckets whose keys
+    // differ by up to probeRadius bits (at most 2) from the signature slice of the cell.
+    // This is prototype code.
+    void findSimilarPairs8(
+        const string& geneSetName,      // The name of the gene set to be used.
+        const string& cellSetName,      // The name of the cell set to be used.
+        const string& lshName,          // The name of the Lsh object to be used.
+        const string& similarPairsName, // The name of the SimilarPairs object to be created.
+        size_t k,                       // The maximum number of similar pairs to be stored for each cell.
+        double similarityThreshold,     // The minimum similarity for a pair to be stored.
+        size_t lshSliceLength,          // The number of bits in each LSH signature slice.
+        size_t probeRadius,             // The maximum number of slice bits flipped when probing buckets.
+        CellId maxCheck,                // Maximum number of cells to consider for each cell.
+        size_t log2BucketCount,
+        size_t threadCount              // The number of threads to use.
     );
+
+    // Update a SimilarPairs object created by findSimilarPairs7
+    // after cells were appended to the cell set it was created for.
+    // The Lsh object used to create it is extended with signatures
+    // for the new cells, the neighbors of the new cells are found,
+    // and the similar pairs of the existing cells are updated in place.
+    // The similar pairs of each existing cell must be sorted
+    // by decreasing similarity, as stored by findSimilarPairs7.
+    // This is prototype code.
+    void updateSimilarPairs7(
+        const string& geneSetName,      // The name of the gene set to be used.
+        const string& cellSetName,      // The name of the cell set to be used.
+        const string& lshName,          // The name of the Lsh object to be extended.
+        const string& similarPairsName, // The name of the SimilarPairs object to be updated.
+        double similarityThreshold,     // The minimum similarity for a pair to be stored.
+        const vector<int>& lshSliceLengths, // The number of bits in each LSH signature slice, in decreasing order.
+        CellId maxCheck,                // Maximum number of cells to consider for each cell.
+        size_t log2BucketCount,
+        size_t threadCount              // The number of threads to use.
+    );
+
     void findSimilarPairs7AssignCellsToBuckets(
         Lsh&,
         const vector<int>& lshSliceLengths,                     // The number of signature slice bits, in decreasing order.
@@ -543,6 +812,44 @@ public:
         vector< vector< vector< vector<CellId> > > >& table4,   // The cells in each bucket.
         size_t log2BucketCount
         );
+    void findSimilarPairs7FindNeighbors(
+        Lsh&,
+        CellId cellId0,
+        size_t k,                       // The maximum number of neighbors.
+        uint32_t mismatchCountBound,    // Only neighbors with mismatch count less than this are used.
+        const LshBuckets&,
+        CellId maxCheck,                // Maximum number of cells to consider.
+        BitSet& cellMap,                // Work areas owned by the calling thread.
+        vector<CellId>& candidateNeighbors,
+        vector<CellId>& bucketCandidates,
+        vector<uint32_t>& bucketMismatchCounts,
+        vector< MemoryAsContainer<const CellId> >& buckets,
+        vector< pair<uint32_t, CellId> >& neighbors);
+
+    // Update the best k neighbors of a cell using the cells
+    // in the given buckets, which are examined in order.
+    // Returns true if maxCheck cells have been considered.
+    // Used by findSimilarPairs7FindNeighbors and findSimilarPairs8,
+    // which differ only in the choice of buckets.
+    bool findSimilarPairs7CheckBuckets(
+        Lsh&,
+        CellId cellId0,
+        size_t k,                       // The maximum number of neighbors.
+        uint32_t mismatchCountBound,    // Only neighbors with mismatch count less than this are used.
+        const vector< MemoryAsContainer<const CellId> >& buckets,
+        CellId maxCheck,                // Maximum number of cells to consider.
+        BitSet& cellMap,                // Work areas owned by the calling thread.
+        vector<CellId>& candidateNeighbors,
+        vector<CellId>& bucketCandidates,
+        vector<uint32_t>& bucketMismatchCounts,
+        vector< pair<uint32_t, CellId> >& neighbors);
+
+    // Sort the neighbors found by findSimilarPairs7CheckBuckets
+    // and reset the work areas for the next cell.
+    void findSimilarPairs7SortNeighbors(
+        BitSet& cellMap,
+        vector<CellId>& candidateNeighbors,
+        vector< pair<uint32_t, CellId> >& neighbors);
 #if CZI_EXPRESSION_MATRIX2_BUILD_FOR_GPU
     // GPU version. See Lsh.cl for details.
     void findSimilarPairs7Gpu(
@@ -568,12 +875,51 @@ public:
         size_t log2BucketCount);
 #endif
     // Compute cell LSH signatures and store them.
+    // The signatures are computed using the specified number of threads
+    // (0 to use all available hardware threads).
     void computeLshSignatures(
         const string& geneSetName,      // The name of the gene set to be used.
         const string& cellSetName,      // The name of the cell set to be used.
         const string& lshName,          // The name of the Lsh object to be created.
         size_t lshCount,                // The number of LSH vectors to use.
-        unsigned int seed               // The seed used to generate the LSH vectors.
+        unsigned int seed,              // The seed used to generate the LSH vectors.
+        size_t threadCount              // The number of threads to use.
+        );
+
+    // Create a compact copy of the expression counts of a cell set,
+    // restricted to a gene set, used to compute exact cell similarities
+    // quickly (see CellExpressionCache.hpp).
+    // It is stored in memory mapped files with names beginning with CellExpressionCache-.
+    void createCellExpressionCache(
+        const string& geneSetName,      // The name of the gene set to be used.
+        const string& cellSetName,      // The name of the cell set to be used.
+        const string& cellExpressionCacheName, // The name of the CellExpressionCache to be created.
+        bool quantize                   // If true, store expression counts as 8-bit codes.
+        );
+
+    // Create a persistent approximate k-NN graph from the signatures
+    // of an existing Lsh object, using NN-descent (see KnnGraph.hpp).
+    // The graph is stored in memory mapped files with names beginning with KnnGraph-
+    // and is built using the specified number of threads
+    // (0 to use all available hardware threads).
+    void createKnnGraph(
+        const string& lshName,          // The name of the Lsh object to be used.
+        const string& knnGraphName,     // The name of the KnnGraph object to be created.
+        size_t k,                       // The number of neighbors of each cell.
+        size_t maxIterationCount,       // The maximum number of NN-descent iterations.
+        unsigned int seed,              // The seed used to generate the initial random graph.
+        size_t threadCount              // The number of threads to use.
+        );
+
+    // Find similar cell pairs using a k-NN graph created by createKnnGraph.
+    void findSimilarPairs9(
+        const string& geneSetName,      // The name of the gene set to be used.
+        const string& cellSetName,      // The name of the cell set to be used.
+        const string& lshName,          // The name of the Lsh object used to create the k-NN graph.
+        const string& knnGraphName,     // The name of the KnnGraph object to be used.
+        const string& similarPairsName, // The name of the SimilarPairs object to be created.
+        size_t k,                       // The maximum number of similar pairs to be stored for each cell.
+        double similarityThreshold      // The minimum similarity for a pair to be stored.
         );
 
 
@@ -605,6 +951,8 @@ public:
     // Compare two SimilarPairs objects computed using LSH,
     // assuming that the first one was computed using a complete
     // loop on all pairs (findSimilarPairs4).
+    // Writes per-cell differences to CompareSimilarPairs.csv
+    // and reports the recall of the second one relative to the first one.
     void compareSimilarPairs(
         const string& similarPairsName0,
         const string& similarPairsName1);
@@ -667,6 +1015,12 @@ private:
     // The directory that contains the binary data for this Expression matrix.
     string directoryName;
 
+    // The mapping policies set for the files of this expression matrix.
+    // This is declared before all the memory mapped data, so the policies
+    // are removed after all the files of this expression matrix are unmapped.
+    MemoryMapped::ScopedMappingPolicies mappingPolicies;
+    void setMappingPolicies(const vector<ExpressionMatrixMappingPolicy>&);
+
     // A StringTable containing the gene names.
     // Given a GeneId (an integer), it can find the gene name.
     // Given the gene name, it can find the corresponding GeneId.
@@ -733,12 +1087,227 @@ private:
     void incrementCellMetaDataNameUsageCount(StringId);
     void decrementCellMetaDataNameUsageCount(StringId);
 
+    // The cell meta data in columnar form, kept up to date with cellMetaData.
+    // It is not open for expression matrices created before it was introduced,
+    // if accessed read-only. In that case functions that use it
+    // fall back to using cellMetaData.
+    // See CellMetaDataColumns.hpp.
+    CellMetaDataColumns cellMetaDataColumns;
+    void accessCellMetaDataColumns(bool readWriteAccess);
+    void setCellMetaDataColumnValue(CellId, StringId nameId, StringId valueId);
+
+    // The StringId of "CellName" in cellMetaDataNames, looked up on first use
+    // by setCellMetaDataColumnValue. Reset when cellMetaDataNames is truncated.
+    StringId cellNameMetaDataNameId = MemoryMapped::StringTable<StringId>::invalidStringId;
+    void appendCellToCellMetaDataColumns(CellId);
+
+    // Return the value StringId of a meta data field for a cell,
+    // or invalidStringId if the cell does not have that field.
+    StringId getCellMetaDataValueId(CellId, StringId nameId) const;
+
+    // Return the value of a meta data field for a cell converted to a double,
+    // or NaN if the cell does not have that field or its value is not numeric.
+    double getCellMetaDataNumericValue(CellId, StringId nameId) const;
+
     // The expression counts for each cell. Stored in sparse format,
     // each with the GeneId it corresponds to.
     // For each cell, they are stored sorted by increasing GeneId.
     // This is indexed by the CellId.
     MemoryMapped::VectorOfVectors<pair<GeneId, float>, uint64_t> cellExpressionCounts;
 
+    // The optional compressed copy of the expression counts.
+    // When present, it always contains all cells.
+    CompressedExpressionCounts compressedCellExpressionCounts;
+    void dropInconsistentCompressedExpressionCounts();
+
+    // The optional gene-major copy of the expression counts.
+    // Cells added after it was built are appended to its overlay in memory.
+    GeneExpressionIndex geneExpressionIndex;
+    void updateGeneExpressionIndex();
+    void updateAndMergeGeneExpressionIndex();
+
+    // Get the expression counts of a gene for a range of cells,
+    // using the gene expression index if available.
+    // The counts are stored in the same order as the cell ids.
+    void getExpressionCountsForGene(
+        GeneId,
+        const CellId* cellIdsBegin,
+        const CellId* cellIdsEnd,
+        float* counts) const;
+
+
+
+    // Checkpoints for ingestion functions (addCells, addCellsFromHdf5, etc.).
+    // During ingestion, cells are committed periodically by syncing to disk
+    // all the data structures that are modified when adding cells and genes,
+    // and then recording their sizes here.
+    // If the program terminates during an ingestion, when the expression matrix
+    // is accessed again all of those data structures are truncated back to
+    // the last committed state. After that, ingestion functions skip cells
+    // whose name already exists, so running the same ingestion again
+    // resumes where it left off instead of starting over.
+    // See ExpressionMatrixIngestion.cpp.
+    class IngestionCheckpoint {
+    public:
+        uint64_t isActive;  // Set to 1 while an ingestion is in progress.
+        uint64_t cellCount;
+        uint64_t geneCount;
+        uint64_t cellMetaDataDataSize;
+        uint64_t cellMetaDataNameCount;
+        uint64_t cellMetaDataValueCount;
+        uint64_t geneMetaDataDataSize;
+        uint64_t geneMetaDataNameCount;
+        uint64_t geneMetaDataValueCount;
+    };
+    MemoryMapped::Object<IngestionCheckpoint> ingestionCheckpoint;
+    void accessIngestionCheckpoint(bool readWriteAccess);
+    void beginIngestion();
+    void commitIngestion();
+    void commitIngestionIfNeeded();
+    void endIngestion();
+    void abortIngestion();
+    void rollBackIngestion();
+
+    // The number of cells added since the last commit after which
+    // commitIngestionIfNeeded commits.
+    static const CellId ingestionCheckpointCellCount = 100000;
+
+    // The state of the expression matrix when the current ingestion began.
+    // If the ingestion function fails, abortIngestion rolls back to it,
+    // so the call can be repeated.
+    IngestionCheckpoint ingestionBeginState;
+
+    // True if this expression matrix was rolled back to an ingestion checkpoint
+    // when it was accessed. In that case, ingestion functions skip cells
+    // that already exist.
+    bool isResumingIngestion = false;
+    bool skipCellDuringIngestion(const string& cellName) const
+    {
+        return isResumingIngestion && cellNames(cellName) != invalidCellId;
+    }
+
+    // Class used by ingestion functions to call beginIngestion on entry.
+    // On normal exit, the ingestion function calls commit, which calls endIngestion,
+    // so errors during the final commit are reported to the caller.
+    // If the Ingestion object is destroyed without a commit
+    // (exit via an exception), abortIngestion is called instead,
+    // which rolls back to the state when the ingestion began.
+    // Errors during the rollback cannot be thrown from the destructor,
+    // so they are written to cerr. The ingestion checkpoint is then still active,
+    // and the rollback is completed the next time the expression matrix is accessed.
+    class Ingestion {
+    public:
+        Ingestion(ExpressionMatrix& expressionMatrix) :
+            expressionMatrix(expressionMatrix)
+        {
+            expressionMatrix.beginIngestion();
+        }
+        void commit()
+        {
+            isCommitted = true;
+            expressionMatrix.endIngestion();
+        }
+        ~Ingestion()
+        {
+            if(isCommitted) {
+                return;
+            }
+            try {
+                expressionMatrix.abortIngestion();
+            } catch(const std::exception& e) {
+                cerr << "Error rolling back an ingestion in " << expressionMatrix.directoryName <<
+                    ": " << e.what() << endl;
+            } catch(...) {
+                cerr << "Error rolling back an ingestion in " << expressionMatrix.directoryName << endl;
+            }
+        }
+        Ingestion(const Ingestion&) = delete;
+        Ingestion& operator=(const Ingestion&) = delete;
+    private:
+        ExpressionMatrix& expressionMatrix;
+        bool isCommitted = false;
+    };
+
+    // Read the cell meta data file used by addCells.
+    void readCellMetaDataFile(
+        const string& cellMetaDataFileName,
+        const string& cellMetaDataFileSeparators,
+        vector<string>& metaDataNames,
+        vector< vector<string> >& metaDataInFile,
+        map<string, CellId>& metaDataInFileMap);
+
+    // Read blocks of cells using multiple threads, and add them
+    // in order of increasing block id using the calling thread.
+    // The readBlock function is called concurrently by worker threads
+    // with arguments (blockId, block to be filled), and it must not
+    // access the expression matrix.
+    // At most a fixed number of blocks are read ahead of the block
+    // being added, to bound memory usage.
+    // If reading a block throws an exception, all previous blocks are added
+    // and the exception is rethrown.
+    void addCellBlocksInParallel(
+        size_t blockCount,
+        size_t threadCount,
+        const std::function<void(size_t, CellBlock&)>& readBlock);
+
+    // Functions used by the batch versions of addCellsFromHdf5 and addCellsFromBioHub3
+    // to read a plate into a CellBlock.
+    // addCellsFromBioHub3 also uses readCellBlockFromBioHub3.
+#ifndef CZI_EXPRESSION_MATRIX2_SKIP_HDF5
+    static void readCellBlockFromHdf5(
+        const string& fileName,
+        const string& cellNamePrefix,
+        double totalExpressionCountThreshold,
+        CellBlock&);
+#endif
+    static void readCellBlockFromBioHub3(
+        const string& expressionCountsFileName,
+        const string& expressionCountsFileSeparators,
+        CellBlock&);
+
+    // Common code for addCellBlock and addCellBlockUsingGeneIds.
+    // The GeneId for each entry is geneIdTable[geneIndexes[i]],
+    // or geneIndexes[i] if geneIdTable is null.
+    // If perCellMetaData is not null, it contains additional
+    // meta data for each cell of the block.
+    // If newGeneNames is not null, geneIdTable can contain the GeneIds
+    // that these genes will get (see getGeneIdTable), and the genes
+    // are added only after the block has been validated.
+    void addCellBlock(
+        const vector<string>& cellNames,
+        const vector< pair<string, string> >& cellMetaData,
+        const uint64_t* indptr,
+        const uint32_t* geneIndexes,
+        const float* values,
+        const GeneId* geneIdTable,
+        size_t geneIdTableSize,
+        const vector< vector< pair<string, string> > >* perCellMetaData = 0,
+        const vector<string>* newGeneNames = 0);
+
+    // Convert gene names to GeneIds without adding any genes.
+    // Genes that don't exist yet get the GeneIds they will have
+    // once added in the order in which they are stored in newGeneNames.
+    void getGeneIdTable(
+        const vector<string>& geneNames,
+        vector<GeneId>& geneIdTable,
+        vector<string>& newGeneNames);
+
+    // Functions used to compute the statistics stored in the Cell objects.
+    // While deferCellStatistics is true (during ingestion), cells are added with
+    // statistics set to zero, and computed later for a range of cells.
+    bool deferCellStatistics = false;
+    void computeCellStatistics(
+        CellId begin,
+        CellId end,
+        size_t threadCount,
+        double largeExpressionCountThreshold);
+    static void computeCellStatistics(
+        const pair<GeneId, float>* begin,
+        const pair<GeneId, float>* end,
+        double largeExpressionCountThreshold,
+        Cell&);
+    static void clearCellStatistics(Cell&);
+
 
 
 public:
@@ -795,6 +1364,18 @@ public:
         const string& cellSetName,
         NormalizationMethod);
 
+    // Version of addCellBlock that takes the CSR arrays as numpy arrays,
+    // for example the indptr, indices, and data arrays of a scipy.sparse.csr_matrix
+    // with a row for each cell and a column for each gene.
+    // The arrays are converted to the required types if necessary.
+    void addCellBlockFromNumpy(
+        const vector<string>& geneNames,
+        const vector<string>& cellNames,
+        pybind11::array indptr,
+        pybind11::array geneIndexes,
+        pybind11::array values,
+        const vector< pair<string, string> >& cellMetaData);
+
 private:
 
 
@@ -1041,6 +1622,8 @@ public:
 
     // Create a new cell set consisting of cells for which a given meta data field
     // is numeric and is greater than, less than, or between specified values.
+    // A value is numeric if it is a decimal number or "inf"/"infinity"
+    // with an optional sign. Cells with value "nan" are never included.
     void createCellSetUsingNumericMetaDataGreaterThan(
         const string& cellSetName,          // The name of the cell set to be created.
         const string& metaDataFieldName,
@@ -51,6 +51,10 @@ The following two columns are mandatory:
 The remaining columns are treated as plate meta data.
 The meta data for a plate are added to all of the cells found on the plate.
 
+Plates are downloaded and read concurrently by worker threads,
+and their cells are added in the order of the master file,
+as for the batch functions described below.
+
 Cells are named using the pattern PlateName-Barcode, where the barcode
 is as obtained from the HDF5 file for each plate.
 
@@ -85,12 +89,26 @@ metaDataFileNameSuffix
 Suffix to be added to a plate name to obtain the name of the corresponding per-cell meta data file.
 
 
+
+BATCH INGESTION OF LOCAL PLATES: addCellsFromHdf5Batch, addCellsFromBioHub3Batch
+
+These take a list of plate files already available locally, with
+per-plate arguments. Plates are read concurrently by worker threads into
+CellBlock objects, which do not access the expression matrix.
+The calling thread adds the cells of each CellBlock, in the order in which
+the plates were specified, using addCellBlock. Gene names are resolved
+to GeneIds only by the calling thread, so all plates share the same
+gene dictionary, and CellIds do not depend on the number of threads.
+
+
 *******************************************************************************/
 
 
 
 #include "ExpressionMatrix.hpp"
+#include "CellBlock.hpp"
 #include "filesystem.hpp"
+#include "runThreads.hpp"
 #include "timestamp.hpp"
 #include "tokenize.hpp"
 using namespace ChanZuckerberg;
@@ -102,6 +120,10 @@ using namespace ExpressionMatrix2;
 
 #include "fstream.hpp"
 #include "iterator.hpp"
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
 
 
 
@@ -398,7 +420,8 @@ void ExpressionMatrix::addCellMetaData(const string& cellMetaDataFileName)
 #ifndef CZI_EXPRESSION_MATRIX2_SKIP_HDF5
 void ExpressionMatrix::addCellsFromBioHub2(
     const string& plateFileName,
-    double totalExpressionCountThreshold
+    double totalExpressionCountThreshold,
+    size_t threadCount
     )
 {
     // Open the plate file.
@@ -444,10 +467,12 @@ void ExpressionMatrix::addCellsFromBioHub2(
 
 
 
-    // Main loop over the remaining lines of the plate file.
+    // Loop over the remaining lines of the plate file.
     // Each line corresponds to a plate.
-    size_t plateCount = 0;
-    for(; ; ++plateCount) {
+    vector<string> plateNames;
+    vector<string> awsPaths;
+    vector< vector< pair<string, string> > > plateMetaData;
+    while(true) {
 
         // Read this line.
         getline(plateFile, line);
@@ -473,33 +498,47 @@ void ExpressionMatrix::addCellsFromBioHub2(
         for(size_t i=0; i<columnNames.size(); i++) {
             cellMetaData[i].second = columnValues[i];
         }
+        plateMetaData.push_back(cellMetaData);
 
         // Extract the PlateName and the aws path.
         CZI_ASSERT(plateNamePosition < columnValues.size());
         CZI_ASSERT(awsPathPosition < columnValues.size());
-        const string& plateName = columnValues[plateNamePosition];
-        const string awsPath = columnValues[awsPathPosition];
-        cout << timestamp << " Working on plate " << plateCount << " " << plateName << endl;
-
-        // Make a local copy of the hdf5 file.
-        const string uuid = boost::uuids::to_string(boost::uuids::uuid(boost::uuids::random_generator()()));
-        const string localPath = string("/dev/shm/aws-") + uuid;
-        const string command = "aws s3 cp --quiet " + awsPath + " " + localPath;
-        const int returnCode = ::system(command.c_str());
-        if(returnCode!=0) {
-            throw runtime_error("Error " +
-                lexical_cast<string>(returnCode) +
-                " from command: " + command);
-        }
-
-        // Add cells from this hdf5 file.
-        addCellsFromHdf5(localPath, plateName, cellMetaData, totalExpressionCountThreshold);
-
-
-        // Remove the local copy.
-        filesystem::remove(localPath);
-
+        plateNames.push_back(columnValues[plateNamePosition]);
+        awsPaths.push_back(columnValues[awsPathPosition]);
     }
+    const size_t plateCount = plateNames.size();
+
+
+
+    // Download and read the plates using multiple threads,
+    // and add their cells in the order of the plate file.
+    addCellBlocksInParallel(plateCount, threadCount,
+        [&](size_t i, CellBlock& block)
+        {
+            // Make a local copy of the hdf5 file.
+            const string uuid = boost::uuids::to_string(boost::uuids::uuid(boost::uuids::random_generator()()));
+            const string localPath = string("/dev/shm/aws-") + uuid;
+            const string command = "aws s3 cp --quiet " + awsPaths[i] + " " + localPath;
+            const int returnCode = ::system(command.c_str());
+            if(returnCode!=0) {
+                if(filesystem::exists(localPath)) {
+                    filesystem::remove(localPath);
+                }
+                throw runtime_error("Error " +
+                    lexical_cast<string>(returnCode) +
+                    " from command: " + command);
+            }
+
+            // Read the cells from this hdf5 file, then remove the local copy.
+            try {
+                readCellBlockFromHdf5(localPath, plateNames[i], totalExpressionCountThreshold, block);
+            } catch(...) {
+                filesystem::remove(localPath);
+                throw;
+            }
+            filesystem::remove(localPath);
+            block.cellMetaData = plateMetaData[i];
+        });
     cout << timestamp << "Processed " << plateCount << " plates." << endl;
 }
 #endif
@@ -520,17 +559,219 @@ void ExpressionMatrix::addCellsFromBioHub3(
     copy(plateMetaDataWithoutCellName.begin(), plateMetaDataWithoutCellName.end(),
         back_inserter(plateMetaData));
 
+    // Read the expression counts file for this plate.
+    CellBlock block;
+    readCellBlockFromBioHub3(expressionCountsFileName, expressionCountsFileSeparators, block);
+
+    // Now we can add the cells.
+    vector< pair<string, float> > expressionCounts;
+    for(size_t i=0; i<block.cellCount(); i++) {
+        plateMetaData.front().second = block.cellNames[i];
+        expressionCounts.clear();
+        for(uint64_t j=block.indptr[i]; j!=block.indptr[i+1]; j++) {
+            expressionCounts.push_back(make_pair(block.geneNames[block.geneIndexes[j]], block.values[j]));
+        }
+        addCell(plateMetaData, expressionCounts);
+    }
+}
+
+
+
+// Read blocks of cells using multiple threads, and add them
+// in order of increasing block id using the calling thread.
+// Each block has a slot that is filled by the worker thread that reads it.
+// The calling thread (the committer) waits for each slot in turn,
+// adds its cells, and releases its memory.
+void ExpressionMatrix::addCellBlocksInParallel(
+    size_t blockCount,
+    size_t threadCount,
+    const std::function<void(size_t, CellBlock&)>& readBlock)
+{
+    threadCount = min(getThreadCount(threadCount), max(blockCount, size_t(1)));
+    const size_t maxReadAheadCount = 2 * threadCount;
+    Ingestion ingestion(*this);
+
+    class Slot {
+    public:
+        CellBlock block;
+        std::exception_ptr exception;
+        bool isReady = false;
+    };
+    vector<Slot> slots(blockCount);
+    std::mutex mutex;
+    std::condition_variable slotIsReady;
+    std::condition_variable slotIsAvailable;
+    size_t nextBlockToRead = 0;
+    size_t nextBlockToAdd = 0;
+    bool stop = false;
+
+    // The function run by each worker thread.
+    const auto worker = [&]()
+    {
+        while(true) {
+
+            // Wait until we can read another block.
+            size_t blockId;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                slotIsAvailable.wait(lock, [&]()
+                {
+                    return stop || nextBlockToRead>=blockCount || nextBlockToRead<nextBlockToAdd+maxReadAheadCount;
+                });
+                if(stop || nextBlockToRead>=blockCount) {
+                    return;
+                }
+                blockId = nextBlockToRead++;
+            }
+
+            // Read it.
+            CellBlock block;
+            std::exception_ptr exception;
+            try {
+                readBlock(blockId, block);
+            } catch(...) {
+                exception = std::current_exception();
+            }
+
+            // Store it in its slot.
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                Slot& slot = slots[blockId];
+                slot.block = std::move(block);
+                slot.exception = exception;
+                slot.isReady = true;
+            }
+            slotIsReady.notify_all();
+        }
+    };
+
+    vector<std::thread> threads;
+    const auto stopAndJoin = [&]()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        slotIsAvailable.notify_all();
+        for(std::thread& thread: threads) {
+            thread.join();
+        }
+    };
+
+    try {
+        for(size_t threadId=0; threadId<threadCount; threadId++) {
+            threads.push_back(std::thread(worker));
+        }
+
+        // Add the blocks in order.
+        for(size_t blockId=0; blockId<blockCount; blockId++) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                slotIsReady.wait(lock, [&]() {return slots[blockId].isReady;});
+            }
+            Slot& slot = slots[blockId];
+            if(slot.exception) {
+                std::rethrow_exception(slot.exception);
+            }
+            const CellBlock& block = slot.block;
+
+            // Blocks are committed as a whole, so if resuming an interrupted ingestion
+            // a block was either completely added or not at all.
+            const bool skipBlock = block.cellCount() > 0 && all_of(
+                block.cellNames.begin(), block.cellNames.end(),
+                [this](const string& cellName) {return skipCellDuringIngestion(cellName);});
+            if(skipBlock) {
+                cout << timestamp << "Skipped block " << blockId << " of " << blockCount <<
+                    ", which was already added." << endl;
+            } else {
+                if(block.cellCount() > 0) {
+                    addCellBlock(block.geneNames, block.cellNames, block.cellMetaData,
+                        block.indptr.data(), block.geneIndexes.data(), block.values.data());
+                    commitIngestionIfNeeded();
+                }
+                cout << timestamp << "Added " << block.cellCount() << " cells from block " << blockId <<
+                    " of " << blockCount << "." << endl;
+            }
+            slot.block.clear();
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                nextBlockToAdd = blockId + 1;
+            }
+            slotIsAvailable.notify_all();
+        }
+    } catch(...) {
+        stopAndJoin();
+        throw;
+    }
+    stopAndJoin();
+    ingestion.commit();
+}
+
+
+
+// Batch version of addCellsFromHdf5.
+#ifndef CZI_EXPRESSION_MATRIX2_SKIP_HDF5
+void ExpressionMatrix::addCellsFromHdf5Batch(
+    const vector<string>& fileNames,
+    const vector<string>& cellNamePrefixes,
+    const vector< vector< pair<string, string> > >& cellMetaData,
+    double totalExpressionCountThreshold,
+    size_t threadCount)
+{
+    if(cellNamePrefixes.size()!=fileNames.size() || cellMetaData.size()!=fileNames.size()) {
+        throw runtime_error("addCellsFromHdf5Batch: inconsistent number of files, cell name prefixes, and cell meta data.");
+    }
+    addCellBlocksInParallel(fileNames.size(), threadCount,
+        [&](size_t i, CellBlock& block)
+        {
+            readCellBlockFromHdf5(fileNames[i], cellNamePrefixes[i], totalExpressionCountThreshold, block);
+            block.cellMetaData = cellMetaData[i];
+        });
+    cout << "There are " << cellCount() << " cells and " << geneCount() << " genes." << endl;
+}
+#endif
+
+
+
+// Batch version of addCellsFromBioHub3.
+void ExpressionMatrix::addCellsFromBioHub3Batch(
+    const vector<string>& expressionCountsFileNames,
+    const string& expressionCountsFileSeparators,
+    const vector< vector< pair<string, string> > >& plateMetaData,
+    size_t threadCount)
+{
+    if(plateMetaData.size() != expressionCountsFileNames.size()) {
+        throw runtime_error("addCellsFromBioHub3Batch: inconsistent number of files and plate meta data.");
+    }
+    addCellBlocksInParallel(expressionCountsFileNames.size(), threadCount,
+        [&](size_t i, CellBlock& block)
+        {
+            readCellBlockFromBioHub3(expressionCountsFileNames[i], expressionCountsFileSeparators, block);
+            block.cellMetaData = plateMetaData[i];
+        });
+    cout << "There are " << cellCount() << " cells and " << geneCount() << " genes." << endl;
+}
+
+
+
+// Read the expression counts file of a plate
+// for addCellsFromBioHub3 and addCellsFromBioHub3Batch.
+// This does not access the expression matrix.
+void ExpressionMatrix::readCellBlockFromBioHub3(
+    const string& expressionCountsFileName,
+    const string& expressionCountsFileSeparators,
+    CellBlock& block)
+{
     // See how many cells we have in this plate.
     const size_t cellCountInPlate = countTokensInSecondLine(expressionCountsFileName, expressionCountsFileSeparators) - 1;
 
-
     // Open the expression counts file for this plate.
     ifstream expressionCountsFile(expressionCountsFileName);
     if(!expressionCountsFile) {
         throw runtime_error("Error opening " + expressionCountsFileName);
     }
 
-
     // Read the cell names from the first line.
     string line;
     getline(expressionCountsFile, line);
@@ -547,10 +788,9 @@ void ExpressionMatrix::addCellsFromBioHub3(
             " has inconsistent number of tokens in first two lines.");
     }
 
-
-
     // Read the expression file to create expression vectors for all the cells in this plate.
-    vector< vector< pair<string, float> > > cellsInPlateExpressionVectors(cellCountInPlate);
+    // Gene indexes refer to block.geneNames, which contains one entry per line.
+    vector< vector< pair<uint32_t, float> > > cellsInPlateExpressionVectors(cellCountInPlate);
     vector<string> tokens;
     for(size_t lineNumber=2; ; ++lineNumber) {
 
@@ -569,7 +809,8 @@ void ExpressionMatrix::addCellsFromBioHub3(
         }
 
         // Add the gene name.
-        const string& geneName = tokens.front();
+        const uint32_t geneIndex = uint32_t(block.geneNames.size());
+        block.geneNames.push_back(tokens.front());
 
         // Add all the non-zero expression counts.
         for(size_t i=0; i<cellCountInPlate; i++) {
@@ -580,23 +821,19 @@ void ExpressionMatrix::addCellsFromBioHub3(
             float expressionCount;
             try {
                 expressionCount = lexical_cast<float>(token);
-            } catch(bad_lexical_cast) {
+            } catch(const bad_lexical_cast&) {
                 throw runtime_error("Invalid expression count at line " +
                     lexical_cast<string>(lineNumber) + " of file " + expressionCountsFileName);
             }
-            cellsInPlateExpressionVectors[i].push_back(make_pair(geneName, expressionCount));
+            cellsInPlateExpressionVectors[i].push_back(make_pair(geneIndex, expressionCount));
         }
-
     }
 
-
-    // Now we can add the cells.
+    // Store the cells in the block.
     for(size_t i=0; i<cellCountInPlate; i++) {
-        plateMetaData.front().second = cellNamesInPlate[i];
-        addCell(plateMetaData, cellsInPlateExpressionVectors[i]);
+        block.beginCell(cellNamesInPlate[i]);
+        for(const auto& p: cellsInPlateExpressionVectors[i]) {
+            block.addExpressionCount(p.first, p.second);
+        }
     }
-
-
-
-
 }
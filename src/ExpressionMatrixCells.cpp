@@ -1,4 +1,5 @@
 #include "ExpressionMatrix.hpp"
+#include <cmath>
 using namespace ChanZuckerberg;
 using namespace ExpressionMatrix2;
 
@@ -71,33 +72,24 @@ void ExpressionMatrix::createCellSetUsingNumericMetaData(
 
     // Find the cells that belong to the new cell set.
     vector<CellId> cellSet;
-    for(CellId cellId=0; cellId<cells.size(); cellId++) {
-
-        // Loop over the meta data fields for this cell.
-        const auto metaData = cellMetaData[cellId];
-        for(const pair<StringId, StringId>& p: metaData) {
-
-            // If the meta data name is not the specified one, skip.
-            if(cellMetaDataNames.equal(p.first, metaDataFieldName)) {
-                // We found the meta data field we are looking for. Get its value.
-                const string metaDataValue = cellMetaDataValues[p.second];
-
-                // If the value is numeric, check it against the specified bounds.
-                try {
-                    const double value = lexical_cast<double>(metaDataValue);
-                    const bool lowerBoundViolated = useLowerBound && value<lowerBound;
-                    const bool upperBoundViolated = useUpperBound && value>upperBound;
-                    if(!(lowerBoundViolated || upperBoundViolated)) {
-                        cellSet.push_back(cellId);
-                    }
-                } catch(bad_lexical_cast) {
-                    // It was not a number. Don't add this cell to the cell set.
-                }
-
-                // We don't need to check the remaining meta data fields for this cell.
-                break;
+    const StringId nameId = cellMetaDataNames(metaDataFieldName);
+    if(nameId != cellMetaDataNames.invalidStringId) {
+        for(CellId cellId=0; cellId<cells.size(); cellId++) {
+
+            // Get the numeric value of this meta data field.
+            // It is NaN if the cell does not have this field or its value is not a number.
+            // In that case, don't add this cell to the cell set.
+            const double value = getCellMetaDataNumericValue(cellId, nameId);
+            if(std::isnan(value)) {
+                continue;
             }
 
+            // Check it against the specified bounds.
+            const bool lowerBoundViolated = useLowerBound && value<lowerBound;
+            const bool upperBoundViolated = useUpperBound && value>upperBound;
+            if(!(lowerBoundViolated || upperBoundViolated)) {
+                cellSet.push_back(cellId);
+            }
         }
     }
 
@@ -0,0 +1,507 @@
+// Functionality to read expression counts from files with fields separated
+// by commas or by other separators.
+
+#include "ExpressionMatrix.hpp"
+#include "MemoryMappedFile.hpp"
+#include "runThreads.hpp"
+#include "timestamp.hpp"
+#include "tokenize.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include "algorithm.hpp"
+#include "array.hpp"
+#include <cstring>
+#include "iostream.hpp"
+#include "set.hpp"
+
+
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace Csv {
+
+            // A line of the expression counts file, without the line end.
+            class Line {
+            public:
+                const char* begin;
+                const char* end;
+                string geneName;
+            };
+
+            inline bool isBlank(char c)
+            {
+                return c==' ' || c=='\t' || c=='\r' || c=='\n' || c=='\v' || c=='\f';
+            }
+
+            bool parseExpressionCount(const char* begin, const char* end, float& value);
+
+            template<class Function> void parseLine(
+                const Line&,
+                const array<bool, 256>& isSeparator,
+                const string& separators,
+                size_t expectedTokenCount,
+                const vector<CellId>& keptCellIndex,
+                string& geneName,
+                vector<string>& tokens,
+                const Function&);
+        }
+    }
+}
+
+
+
+// Parse an expression count.
+// Returns false if the field does not begin with a valid number.
+// Leading and trailing blanks are ignored.
+// Decimal numbers without an exponent and with a mantissa
+// of at most 2^24, which make up most expression counts, are
+// converted in place. Everything else uses strtof,
+// which needs a null terminated copy of the field.
+bool ChanZuckerberg::ExpressionMatrix2::Csv::parseExpressionCount(
+    const char* begin,
+    const char* end,
+    float& value)
+{
+    while(begin!=end && isBlank(*begin)) {
+        ++begin;
+    }
+    while(end!=begin && isBlank(*(end-1))) {
+        --end;
+    }
+    if(begin == end) {
+        return false;
+    }
+
+    // Fast path. The mantissa and the power of ten (at most 10^10)
+    // are both exactly representable as floats, so a single division
+    // gives the correctly rounded result, the same returned by strtof.
+    {
+        static const float powersOfTen[] =
+            {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+        const uint32_t maxMantissa = uint32_t(1) << 24;
+        const char* p = begin;
+        const bool isNegative = (*p == '-');
+        if(isNegative || *p == '+') {
+            ++p;
+        }
+        uint32_t mantissa = 0;
+        int digitCount = 0;
+        int fractionDigitCount = 0;
+        bool hasPoint = false;
+        for(; p!=end; ++p) {
+            const uint32_t digit = uint32_t(*p - '0');
+            if(digit <= 9) {
+                mantissa = 10*mantissa + digit;
+                if(mantissa > maxMantissa) {
+                    break;
+                }
+                ++digitCount;
+                if(hasPoint) {
+                    ++fractionDigitCount;
+                }
+            } else if(*p == '.' && !hasPoint) {
+                hasPoint = true;
+            } else {
+                break;
+            }
+        }
+        if(p == end && digitCount > 0 && fractionDigitCount <= 10) {
+            value = float(mantissa) / powersOfTen[fractionDigitCount];
+            if(isNegative) {
+                value = -value;
+            }
+            return true;
+        }
+    }
+
+    // General case.
+    const string field(begin, end);
+    const char* fieldBegin = field.c_str();
+    char* check = 0;
+    value = strtof(fieldBegin, &check);
+    return check != fieldBegin;
+}
+
+
+
+// Parse a line of the expression counts file.
+// The gene name is stored in geneName, and the function is called
+// for each expression count of a cell to be kept, with arguments
+// (index of the cell in the list of cells to be kept, count).
+// Expression counts for cells that are not kept are not parsed.
+// Lines that contain quotes or escapes are parsed using tokenize,
+// which handles them in the same way as the rest of the code.
+template<class Function> void ChanZuckerberg::ExpressionMatrix2::Csv::parseLine(
+    const Line& line,
+    const array<bool, 256>& isSeparator,
+    const string& separators,
+    size_t expectedTokenCount,
+    const vector<CellId>& keptCellIndex,
+    string& geneName,
+    vector<string>& tokens,
+    const Function& function)
+{
+    const char* begin = line.begin;
+    const char* end = line.end;
+    const size_t length = size_t(end - begin);
+    float count;
+
+    if(memchr(begin, '"', length) || memchr(begin, '\\', length)) {
+        tokenize(separators, string(begin, end), tokens, true);
+        if(tokens.size() != expectedTokenCount) {
+            throw runtime_error("Unexpected number of items in line of expression counts file: " +
+                string(begin, min(end, begin+200)));
+        }
+        geneName = tokens[0];
+        for(size_t i=1; i<tokens.size(); i++) {
+            const CellId cellIndex = keptCellIndex[i-1];
+            if(cellIndex == invalidCellId) {
+                continue;
+            }
+            const string& token = tokens[i];
+            if(!parseExpressionCount(token.data(), token.data()+token.size(), count)) {
+                throw runtime_error("Invalid expression count " +
+                    (token.empty() ? string("(empty)") : token) +
+                    " encountered for gene " + geneName);
+            }
+            function(cellIndex, count);
+        }
+        return;
+    }
+
+    size_t tokenCount = 0;
+    const char* p = begin;
+    while(true) {
+
+        // Locate the end of this field.
+        const char* q = p;
+        while(q!=end && !isSeparator[uint8_t(*q)]) {
+            ++q;
+        }
+
+        if(tokenCount == 0) {
+            const char* nameBegin = p;
+            const char* nameEnd = q;
+            while(nameBegin!=nameEnd && isBlank(*nameBegin)) {
+                ++nameBegin;
+            }
+            while(nameEnd!=nameBegin && isBlank(*(nameEnd-1))) {
+                --nameEnd;
+            }
+            geneName.assign(nameBegin, nameEnd);
+        } else {
+            if(tokenCount == expectedTokenCount) {
+                break;  // Too many tokens, reported below.
+            }
+            const CellId cellIndex = keptCellIndex[tokenCount-1];
+            if(cellIndex != invalidCellId) {
+                if(!parseExpressionCount(p, q, count)) {
+                    const string token(p, q);
+                    throw runtime_error("Invalid expression count " +
+                        (token.empty() ? string("(empty)") : token) +
+                        " encountered for gene " + geneName);
+                }
+                function(cellIndex, count);
+            }
+        }
+        ++tokenCount;
+
+        if(q == end) {
+            break;
+        }
+        p = q + 1;
+    }
+
+    if(tokenCount != expectedTokenCount) {
+        throw runtime_error("Unexpected number of items in line of expression counts file: " +
+            string(begin, min(end, begin+200)));
+    }
+}
+
+
+
+// Add cells from data in files with fields separated by commas or by other separators.
+// This accepts the same input files as addCellsOld2,
+// but the expression counts file is memory mapped and parsed by multiple threads.
+// The file is split into chunks of entire lines, and the cell expression counts
+// are built in two passes using the two-pass construction of
+// MemoryMapped::VectorOfVectors:
+// - Pass 1: each thread parses the lines of its chunks,
+//   and counts the non-zero expression counts of each cell.
+// - Pass 2: the lines are parsed again, and the expression counts
+//   are stored in their final position.
+// The expression counts of each cell are then sorted by gene id,
+// so the result does not depend on the number of threads.
+// See ExpressionMatrix.hpp for usage information.
+void ExpressionMatrix::addCells(
+    const string& expressionCountsFileName,
+    const string& expressionCountsFileSeparators,
+    const string& cellMetaDataFileName,
+    const string& cellMetaDataFileSeparators,
+    const vector< pair<string, string> >& additionalCellMetaData, // Added to all cells.
+    size_t threadCount
+    )
+{
+    using Csv::Line;
+    threadCount = getThreadCount(threadCount);
+    Ingestion ingestion(*this);
+    cout << timestamp << "Begin addCells: " << cellCount() <<" cells, "
+        << geneCount() << " genes." << endl;
+
+
+    // Read the cell meta data file.
+    vector<string> metaDataNames;
+    vector< vector<string> > metaDataInFile;    // Indexed by CellId within the file
+    map<string, CellId> metaDataInFileMap;      // Map from cell name to CellId.
+    readCellMetaDataFile(cellMetaDataFileName, cellMetaDataFileSeparators,
+        metaDataNames, metaDataInFile, metaDataInFileMap);
+
+
+
+    // Get the number of cells in the expression counts file.
+    const size_t cellCountInExpressionFile =
+        countTokensInSecondLine(expressionCountsFileName, expressionCountsFileSeparators) - 1;
+    cout << "Cell expression counts file " << expressionCountsFileName <<
+        " contains data for " << cellCountInExpressionFile << " cells." << endl;
+
+    // Map the expression counts file.
+    MemoryMapped::File file;
+    file.open(expressionCountsFileName, true);
+    const char* fileBegin = file.begin();
+    const char* fileEnd = file.end();
+
+    // Read the names of the cells in the expression counts file.
+    const char* headerEnd = static_cast<const char*>(memchr(fileBegin, '\n', file.size()));
+    if(!headerEnd) {
+        throw runtime_error("Error reading header line from expression counts file " + expressionCountsFileName);
+    }
+    string line(fileBegin, headerEnd);
+    removeWindowsLineEnd(line);
+    if(line.empty()) {
+        throw runtime_error("Error reading header line from expression counts file " + expressionCountsFileName);
+    }
+    vector<string> tokens;
+    tokenize(expressionCountsFileSeparators, line, tokens, true);
+    vector<string> cellNamesInExpressionCountsFile;
+    if(tokens.size() == cellCountInExpressionFile) {
+        cellNamesInExpressionCountsFile = tokens;
+    } else if(tokens.size() == cellCountInExpressionFile+1) {
+        copy(tokens.begin()+1, tokens.end(), back_inserter(cellNamesInExpressionCountsFile));
+    } else {
+        throw runtime_error("Number of tokens in header line of expression counts file " +
+            expressionCountsFileName + " is inconsistent with file contents.");
+    }
+    CZI_ASSERT(cellNamesInExpressionCountsFile.size() == cellCountInExpressionFile);
+
+
+
+    // Create a list of the cells present in both the cell meta data file
+    // and the expression counts file. For each store a pair
+    // (index in meta data file, index in expression counts file).
+    // Also store, for each cell in the expression counts file,
+    // its index in this list, or invalidCellId if it is not kept.
+    vector< pair<CellId, CellId> > cellsToBeKept;
+    vector<CellId> keptCellIndex(cellCountInExpressionFile, invalidCellId);
+    for(size_t i=0; i<cellNamesInExpressionCountsFile.size(); i++) {
+        const string& cellName = cellNamesInExpressionCountsFile[i];
+        const auto it = metaDataInFileMap.find(cellName);
+        if(it == metaDataInFileMap.end()) {
+            continue;
+        }
+        const auto j = it->second;
+        keptCellIndex[i] = CellId(cellsToBeKept.size());
+        cellsToBeKept.push_back(make_pair(j, CellId(i)));
+    }
+    cout << "The number of cells that appear in both the cell meta data file " <<
+        " and the expression counts file is " << cellsToBeKept.size() << "." << endl;
+    cout << "This is the number of cells that will be kept." << endl;
+
+
+
+    // Split the rest of the file into chunks of entire lines.
+    const char* dataBegin = headerEnd + 1;
+    const size_t chunkCount = max(size_t(1), min(16 * threadCount, size_t(fileEnd - dataBegin) / (1<<20)));
+    vector<const char*> chunkBegins(chunkCount + 1, fileEnd);
+    chunkBegins[0] = dataBegin;
+    for(size_t i=1; i<chunkCount; i++) {
+        const char* p = dataBegin + (size_t(fileEnd - dataBegin) * i) / chunkCount;
+        p = max(p, chunkBegins[i-1]);
+        const char* lineEnd = static_cast<const char*>(memchr(p, '\n', size_t(fileEnd - p)));
+        chunkBegins[i] = lineEnd ? lineEnd + 1 : fileEnd;
+    }
+
+    array<bool, 256> isSeparator;
+    fill(isSeparator.begin(), isSeparator.end(), false);
+    for(const char c: expressionCountsFileSeparators) {
+        isSeparator[uint8_t(c)] = true;
+    }
+    const size_t expectedTokenCount = cellCountInExpressionFile + 1;
+
+    // Temporary storage for the expression counts of the cells to be kept.
+    // It is removed when we are done, even if an exception is thrown.
+    MemoryMapped::VectorOfVectors<pair<GeneId, float>, uint64_t> counts;
+    counts.createNew(directoryName + "/tmp-AddCells-ExpressionCounts");
+
+
+
+    try {
+        // Pass 1: find the lines in each chunk, get the gene names,
+        // and count the non-zero expression counts of each cell.
+        cout << timestamp << "Pass 1 begins." << endl;
+        counts.beginPass1(cellsToBeKept.size());
+        vector< vector<Line> > chunkLines(chunkCount);
+        {
+            BatchDispatcher batchDispatcher(chunkCount, 1);
+            runThreads(threadCount, [&](size_t)
+            {
+                vector<string> threadTokens;
+                size_t begin, end;
+                while(batchDispatcher.getBatch(begin, end)) {
+                    for(size_t chunk=begin; chunk!=end; chunk++) {
+                        const char* p = chunkBegins[chunk];
+                        const char* chunkEnd = chunkBegins[chunk + 1];
+                        while(p != chunkEnd) {
+                            const char* lineEnd = static_cast<const char*>(memchr(p, '\n', size_t(chunkEnd - p)));
+                            const char* next = lineEnd ? lineEnd + 1 : chunkEnd;
+                            if(!lineEnd) {
+                                lineEnd = chunkEnd;
+                            }
+                            if(lineEnd!=p && *(lineEnd-1)==13) {
+                                --lineEnd; // Remove Windows style line end if necessary.
+                            }
+                            if(lineEnd == p) {
+                                throw runtime_error("Empty line in expression counts file " + expressionCountsFileName);
+                            }
+
+                            chunkLines[chunk].push_back(Line());
+                            Line& line = chunkLines[chunk].back();
+                            line.begin = p;
+                            line.end = lineEnd;
+                            Csv::parseLine(line, isSeparator, expressionCountsFileSeparators, expectedTokenCount,
+                                keptCellIndex, line.geneName, threadTokens,
+                                [&](CellId cellIndex, float count)
+                                {
+                                    if(!(count >= 0.)) {
+                                        throw runtime_error("Negative expression count encountered for gene " +
+                                            line.geneName + " in expression counts file " + expressionCountsFileName);
+                                    }
+                                    if(count != 0.) {
+                                        counts.incrementCountMultithreaded(cellIndex);
+                                    }
+                                });
+
+                            p = next;
+                        }
+                    }
+                }
+            });
+        }
+
+        // Gather the lines of all chunks, in the order in which they appear in the file.
+        vector<Line> lines;
+        for(vector<Line>& v: chunkLines) {
+            for(Line& line: v) {
+                lines.push_back(Line());
+                lines.back().begin = line.begin;
+                lines.back().end = line.end;
+                lines.back().geneName.swap(line.geneName);
+            }
+            vector<Line>().swap(v);
+        }
+        cout << timestamp << "Expression counts file " << expressionCountsFileName <<
+            " contains data for " << lines.size() << " genes." << endl;
+
+        // Add the genes, checking that no gene appears more than once.
+        set<string> geneNamesInFile;
+        vector<GeneId> geneIdsInFile; // The global gene id, indexed by line.
+        geneIdsInFile.reserve(lines.size());
+        for(const Line& line: lines) {
+            const string& geneName = line.geneName;
+            if(!geneNamesInFile.insert(geneName).second) {
+                throw runtime_error("Duplicate entry for gene " + geneName +
+                    " in cell expression counts file " + expressionCountsFileName);
+            }
+            addGene(geneName);
+            const GeneId geneId = geneIdFromName(geneName);
+            CZI_ASSERT(geneId != invalidGeneId);
+            geneIdsInFile.push_back(geneId);
+        }
+
+
+
+        // Pass 2: parse the lines again and store the expression counts.
+        cout << timestamp << "Pass 2 begins." << endl;
+        counts.beginPass2();
+        {
+            BatchDispatcher batchDispatcher(lines.size(), 16);
+            runThreads(threadCount, [&](size_t)
+            {
+                vector<string> threadTokens;
+                string geneName;
+                size_t begin, end;
+                while(batchDispatcher.getBatch(begin, end)) {
+                    for(size_t i=begin; i!=end; i++) {
+                        const GeneId geneId = geneIdsInFile[i];
+                        Csv::parseLine(lines[i], isSeparator, expressionCountsFileSeparators, expectedTokenCount,
+                            keptCellIndex, geneName, threadTokens,
+                            [&](CellId cellIndex, float count)
+                            {
+                                if(count != 0.) {
+                                    counts.storeMultithreaded(cellIndex, make_pair(geneId, count));
+                                }
+                            });
+                    }
+                }
+            });
+        }
+        counts.endPass2();
+        file.close();
+
+        // Sort the expression counts of each cell by gene id.
+        {
+            BatchDispatcher batchDispatcher(cellsToBeKept.size(), 1000);
+            runThreads(threadCount, [&](size_t)
+            {
+                size_t begin, end;
+                while(batchDispatcher.getBatch(begin, end)) {
+                    for(size_t i=begin; i!=end; i++) {
+                        sort(counts.begin(i), counts.end(i));
+                    }
+                }
+            });
+        }
+
+
+
+        // Now we can add all the cells to be kept.
+        cout << timestamp << "Storing expression counts." << endl;
+        vector< pair<string, string> > metaDataForOneCell = additionalCellMetaData;
+        vector< pair<GeneId, float> > countsForOneCell;
+        for(const string& metaDataName: metaDataNames) {
+            metaDataForOneCell.push_back(make_pair(metaDataName, ""));
+        }
+        for(size_t i=0; i<cellsToBeKept.size(); i++) {
+            const CellId cellIdInMetaDataFile = cellsToBeKept[i].first;
+            CZI_ASSERT(metaDataInFile[cellIdInMetaDataFile].size() == metaDataNames.size());
+            for(size_t j=0; j<metaDataNames.size(); j++) {
+                metaDataForOneCell[j+additionalCellMetaData.size()].second
+                    = metaDataInFile[cellIdInMetaDataFile][j];
+            }
+            if(skipCellDuringIngestion(metaDataForOneCell[additionalCellMetaData.size()].second)) {
+                continue;
+            }
+            countsForOneCell.assign(counts.begin(i), counts.end(i));
+            addCellUsingGeneIds(metaDataForOneCell, countsForOneCell);
+            commitIngestionIfNeeded();
+        }
+    } catch(...) {
+        counts.remove();
+        throw;
+    }
+    counts.remove();
+    ingestion.commit();
+
+    cout << timestamp << "End addCells: " << cellCount() <<" cells, "
+        << geneCount() << " genes." << endl;
+}
@@ -45,20 +45,57 @@ void ExpressionMatrix::findSimilarGenePairs0(
         throw runtime_error("Cell set " + cellSetName + " is empty.");
     }
 
-    // Create the expression matrix subset for this gene set and cell set.
-    cout << timestamp << "Creating expression matrix subset." << endl;
-    const string expressionMatrixSubsetName =
-        directoryName + "/tmp-ExpressionMatrixSubset-" + similarGenePairsName;
-    ExpressionMatrixSubset expressionMatrixSubset(
-        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts);
-
-
-
     // Create a dense expression vector for each gene.
     // All indices are local to the gene set and cell set.
-    cout << timestamp << "Creating dense expression vectors." << endl;
     vector< vector<float> > v;
-    expressionMatrixSubset.getDenseRepresentation(v, normalizationMethod);
+    if(geneExpressionIndex.isOpen()) {
+
+        // Use the gene expression index to get the expression counts
+        // of each gene directly, without creating an expression matrix subset.
+        cout << timestamp << "Creating dense expression vectors using the gene expression index." << endl;
+        v.resize(geneCount, vector<float>(cellCount));
+        vector<ExpressionMatrixSubset::Sum> sums(cellCount);
+        for(GeneId localGeneId=0; localGeneId!=geneCount; localGeneId++) {
+            vector<float>& x = v[localGeneId];
+            getExpressionCountsForGene(geneSet.getGlobalGeneId(localGeneId),
+                cellSet.begin(), cellSet.end(), x.data());
+            for(CellId localCellId=0; localCellId!=cellCount; localCellId++) {
+                const float count = x[localCellId];
+                sums[localCellId].sum1 += count;
+                sums[localCellId].sum2 += count * count;
+            }
+        }
+
+        // Normalize the expression vector of each cell, if requested,
+        // in the same way as ExpressionMatrixSubset::getDenseRepresentation.
+        if(normalizationMethod != NormalizationMethod::none) {
+            CZI_ASSERT(normalizationMethod != NormalizationMethod::Invalid);
+            for(CellId localCellId=0; localCellId!=cellCount; localCellId++) {
+                const double scaling =
+                    (normalizationMethod==NormalizationMethod::L1) ?
+                        sums[localCellId].sum1 :
+                        sqrt(sums[localCellId].sum2);
+                if(scaling != 0.) {
+                    const float factor = float(1./scaling);
+                    for(GeneId localGeneId=0; localGeneId!=geneCount; localGeneId++) {
+                        v[localGeneId][localCellId] *= factor;
+                    }
+                }
+            }
+        }
+
+    } else {
+
+        // Create the expression matrix subset for this gene set and cell set.
+        cout << timestamp << "Creating expression matrix subset." << endl;
+        const string expressionMatrixSubsetName =
+            directoryName + "/tmp-ExpressionMatrixSubset-" + similarGenePairsName;
+        ExpressionMatrixSubset expressionMatrixSubset(
+            expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts, compressedCellExpressionCounts);
+
+        cout << timestamp << "Creating dense expression vectors." << endl;
+        expressionMatrixSubset.getDenseRepresentation(v, normalizationMethod);
+    }
 
 
 
@@ -1,10 +1,13 @@
 #include "ExpressionMatrix.hpp"
 #include "ExpressionMatrixSubset.hpp"
+#include "heap.hpp"
+#include "runThreads.hpp"
 #include "SimilarPairs.hpp"
 #include "timestamp.hpp"
 using namespace ChanZuckerberg;
 using namespace ExpressionMatrix2;
 
+#include "algorithm.hpp"
 #include <chrono>
 #include "fstream.hpp"
 
@@ -12,14 +15,35 @@ using namespace ExpressionMatrix2;
 
 // Find similar cell pairs by looping over all pairs,
 // taking into account only genes in the specified gene set.
-// This is O(N**2) slow because it loops over cell pairs.
+// This is O(N**2) slow because it loops over cell pairs,
+// but the similarities are exact, so it is used as ground truth
+// for the approximate methods.
+
+// The computation is done for blocks of blockSize cells (the query cells)
+// at a time. The expression counts of the query cells are stored
+// in dense form, indexed by [localGeneId][i], where i is the index
+// of the query cell in the block. For each cell, we then loop over
+// its sparse expression counts and gather the corresponding
+// dense rows, which accumulates the scalar products with all the query
+// cells at once and without the branches required to merge two sparse vectors.
+// The scalar products are accumulated in gene order in the same way as
+// ExpressionMatrixSubset::computeCellSimilarity, so the similarities are identical.
+// Query blocks are processed by threadCount threads,
+// each using its own dense block and keeping the best k pairs
+// for each of its query cells, so no synchronization is necessary.
+// Each pair is therefore computed twice, once for each of its cells,
+// and stored using addUnsymmetric for the query cell only.
+// The list of each cell contains its best k pairs, as when each pair
+// was computed once and stored for both cells using SimilarPairs::add
+// (except possibly for the choice among pairs with equal similarity).
 void ExpressionMatrix::findSimilarPairs0(
     ostream& out,
     const string& geneSetName,      // The name of the gene set to be used.
     const string& cellSetName,      // The name of the cell set to be used.
     const string& similarPairsName, // The name of the SimilarPairs object to be created.
     size_t k,                       // The maximum number of similar pairs to be stored for each cell.
-    double similarityThreshold
+    double similarityThreshold,
+    size_t threadCount              // The number of threads to use, or 0 to use all hardware threads.
     )
 {
     // Sanity check.
@@ -51,40 +75,104 @@ void ExpressionMatrix::findSimilarPairs0(
     // Create the expression matrix subset for this gene set and cell set.
     const string expressionMatrixSubsetName = directoryName + "/tmp-ExpressionMatrixSubset-" + similarPairsName;
     ExpressionMatrixSubset expressionMatrixSubset(
-        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts);
+        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts, compressedCellExpressionCounts);
+    const CellId cellCount = CellId(cellSet.size());
+    const GeneId geneCount = expressionMatrixSubset.geneCount();
 
 
     // Loop over all pairs.
-    out << timestamp << "Begin computing similarities for all cell pairs." << endl;
+    threadCount = getThreadCount(threadCount);
+    out << timestamp << "Begin computing similarities for all cell pairs using " <<
+        threadCount << " threads." << endl;
     const auto t0 = std::chrono::steady_clock::now();
-    for(CellId localCellId0=0; localCellId0!=similarPairs.cellCount()-1; localCellId0++) {
-        if(localCellId0>0 && ((localCellId0%100) == 0)) {
-            out << timestamp << "Working on cell " << localCellId0 << " of " << cellSet.size() << endl;
-        }
+    const size_t blockSize = 32;
+    BatchDispatcher batchDispatcher(cellCount, blockSize);
+    runThreads(threadCount, [&](size_t threadId)
+    {
+        // The expression counts of the query cells in dense form.
+        vector<float> dense(size_t(geneCount) * blockSize, 0.);
+
+        // The scalar products of the current cell with each of the query cells.
+        vector<double> scalarProducts(blockSize);
+
+        // The best k pairs found so far for each query cell,
+        // stored as a max-heap of pair(-similarity, localCellId1),
+        // so the worst of the k pairs is at the top.
+        vector< vector< pair<double, CellId> > > neighbors(blockSize);
+        const std::less< pair<double, CellId> > comparator;
+
+        size_t begin, end;
+        while(batchDispatcher.getBatch(begin, end)) {
+            const CellId localCellId0Begin = CellId(begin);
+            const size_t n = end - begin;
+            if(threadId==0 && begin!=0 && (begin % 1024)==0) {
+                out << timestamp << "Working on cell " << localCellId0Begin << " of " << cellCount << endl;
+            }
+
+            // Store the query cells in dense form.
+            for(size_t i=0; i<n; i++) {
+                for(const auto& p: expressionMatrixSubset.cellExpressionCounts[CellId(localCellId0Begin + i)]) {
+                    dense[size_t(p.first) * blockSize + i] = p.second;
+                }
+                neighbors[i].clear();
+            }
 
-        // Find all cells with similarity better than the specified threshold.
-        for(CellId localCellId1=localCellId0+1; localCellId1!=similarPairs.cellCount(); localCellId1++) {
-            const double similarity = expressionMatrixSubset.computeCellSimilarity(localCellId0, localCellId1);
+            // Loop over all cells.
+            for(CellId localCellId1=0; localCellId1!=cellCount; localCellId1++) {
+
+                // Compute the scalar products with all the query cells.
+                fill(scalarProducts.begin(), scalarProducts.end(), 0.);
+                for(const auto& p: expressionMatrixSubset.cellExpressionCounts[localCellId1]) {
+                    const float* row = dense.data() + size_t(p.first) * blockSize;
+                    const float count1 = p.second;
+                    for(size_t i=0; i<blockSize; i++) {
+                        scalarProducts[i] += row[i] * count1;
+                    }
+                }
+
+                // Update the best pairs of each query cell.
+                for(size_t i=0; i<n; i++) {
+                    const CellId localCellId0 = CellId(localCellId0Begin + i);
+                    if(localCellId1 == localCellId0) {
+                        continue;
+                    }
+                    const double similarity =
+                        expressionMatrixSubset.computeCellSimilarity(localCellId0, localCellId1, scalarProducts[i]);
+                    if(!(similarity > similarityThreshold)) {
+                        continue;
+                    }
+                    const pair<double, CellId> neighbor(-similarity, localCellId1);
+                    auto& neighbors0 = neighbors[i];
+                    if(neighbors0.size() < k) {
+                        neighbors0.push_back(neighbor);
+                        std::push_heap(neighbors0.begin(), neighbors0.end(), comparator);
+                    } else if(!neighbors0.empty() && comparator(neighbor, neighbors0.front())) {
+                        popAndPushHeap(neighbors0.begin(), neighbors0.end(), neighbor, comparator);
+                    }
+                }
+            }
 
-            // If the similarity is sufficient, pass it to the SimilarPairs container,
-            // which will make the decision whether to store it, depending on the
-            // number of pairs already stored for cellId0 and cellId1.
-            if(similarity > similarityThreshold) {
-                similarPairs.add(localCellId0, localCellId1, similarity);
+            // Store the pairs of each query cell, sorted by decreasing similarity,
+            // and clear the dense block for the next query block.
+            for(size_t i=0; i<n; i++) {
+                const CellId localCellId0 = CellId(localCellId0Begin + i);
+                auto& neighbors0 = neighbors[i];
+                std::sort_heap(neighbors0.begin(), neighbors0.end(), comparator);
+                for(const auto& neighbor: neighbors0) {
+                    similarPairs.addUnsymmetricNoCheck(localCellId0, neighbor.second, -neighbor.first);
+                }
+                for(const auto& p: expressionMatrixSubset.cellExpressionCounts[localCellId0]) {
+                    dense[size_t(p.first) * blockSize + i] = 0.;
+                }
             }
         }
-    }
+    });
     const auto t1 = std::chrono::steady_clock::now();
     const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
 
 
-    // Sort the similar pairs for each cell by decreasing similarity.
-    similarPairs.sort();
-
-
     out << "Time for all pairs: " << t01 << " s." << endl;
-    const CellId cellCount = CellId(cellSet.size());
-    out << "Time per pair: " << t01/(0.5*double(cellCount)*double(cellCount-1)) << " s." << endl;
+    out << "Time per pair: " << t01/(double(cellCount)*double(cellCount-1)) << " s." << endl;
 }
 
 void ExpressionMatrix::findSimilarPairs0(
@@ -92,10 +180,11 @@ void ExpressionMatrix::findSimilarPairs0(
     const string& cellSetName,      // The name of the cell set to be used.
     const string& similarPairsName, // The name of the SimilarPairs object to be created.
     size_t k,                       // The maximum number of similar pairs to be stored for each cell.
-    double similarityThreshold
+    double similarityThreshold,
+    size_t threadCount              // The number of threads to use, or 0 to use all hardware threads.
     )
 {
-    findSimilarPairs0(cout, geneSetName, cellSetName, similarPairsName, k, similarityThreshold);
+    findSimilarPairs0(cout, geneSetName, cellSetName, similarPairsName, k, similarityThreshold, threadCount);
 }
 
 
@@ -138,7 +227,7 @@ void ExpressionMatrix::testExpressionMatrixSubset(CellId cellId0, CellId cellId1
 
     const string expressionMatrixSubsetName = directoryName + "/tmp-ExpressionMatrixSubset-Test";
     ExpressionMatrixSubset expressionMatrixSubset(
-        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts);
+        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts, compressedCellExpressionCounts);
 
     cout << "Exact " << computeCellSimilarity(cellId0, cellId1) << endl << endl;
     cout << "Subset " << expressionMatrixSubset.computeCellSimilarity(cellId0, cellId1) << endl;
@@ -0,0 +1,134 @@
+// Functions that create, update, and use the gene expression index.
+// See GeneExpressionIndex.hpp.
+
+#include "ExpressionMatrix.hpp"
+#include "timestamp.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include "algorithm.hpp"
+
+
+
+// Get the expression counts of a gene for a range of cells,
+// using the gene expression index if available.
+// The counts are stored in the same order as the cell ids.
+// The index can only be used if the cell ids are sorted,
+// which is always the case for cell sets.
+void ExpressionMatrix::getExpressionCountsForGene(
+    GeneId geneId,
+    const CellId* cellIdsBegin,
+    const CellId* cellIdsEnd,
+    float* counts) const
+{
+    if(!geneExpressionIndex.isOpen() || !std::is_sorted(cellIdsBegin, cellIdsEnd)) {
+        for(const CellId* it=cellIdsBegin; it!=cellIdsEnd; ++it) {
+            *counts++ = getCellExpressionCount(*it, geneId);
+        }
+        return;
+    }
+
+    // Get the counts for the cells in [cellIdsBegin, cellIdsEnd) with ids less than cellIdEnd
+    // from the (CellId, count) pairs of the gene in the stored index or in the overlay.
+    // This advances cellIdsBegin and counts.
+    const auto getCounts = [&](const MemoryAsContainer<const pair<CellId, float> >& geneCounts, CellId cellIdEnd)
+    {
+        const CellId* end = std::lower_bound(cellIdsBegin, cellIdsEnd, cellIdEnd);
+        const pair<CellId, float>* jt = geneCounts.begin();
+        const pair<CellId, float>* jtEnd = geneCounts.end();
+
+        // If the gene has many more expression counts than the requested cells,
+        // use binary searches instead of a linear merge.
+        const size_t requestedCellCount = end - cellIdsBegin;
+        const bool useBinarySearch = geneCounts.size() > 8 * requestedCellCount;
+        for(; cellIdsBegin!=end; ++cellIdsBegin) {
+            const CellId cellId = *cellIdsBegin;
+            if(useBinarySearch) {
+                jt = std::lower_bound(jt, jtEnd, make_pair(cellId, 0.f), OrderPairsByFirstOnly< pair<CellId, float> >());
+            } else {
+                while(jt!=jtEnd && jt->first<cellId) {
+                    ++jt;
+                }
+            }
+            *counts++ = (jt!=jtEnd && jt->first==cellId) ? jt->second : 0.f;
+        }
+    };
+
+    // The cells in the stored index.
+    // A gene that is not in the stored index has no expression counts for these cells.
+    if(geneId < geneExpressionIndex.storedGeneCount()) {
+        getCounts(geneExpressionIndex[geneId], geneExpressionIndex.storedCellCount());
+    } else {
+        getCounts(MemoryAsContainer<const pair<CellId, float> >(0, 0), geneExpressionIndex.storedCellCount());
+    }
+
+    // The cells in the overlay.
+    getCounts(geneExpressionIndex.getOverlay(geneId), geneExpressionIndex.cellCount());
+
+    // Cells added by an ingestion function that is still running
+    // are not yet in the index.
+    for(const CellId* it=cellIdsBegin; it!=cellIdsEnd; ++it) {
+        *counts++ = getCellExpressionCount(*it, geneId);
+    }
+}
+
+
+
+void ExpressionMatrix::createGeneExpressionIndex(size_t threadCount)
+{
+    if(!cells.isOpenWithWriteAccess) {
+        throw runtime_error("Expression matrix in " + directoryName + " was not accessed with write access.");
+    }
+    if(geneExpressionIndex.isOpen()) {
+        geneExpressionIndex.remove();
+    }
+    cout << timestamp << "Creating the gene expression index for " << cellCount() << " cells and " <<
+        geneCount() << " genes." << endl;
+    geneExpressionIndex.createNew(directoryName + "/GeneExpressionIndex",
+        geneCount(), cellExpressionCounts, threadCount);
+    cout << timestamp << "Done creating the gene expression index." << endl;
+}
+
+
+
+void ExpressionMatrix::removeGeneExpressionIndex()
+{
+    if(geneExpressionIndex.isOpen()) {
+        geneExpressionIndex.remove();
+    }
+}
+
+
+
+// Append to the overlay of the gene expression index the cells that are not in it.
+// This is called as cells are added, so usually only appends one cell,
+// at a cost proportional to its number of expression counts.
+void ExpressionMatrix::updateGeneExpressionIndex()
+{
+    if(!geneExpressionIndex.isOpen()) {
+        return;
+    }
+    for(CellId cellId=geneExpressionIndex.cellCount(); cellId<cellCount(); cellId++) {
+        geneExpressionIndex.appendCell(cellId, cellExpressionCounts.begin(cellId), cellExpressionCounts.end(cellId));
+    }
+}
+
+
+
+// Update the gene expression index, then merge the overlay into the stored index
+// if it contains many cells. This is called at the end of ingestion functions.
+// Since the overlay is merged when its number of cells
+// reaches a fixed fraction of the number of cells in the stored index,
+// the amortized cost of merging is proportional to the number of cells added.
+void ExpressionMatrix::updateAndMergeGeneExpressionIndex()
+{
+    updateGeneExpressionIndex();
+    if(!geneExpressionIndex.isOpen() || !cells.isOpenWithWriteAccess) {
+        return;
+    }
+    const CellId storedCellCount = geneExpressionIndex.storedCellCount();
+    const CellId overlayCellCount = geneExpressionIndex.cellCount() - storedCellCount;
+    if(overlayCellCount > max(CellId(10000), storedCellCount / 8)) {
+        createGeneExpressionIndex(0);
+    }
+}
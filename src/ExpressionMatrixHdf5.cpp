@@ -3,12 +3,17 @@
 #ifndef CZI_EXPRESSION_MATRIX2_SKIP_HDF5
 
 #include "ExpressionMatrix.hpp"
+#include "CellBlock.hpp"
 #include "hdf5.hpp"
 #include "iterator.hpp"
 #include "timestamp.hpp"
 using namespace ChanZuckerberg;
 using namespace ExpressionMatrix2;
 
+#include "memory.hpp"
+#include <future>
+#include <mutex>
+
 
 /*******************************************************************************
 
@@ -48,6 +53,7 @@ void ExpressionMatrix::addCellsFromHdf5(
     const vector< pair<string, string> > cellMetaDataArgument,  // Added to all cells.
     double totalExpressionCountThreshold)
 {
+    Ingestion ingestion(*this);
 
     try {
         // Open the file.
@@ -104,8 +110,9 @@ void ExpressionMatrix::addCellsFromHdf5(
         if (indexPointers.size() != hdf5CellNames.size() + 1) {
             const string message =
                 "Unexpected length of index pointers in hdf5 file " + fileName +
-                ": " + lexical_cast<string>(indexPointers.size() +
-                ". Expected " + lexical_cast<string>(hdf5CellNames.size() + 1) + ".");
+                ": " + lexical_cast<string>(indexPointers.size()) +
+                ". Expected " + lexical_cast<string>(hdf5CellNames.size() + 1) + ".";
+            throw runtime_error(message);
         }
 
 
@@ -113,8 +120,16 @@ void ExpressionMatrix::addCellsFromHdf5(
         // Add the genes.
         // We want to add them independently of the cells, so they all get added, even the ones
         // for which all cells have zero count.
-        for (const string& hdf5GeneName : hdf5GeneNames) {
-            addGene(hdf5GeneName);
+        // At the same time, we map the gene indices used in the hdf5 file to GeneIds.
+        // Note that the gene indices do not necessarily agree with the GeneId as stored in the
+        // Expression Matrix (this is in particular true if some genes were already defined
+        // before the call to addCellsFromHdf5).
+        // This way we don't have to look up gene names for each cell.
+        vector<GeneId> hdf5GeneIds(hdf5GeneNames.size());
+        for (size_t i = 0; i < hdf5GeneNames.size(); i++) {
+            addGene(hdf5GeneNames[i]);
+            hdf5GeneIds[i] = geneNames(hdf5GeneNames[i]);
+            CZI_ASSERT(hdf5GeneIds[i] != geneNames.invalidStringId);
         }
 
         // Prepare the cell metadata to be added for all cells.
@@ -124,78 +139,128 @@ void ExpressionMatrix::addCellsFromHdf5(
         copy(cellMetaDataArgument.begin(), cellMetaDataArgument.end(), cellMetaData.begin()+1);
 
 
-        // Main loop over the cells.
-        // For each cell we read the appropriate portion of the data and indices vector.
-        // Data contains expression counts and indices contain gene indices into the hdf5GeneNames vector.
-        // Note that the gene indices do not necessarily agree with the GeneId as stored in the
-        // Expression Matrix (this is in particular true if some genes were already defined
-        // before the call to addCellsFromHdf5).
-        // Similarly, the index i of this loop is not necessarily the same as the CellId
-        // of the cell being added.
-        // The data and indices vectors will be used to hold the data and indices for
-        // a single cell.
-        // The metaData and expressionCounts vector are used as arguments to addCells.
-        // The four vectors are defined here to avoid reallocation inside the loop.
-        vector<uint32_t> data;
-        vector<uint64_t> indices;	// Silly, but that's the way 10X does it.
-        vector<pair<string, float> > expressionCounts;
+
+        // The cells are processed in chunks, each containing a contiguous range of barcodes
+        // with a total of up to chunkSize expression counts (but at least one barcode).
+        // For each chunk, the data and indices are read with a single hyperslab read each,
+        // instead of one read per barcode, and the hdf5 gene indices are converted to GeneIds.
+        // Reading is done by a separate thread, which reads the next chunk
+        // while the cells of the current chunk are being added.
+        // Only the reader thread makes hdf5 calls while the pipeline is running.
+        class Chunk {
+        public:
+            size_t barcodeBegin;
+            size_t barcodeEnd;
+            vector<uint32_t> data;
+            vector<uint64_t> indices;	// Silly, but that's the way 10X does it.
+
+            // The expression counts of the cells in the chunk, with GeneIds.
+            // The expression counts for barcode i begin at
+            // indexPointers[i] - indexPointers[barcodeBegin].
+            vector< pair<GeneId, float> > expressionCounts;
+        };
+        const uint64_t chunkSize = 1ULL << 22;
         const H5::DataSet dataDataSet = file.openDataSet(groupName + "data");
         const H5::DataSet indicesDataSet = file.openDataSet(groupName + "indices");
-        size_t addedCellsCount = 0;
-        for (size_t i = 0; i < hdf5CellNames.size(); i++) {
-            /*
-            if ((i % 1000) == 0) {
-                cout << timestamp << "Processed " << i << " barcodes of " << hdf5CellNames.size();
-                cout << ", added " << addedCellsCount << " cells." << endl;
+        const size_t barcodeCount = hdf5CellNames.size();
+        const auto readChunk = [&](size_t barcodeBegin) -> shared_ptr<Chunk>
+        {
+            const shared_ptr<Chunk> chunk = make_shared<Chunk>();
+            chunk->barcodeBegin = barcodeBegin;
+            size_t barcodeEnd = barcodeBegin + 1;
+            while(barcodeEnd < barcodeCount &&
+                indexPointers[barcodeEnd+1] - indexPointers[barcodeBegin] <= chunkSize) {
+                ++barcodeEnd;
             }
-            */
-
-            // Read the data and indices for this cell.
-            const uint64_t offset = indexPointers[i];
-            const uint64_t n = indexPointers[i + 1] - offset;
-            hdf5::read(dataDataSet, offset, n, data);
-            hdf5::read(indicesDataSet, offset, n, indices);
-            CZI_ASSERT(data.size() == n);
-            CZI_ASSERT(indices.size() == n);
-
-            // cout << "offset = " << offset << endl;
-            // cout << "n = " << n << endl;
-
-            // Gather the expression counts.
-            expressionCounts.clear();
-            cellMetaData.front().second = cellNamePrefix + "-" + hdf5CellNames[i];
-            double totalExpressionCount = 0.;
+            chunk->barcodeEnd = barcodeEnd;
+
+            const uint64_t offset = indexPointers[barcodeBegin];
+            const uint64_t n = indexPointers[barcodeEnd] - offset;
+            hdf5::read(dataDataSet, offset, n, chunk->data);
+            hdf5::read(indicesDataSet, offset, n, chunk->indices);
+            CZI_ASSERT(chunk->data.size() == n);
+            CZI_ASSERT(chunk->indices.size() == n);
+
+            chunk->expressionCounts.resize(n);
             for (size_t j = 0; j < n; j++) {
-                // cout << j << " " << indices[j] << endl;
-                const uint64_t hdf5GeneIndex = indices[j];
-                CZI_ASSERT(hdf5GeneIndex < hdf5GeneNames.size());
-                expressionCounts.push_back(make_pair(hdf5GeneNames[hdf5GeneIndex], float(data[j])));
-                totalExpressionCount+= data[j];
+                const uint64_t hdf5GeneIndex = chunk->indices[j];
+                if(hdf5GeneIndex >= hdf5GeneIds.size()) {
+                    throw runtime_error("Invalid gene index " + lexical_cast<string>(hdf5GeneIndex) +
+                        " in hdf5 file " + fileName);
+                }
+                chunk->expressionCounts[j] = make_pair(hdf5GeneIds[hdf5GeneIndex], float(chunk->data[j]));
             }
+            return chunk;
+        };
+
+
 
-            // If the total expression count is not enough, skip.
-            if(totalExpressionCount < totalExpressionCountThreshold) {
-                continue;
+        // Main loop over chunks.
+        // The index i of the barcode loop is not necessarily the same as the CellId
+        // of the cell being added.
+        // The expressionCounts vector is used as argument to addCellUsingGeneIds.
+        // It is defined here to avoid reallocation inside the loop.
+        vector<pair<GeneId, float> > expressionCounts;
+        size_t addedCellsCount = 0;
+        std::future< shared_ptr<Chunk> > nextChunk;
+        if(barcodeCount > 0) {
+            nextChunk = std::async(std::launch::async, readChunk, 0);
+        }
+        while(nextChunk.valid()) {
+            const shared_ptr<Chunk> chunk = nextChunk.get();
+
+            // Start reading the next chunk.
+            if(chunk->barcodeEnd < barcodeCount) {
+                nextChunk = std::async(std::launch::async, readChunk, chunk->barcodeEnd);
             }
-            ++addedCellsCount;
-
-            try {
-                addCell(cellMetaData, expressionCounts);
-            } catch (...) {
-                cout << "Error occurred adding cell " << i << " ";
-                cout << hdf5CellNames[i] << " from HDF5 file " << fileName << endl;
-                cout << "Index pointers information: " << indexPointers[i];
-                cout << " " << indexPointers[i + 1] << " " << n << endl;
-                cout << ". Details follow." << endl;
+
+            // Add the cells of this chunk.
+            for (size_t i = chunk->barcodeBegin; i < chunk->barcodeEnd; i++) {
+
+                // Gather the expression counts.
+                const uint64_t chunkOffset = indexPointers[i] - indexPointers[chunk->barcodeBegin];
+                const uint64_t n = indexPointers[i + 1] - indexPointers[i];
+                expressionCounts.assign(
+                    chunk->expressionCounts.begin() + chunkOffset,
+                    chunk->expressionCounts.begin() + chunkOffset + n);
+                cellMetaData.front().second = cellNamePrefix + "-" + hdf5CellNames[i];
+                double totalExpressionCount = 0.;
                 for (size_t j = 0; j < n; j++) {
-                    cout << j << " " << indices[j] << " " << hdf5GeneNames[indices[j]] << " " << data[j] << endl;
+                    totalExpressionCount += chunk->data[chunkOffset + j];
+                }
+
+                // If the total expression count is not enough, skip.
+                if(totalExpressionCount < totalExpressionCountThreshold) {
+                    continue;
+                }
+
+                // If resuming an interrupted ingestion, skip cells that were already added.
+                if(skipCellDuringIngestion(cellMetaData.front().second)) {
+                    continue;
+                }
+                ++addedCellsCount;
+
+                try {
+                    addCellUsingGeneIds(cellMetaData, expressionCounts);
+                } catch (...) {
+                    cout << "Error occurred adding cell " << i << " ";
+                    cout << hdf5CellNames[i] << " from HDF5 file " << fileName << endl;
+                    cout << "Index pointers information: " << indexPointers[i];
+                    cout << " " << indexPointers[i + 1] << " " << n << endl;
+                    cout << ". Details follow." << endl;
+                    for (size_t j = 0; j < n; j++) {
+                        const uint64_t hdf5GeneIndex = chunk->indices[chunkOffset + j];
+                        cout << j << " " << hdf5GeneIndex << " " << hdf5GeneNames[hdf5GeneIndex];
+                        cout << " " << chunk->data[chunkOffset + j] << endl;
+                    }
+                    cout << "Error occurred adding cell " << i << " ";
+                    cout << hdf5CellNames[i] << " from HDF5 file " << fileName  << endl;
+                    cout << "Index pointers information: " << indexPointers[i] << " ";
+                    cout << indexPointers[i + 1] << " " << n << endl;
+                    cout << "See details above." << endl;
+                    throw;
                 }
-                cout << "Error occurred adding cell " << i << " ";
-                cout << hdf5CellNames[i] << " from HDF5 file " << fileName  << endl;
-                cout << "Index pointers information: " << indexPointers[i] << " ";
-                cout << indexPointers[i + 1] << " " << n << endl;
-                cout << "See details above." << endl;
-                throw;
+                commitIngestionIfNeeded();
             }
         }
 
@@ -213,7 +278,92 @@ void ExpressionMatrix::addCellsFromHdf5(
         cout << e.what() << endl;
         throw;
     }
+    ingestion.commit();
 
     cout << "There are " << cellCount() << " cells and " << geneCount() << " genes." << endl;
 }
+
+
+
+// Read an hdf5 file into a CellBlock, for addCellsFromHdf5Batch.
+// This does not access the expression matrix, so it can run
+// concurrently with the addition of cells from other files.
+// The hdf5 library is usually not built thread safe, so hdf5 calls
+// are serialized using a mutex. The conversion to a CellBlock
+// is done without holding the mutex.
+void ExpressionMatrix::readCellBlockFromHdf5(
+    const string& fileName,
+    const string& cellNamePrefix,
+    double totalExpressionCountThreshold,
+    CellBlock& block)
+{
+    static std::mutex hdf5Mutex;
+
+    vector<string> hdf5CellNames;
+    vector<uint64_t> indexPointers;
+    vector<uint32_t> data;
+    vector<uint64_t> indices;
+    try {
+        std::lock_guard<std::mutex> lock(hdf5Mutex);
+
+        // Open the file and find the group, as in addCellsFromHdf5.
+        const H5::H5File file(fileName, H5F_ACC_RDONLY);
+        vector<string> groupNames;
+        hdf5::getTopLevelGroups(file, groupNames);
+        if (groupNames.size() != 1) {
+            throw runtime_error("HDF5 file " + fileName + " should have one and only one group.");
+        }
+        const string groupName = "/" + groupNames.front() + "/";
+
+        // Read everything we need.
+        hdf5::read(file.openDataSet(groupName + "genes"), block.geneNames);
+        hdf5::read(file.openDataSet(groupName + "barcodes"), hdf5CellNames);
+        hdf5::read(file.openDataSet(groupName + "indptr"), indexPointers);
+        if (indexPointers.size() != hdf5CellNames.size() + 1) {
+            throw runtime_error("Unexpected length of index pointers in hdf5 file " + fileName);
+        }
+        const uint64_t n = indexPointers.back();
+        if(n > 0) {
+            hdf5::read(file.openDataSet(groupName + "data"), 0, n, data);
+            hdf5::read(file.openDataSet(groupName + "indices"), 0, n, indices);
+        }
+    }
+    catch (H5::Exception& e) {
+        cout << "An error occurred while reading HDF5 file " << fileName << endl;
+        cout << e.getDetailMsg() << endl;
+        throw;
+    }
+
+    // Check for duplications in the gene names.
+    {
+        vector<string> sortedGeneNames = block.geneNames;
+        sort(sortedGeneNames.begin(), sortedGeneNames.end());
+        const auto it = adjacent_find(sortedGeneNames.begin(), sortedGeneNames.end());
+        if(it != sortedGeneNames.end()) {
+            throw runtime_error("Duplicate gene name " + *it + " in hdf5 file " + fileName);
+        }
+    }
+
+    // Store the cells that pass the total expression count threshold.
+    for(size_t i=0; i<hdf5CellNames.size(); i++) {
+        if(indexPointers[i+1] < indexPointers[i] || indexPointers[i+1] > data.size()) {
+            throw runtime_error("Invalid index pointers in hdf5 file " + fileName);
+        }
+        double totalExpressionCount = 0.;
+        for(uint64_t j=indexPointers[i]; j!=indexPointers[i+1]; j++) {
+            totalExpressionCount += data[j];
+        }
+        if(totalExpressionCount < totalExpressionCountThreshold) {
+            continue;
+        }
+        block.beginCell(cellNamePrefix + "-" + hdf5CellNames[i]);
+        for(uint64_t j=indexPointers[i]; j!=indexPointers[i+1]; j++) {
+            if(indices[j] >= block.geneNames.size()) {
+                throw runtime_error("Invalid gene index " + lexical_cast<string>(indices[j]) +
+                    " in hdf5 file " + fileName);
+            }
+            block.addExpressionCount(uint32_t(indices[j]), float(data[j]));
+        }
+    }
+}
 #endif
@@ -425,6 +425,8 @@ void ExpressionMatrix::exploreHashTableSummary(const vector<string>& request, os
         "These hash tables behave well at low load factors, but their performance "
         "<a href='http://cseweb.ucsd.edu/~kube/cls/100/Lectures/lec16/lec16-27.html'>degrades rapidly</a> "
         "when the load factor is 0.5 or greater. "
+        "Each hash table doubles its number of slots when its load factor would exceed 0.5, "
+        "so its initial number of slots, controlled by a creation parameter, is not a limit. "
         " The table below provides a current usage summary of these hash tables.";
 
     html <<
@@ -1301,6 +1303,9 @@ void ExpressionMatrix::removeMetaData(
             if((*it).first == metaDataNameId) {
                 decrementCellMetaDataNameUsageCount(metaDataNameId);
                 cellMetaData.erase(it);
+                if(cellMetaDataColumns.isOpen()) {
+                    setCellMetaDataColumnValue(cellId, metaDataNameId, cellMetaDataValues.invalidStringId);
+                }
                 break;
             }
         }
@@ -1126,10 +1126,10 @@ void ExpressionMatrix::createSimilarPairs(const vector<string>& request, ostream
     html << "<pre>";
     if(lshCount) {
         findSimilarPairs4(html, geneSetName, cellSetName, similarPairsName,
-            maxConnectivity, similarityThreshold, lshCount, seed);
+            maxConnectivity, similarityThreshold, lshCount, seed, 0);
     }  else {
         findSimilarPairs0(html, geneSetName, cellSetName, similarPairsName,
-            maxConnectivity, similarityThreshold);
+            maxConnectivity, similarityThreshold, 0);
     }
     html << "</pre>";
 
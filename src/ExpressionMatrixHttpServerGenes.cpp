@@ -254,12 +254,15 @@ void ExpressionMatrix::exploreGene(
 
 
     // Gather the expression counts for this gene for all cells in the specified cell set.
+    vector<float> rawCounts(cellSet.size());
+    getExpressionCountsForGene(geneId, cellSet.begin(), cellSet.end(), rawCounts.data());
     vector<ExploreGeneData> counts;
-    for(const CellId cellId: cellSet) {
+    for(size_t i=0; i!=cellSet.size(); i++) {
+        const CellId cellId = cellSet[i];
         const Cell& cell = cells[cellId];
         ExploreGeneData data;
         data.cellId = cellId;
-        data.rawCount =  getCellExpressionCount(cellId, geneId);
+        data.rawCount = rawCounts[i];
         if(data.rawCount) {
             data.count1 = float(data.rawCount * cell.norm1Inverse);
             data.count2 = float(data.rawCount * cell.norm2Inverse);
@@ -943,7 +946,7 @@ void ExpressionMatrix::compareTwoGenes(
     const string expressionMatrixSubsetName =
         directoryName + "/tmp-ExpressionMatrixSubset-" + randomUuid();
     ExpressionMatrixSubset expressionMatrixSubset(
-        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts);
+        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts, compressedCellExpressionCounts);
 
     // Create a dense expression vector for each gene.
     // All indices are local to the gene set and cell set.
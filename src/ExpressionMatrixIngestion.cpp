@@ -0,0 +1,225 @@
+// Checkpoints for ingestion functions.
+// See the comments before class IngestionCheckpoint in ExpressionMatrix.hpp.
+
+// A commit first syncs to disk all the data structures that are modified
+// when cells and genes are added, then records their sizes in the
+// IngestionCheckpoint and syncs that too. So the sizes recorded in the
+// checkpoint always describe data that are on disk.
+// Between commits, these data structures only grow at the end
+// (with the exception of the hash tables of the string tables
+// and the free slots of the meta data lists, which are rebuilt
+// when rolling back).
+
+#include "ExpressionMatrix.hpp"
+#include "filesystem.hpp"
+#include "timestamp.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+
+
+// Access the ingestion checkpoint when accessing an existing expression matrix.
+// If the last ingestion was interrupted, roll back to its last commit.
+void ExpressionMatrix::accessIngestionCheckpoint(bool readWriteAccess)
+{
+    const string fileName = directoryName + "/IngestionCheckpoint";
+
+    // Expression matrices created before checkpoints were introduced don't have one.
+    if(!filesystem::exists(fileName)) {
+        if(readWriteAccess) {
+            ingestionCheckpoint.createNew(fileName);
+            ingestionCheckpoint->isActive = 0;
+            commitIngestion();
+        }
+        return;
+    }
+
+    ingestionCheckpoint.accessExisting(fileName, readWriteAccess);
+    if(!ingestionCheckpoint->isActive) {
+        return;
+    }
+    if(!readWriteAccess) {
+        throw runtime_error("Expression matrix in " + directoryName +
+            " contains an interrupted ingestion. "
+            "Access it with write access to roll back to the last ingestion checkpoint.");
+    }
+    cout << timestamp << "The last ingestion in " << directoryName << " was interrupted." << endl;
+    rollBackIngestion();
+
+    // Record that ingestion functions should skip cells that were already added.
+    isResumingIngestion = true;
+    cout << "Ingestion functions will skip cells that already exist." << endl;
+}
+
+
+
+// Truncate all the data structures that are modified when cells and genes
+// are added back to the state of the last commit.
+void ExpressionMatrix::rollBackIngestion()
+{
+    IngestionCheckpoint& checkpoint = *ingestionCheckpoint.operator->();
+    cout << timestamp << "Rolling back to " << checkpoint.cellCount << " cells and " <<
+        checkpoint.geneCount << " genes." << endl;
+
+    // Genes.
+    const GeneId geneCount = GeneId(checkpoint.geneCount);
+    geneNames.truncate(geneCount);
+    geneMetaData.truncate(geneCount, checkpoint.geneMetaDataDataSize);
+    geneMetaDataNames.truncate(checkpoint.geneMetaDataNameCount);
+    geneMetaDataValues.truncate(checkpoint.geneMetaDataValueCount);
+    GeneSet& allGenes = geneSets["AllGenes"];
+    allGenes.remove();
+    allGenes.createNew(directoryName + "/GeneSet-AllGenes");
+    for(GeneId geneId=0; geneId!=geneCount; geneId++) {
+        allGenes.addGene(geneId);
+    }
+    allGenes.forceSorted();
+
+    // Cells.
+    const CellId cellCount = CellId(checkpoint.cellCount);
+    cells.resize(cellCount);
+    cellNames.truncate(cellCount);
+    cellMetaData.truncate(cellCount, checkpoint.cellMetaDataDataSize);
+    cellMetaDataNames.truncate(checkpoint.cellMetaDataNameCount);
+    cellNameMetaDataNameId = cellMetaDataNames.invalidStringId;
+    cellMetaDataValues.truncate(checkpoint.cellMetaDataValueCount);
+    if(cellMetaDataColumns.isOpen()) {
+        cellMetaDataColumns.truncate(cellCount, StringId(checkpoint.cellMetaDataNameCount));
+    }
+    cellExpressionCounts.truncate(cellCount);
+    if(compressedCellExpressionCounts.isOpen()) {
+        compressedCellExpressionCounts.truncate(cellCount);
+    }
+    CellSet& allCells = *cellSets.cellSets["AllCells"];
+    allCells.resize(cellCount);
+    for(CellId cellId=0; cellId!=cellCount; cellId++) {
+        allCells[cellId] = cellId;
+    }
+
+    // Recompute the meta data name usage counts.
+    geneMetaDataNamesUsageCount.resize(geneMetaDataNames.size());
+    fill(geneMetaDataNamesUsageCount.begin(), geneMetaDataNamesUsageCount.end(), GeneId(0));
+    for(GeneId geneId=0; geneId!=geneCount; geneId++) {
+        for(const auto& p: geneMetaData[geneId]) {
+            ++geneMetaDataNamesUsageCount[p.first];
+        }
+    }
+    cellMetaDataNamesUsageCount.resize(cellMetaDataNames.size());
+    fill(cellMetaDataNamesUsageCount.begin(), cellMetaDataNamesUsageCount.end(), CellId(0));
+    for(CellId cellId=0; cellId!=cellCount; cellId++) {
+        for(const auto& p: cellMetaData[cellId]) {
+            ++cellMetaDataNamesUsageCount[p.first];
+        }
+    }
+
+    // The gene expression index can cover cells and genes that were removed.
+    if(geneExpressionIndex.isOpen()) {
+        if(geneExpressionIndex.storedCellCount() > cellCount || geneExpressionIndex.storedGeneCount() > geneCount) {
+            createGeneExpressionIndex(0);
+        } else if(geneExpressionIndex.cellCount() > cellCount) {
+            geneExpressionIndex.truncate(cellCount);
+        }
+    }
+
+    // The expression matrix is now consistent.
+    checkpoint.isActive = 0;
+    ingestionCheckpoint.syncToDisk();
+}
+
+
+
+void ExpressionMatrix::beginIngestion()
+{
+    if(!ingestionCheckpoint.isOpen) {
+        throw runtime_error("Expression matrix in " + directoryName + " was not accessed with write access.");
+    }
+    commitIngestion();
+    ingestionCheckpoint->isActive = 1;
+    ingestionCheckpoint.syncToDisk();
+    ingestionBeginState = *ingestionCheckpoint.operator->();
+    deferCellStatistics = true;
+}
+
+
+
+void ExpressionMatrix::commitIngestion()
+{
+    // Compute the statistics of the cells added since the last commit.
+    if(deferCellStatistics) {
+        computeCellStatistics(CellId(ingestionCheckpoint->cellCount), CellId(cells.size()), 0,
+            std::numeric_limits<double>::infinity());
+    }
+
+    // Sync to disk everything that is modified when adding cells and genes.
+    geneNames.syncToDisk();
+    geneMetaData.syncToDisk();
+    geneMetaDataNames.syncToDisk();
+    geneMetaDataValues.syncToDisk();
+    cells.syncToDisk();
+    cellNames.syncToDisk();
+    cellMetaData.syncToDisk();
+    cellMetaDataNames.syncToDisk();
+    cellMetaDataValues.syncToDisk();
+    if(cellMetaDataColumns.isOpen()) {
+        cellMetaDataColumns.syncToDisk();
+    }
+    cellExpressionCounts.syncToDisk();
+    if(compressedCellExpressionCounts.isOpen()) {
+        compressedCellExpressionCounts.syncToDisk();
+    }
+    cellSets.cellSets["AllCells"]->syncToDisk();
+
+    // Now record the sizes.
+    IngestionCheckpoint& checkpoint = *ingestionCheckpoint.operator->();
+    checkpoint.cellCount = cells.size();
+    checkpoint.geneCount = geneNames.size();
+    checkpoint.cellMetaDataDataSize = cellMetaData.dataSize();
+    checkpoint.cellMetaDataNameCount = cellMetaDataNames.size();
+    checkpoint.cellMetaDataValueCount = cellMetaDataValues.size();
+    checkpoint.geneMetaDataDataSize = geneMetaData.dataSize();
+    checkpoint.geneMetaDataNameCount = geneMetaDataNames.size();
+    checkpoint.geneMetaDataValueCount = geneMetaDataValues.size();
+    ingestionCheckpoint.syncToDisk();
+}
+
+
+
+// Commit if enough cells were added since the last commit.
+// Ingestion functions call this at points where all data structures
+// are consistent, for example between cells or blocks of cells.
+void ExpressionMatrix::commitIngestionIfNeeded()
+{
+    if(cells.size() >= ingestionCheckpoint->cellCount + ingestionCheckpointCellCount) {
+        commitIngestion();
+    }
+}
+
+
+
+void ExpressionMatrix::endIngestion()
+{
+    commitIngestion();
+    deferCellStatistics = false;
+    ingestionCheckpoint->isActive = 0;
+    ingestionCheckpoint.syncToDisk();
+    updateAndMergeGeneExpressionIndex();
+}
+
+
+
+// Called instead of endIngestion when an ingestion function
+// exits via an exception. The expression matrix is rolled back
+// to its state when the ingestion began, including the cells
+// committed since then, so repeating the call
+// does not fail because of cells it already added.
+// The data structures only grew since then,
+// so this is done by recording the sizes at the beginning in the checkpoint
+// (which is still active, so an interrupted rollback is completed
+// the next time the expression matrix is accessed), then rolling back to it.
+void ExpressionMatrix::abortIngestion()
+{
+    deferCellStatistics = false;
+    *ingestionCheckpoint.operator->() = ingestionBeginState;
+    ingestionCheckpoint.syncToDisk();
+    rollBackIngestion();
+}
@@ -0,0 +1,493 @@
+/*******************************************************************************
+
+Functionality to add cells from a file in JSON lines format
+(one JSON object per line), as produced by services that hand us cells
+one at a time. Each line has the format used by addCellFromJson:
+
+{"metaData": {"CellName": "abc", "key1": "value1"}, "expressionCounts": {"gene1": 10, "gene2": 20}}
+
+The CellName meta data entry is required. Other meta data values
+can be strings, numbers, true, false, or null, and are stored as text.
+Additional top level keys are ignored.
+
+Each line is parsed in place using a small special purpose parser
+that does not build a tree, and the cells are accumulated in a CellBlock
+and added in batches using addCellBlock.
+Before a line is staged it is fully validated, so a bad line is reported
+(with its line number) and skipped, and the remaining lines are still added.
+
+*******************************************************************************/
+
+#include "ExpressionMatrix.hpp"
+#include "CellBlock.hpp"
+#include "GzipLineReader.hpp"
+#include "timestamp.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include "algorithm.hpp"
+#include <cstdlib>
+#include "iostream.hpp"
+#include <unordered_map>
+#include <unordered_set>
+
+
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace Json {
+            class Parser;
+        }
+    }
+}
+
+
+
+// A parser for a JSON value stored in a null terminated buffer.
+// It only supports what we need to process a cell: objects are visited
+// key by key, and any other value is either converted to text or skipped.
+// Errors are reported by throwing runtime_error.
+class ChanZuckerberg::ExpressionMatrix2::Json::Parser {
+public:
+    Parser(const char* text) : p(text), begin(text) {}
+
+    // Parse an object. For each key, call f(key),
+    // which must consume the corresponding value.
+    template<class F> void parseObject(const F& f)
+    {
+        expect('{');
+        skipBlanks();
+        if(*p == '}') {
+            ++p;
+            return;
+        }
+        string key;
+        while(true) {
+            skipBlanks();
+            parseString(key);
+            expect(':');
+            skipBlanks();
+            f(key);
+            skipBlanks();
+            if(*p == ',') {
+                ++p;
+            } else {
+                expect('}');
+                return;
+            }
+        }
+    }
+
+    // Parse a string, handling escapes.
+    void parseString(string& s)
+    {
+        expect('"');
+        s.clear();
+        while(true) {
+            const char c = *p;
+            if(c == '"') {
+                ++p;
+                return;
+            }
+            if(c == 0) {
+                error("Unterminated string");
+            }
+            if(c != '\\') {
+                s.push_back(c);
+                ++p;
+                continue;
+            }
+            ++p;
+            switch(*p++) {
+            case '"': s.push_back('"'); break;
+            case '\\': s.push_back('\\'); break;
+            case '/': s.push_back('/'); break;
+            case 'b': s.push_back('\b'); break;
+            case 'f': s.push_back('\f'); break;
+            case 'n': s.push_back('\n'); break;
+            case 'r': s.push_back('\r'); break;
+            case 't': s.push_back('\t'); break;
+            case 'u': appendUtf8(parseCodePoint(), s); break;
+            default: --p; error("Invalid escape sequence");
+            }
+        }
+    }
+
+    // Parse a number.
+    // Only the JSON number grammar is accepted, so forms that strtod
+    // also understands (hexadecimal, inf, nan, leading +) are rejected.
+    double parseNumber()
+    {
+        const auto isDigit = [](char c) {return c>='0' && c<='9';};
+        const char* q = p;
+        if(*q == '-') {
+            ++q;
+        }
+        if(*q == '0') {
+            ++q;
+        } else if(isDigit(*q)) {
+            while(isDigit(*q)) {
+                ++q;
+            }
+        } else {
+            error("Expected a number");
+        }
+        if(*q == '.') {
+            ++q;
+            if(!isDigit(*q)) {
+                error("Invalid number");
+            }
+            while(isDigit(*q)) {
+                ++q;
+            }
+        }
+        if(*q=='e' || *q=='E') {
+            ++q;
+            if(*q=='+' || *q=='-') {
+                ++q;
+            }
+            if(!isDigit(*q)) {
+                error("Invalid number");
+            }
+            while(isDigit(*q)) {
+                ++q;
+            }
+        }
+
+        // Now convert it. strtod must stop at the same place.
+        char* numberEnd;
+        const double x = std::strtod(p, &numberEnd);
+        if(numberEnd != q) {
+            error("Invalid number");
+        }
+        p = numberEnd;
+        return x;
+    }
+
+    // Parse a string, number, true, false, or null, and store its text.
+    void parseScalar(string& s)
+    {
+        if(*p == '"') {
+            parseString(s);
+            return;
+        }
+        const char* scalarBegin = p;
+        if(*p=='-' || (*p>='0' && *p<='9')) {
+            parseNumber();
+        } else if(!(parseKeyword("true") || parseKeyword("false") || parseKeyword("null"))) {
+            error("Expected a string, number, true, false, or null");
+        }
+        s.assign(scalarBegin, p);
+    }
+
+    // Skip a value of any type.
+    void skipValue()
+    {
+        skipBlanks();
+        if(*p == '{') {
+            parseObject([this](const string&) {skipValue();});
+        } else if(*p == '[') {
+            ++p;
+            skipBlanks();
+            if(*p == ']') {
+                ++p;
+                return;
+            }
+            while(true) {
+                skipValue();
+                skipBlanks();
+                if(*p == ',') {
+                    ++p;
+                } else {
+                    expect(']');
+                    return;
+                }
+            }
+        } else {
+            string s;
+            parseScalar(s);
+        }
+    }
+
+    // Check that nothing other than blanks is left.
+    void expectEnd()
+    {
+        skipBlanks();
+        if(*p != 0) {
+            error("Unexpected characters after the end of the JSON object");
+        }
+    }
+
+    void skipBlanks()
+    {
+        while(*p==' ' || *p=='\t' || *p=='\r' || *p=='\n') {
+            ++p;
+        }
+    }
+
+    char peek() const
+    {
+        return *p;
+    }
+
+    void error(const string& message) const
+    {
+        throw runtime_error(message + " at position " + lexical_cast<string>(p - begin));
+    }
+
+private:
+    const char* p;
+    const char* begin;
+
+    void expect(char c)
+    {
+        skipBlanks();
+        if(*p != c) {
+            error(string("Expected '") + c + "'");
+        }
+        ++p;
+    }
+
+    bool parseKeyword(const char* keyword)
+    {
+        const char* q = p;
+        for(; *keyword; ++keyword, ++q) {
+            if(*q != *keyword) {
+                return false;
+            }
+        }
+        p = q;
+        return true;
+    }
+
+    // Parse the four hex digits following \u, and a low surrogate if needed.
+    uint32_t parseCodePoint()
+    {
+        uint32_t codePoint = parseHex4();
+        if(codePoint>=0xd800 && codePoint<0xdc00) {
+            if(p[0]!='\\' || p[1]!='u') {
+                error("Invalid surrogate pair");
+            }
+            p += 2;
+            const uint32_t low = parseHex4();
+            if(low<0xdc00 || low>=0xe000) {
+                error("Invalid surrogate pair");
+            }
+            codePoint = 0x10000 + ((codePoint - 0xd800) << 10) + (low - 0xdc00);
+        }
+        return codePoint;
+    }
+    uint32_t parseHex4()
+    {
+        uint32_t x = 0;
+        for(int i=0; i<4; i++, ++p) {
+            const char c = *p;
+            x <<= 4;
+            if(c>='0' && c<='9') {
+                x += uint32_t(c - '0');
+            } else if(c>='a' && c<='f') {
+                x += uint32_t(c - 'a' + 10);
+            } else if(c>='A' && c<='F') {
+                x += uint32_t(c - 'A' + 10);
+            } else {
+                error("Invalid unicode escape");
+            }
+        }
+        return x;
+    }
+    static void appendUtf8(uint32_t c, string& s)
+    {
+        if(c < 0x80) {
+            s.push_back(char(c));
+        } else if(c < 0x800) {
+            s.push_back(char(0xc0 | (c >> 6)));
+            s.push_back(char(0x80 | (c & 0x3f)));
+        } else if(c < 0x10000) {
+            s.push_back(char(0xe0 | (c >> 12)));
+            s.push_back(char(0x80 | ((c >> 6) & 0x3f)));
+            s.push_back(char(0x80 | (c & 0x3f)));
+        } else {
+            s.push_back(char(0xf0 | (c >> 18)));
+            s.push_back(char(0x80 | ((c >> 12) & 0x3f)));
+            s.push_back(char(0x80 | ((c >> 6) & 0x3f)));
+            s.push_back(char(0x80 | (c & 0x3f)));
+        }
+    }
+};
+
+
+
+size_t ExpressionMatrix::addCellsFromJsonLines(const string& fileName, size_t batchSize)
+{
+    if(batchSize == 0) {
+        batchSize = 1;
+    }
+    GzipLineReader reader(fileName);
+    Ingestion ingestion(*this);
+
+    // The cells being accumulated, with per-cell meta data.
+    // Gene indexes in the block refer to block.geneNames,
+    // and geneIndexMap is the inverse of block.geneNames.
+    CellBlock block;
+    vector< vector< pair<string, string> > > blockCellMetaData;
+    std::unordered_map<string, uint32_t> geneIndexMap;
+    std::unordered_set<string> blockCellNames;
+    const vector< pair<string, string> > noSharedMetaData;
+    vector<GeneId> geneIdTable;
+    vector<string> newGeneNames;
+
+    // Add the accumulated cells.
+    size_t addedCellCount = 0;
+    const auto flush = [&]()
+    {
+        if(block.cellCount() > 0) {
+            getGeneIdTable(block.geneNames, geneIdTable, newGeneNames);
+            addCellBlock(block.cellNames, noSharedMetaData,
+                block.indptr.data(), block.geneIndexes.data(), block.values.data(),
+                geneIdTable.data(), geneIdTable.size(), &blockCellMetaData, &newGeneNames);
+            addedCellCount += block.cellCount();
+            commitIngestionIfNeeded();
+        }
+        block.clear();
+        blockCellMetaData.clear();
+        geneIndexMap.clear();
+        blockCellNames.clear();
+    };
+
+    // Variables used to process one line, defined here to reduce memory allocation.
+    string cellName;
+    vector< pair<string, string> > metaData;
+    string key;
+    string value;
+    vector<uint32_t> lineGeneIndexes;
+    vector<float> lineValues;
+    vector<uint32_t> sortedLineGeneIndexes;
+
+    // Main loop over lines.
+    size_t errorCount = 0;
+    size_t skippedCellCount = 0;
+    char* line;
+    size_t lineLength;
+    while(reader.getLine(line, lineLength)) {
+        const size_t lineNumber = reader.lineNumber();
+        const size_t oldGeneCount = block.geneNames.size();
+
+        try {
+            Json::Parser parser(line);
+            parser.skipBlanks();
+            if(parser.peek() == 0) {
+                continue;   // Skip empty lines.
+            }
+
+            // Parse the line.
+            cellName.clear();
+            metaData.clear();
+            lineGeneIndexes.clear();
+            lineValues.clear();
+            bool metaDataFound = false;
+            bool cellNameFound = false;
+            bool expressionCountsFound = false;
+            parser.parseObject([&](const string& topLevelKey)
+            {
+                if(topLevelKey == "metaData") {
+                    metaDataFound = true;
+                    parser.parseObject([&](const string& metaDataName)
+                    {
+                        if(parser.peek()=='{' || parser.peek()=='[') {
+                            parser.error("Invalid value for meta data " + metaDataName);
+                        }
+                        parser.parseScalar(value);
+                        if(metaDataName == "CellName") {
+                            cellName = value;
+                            cellNameFound = true;
+                        } else {
+                            metaData.push_back(make_pair(metaDataName, value));
+                        }
+                    });
+                } else if(topLevelKey == "expressionCounts") {
+                    expressionCountsFound = true;
+                    parser.parseObject([&](const string& geneName)
+                    {
+                        const double count = parser.parseNumber();
+                        if(!(count >= 0.) || count > double(std::numeric_limits<float>::max())) {
+                            parser.error("Invalid expression count for gene " + geneName);
+                        }
+                        const auto it = geneIndexMap.insert(
+                            make_pair(geneName, uint32_t(block.geneNames.size()))).first;
+                        if(it->second == block.geneNames.size()) {
+                            block.geneNames.push_back(geneName);
+                        }
+                        lineGeneIndexes.push_back(it->second);
+                        lineValues.push_back(float(count));
+                    });
+                } else {
+                    parser.skipValue();
+                }
+            });
+            parser.expectEnd();
+
+            // Check that we have what we need.
+            if(!metaDataFound) {
+                throw runtime_error("Missing metaData");
+            }
+            if(!expressionCountsFound) {
+                throw runtime_error("Missing expressionCounts");
+            }
+            if(!cellNameFound) {
+                throw runtime_error("Missing CellName meta data");
+            }
+            if(skipCellDuringIngestion(cellName)) {
+                ++skippedCellCount;
+                for(size_t i=oldGeneCount; i<block.geneNames.size(); i++) {
+                    geneIndexMap.erase(block.geneNames[i]);
+                }
+                block.geneNames.resize(oldGeneCount);
+                continue;
+            }
+            if(cellNames(cellName) != invalidCellId || blockCellNames.count(cellName)) {
+                throw runtime_error("Cell name " + cellName + " already exists");
+            }
+            sortedLineGeneIndexes = lineGeneIndexes;
+            sort(sortedLineGeneIndexes.begin(), sortedLineGeneIndexes.end());
+            const auto it = adjacent_find(sortedLineGeneIndexes.begin(), sortedLineGeneIndexes.end());
+            if(it != sortedLineGeneIndexes.end()) {
+                throw runtime_error("Duplicate expression count for gene " + block.geneNames[*it]);
+            }
+
+        } catch(const std::exception& e) {
+
+            // Report the error and forget any genes added by this line.
+            cout << "Skipped line " << lineNumber << " of " << fileName << ": " << e.what() << endl;
+            ++errorCount;
+            for(size_t i=oldGeneCount; i<block.geneNames.size(); i++) {
+                geneIndexMap.erase(block.geneNames[i]);
+            }
+            block.geneNames.resize(oldGeneCount);
+            continue;
+        }
+
+        // The line is valid. Stage the cell.
+        block.beginCell(cellName);
+        for(size_t i=0; i<lineGeneIndexes.size(); i++) {
+            block.addExpressionCount(lineGeneIndexes[i], lineValues[i]);
+        }
+        blockCellMetaData.push_back(metaData);
+        blockCellNames.insert(cellName);
+        if(block.cellCount() >= batchSize) {
+            flush();
+        }
+    }
+    flush();
+    ingestion.commit();
+
+    cout << timestamp << "Added " << addedCellCount << " cells from " << fileName;
+    if(errorCount) {
+        cout << ", skipped " << errorCount << " lines with errors";
+    }
+    if(skippedCellCount) {
+        cout << ", skipped " << skippedCellCount << " cells that were already added";
+    }
+    cout << "." << endl;
+    cout << "There are " << cellCount() << " cells and " << geneCount() << " genes." << endl;
+    return addedCellCount;
+}
@@ -23,14 +23,18 @@
 
 #include "ExpressionMatrix.hpp"
 #include "BitSet.hpp"
+#include "CellExpressionCache.hpp"
 #include "charikar.hpp"
 #include "ExpressionMatrixSubset.hpp"
 #include "heap.hpp"
 #include "iterator.hpp"
+#include "KnnGraph.hpp"
 #include "Lsh.hpp"
+#include "LshBuckets.hpp"
 #include "multipleSetUnion.hpp"
 #include "nextPowerOfTwo.hpp"
 #include "orderPairs.hpp"
+#include "runThreads.hpp"
 #include "SimilarPairs.hpp"
 #include "timestamp.hpp"
 using namespace ChanZuckerberg;
@@ -42,9 +46,13 @@ using namespace ExpressionMatrix2;
 #include <boost/random/variate_generator.hpp>
 
 #include "algorithm.hpp"
+#include "array.hpp"
 #include <cmath>
 #include "fstream.hpp"
+#include "tuple.hpp"
+#include <atomic>
 #include <chrono>
+#include <mutex>
 #include <numeric>
 #include <queue>
 
@@ -65,7 +73,7 @@ void ExpressionMatrix::analyzeSimilarPairs(
     // for exact similarity computations.
     const string expressionMatrixSubsetName = directoryName + "/tmp-ExpressionMatrixSubset-" + similarPairsName;
     ExpressionMatrixSubset expressionMatrixSubset(
-        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts);
+        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts, compressedCellExpressionCounts);
 
     // Open the output csv file.
     ofstream csvOut(similarPairsName + "-analysis.csv");
@@ -159,7 +167,8 @@ void ExpressionMatrix::findSimilarPairs4(
     size_t k,                       // The maximum number of similar pairs to be stored for each cell.
     double similarityThreshold,     // The minimum similarity for a pair to be stored.
     size_t lshCount,                // The number of LSH vectors to use.
-    unsigned int seed               // The seed used to generate the LSH vectors.
+    unsigned int seed,              // The seed used to generate the LSH vectors.
+    size_t threadCount              // The number of threads to use (0 to use all hardware threads).
     )
 {
     out << timestamp << "ExpressionMatrix::findSimilarPairs4 begins." << endl;
@@ -190,98 +199,146 @@ void ExpressionMatrix::findSimilarPairs4(
     const string expressionMatrixSubsetName =
         directoryName + "/tmp-ExpressionMatrixSubset-" + similarPairsName;
     ExpressionMatrixSubset expressionMatrixSubset(
-        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts);
+        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts, compressedCellExpressionCounts);
 
     // Create the Lsh object that will do the computation.
-    Lsh lsh(directoryName + "/tmp-Lsh", expressionMatrixSubset, lshCount, seed);
+    threadCount = getThreadCount(threadCount);
+    Lsh lsh(directoryName + "/tmp-Lsh", expressionMatrixSubset, lshCount, seed, threadCount);
 
-    // Temporary storage of pairs for each cell.
-    vector< vector< pair<CellId, float> > > tmp(cellCount);
-    const size_t tmpStore = 2 * k;
-    for(auto& v: tmp) {
-        v.reserve(tmpStore);
-    }
+    // Pairs are stored if their similarity exceeds similarityThreshold,
+    // that is, if their mismatch count is less than mismatchCountBound.
+    const uint32_t mismatchCountBound = lsh.computeMismatchCountBound(similarityThreshold);
 
-    // Current similarity threshold for each cell.
-    vector<float> cellThreshold(cellCount, float(similarityThreshold));
+    // Create the SimilarPairs object that will contain the results.
+    out << timestamp << "Initializing SimilarPairs object." << endl;
+    SimilarPairs similarPairs(directoryName + "/SimilarPairs-" + similarPairsName, k, geneSet, cellSet);
 
 
 
-    // Loop over all pairs. This is much faster than findSimilarPairs0
-    // (around 15 ns per pair when using LSH vectors of 1024 bits), but
+    // Loop over all pairs. This is much faster than findSimilarPairs0, but
     // still scales like the square of the number of cells in the cell set.
-    // This loops in blocks of cells for better memory locality than a simple
-    // loop over cell pairs.
-    out << timestamp << "Begin computing similarities for all cell pairs." << endl;
+    // The loop is organized in tiles: each thread works on a row tile of cells
+    // and loops over column tiles small enough for their signatures
+    // to stay in the L1 cache while all the cells of the row tile
+    // are compared against them.
+    // Only the upper triangle is computed (cell1 > cell0), so each unordered pair
+    // is computed once and added to the neighbors of both cells.
+    // The best k neighbors of each cell are kept in a max-heap of
+    // pair(mismatchCount, cellId1), so the worst of the k neighbors is at the top.
+    // Any thread can update the heap of any cell, so the heaps
+    // are protected by a set of mutexes. To avoid locking for most pairs,
+    // heapTop stores for each cell the top of its heap once it is full
+    // (encoded as mismatchCount<<32 | cellId1), which only decreases.
+    // Neighbors are ordered by mismatch count, then by cell id,
+    // so the result does not depend on the number of threads or tile sizes.
+    vector< vector< pair<uint32_t, CellId> > > neighbors(cellCount);
+    const std::less< pair<uint32_t, CellId> > comparator;
+    std::unique_ptr< std::atomic<uint64_t>[] > heapTop(new std::atomic<uint64_t>[cellCount]);
+    for(CellId cellId=0; cellId!=cellCount; cellId++) {
+        heapTop[cellId].store(std::numeric_limits<uint64_t>::max(), std::memory_order_relaxed);
+    }
+    vector<std::mutex> mutexes(4096);
+    const auto addNeighbor = [&](CellId cellId, uint32_t mismatchCount, CellId neighborCellId)
+    {
+        const uint64_t encodedNeighbor = (uint64_t(mismatchCount) << 32) | neighborCellId;
+        if(encodedNeighbor >= heapTop[cellId].load(std::memory_order_relaxed)) {
+            return;
+        }
+        const pair<uint32_t, CellId> neighbor(mismatchCount, neighborCellId);
+        std::lock_guard<std::mutex> lock(mutexes[cellId % mutexes.size()]);
+        auto& v = neighbors[cellId];
+        if(v.size() < k) {
+            if(v.capacity() == 0) {
+                v.reserve(k);
+            }
+            v.push_back(neighbor);
+            std::push_heap(v.begin(), v.end(), comparator);
+        } else if(!v.empty() && comparator(neighbor, v.front())) {
+            popAndPushHeap(v.begin(), v.end(), neighbor, comparator);
+        } else {
+            return;
+        }
+        if(v.size() == k) {
+            heapTop[cellId].store((uint64_t(v.front().first) << 32) | v.front().second,
+                std::memory_order_relaxed);
+        }
+    };
+
+    const size_t signatureBytes = 8 * lsh.wordCount();
+    const CellId columnTileSize = CellId(max(size_t(64), size_t(32*1024) / signatureBytes));
+    const CellId rowTileSize = 256;
+    const size_t rowTileCount = (size_t(cellCount) + rowTileSize - 1) / rowTileSize; // Does not underflow for 0 cells.
+    out << timestamp << "Begin computing similarities for all cell pairs using " <<
+        threadCount << " threads." << endl;
+    out << "Tile size is " << rowTileSize << " by " << columnTileSize << " cells." << endl;
     const auto t0 = std::chrono::steady_clock::now();
-    const CellId blockSize = 64;
-    size_t pairCount = 0;
-    size_t totalPairCount = size_t(cellCount)*(size_t(cellCount-1))/2;
-    size_t blockCount = 0;
-    for(CellId begin0=0; begin0<cellCount; begin0+=blockSize) {
-        const CellId end0 = min(begin0+blockSize, cellCount);
-        for(CellId begin1=0; begin1<=begin0; begin1+=blockSize) {
-            if(blockCount>0 && ((blockCount%1000000)==0)) {
-                out << timestamp << "Pair computation ";
-                out << 100.*double(pairCount)/double(totalPairCount);
-                out << "% complete." << endl;
+    BatchDispatcher batchDispatcher(cellCount, rowTileSize);
+    runThreads(threadCount, [&](size_t threadId)
+    {
+        vector<uint32_t> mismatchCounts(columnTileSize);
+
+        size_t begin0, end0;
+        while(batchDispatcher.getBatch(begin0, end0)) {
+            if(threadId == 0) {
+                const size_t rowTileId = begin0 / rowTileSize;
+                if(rowTileId>0 && (rowTileId % 100)==0) {
+                    out << timestamp << "Working on row tile " << rowTileId <<
+                        " of " << rowTileCount << endl;
+                }
             }
-            ++blockCount;
-            const CellId end1 = min(begin1+blockSize, end0);
-            for(CellId cell0=begin0; cell0!=end0; ++cell0) {
-                auto& tmp0 = tmp[cell0];
-                for(CellId cell1=begin1; cell1!=end1 && cell1<cell0; ++cell1) {
-                    auto& tmp1 = tmp[cell1];
-                    ++pairCount;
-
-                    // Compute the LSH similarity between these two cells.
-                    const double similarity = lsh.computeCellSimilarity(cell0, cell1);
-
-                    // If the similarity is sufficient, pass it to the SimilarPairs container,
-                    // which will make the decision whether to store it, depending on the
-                    // number of pairs already stored for cellId0 and cellId1.
-                    if(similarity > similarityThreshold) {
-                        if(similarity > cellThreshold[cell0]) {
-                            tmp0.push_back(make_pair(cell1, similarity));
-                            if(tmp0.size() == tmpStore) {
-                                keepBest(tmp0, k, OrderPairsBySecondGreater< pair<CellId, float> >());
-                                cellThreshold[cell0] = tmp0.back().second;
-                            }
-                        }
-                        if(similarity > cellThreshold[cell1]) {
-                            tmp1.push_back(make_pair(cell0, similarity));
-                            if(tmp1.size() == tmpStore) {
-                                keepBest(tmp1, k, OrderPairsBySecondGreater< pair<CellId, float> >());
-                                cellThreshold[cell1] = tmp1.back().second;
-                            }
+
+            // Loop over column tiles, starting at the diagonal.
+            for(CellId begin1=CellId(begin0); begin1<cellCount; begin1+=columnTileSize) {
+                const CellId end1 = min(begin1+columnTileSize, cellCount);
+
+                // Loop over cells of the row tile.
+                for(CellId cell0=CellId(begin0); cell0!=CellId(end0); ++cell0) {
+
+                    // Only use cells of the column tile with cell1 > cell0.
+                    const CellId begin1ForCell0 = max(begin1, cell0 + 1);
+                    if(begin1ForCell0 >= end1) {
+                        continue;
+                    }
+                    lsh.computeMismatchCounts(cell0, begin1ForCell0, end1, mismatchCounts.data());
+
+                    // Loop over cells of the column tile.
+                    for(CellId cell1=begin1ForCell0; cell1!=end1; ++cell1) {
+                        const uint32_t mismatchCount = mismatchCounts[cell1 - begin1ForCell0];
+                        if(mismatchCount < mismatchCountBound) {
+                            addNeighbor(cell0, mismatchCount, cell1);
+                            addNeighbor(cell1, mismatchCount, cell0);
                         }
                     }
                 }
             }
         }
-    }
-    // Keep at most k of each.
-    for(auto& tmp0: tmp) {
-        if(tmp0.size() > k) {
-            keepBest(tmp0, k, OrderPairsBySecondGreater< pair<CellId, float> >());
+    });
+
+    // Store the neighbors of each cell, sorted by decreasing similarity.
+    // Each cell owns its own block of k slots in the SimilarPairs object,
+    // so no synchronization is necessary.
+    BatchDispatcher storeBatchDispatcher(cellCount, rowTileSize);
+    runThreads(threadCount, [&](size_t)
+    {
+        size_t begin0, end0;
+        while(storeBatchDispatcher.getBatch(begin0, end0)) {
+            for(CellId cell0=CellId(begin0); cell0!=CellId(end0); ++cell0) {
+                auto& neighbors0 = neighbors[cell0];
+                std::sort_heap(neighbors0.begin(), neighbors0.end(), comparator);
+                for(const auto& neighbor: neighbors0) {
+                    similarPairs.addUnsymmetricNoCheck(cell0, neighbor.second, lsh.getSimilarity(neighbor.first));
+                }
+                vector< pair<uint32_t, CellId> >().swap(neighbors0);
+            }
         }
-    }
+    });
     const auto t1 = std::chrono::steady_clock::now();
     const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
-    CZI_ASSERT(pairCount == totalPairCount);
     out << "Time for all pairs: " << t01 << " s." << endl;
-    out << "Time per pair: " << t01/(0.5*double(cellCount)*double(cellCount-1)) << " s." << endl;
-
-    // Store the pairs in a SimilarPairs object.
-    out << timestamp << "Initializing SimilarPairs object." << endl;
-    SimilarPairs similarPairs(directoryName + "/SimilarPairs-" + similarPairsName, k, geneSet, cellSet);
-    out << timestamp << "Copying similar pairs." << endl;
-    similarPairs.copy(tmp);
-
+    if(cellCount > 1) {
+        out << "Time per pair: " << t01/(0.5*double(cellCount)*double(cellCount-1)) << " s." << endl;
+    }
 
-    // Sort the similar pairs for each cell by decreasing similarity.
-    out << timestamp << "Sorting similar pairs." << endl;
-    similarPairs.sort();
     out << timestamp << "ExpressionMatrix::findSimilarPairs4 ends." << endl;
 
     lsh.remove();
@@ -294,11 +351,12 @@ void ExpressionMatrix::findSimilarPairs4(
     size_t k,                       // The maximum number of similar pairs to be stored for each cell.
     double similarityThreshold,     // The minimum similarity for a pair to be stored.
     size_t lshCount,                // The number of LSH vectors to use.
-    unsigned int seed               // The seed used to generate the LSH vectors.
+    unsigned int seed,              // The seed used to generate the LSH vectors.
+    size_t threadCount              // The number of threads to use (0 to use all hardware threads).
     )
 {
     findSimilarPairs4(cout, geneSetName, cellSetName, similarPairsName,
-        k, similarityThreshold, lshCount, seed);
+        k, similarityThreshold, lshCount, seed, threadCount);
 }
 
 
@@ -398,6 +456,7 @@ void ExpressionMatrix::findSimilarPairs5(
     // for this cell.
     size_t fullCellCount = 0;
     vector<CellId> candidates;
+    vector<uint32_t> candidateMismatchCounts;
     vector< const vector<CellId>* > setsToUnion;
     vector< pair<CellId, float> > cellNeighbors;    // The neighbors of a single cell.
     size_t totalCandidateCount = 0;
@@ -433,11 +492,13 @@ void ExpressionMatrix::findSimilarPairs5(
 
         // Check each of the candidates.
         cellNeighbors.clear();
-        for(const CellId cellId1: candidates) {
+        lsh.computeMismatchCounts(cellId0, candidates, candidateMismatchCounts);
+        for(size_t i=0; i<candidates.size(); i++) {
+            const CellId cellId1 = candidates[i];
             if(cellId1 == cellId0) {
                 continue;
             }
-            const double similarity = lsh.computeCellSimilarity(cellId0, cellId1);
+            const double similarity = lsh.getSimilarity(candidateMismatchCounts[i]);
             if(similarity > similarityThreshold) {
                 cellNeighbors.push_back(make_pair(cellId1, float(similarity)));
             }
@@ -512,7 +573,10 @@ void ExpressionMatrix::findSimilarPairs7(
     double similarityThreshold,     // The minimum similarity for a pair to be stored.
     const vector<int>& lshSliceLengths, // The number of bits in each LSH signature slice, in decreasing order.
     CellId maxCheck,                // Maximum number of cells to consider for each cell.
-    size_t log2BucketCount
+    size_t log2BucketCount,
+    const string& cellExpressionCacheName,  // If not empty, the CellExpressionCache used to rerank candidates.
+    size_t rerankCount,             // The number of LSH candidates of each cell to rerank.
+    size_t threadCount              // The number of threads to use, or 0 to use all hardware threads.
     )
 {
     cout << timestamp << "ExpressionMatrix::findSimilarPairs7 begins." << endl;
@@ -565,144 +629,472 @@ void ExpressionMatrix::findSimilarPairs7(
     // Create SimilarPairs object that will store the results.
     SimilarPairs similarPairs(directoryName + "/SimilarPairs-" + similarPairsName, k, geneSet, cellSet);
 
+    // If requested, access the CellExpressionCache used to rerank
+    // the LSH candidates of each cell by exact similarity.
+    // In that case, the best rerankCount candidates are found using LSH,
+    // and the best k of those by exact similarity are kept.
+    shared_ptr<CellExpressionCache> cellExpressionCache;
+    size_t candidateCount = k;
+    if(!cellExpressionCacheName.empty()) {
+        cellExpressionCache = make_shared<CellExpressionCache>(
+            directoryName + "/CellExpressionCache-" + cellExpressionCacheName);
+        if(!cellExpressionCache->isConsistentWith(geneSet, cellSet)) {
+            throw runtime_error("CellExpressionCache " + cellExpressionCacheName +
+                " is inconsistent with gene set " + geneSetName + " and cell set " + cellSetName);
+        }
+        candidateCount = max(k, rerankCount);
+        cout << "Reranking the best " << candidateCount << " LSH candidates of each cell." << endl;
+    }
 
 
-    // For each slice length and signature slice of that length,
-    // each cell is assigned to a bucket
-    // based on the value of its signature slice.
-    // The cells in each bucket will be stored in
-    // tables4[sliceLengthId][sliceId][bucketId],
-    // where:
-    // - sliceLengthId corresponds to the slice lengths to be used,
-    //   stored in lshSliceLengths in decreasing order.
-    // - sliceId identifies the particular slice of that length
-    //   (we have a total lshBitCount bits, which can be used
-    //   to form lshBitCount/lshSliceLength possible signature
-    //   slices each lshSliceLength bits in length).
-    // - bucketId identifies the bucket.
-    vector< vector< vector< vector<CellId> > > > table4;
-
-    // Vector to contain the signature bits of each signature slice.
-    // Indexed by [sliceLengthId][sliceId].
-    vector< vector< vector< size_t > > > sliceBits3;
-
-    // Assign cells to buckets.
-    findSimilarPairs7AssignCellsToBuckets(lsh, lshSliceLengths, sliceBits3, table4, log2BucketCount);
-
 
+    // Assign cells to buckets, or access the buckets
+    // created by a previous run with the same parameters.
+    // See LshBuckets.hpp for details.
+    LshBuckets lshBuckets;
+    lshBuckets.accessOrCreate(
+        LshBuckets::getName(directoryName + "/Lsh-" + lshName, lshSliceLengths, log2BucketCount),
+        lsh, lshSliceLengths, log2BucketCount, threadCount);
 
-    // Bit set to keep track which cellId1 cells we have already
-    // looked at, for a given cellId0.
-    BitSet cellMap(cellCount);
 
-    // Other vectors used over and over again for each cell.
-    vector<CellId> candidateNeighbors;
-    vector< pair<uint32_t, CellId> > neighbors; // pair(mismatchCount, cellId1)
 
-    const size_t mismatchCountThreshold =
-        lsh.computeMismatchCountThresholdFromSimilarityThreshold(similarityThreshold);
-    cout << "Mismatch count threshold is " << mismatchCountThreshold << endl;
+    // Pairs are stored if their similarity exceeds similarityThreshold,
+    // that is, if their mismatch count is less than mismatchCountBound.
+    const uint32_t mismatchCountBound = lsh.computeMismatchCountBound(similarityThreshold);
+    cout << "Mismatch count bound is " << mismatchCountBound << endl;
 
 
 
     // For each cell, look at cells in the same bucket.
     // Stop when we found enough similar cells.
-    cout << timestamp << "Finding similar cell pairs." << endl;
-    const uint64_t bucketCount = (1ULL << log2BucketCount);
-    const uint64_t bucketMask = bucketCount - 1ULL;
-    for(CellId cellId0=0; cellId0<cellCount; cellId0++) {
-        if(cellId0!=0 && (cellId0 % 1000)==0) {
-            cout << timestamp << "Working on cell " << cellId0 << " of " << cellCount << endl;
+    // Cells are processed in batches by threadCount threads.
+    // Each thread only writes to the SimilarPairs slots of the cells
+    // it is working on, and each cell owns its own block of k slots,
+    // so no synchronization is necessary.
+    threadCount = getThreadCount(threadCount);
+    cout << timestamp << "Finding similar cell pairs using " << threadCount << " threads." << endl;
+    const size_t batchSize = 1000;
+    BatchDispatcher batchDispatcher(cellCount, batchSize);
+    runThreads(threadCount, [&](size_t threadId)
+    {
+        // Bit set to keep track which cellId1 cells we have already
+        // looked at, for a given cellId0.
+        BitSet cellMap(cellCount);
+
+        // Other vectors used over and over again for each cell.
+        vector<CellId> candidateNeighbors;
+        vector<CellId> bucketCandidates;
+        vector<uint32_t> bucketMismatchCounts;
+        vector< MemoryAsContainer<const CellId> > buckets;
+        vector< pair<uint32_t, CellId> > neighbors;
+        neighbors.reserve(candidateCount);
+
+        // Work areas used for reranking.
+        vector<float> dense;
+        if(cellExpressionCache) {
+            dense.resize(cellExpressionCache->geneCount(), 0.);
         }
-        const BitSetPointer signature = lsh.getSignature(cellId0);
+        vector<CellId> rerankCellIds;
+        vector<double> rerankSimilarities;
+        vector< pair<double, CellId> > rerankedNeighbors;
+
+        size_t begin, end;
+        while(batchDispatcher.getBatch(begin, end)) {
+            for(CellId cellId0=CellId(begin); cellId0!=CellId(end); cellId0++) {
+                if(threadId==0 && cellId0!=0 && (cellId0 % 1000)==0) {
+                    cout << timestamp << "Working on cell " << cellId0 << " of " << cellCount << endl;
+                }
 
-        // Loop over slice lengths.
-        for(size_t sliceLengthId=0; sliceLengthId<sliceLengthCount; sliceLengthId++) {
-            const auto& table3 = table4[sliceLengthId];
-            const auto& sliceBits2 = sliceBits3[sliceLengthId];
+                // Find the best candidateCount neighbors of this cell.
+                findSimilarPairs7FindNeighbors(lsh, cellId0, candidateCount, mismatchCountBound,
+                    lshBuckets, maxCheck,
+                    cellMap, candidateNeighbors, bucketCandidates, bucketMismatchCounts, buckets, neighbors);
+
+                // Store.
+                if(!cellExpressionCache) {
+                    for(const auto& neighbor: neighbors) {
+                        const CellId cellId1 = neighbor.second;
+                        const uint32_t mismatchCount = neighbor.first;
+                        const double similarity = lsh.getSimilarity(mismatchCount);
+                        similarPairs.addUnsymmetricNoCheck(cellId0, cellId1, similarity);
+                    }
+                } else {
 
-            // Extract the slice length.
-            const size_t sliceLength = lshSliceLengths[sliceLengthId];
+                    // Rerank by exact similarity, then store the best k
+                    // by decreasing similarity, then by increasing cell id.
+                    rerankCellIds.clear();
+                    for(const auto& neighbor: neighbors) {
+                        rerankCellIds.push_back(neighbor.second);
+                    }
+                    cellExpressionCache->computeCellSimilarities(cellId0, rerankCellIds, dense, rerankSimilarities);
+                    rerankedNeighbors.clear();
+                    for(size_t i=0; i<rerankCellIds.size(); i++) {
+                        if(rerankSimilarities[i] > similarityThreshold) {
+                            rerankedNeighbors.push_back(make_pair(-rerankSimilarities[i], rerankCellIds[i]));
+                        }
+                    }
+                    sort(rerankedNeighbors.begin(), rerankedNeighbors.end());
+                    if(rerankedNeighbors.size() > k) {
+                        rerankedNeighbors.resize(k);
+                    }
+                    for(const auto& neighbor: rerankedNeighbors) {
+                        similarPairs.addUnsymmetricNoCheck(cellId0, neighbor.second, -neighbor.first);
+                    }
+                }
+            }
+        }
+    });
 
-            // Compute the number of possible slices for this length.
-            const size_t sliceCount = lshBitCount / sliceLength;
 
-            // Loop over all possible signature slices of this length.
-            for(size_t sliceId=0; sliceId<sliceCount; sliceId++) {
-                const auto& table2 = table3[sliceId];
-                const auto& sliceBits1 = sliceBits2[sliceId];
+    const auto t1 = std::chrono::steady_clock::now();
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    cout << timestamp << "ExpressionMatrix::findSimilarPairs7 ends. Took " << t01 << " s." << endl;
+}
 
-                // Extract this signature slice for this cell.
-                const uint64_t signatureSlice = signature.getBits(sliceBits1);
 
-                // Find the bucket that corresponds to this signature slice.
-                const uint64_t bucketId =
-                    (sliceLength<log2BucketCount) ?
-                    signatureSlice :
-                    (MurmurHash64A(&signatureSlice, 8, 231) & bucketMask);
-                CZI_ASSERT(bucketId < table2.size());
-                const auto& table1 = table2[bucketId];
 
-                // Loop over cells in the same bucket.
-                for(const CellId cellId1: table1) {
-                    if(cellId1 == cellId0){
-                        continue;
-                    }
-                    if(cellMap.get(cellId1)) {
-                        continue;   // We already looked at this one.
-                    }
-                    cellMap.set(cellId1);
-                    candidateNeighbors.push_back(cellId1);
-                    const uint32_t mismatchCount = uint32_t(lsh.computeMismatchCount(cellId0, cellId1));
-                    if(mismatchCount < mismatchCountThreshold) {
-                        neighbors.push_back(make_pair(mismatchCount, cellId1));
-                    }
-                    if(candidateNeighbors.size() == maxCheck) {
-                        break;
+// Update an existing SimilarPairs object created by findSimilarPairs7
+// after cells were added to the cell set it was created for.
+// The cell set must consist of the cell set used to create
+// the SimilarPairs object, followed by the new cells.
+// The Lsh object used to create the SimilarPairs object is extended
+// with signatures for the new cells.
+// The best k neighbors of each new cell are found as in findSimilarPairs7,
+// and the new cells found are used to update in place
+// the similar pairs of the existing cells.
+// The new cells are also added to the LSH buckets stored by findSimilarPairs7,
+// without rewriting the existing buckets (see LshBuckets::appendCells).
+void ExpressionMatrix::updateSimilarPairs7(
+    const string& geneSetName,      // The name of the gene set to be used.
+    const string& cellSetName,      // The name of the cell set to be used.
+    const string& lshName,          // The name of the Lsh object to be extended.
+    const string& similarPairsName, // The name of the SimilarPairs object to be updated.
+    double similarityThreshold,     // The minimum similarity for a pair to be stored.
+    const vector<int>& lshSliceLengths, // The number of bits in each LSH signature slice, in decreasing order.
+    CellId maxCheck,                // Maximum number of cells to consider for each cell.
+    size_t log2BucketCount,
+    size_t threadCount              // The number of threads to use, or 0 to use all hardware threads.
+    )
+{
+    cout << timestamp << "ExpressionMatrix::updateSimilarPairs7 begins." << endl;
+    const auto t0 = std::chrono::steady_clock::now();
+
+    // Locate the gene set and verify that it is not empty.
+    const auto itGeneSet = geneSets.find(geneSetName);
+    if(itGeneSet == geneSets.end()) {
+        throw runtime_error("Gene set " + geneSetName + " does not exist.");
+    }
+    const GeneSet& geneSet = itGeneSet->second;
+    if(geneSet.size() == 0) {
+        throw runtime_error("Gene set " + geneSetName + " is empty.");
+    }
+
+    // Locate the cell set and verify that it is not empty.
+    const auto& it = cellSets.cellSets.find(cellSetName);
+    if(it == cellSets.cellSets.end()) {
+        throw runtime_error("Cell set " + cellSetName + " does not exist.");
+    }
+    const MemoryMapped::Vector<CellId>& cellSet = *(it->second);
+    const CellId cellCount = CellId(cellSet.size());
+    if(cellCount == 0) {
+        throw runtime_error("Cell set " + cellSetName + " is empty.");
+    }
+
+    // Access the SimilarPairs object and the Lsh object with write access,
+    // and check that they are consistent.
+    SimilarPairs similarPairs(directoryName + "/SimilarPairs-" + similarPairsName, false, true);
+    if(!(similarPairs.getGeneSet() == geneSet)) {
+        throw runtime_error("SimilarPairs object " + similarPairsName + " was not created using gene set " + geneSetName);
+    }
+    const CellId oldCellCount = similarPairs.cellCount();
+    Lsh lsh(directoryName + "/Lsh-" + lshName, true);
+    if(lsh.cellCount() != oldCellCount) {
+        throw runtime_error("LSH object " + lshName + " has a number of cells inconsistent with SimilarPairs object " + similarPairsName +
+            ". This can happen if a previous update was interrupted. Recreate the LSH object using computeLshSignatures.");
+    }
+    if(cellCount < oldCellCount) {
+        throw runtime_error("Cell set " + cellSetName + " has fewer cells than SimilarPairs object " + similarPairsName);
+    }
+    const CellSet& oldCellSet = similarPairs.getCellSet();
+    if(!std::equal(oldCellSet.begin(), oldCellSet.end(), cellSet.begin())) {
+        throw runtime_error("Cell set " + cellSetName + " was not obtained by appending cells "
+            "to the cell set used by SimilarPairs object " + similarPairsName);
+    }
+    if(cellCount == oldCellCount) {
+        cout << timestamp << "No new cells. ExpressionMatrix::updateSimilarPairs7 ends." << endl;
+        return;
+    }
+    const CellId newCellCount = cellCount - oldCellCount;
+    cout << "Updating similar pairs for " << newCellCount << " new cells." << endl;
+
+    // Extend the Lsh object and its buckets before the SimilarPairs object.
+    // The SimilarPairs object is extended last, so if the update is interrupted
+    // before that it still describes the old cells, and the check above
+    // reports the inconsistency with the Lsh object.
+
+    // Compute LSH signatures for the new cells only.
+    {
+        CellSet newCellSet;
+        newCellSet.createNew(directoryName + "/tmp-NewCells-" + similarPairsName);
+        for(CellId cellId=oldCellCount; cellId<cellCount; cellId++) {
+            newCellSet.push_back(cellSet[cellId]);
+        }
+        ExpressionMatrixSubset expressionMatrixSubset(
+            directoryName + "/tmp-ExpressionMatrixSubset-" + similarPairsName,
+            geneSet, newCellSet, cellExpressionCounts, compressedCellExpressionCounts);
+        lsh.appendCells(expressionMatrixSubset, threadCount);
+        newCellSet.remove();
+    }
+
+    // Access the buckets and add the new cells to them.
+    // If the buckets don't exist, they are created for all cells.
+    LshBuckets lshBuckets;
+    lshBuckets.accessOrCreate(
+        LshBuckets::getName(directoryName + "/Lsh-" + lshName, lshSliceLengths, log2BucketCount),
+        lsh, lshSliceLengths, log2BucketCount, threadCount);
+
+    // Extend the SimilarPairs object. The new cells have no pairs yet.
+    similarPairs.appendCells(cellSet);
+
+    const uint32_t mismatchCountBound = lsh.computeMismatchCountBound(similarityThreshold);
+    const size_t k = similarPairs.k();
+
+
+
+    // Find the neighbors of the new cells, using threadCount threads.
+    // Each thread stores the neighbors of the cells it works on, and
+    // also records the pairs that can be used to update the existing cells.
+    threadCount = getThreadCount(threadCount);
+    cout << timestamp << "Finding similar cell pairs for the new cells using " << threadCount << " threads." << endl;
+    vector< vector< tuple<CellId, CellId, uint32_t> > > threadUpdates(threadCount);
+    const size_t batchSize = 1000;
+    BatchDispatcher batchDispatcher(newCellCount, batchSize);
+    runThreads(threadCount, [&](size_t threadId)
+    {
+        BitSet cellMap(cellCount);
+        vector<CellId> candidateNeighbors;
+        vector<CellId> bucketCandidates;
+        vector<uint32_t> bucketMismatchCounts;
+        vector< MemoryAsContainer<const CellId> > buckets;
+        vector< pair<uint32_t, CellId> > neighbors;
+        neighbors.reserve(k);
+        auto& updates = threadUpdates[threadId];
+
+        size_t begin, end;
+        while(batchDispatcher.getBatch(begin, end)) {
+            for(CellId cellId0=CellId(oldCellCount+begin); cellId0!=CellId(oldCellCount+end); cellId0++) {
+                findSimilarPairs7FindNeighbors(lsh, cellId0, k, mismatchCountBound,
+                    lshBuckets, maxCheck,
+                    cellMap, candidateNeighbors, bucketCandidates, bucketMismatchCounts, buckets, neighbors);
+                for(const auto& neighbor: neighbors) {
+                    const CellId cellId1 = neighbor.second;
+                    const uint32_t mismatchCount = neighbor.first;
+                    similarPairs.addUnsymmetricNoCheck(cellId0, cellId1, lsh.getSimilarity(mismatchCount));
+                    if(cellId1 < oldCellCount) {
+                        updates.push_back(make_tuple(cellId1, cellId0, mismatchCount));
                     }
                 }
-                if(candidateNeighbors.size() == maxCheck) {
-                    break;
-                }
             }
-            if(candidateNeighbors.size() == maxCheck) {
-                break;
+        }
+    });
+
+
+
+    // Update the similar pairs of the existing cells.
+    // Only the existing cells that were found as neighbors of a new cell
+    // are touched. The updates are grouped by existing cell, and
+    // each group is merged into the pairs of that cell in a single pass,
+    // which keeps them sorted by decreasing similarity.
+    // Distinct existing cells are independent, so this is done in parallel.
+    vector< tuple<CellId, CellId, uint32_t> > updates;
+    for(const auto& v: threadUpdates) {
+        updates.insert(updates.end(), v.begin(), v.end());
+    }
+    sort(updates.begin(), updates.end());
+    vector<size_t> groupBegins;
+    for(size_t i=0; i<updates.size(); i++) {
+        if(i==0 || std::get<0>(updates[i]) != std::get<0>(updates[i-1])) {
+            groupBegins.push_back(i);
+        }
+    }
+    const size_t groupCount = groupBegins.size();
+    groupBegins.push_back(updates.size());
+    BatchDispatcher groupBatchDispatcher(groupCount, batchSize);
+    runThreads(threadCount, [&](size_t)
+    {
+        const OrderPairsBySecondGreaterThenByFirstLess<SimilarPairs::Pair> comparator;
+        vector<SimilarPairs::Pair> newPairs;
+        size_t begin, end;
+        while(groupBatchDispatcher.getBatch(begin, end)) {
+            for(size_t group=begin; group!=end; group++) {
+                newPairs.clear();
+                for(size_t i=groupBegins[group]; i!=groupBegins[group+1]; i++) {
+                    const auto& update = updates[i];
+                    newPairs.push_back(SimilarPairs::Pair(std::get<1>(update),
+                        SimilarPairs::CellSimilarity(lsh.getSimilarity(std::get<2>(update)))));
+                }
+                sort(newPairs.begin(), newPairs.end(), comparator);
+                similarPairs.addUnsymmetricSorted(std::get<0>(updates[groupBegins[group]]), newPairs);
             }
         }
+    });
+    cout << "Considered " << updates.size() << " updates of " << groupCount << " existing cells." << endl;
+
+    const auto t1 = std::chrono::steady_clock::now();
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    cout << timestamp << "ExpressionMatrix::updateSimilarPairs7 ends. Took " << t01 << " s." << endl;
+}
 
-        // Only keep the k best neighbors, then sort them.
-        // This is faster than sorting, then keeping the k best,
-        // because it avoids doing a complete sorting of all of the neighbors.
-        // Instead, keepBest uses std::nth_element, which does a partial sorting.
-        keepBest(neighbors, k, std::less< pair<uint32_t, CellId> >());
-        sort(neighbors.begin(), neighbors.end());
 
-        // Store.
-        for(const auto& neighbor: neighbors) {
-            const CellId cellId1 = neighbor.second;
-            const uint32_t mismatchCount = neighbor.first;
-            const double similarity = lsh.getSimilarity(mismatchCount);
-            similarPairs.addUnsymmetricNoCheck(cellId0, cellId1, similarity);
+
+// Find the best k neighbors of a cell, using the LSH buckets.
+// On return, neighbors contains pair(mismatchCount, cellId1) for the
+// best k neighbors, sorted by increasing mismatch count, then by cell id.
+// The remaining arguments are work areas owned by the calling thread,
+// so this can be called concurrently for distinct cells.
+void ExpressionMatrix::findSimilarPairs7FindNeighbors(
+    Lsh& lsh,
+    CellId cellId0,
+    size_t k,                       // The maximum number of neighbors.
+    uint32_t mismatchCountBound,    // Only neighbors with mismatch count less than this are used.
+    const LshBuckets& lshBuckets,
+    CellId maxCheck,                // Maximum number of cells to consider.
+    BitSet& cellMap,                // Must have all bits clear. Left in the same state on return.
+    vector<CellId>& candidateNeighbors,
+    vector<CellId>& bucketCandidates,
+    vector<uint32_t>& bucketMismatchCounts,
+    vector< MemoryAsContainer<const CellId> >& buckets,
+    vector< pair<uint32_t, CellId> >& neighbors)
+{
+    const size_t sliceLengthCount = lshBuckets.sliceLengthCount();
+    const auto& sliceBits3 = lshBuckets.getSliceBits();
+    const BitSetPointer signature = lsh.getSignature(cellId0);
+
+    // Find the buckets containing this cell, looping over slice lengths
+    // and over all possible signature slices of each length.
+    buckets.clear();
+    for(size_t sliceLengthId=0; sliceLengthId<sliceLengthCount; sliceLengthId++) {
+        const auto& sliceBits2 = sliceBits3[sliceLengthId];
+        const size_t sliceCount = lshBuckets.sliceCount(sliceLengthId);
+        for(size_t sliceId=0; sliceId<sliceCount; sliceId++) {
+
+            // Extract this signature slice for this cell
+            // and find the bucket that corresponds to it.
+            const uint64_t signatureSlice = signature.getBits(sliceBits2[sliceId]);
+            const uint64_t bucketId = lshBuckets.getBucketId(sliceLengthId, signatureSlice);
+            lshBuckets.getBucket(sliceLengthId, sliceId, bucketId, buckets);
         }
+    }
+
+    // Look at the cells in these buckets.
+    neighbors.clear();
+    findSimilarPairs7CheckBuckets(lsh, cellId0, k, mismatchCountBound, buckets, maxCheck,
+        cellMap, candidateNeighbors, bucketCandidates, bucketMismatchCounts, neighbors);
+    findSimilarPairs7SortNeighbors(cellMap, candidateNeighbors, neighbors);
+}
+
 
-        // Clean up our data structures so we can reuse them for the next cell.
-        for(const CellId cellId1: candidateNeighbors) {
-            cellMap.clear(cellId1);
+
+// Update the best k neighbors of a cell using the cells
+// in the given buckets, which are examined in order until
+// maxCheck cells have been considered for this cell.
+// This can be called repeatedly for the same cell, with different buckets.
+// Before the first call for a cell, neighbors must be empty.
+// It is kept as a max-heap of pair(mismatchCount, cellId1),
+// and findSimilarPairs7SortNeighbors must be called after the last call for the cell.
+// Returns true if maxCheck cells have been considered.
+// The remaining arguments are work areas owned by the calling thread,
+// so this can be called concurrently for distinct cells.
+bool ExpressionMatrix::findSimilarPairs7CheckBuckets(
+    Lsh& lsh,
+    CellId cellId0,
+    size_t k,                       // The maximum number of neighbors.
+    uint32_t mismatchCountBound,    // Only neighbors with mismatch count less than this are used.
+    const vector< MemoryAsContainer<const CellId> >& buckets,
+    CellId maxCheck,                // Maximum number of cells to consider.
+    BitSet& cellMap,                // Must have all bits clear. Left in the same state on return.
+    vector<CellId>& candidateNeighbors,
+    vector<CellId>& bucketCandidates,
+    vector<uint32_t>& bucketMismatchCounts,
+    vector< pair<uint32_t, CellId> >& neighbors)
+{
+    // The best k neighbors found so far,
+    // stored as a max-heap of pair(mismatchCount, cellId1),
+    // so the worst of the k neighbors is at the top.
+    const std::less< pair<uint32_t, CellId> > comparator;
+
+    if(candidateNeighbors.size() == maxCheck) {
+        return true;
+    }
+    for(const auto& bucket: buckets) {
+
+        // Gather the cells in this bucket that we did not already look at.
+        bucketCandidates.clear();
+        for(const CellId cellId1: bucket) {
+            if(cellId1 == cellId0){
+                continue;
+            }
+            if(cellMap.get(cellId1)) {
+                continue;   // We already looked at this one.
+            }
+            cellMap.set(cellId1);
+            candidateNeighbors.push_back(cellId1);
+            bucketCandidates.push_back(cellId1);
+            if(candidateNeighbors.size() == maxCheck) {
+                break;
+            }
         }
-        candidateNeighbors.clear();
-        neighbors.clear();
 
+        // Compute their mismatch counts all at once.
+        lsh.computeMismatchCounts(cellId0, bucketCandidates, bucketMismatchCounts);
+        for(size_t i=0; i<bucketCandidates.size(); i++) {
+            const uint32_t mismatchCount = bucketMismatchCounts[i];
+            if(mismatchCount < mismatchCountBound) {
+                const pair<uint32_t, CellId> neighbor(mismatchCount, bucketCandidates[i]);
+                if(neighbors.size() < k) {
+                    neighbors.push_back(neighbor);
+                    std::push_heap(neighbors.begin(), neighbors.end(), comparator);
+                } else if(!neighbors.empty() && comparator(neighbor, neighbors.front())) {
+                    popAndPushHeap(neighbors.begin(), neighbors.end(), neighbor, comparator);
+                }
+            }
+        }
+        if(candidateNeighbors.size() == maxCheck) {
+            return true;
+        }
     }
+    return false;
+}
 
 
-    const auto t1 = std::chrono::steady_clock::now();
-    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
-    cout << timestamp << "ExpressionMatrix::findSimilarPairs7 ends. Took " << t01 << " s." << endl;
+
+// Sort the neighbors found by findSimilarPairs7CheckBuckets for a cell
+// by increasing mismatch count, then by cell id,
+// and reset the work areas for the next cell.
+void ExpressionMatrix::findSimilarPairs7SortNeighbors(
+    BitSet& cellMap,
+    vector<CellId>& candidateNeighbors,
+    vector< pair<uint32_t, CellId> >& neighbors)
+{
+    const std::less< pair<uint32_t, CellId> > comparator;
+
+    // The heap contains the k best neighbors. Sort them.
+    // This gives the same result as keeping all neighbors,
+    // then keeping the k best, but without storing
+    // neighbors that will be discarded.
+    std::sort_heap(neighbors.begin(), neighbors.end(), comparator);
+
+    // Clean up our data structures so we can reuse them for the next cell.
+    for(const CellId cellId1: candidateNeighbors) {
+        cellMap.clear(cellId1);
+    }
+    candidateNeighbors.clear();
 }
 
 
 
-// In the initial phase of findSimilarPairs7, we assign cells to buckets.
+// Assign cells to buckets in memory. This is used by findSimilarPairs7Gpu.
+// The CPU versions use the persistent buckets of class LshBuckets instead.
 // For each slice length and signature slice of that length,
 // each cell is assigned to a bucket
 // based on the value of its signature slice.
@@ -827,6 +1219,188 @@ void ExpressionMatrix::findSimilarPairs7AssignCellsToBuckets(
 
 
 
+// Find similar cell pairs using multi-probe LSH.
+// Like findSimilarPairs7, but using a single slice length.
+// For each signature slice, in addition to the bucket corresponding
+// to the signature slice of the cell, we also probe the buckets
+// whose keys differ from it by up to probeRadius bits.
+// This way fewer slices (and therefore less memory and
+// less time to assign cells to buckets) are needed to achieve a given recall.
+// See Q. Lv, W. Josephson, Z. Wang, M. Charikar, K. Li,
+// "Multi-Probe LSH: Efficient Indexing for High-Dimensional Similarity Search", 2007.
+// Buckets are probed in order of increasing Hamming distance from the
+// signature slice of the cell: first the exact buckets of all the slices,
+// then all buckets at distance 1, and so on. This way, when maxCheck
+// is reached, we have already looked at the most promising candidates.
+void ExpressionMatrix::findSimilarPairs8(
+    const string& geneSetName,      // The name of the gene set to be used.
+    const string& cellSetName,      // The name of the cell set to be used.
+    const string& lshName,          // The name of the Lsh object to be used.
+    const string& similarPairsName, // The name of the SimilarPairs object to be created.
+    size_t k,                       // The maximum number of similar pairs to be stored for each cell.
+    double similarityThreshold,     // The minimum similarity for a pair to be stored.
+    size_t lshSliceLength,          // The number of bits in each LSH signature slice.
+    size_t probeRadius,             // The maximum number of slice bits flipped when probing buckets.
+    CellId maxCheck,                // Maximum number of cells to consider for each cell.
+    size_t log2BucketCount,
+    size_t threadCount              // The number of threads to use, or 0 to use all hardware threads.
+    )
+{
+    cout << timestamp << "ExpressionMatrix::findSimilarPairs8 begins." << endl;
+    const auto t0 = std::chrono::steady_clock::now();
+
+    // Locate the gene set and verify that it is not empty.
+    const auto itGeneSet = geneSets.find(geneSetName);
+    if(itGeneSet == geneSets.end()) {
+        throw runtime_error("Gene set " + geneSetName + " does not exist.");
+    }
+    const GeneSet& geneSet = itGeneSet->second;
+    if(geneSet.size() == 0) {
+        throw runtime_error("Gene set " + geneSetName + " is empty.");
+    }
+
+    // Locate the cell set and verify that it is not empty.
+    const auto& it = cellSets.cellSets.find(cellSetName);
+    if(it == cellSets.cellSets.end()) {
+        throw runtime_error("Cell set " + cellSetName + " does not exist.");
+    }
+    const MemoryMapped::Vector<CellId>& cellSet = *(it->second);
+    const CellId cellCount = CellId(cellSet.size());
+    if(cellCount == 0) {
+        throw runtime_error("Cell set " + cellSetName + " is empty.");
+    }
+
+    // Access the Lsh object that will do the computation.
+    Lsh lsh(directoryName + "/Lsh-" + lshName);
+    if(lsh.cellCount() != cellCount) {
+        throw runtime_error("LSH object " + lshName + " has a number of cells inconsistent with cell set " + cellSetName);
+    }
+    const size_t lshBitCount = lsh.lshCount();
+    cout << "Number of LSH signature bits is " << lshBitCount << endl;
+
+    // Check the slice length and probe radius.
+    if(lshSliceLength==0 || lshSliceLength>64 || lshSliceLength>lshBitCount) {
+        throw runtime_error("The slice length must be between 1 and 64 bits, "
+            "and no more than the number of LSH signature bits.");
+    }
+    // At radius 3 the number of probes per slice grows as the cube of the
+    // slice length (over 40000 for a 64 bit slice), so this is limited to 2.
+    if(probeRadius > 2) {
+        throw runtime_error("The probe radius can be at most 2.");
+    }
+    if(probeRadius > lshSliceLength) {
+        throw runtime_error("The probe radius cannot exceed the slice length.");
+    }
+
+    // Create SimilarPairs object that will store the results.
+    SimilarPairs similarPairs(directoryName + "/SimilarPairs-" + similarPairsName, k, geneSet, cellSet);
+
+    // Assign cells to buckets, or access the buckets created by a previous run,
+    // using the same buckets as findSimilarPairs7 with a single slice length.
+    const vector<int> lshSliceLengths(1, int(lshSliceLength));
+    LshBuckets lshBuckets;
+    lshBuckets.accessOrCreate(
+        LshBuckets::getName(directoryName + "/Lsh-" + lshName, lshSliceLengths, log2BucketCount),
+        lsh, lshSliceLengths, log2BucketCount, threadCount);
+    const auto& sliceBits2 = lshBuckets.getSliceBits().front();
+    const size_t sliceCount = lshBuckets.sliceCount(0);
+
+    // Generate the probe masks. The masks with radius r
+    // flip exactly r of the lshSliceLength bits of a signature slice.
+    vector<uint64_t> probeMasks(1, 0ULL);
+    for(size_t bit0=0; probeRadius>=1 && bit0<lshSliceLength; bit0++) {
+        probeMasks.push_back(1ULL << bit0);
+    }
+    for(size_t bit0=0; probeRadius>=2 && bit0<lshSliceLength; bit0++) {
+        for(size_t bit1=bit0+1; bit1<lshSliceLength; bit1++) {
+            probeMasks.push_back((1ULL << bit0) | (1ULL << bit1));
+        }
+    }
+    cout << "Number of slices is " << sliceCount << endl;
+    cout << "Number of buckets probed for each slice is " << probeMasks.size() << endl;
+
+    // Pairs are stored if their similarity exceeds similarityThreshold,
+    // that is, if their mismatch count is less than mismatchCountBound.
+    const uint32_t mismatchCountBound = lsh.computeMismatchCountBound(similarityThreshold);
+    cout << "Mismatch count bound is " << mismatchCountBound << endl;
+
+
+
+    // For each cell, look at cells in the probed buckets.
+    // Stop when we found enough similar cells.
+    // Cells are processed in batches by threadCount threads,
+    // as in findSimilarPairs7.
+    threadCount = getThreadCount(threadCount);
+    cout << timestamp << "Finding similar cell pairs using " << threadCount << " threads." << endl;
+    const size_t batchSize = 1000;
+    BatchDispatcher batchDispatcher(cellCount, batchSize);
+    runThreads(threadCount, [&](size_t threadId)
+    {
+        // Bit set to keep track which cellId1 cells we have already
+        // looked at, for a given cellId0.
+        BitSet cellMap(cellCount);
+
+        // Other vectors used over and over again for each cell.
+        vector<CellId> candidateNeighbors;
+        vector<CellId> bucketCandidates;
+        vector<uint32_t> bucketMismatchCounts;
+        vector<uint64_t> signatureSlices(sliceCount);
+        vector< MemoryAsContainer<const CellId> > buckets;
+        vector< pair<uint32_t, CellId> > neighbors;
+        neighbors.reserve(k);
+
+        size_t begin, end;
+        while(batchDispatcher.getBatch(begin, end)) {
+            for(CellId cellId0=CellId(begin); cellId0!=CellId(end); cellId0++) {
+                if(threadId==0 && cellId0!=0 && (cellId0 % 1000)==0) {
+                    cout << timestamp << "Working on cell " << cellId0 << " of " << cellCount << endl;
+                }
+
+                // Extract the signature slices for this cell.
+                const BitSetPointer signature = lsh.getSignature(cellId0);
+                for(size_t sliceId=0; sliceId<sliceCount; sliceId++) {
+                    signatureSlices[sliceId] = signature.getBits(sliceBits2[sliceId]);
+                }
+
+                // Probe the buckets in order of increasing probe radius, then by slice,
+                // and look at the cells in each bucket as in findSimilarPairs7.
+                // Stop as soon as maxCheck cells have been considered.
+                neighbors.clear();
+                bool done = false;
+                for(const uint64_t probeMask: probeMasks) {
+                    for(size_t sliceId=0; sliceId<sliceCount; sliceId++) {
+                        const uint64_t probedSlice = signatureSlices[sliceId] ^ probeMask;
+                        const uint64_t bucketId = lshBuckets.getBucketId(0, probedSlice);
+                        buckets.clear();
+                        lshBuckets.getBucket(0, sliceId, bucketId, buckets);
+                        done = findSimilarPairs7CheckBuckets(lsh, cellId0, k, mismatchCountBound, buckets, maxCheck,
+                            cellMap, candidateNeighbors, bucketCandidates, bucketMismatchCounts, neighbors);
+                        if(done) {
+                            break;
+                        }
+                    }
+                    if(done) {
+                        break;
+                    }
+                }
+                findSimilarPairs7SortNeighbors(cellMap, candidateNeighbors, neighbors);
+
+                // Store the neighbors, sorted by decreasing similarity.
+                for(const auto& neighbor: neighbors) {
+                    similarPairs.addUnsymmetricNoCheck(cellId0, neighbor.second, lsh.getSimilarity(neighbor.first));
+                }
+            }
+        }
+    });
+
+
+    const auto t1 = std::chrono::steady_clock::now();
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    cout << timestamp << "ExpressionMatrix::findSimilarPairs8 ends. Took " << t01 << " s." << endl;
+}
+
+
+
 // Find similar cell pairs using LSH and the Charikar algorithm.
 // See M. Charikar, "Similarity Estimation Techniques from Rounding Algorithms", 2002,
 // section "5. Approximate Nearest neighbor Search in Hamming Space.".
@@ -1151,7 +1725,8 @@ void ExpressionMatrix::computeLshSignatures(
     const string& cellSetName,      // The name of the cell set to be used.
     const string& lshName,          // The name of the Lsh object to be created.
     size_t lshCount,                // The number of LSH vectors to use.
-    unsigned int seed               // The seed used to generate the LSH vectors.
+    unsigned int seed,              // The seed used to generate the LSH vectors.
+    size_t threadCount              // The number of threads to use.
     )
 {
     cout << timestamp << "ExpressionMatrix::computeLshSignatures begins." << endl;
@@ -1182,16 +1757,148 @@ void ExpressionMatrix::computeLshSignatures(
     const string expressionMatrixSubsetName =
         directoryName + "/tmp-ExpressionMatrixSubset-" + lshName;
     ExpressionMatrixSubset expressionMatrixSubset(
-        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts);
+        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts, compressedCellExpressionCounts);
 
     // Create the Lsh object that will do the computation.
-    Lsh lsh(directoryName + "/Lsh-" + lshName, expressionMatrixSubset, lshCount, seed);
+    Lsh lsh(directoryName + "/Lsh-" + lshName, expressionMatrixSubset, lshCount, seed, threadCount);
 
     cout << timestamp << "ExpressionMatrix::computeLshSignatures ends." << endl;
 }
 
 
 
+// Create a compact copy of the expression counts of a cell set,
+// restricted to a gene set.
+// See CellExpressionCache.hpp for more information.
+void ExpressionMatrix::createCellExpressionCache(
+    const string& geneSetName,      // The name of the gene set to be used.
+    const string& cellSetName,      // The name of the cell set to be used.
+    const string& cellExpressionCacheName, // The name of the CellExpressionCache to be created.
+    bool quantize                   // If true, store expression counts as 8-bit codes.
+    )
+{
+    // Locate the gene set and verify that it is not empty.
+    const auto itGeneSet = geneSets.find(geneSetName);
+    if(itGeneSet == geneSets.end()) {
+        throw runtime_error("Gene set " + geneSetName + " does not exist.");
+    }
+    const GeneSet& geneSet = itGeneSet->second;
+    if(geneSet.size() == 0) {
+        throw runtime_error("Gene set " + geneSetName + " is empty.");
+    }
+
+    // Locate the cell set and verify that it is not empty.
+    const auto& it = cellSets.cellSets.find(cellSetName);
+    if(it == cellSets.cellSets.end()) {
+        throw runtime_error("Cell set " + cellSetName + " does not exist.");
+    }
+    const CellSet& cellSet = *(it->second);
+    if(cellSet.size() == 0) {
+        throw runtime_error("Cell set " + cellSetName + " is empty.");
+    }
+
+    cout << timestamp << "Creating cell expression cache " << cellExpressionCacheName << endl;
+    CellExpressionCache cellExpressionCache(
+        directoryName + "/CellExpressionCache-" + cellExpressionCacheName,
+        geneSet, cellSet, cellExpressionCounts, quantize);
+    cout << timestamp << "Cell expression cache " << cellExpressionCacheName << " created." << endl;
+}
+
+
+
+// Create a k-NN graph from the signatures of an existing Lsh object,
+// using NN-descent, and store it on disk.
+// See KnnGraph.hpp for more information.
+void ExpressionMatrix::createKnnGraph(
+    const string& lshName,          // The name of the Lsh object to be used.
+    const string& knnGraphName,     // The name of the KnnGraph object to be created.
+    size_t k,                       // The number of neighbors of each cell.
+    size_t maxIterationCount,       // The maximum number of NN-descent iterations.
+    unsigned int seed,              // The seed used to generate the initial random graph.
+    size_t threadCount              // The number of threads to use.
+    )
+{
+    cout << timestamp << "ExpressionMatrix::createKnnGraph begins." << endl;
+    Lsh lsh(directoryName + "/Lsh-" + lshName);
+    KnnGraph knnGraph(directoryName + "/KnnGraph-" + knnGraphName,
+        lsh, k, maxIterationCount, 0.001, seed, threadCount);
+    cout << timestamp << "ExpressionMatrix::createKnnGraph ends." << endl;
+}
+
+
+
+// Find similar cell pairs using an existing k-NN graph
+// created by createKnnGraph.
+// This only requires reading the k-NN graph, so it is fast.
+void ExpressionMatrix::findSimilarPairs9(
+    const string& geneSetName,      // The name of the gene set to be used.
+    const string& cellSetName,      // The name of the cell set to be used.
+    const string& lshName,          // The name of the Lsh object used to create the k-NN graph.
+    const string& knnGraphName,     // The name of the KnnGraph object to be used.
+    const string& similarPairsName, // The name of the SimilarPairs object to be created.
+    size_t k,                       // The maximum number of similar pairs to be stored for each cell.
+    double similarityThreshold      // The minimum similarity for a pair to be stored.
+    )
+{
+    cout << timestamp << "ExpressionMatrix::findSimilarPairs9 begins." << endl;
+
+    // Locate the gene set and verify that it is not empty.
+    const auto itGeneSet = geneSets.find(geneSetName);
+    if(itGeneSet == geneSets.end()) {
+        throw runtime_error("Gene set " + geneSetName + " does not exist.");
+    }
+    const GeneSet& geneSet = itGeneSet->second;
+    if(geneSet.size() == 0) {
+        throw runtime_error("Gene set " + geneSetName + " is empty.");
+    }
+
+    // Locate the cell set and verify that it is not empty.
+    const auto& it = cellSets.cellSets.find(cellSetName);
+    if(it == cellSets.cellSets.end()) {
+        throw runtime_error("Cell set " + cellSetName + " does not exist.");
+    }
+    const MemoryMapped::Vector<CellId>& cellSet = *(it->second);
+    const CellId cellCount = CellId(cellSet.size());
+    if(cellCount == 0) {
+        throw runtime_error("Cell set " + cellSetName + " is empty.");
+    }
+
+    // Access the Lsh object, which we need to convert mismatch counts to similarities,
+    // and the k-NN graph.
+    const Lsh lsh(directoryName + "/Lsh-" + lshName);
+    if(lsh.cellCount() != cellCount) {
+        throw runtime_error("LSH object " + lshName + " has a number of cells inconsistent with cell set " + cellSetName);
+    }
+    const KnnGraph knnGraph(directoryName + "/KnnGraph-" + knnGraphName);
+    if(knnGraph.cellCount()!=cellCount || knnGraph.lshCount()!=lsh.lshCount()) {
+        throw runtime_error("k-NN graph " + knnGraphName + " is inconsistent with LSH object " + lshName);
+    }
+    if(k > knnGraph.k() && knnGraph.k() < size_t(cellCount-1)) {
+        throw runtime_error("k-NN graph " + knnGraphName + " was created with k = " +
+            to_string(knnGraph.k()) + " and cannot be used to find more similar pairs per cell.");
+    }
+    // Pairs are stored if their similarity exceeds similarityThreshold,
+    // that is, if their mismatch count is less than mismatchCountBound.
+    const uint32_t mismatchCountBound = lsh.computeMismatchCountBound(similarityThreshold);
+
+    // Copy the neighbors to a new SimilarPairs object.
+    // They are already sorted by decreasing similarity.
+    SimilarPairs similarPairs(directoryName + "/SimilarPairs-" + similarPairsName, k, geneSet, cellSet);
+    for(CellId cellId0=0; cellId0<cellCount; cellId0++) {
+        size_t n = 0;
+        for(auto it=knnGraph.begin(cellId0); it!=knnGraph.end(cellId0) && n<k; ++it, ++n) {
+            if(it->mismatchCount >= mismatchCountBound) {
+                break;
+            }
+            similarPairs.addUnsymmetricNoCheck(cellId0, it->cellId, lsh.getSimilarity(it->mismatchCount));
+        }
+    }
+
+    cout << timestamp << "ExpressionMatrix::findSimilarPairs9 ends." << endl;
+}
+
+
+
 // Compare two SimilarPairs objects computed using LSH,
 // assuming that the first one was computed using a complete
 // loop on all pairs (findSimilarPairs4).
@@ -1208,12 +1915,47 @@ void ExpressionMatrix::compareSimilarPairs(
     CZI_ASSERT(similarPairs0.getCellSet() == similarPairs1.getCellSet());
 
     // Loop over cells.
+    // For each cell, also count the pairs stored in the first SimilarPairs object
+    // that are also stored in the second one, to compute the recall.
     ofstream csvOut("CompareSimilarPairs.csv");
     csvOut << "CellId,Stored0,Stored1,Lowest0,Lowest1,\n";
     const CellId cellCount = CellId(similarPairs0.getCellSet().size());
+    size_t totalPairCount0 = 0;
+    size_t totalPairCount1 = 0;
+    size_t totalCommonPairCount = 0;
+    vector<CellId> neighbors0;
+    vector<CellId> neighbors1;
     for(CellId cellId=0; cellId<cellCount; cellId++) {
         const auto n0 = similarPairs0.size(cellId);
         const auto n1 = similarPairs1.size(cellId);
+
+        neighbors0.clear();
+        for(auto it=similarPairs0.begin(cellId); it!=similarPairs0.end(cellId); ++it) {
+            neighbors0.push_back(it->first);
+        }
+        neighbors1.clear();
+        for(auto it=similarPairs1.begin(cellId); it!=similarPairs1.end(cellId); ++it) {
+            neighbors1.push_back(it->first);
+        }
+        sort(neighbors0.begin(), neighbors0.end());
+        sort(neighbors1.begin(), neighbors1.end());
+        size_t commonPairCount = 0;
+        for(auto it0=neighbors0.begin(), it1=neighbors1.begin();
+            it0!=neighbors0.end() && it1!=neighbors1.end(); ) {
+            if(*it0 < *it1) {
+                ++it0;
+            } else if(*it1 < *it0) {
+                ++it1;
+            } else {
+                ++commonPairCount;
+                ++it0;
+                ++it1;
+            }
+        }
+        totalPairCount0 += n0;
+        totalPairCount1 += n1;
+        totalCommonPairCount += commonPairCount;
+
         const auto lowest0 = n0 ? ((similarPairs0.end(cellId)-1)->second) : 1.;
         const auto lowest1 = n1 ? ((similarPairs1.end(cellId)-1)->second) : 1.;
         if(n0==n1 && lowest0==lowest1) {
@@ -1235,6 +1977,13 @@ void ExpressionMatrix::compareSimilarPairs(
 
     }
 
+    cout << "Number of pairs stored in " << similarPairsName0 << ": " << totalPairCount0 << endl;
+    cout << "Number of pairs stored in " << similarPairsName1 << ": " << totalPairCount1 << endl;
+    cout << "Number of pairs stored in both: " << totalCommonPairCount << endl;
+    if(totalPairCount0) {
+        cout << "Recall of " << similarPairsName1 << " relative to " << similarPairsName0 << ": " <<
+            double(totalCommonPairCount) / double(totalPairCount0) << endl;
+    }
 
 }
 
@@ -1275,7 +2024,7 @@ void ExpressionMatrix::analyzeLsh(
     const string expressionMatrixSubsetName =
         directoryName + "/tmp-ExpressionMatrixSubset";
     ExpressionMatrixSubset expressionMatrixSubset(
-        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts);
+        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts, compressedCellExpressionCounts);
 
 
     // Create the Lsh object that will do the computation.
@@ -1401,7 +2150,7 @@ void ExpressionMatrix::analyzeLshSignatures(
     const string expressionMatrixSubsetName =
         directoryName + "/tmp-ExpressionMatrixSubset";
     ExpressionMatrixSubset expressionMatrixSubset(
-        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts);
+        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts, compressedCellExpressionCounts);
 
 
     // Create the Lsh object that will do the computation.
@@ -54,7 +54,7 @@ void ExpressionMatrix::findSimilarPairs4Gpu(
     const string expressionMatrixSubsetName =
         directoryName + "/tmp-ExpressionMatrixSubset-" + similarPairsName;
     ExpressionMatrixSubset expressionMatrixSubset(
-        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts);
+        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts, compressedCellExpressionCounts);
 
     // Create the Lsh object that will do the computation.
     Lsh lsh(directoryName + "/Lsh-" + lshName);
@@ -0,0 +1,337 @@
+// Functionality to read expression matrix data in Matrix Market format,
+// as created by the 10X Genomics pipeline (Cell Ranger 2 and later).
+
+#include "ExpressionMatrix.hpp"
+#include "filesystem.hpp"
+#include "GzipLineReader.hpp"
+#include "timestamp.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include "algorithm.hpp"
+#include <cctype>
+#include <cstring>
+#include "iostream.hpp"
+
+
+
+/*******************************************************************************
+
+Add cells from a directory created by the 10X Genomics pipeline,
+containing the expression matrix in Matrix Market format.
+
+Cell Ranger 3 and later creates three files, all compressed with gzip:
+matrix.mtx.gz, features.tsv.gz, barcodes.tsv.gz.
+Cell Ranger 2 creates the same files, uncompressed, and uses
+genes.tsv instead of features.tsv.
+
+See addCellsFromMtx for more information.
+
+*******************************************************************************/
+void ExpressionMatrix::addCellsFrom10xDirectory(
+    const string& inputDirectoryName,
+    const string& cellNamePrefix,
+    const vector< pair<string, string> > cellMetaData,  // Added to all cells.
+    double totalExpressionCountThreshold)
+{
+    const string prefix = inputDirectoryName + "/";
+    if(filesystem::exists(prefix + "matrix.mtx.gz")) {
+        addCellsFromMtx(
+            prefix + "matrix.mtx.gz",
+            prefix + "features.tsv.gz",
+            prefix + "barcodes.tsv.gz",
+            cellNamePrefix, cellMetaData, totalExpressionCountThreshold);
+    } else if(filesystem::exists(prefix + "matrix.mtx")) {
+        addCellsFromMtx(
+            prefix + "matrix.mtx",
+            prefix + (filesystem::exists(prefix + "genes.tsv") ? "genes.tsv" : "features.tsv"),
+            prefix + "barcodes.tsv",
+            cellNamePrefix, cellMetaData, totalExpressionCountThreshold);
+    } else {
+        throw runtime_error("Directory " + inputDirectoryName +
+            " does not contain matrix.mtx.gz or matrix.mtx.");
+    }
+}
+
+
+
+/*******************************************************************************
+
+Add cells from an expression matrix in Matrix Market coordinate format,
+with one row per gene and one column per cell, as created by the 10X Genomics pipeline.
+
+The input files can be compressed with gzip, and are decompressed on the fly.
+
+The matrix file begins with a header line of the form
+%%MatrixMarket matrix coordinate integer general
+followed by optional comment lines beginning with %,
+and by a line containing the number of rows (genes), columns (cells),
+and entries. Each of the following lines contains a one-based gene index,
+a one-based cell index, and the expression count. Entries can appear in any order.
+Value types integer, real, and pattern (all counts equal to 1) are supported.
+
+The features file (features.tsv or genes.tsv) has a line for each gene.
+The first column is used as the gene name. As in addCellsFromHdf5,
+this is the gene id, because gene symbols in the second column can contain duplicates.
+
+The barcodes file has a line for each cell. Cell names are generated
+using the barcodes, prefixing each barcode with the given cellNamePrefix.
+
+Only cells for which the total expression count equals or exceeded
+the given threshold are added.
+
+The matrix file is read twice, and the cell-major transpose
+is done using the two-pass construction of MemoryMapped::VectorOfVectors:
+- Pass 1 counts the non-zero expression counts of each cell,
+  and computes the total expression count of each cell.
+- Pass 2 stores the expression counts of the cells that will be kept.
+Memory usage is therefore proportional to the number of barcodes,
+while the expression counts are in a temporary memory mapped file.
+
+*******************************************************************************/
+void ExpressionMatrix::addCellsFromMtx(
+    const string& matrixFileName,
+    const string& featuresFileName,
+    const string& barcodesFileName,
+    const string& cellNamePrefix,
+    const vector< pair<string, string> > cellMetaDataArgument,  // Added to all cells.
+    double totalExpressionCountThreshold)
+{
+    Ingestion ingestion(*this);
+    cout << timestamp << "Begin addCellsFromMtx: " << cellCount() <<" cells, "
+        << geneCount() << " genes." << endl;
+    char* line;
+    size_t length;
+
+    // Read the gene names.
+    vector<string> mtxGeneNames;
+    {
+        GzipLineReader reader(featuresFileName);
+        while(reader.getLine(line, length)) {
+            const char* tab = static_cast<const char*>(memchr(line, '\t', length));
+            mtxGeneNames.push_back(string(static_cast<const char*>(line), tab ? tab : line + length));
+            if(mtxGeneNames.back().empty()) {
+                throw runtime_error("Empty gene name at line " + lexical_cast<string>(reader.lineNumber()) +
+                    " of " + featuresFileName);
+            }
+        }
+    }
+
+    // Check for duplications in the gene names.
+    {
+        vector<string> sortedMtxGeneNames = mtxGeneNames;
+        sort(sortedMtxGeneNames.begin(), sortedMtxGeneNames.end());
+        const auto it = adjacent_find(sortedMtxGeneNames.begin(), sortedMtxGeneNames.end());
+        if(it != sortedMtxGeneNames.end()) {
+            throw runtime_error("Duplicate gene name " + *it + " in " + featuresFileName);
+        }
+    }
+
+    // Read the cell names.
+    vector<string> mtxCellNames;
+    {
+        GzipLineReader reader(barcodesFileName);
+        while(reader.getLine(line, length)) {
+            const char* tab = static_cast<const char*>(memchr(line, '\t', length));
+            mtxCellNames.push_back(string(static_cast<const char*>(line), tab ? tab : line + length));
+        }
+    }
+    const size_t barcodeCount = mtxCellNames.size();
+    cout << "Found " << mtxGeneNames.size() << " genes and " << barcodeCount << " barcodes." << endl;
+
+
+
+    // Function to read the header and size lines of the matrix file.
+    // Returns the number of entries, and sets isPattern if
+    // the matrix contains no values.
+    bool isPattern = false;
+    const auto readMatrixHeader = [&](GzipLineReader& reader) -> uint64_t
+    {
+        if(!reader.getLine(line, length) || strncmp(line, "%%MatrixMarket", 14) != 0) {
+            throw runtime_error("Missing Matrix Market header line in " + matrixFileName);
+        }
+        string header(line, length);
+        transform(header.begin(), header.end(), header.begin(), ::tolower);
+        if(header.find(" coordinate") == string::npos) {
+            throw runtime_error("Only Matrix Market coordinate format is supported: " + matrixFileName);
+        }
+        if(header.find(" general") == string::npos) {
+            throw runtime_error("Only general (not symmetric) Matrix Market files are supported: " + matrixFileName);
+        }
+        if(header.find(" complex") != string::npos) {
+            throw runtime_error("Complex Matrix Market files are not supported: " + matrixFileName);
+        }
+        isPattern = (header.find(" pattern") != string::npos);
+
+        // Skip comments.
+        do {
+            if(!reader.getLine(line, length)) {
+                throw runtime_error("Missing Matrix Market size line in " + matrixFileName);
+            }
+        } while(length==0 || line[0]=='%');
+
+        // Read the number of rows (genes), columns (cells), and entries.
+        char* p = line;
+        const uint64_t rowCount = strtoull(p, &p, 10);
+        const uint64_t columnCount = strtoull(p, &p, 10);
+        char* q;
+        const uint64_t entryCount = strtoull(p, &q, 10);
+        if(q == p) {
+            throw runtime_error("Invalid Matrix Market size line in " + matrixFileName);
+        }
+        if(rowCount != mtxGeneNames.size()) {
+            throw runtime_error("Number of rows in " + matrixFileName +
+                " does not match the number of genes in " + featuresFileName);
+        }
+        if(columnCount != barcodeCount) {
+            throw runtime_error("Number of columns in " + matrixFileName +
+                " does not match the number of barcodes in " + barcodesFileName);
+        }
+        return entryCount;
+    };
+
+    // Function to parse an entry of the matrix file.
+    const auto parseEntry = [&](const GzipLineReader& reader, GeneId& mtxGeneIndex, CellId& mtxCellIndex, float& count)
+    {
+        char* p = line;
+        char* q;
+        const uint64_t row = strtoull(p, &q, 10);
+        if(q == p || row == 0 || row > mtxGeneNames.size()) {
+            throw runtime_error("Invalid gene index at line " + lexical_cast<string>(reader.lineNumber()) +
+                " of " + matrixFileName);
+        }
+        p = q;
+        const uint64_t column = strtoull(p, &q, 10);
+        if(q == p || column == 0 || column > barcodeCount) {
+            throw runtime_error("Invalid cell index at line " + lexical_cast<string>(reader.lineNumber()) +
+                " of " + matrixFileName);
+        }
+        p = q;
+        mtxGeneIndex = GeneId(row - 1);
+        mtxCellIndex = CellId(column - 1);
+        if(isPattern) {
+            count = 1.;
+        } else {
+            count = strtof(p, &q);
+            if(q == p || !(count >= 0.)) {
+                throw runtime_error("Invalid expression count at line " + lexical_cast<string>(reader.lineNumber()) +
+                    " of " + matrixFileName);
+            }
+        }
+    };
+
+
+
+    // Add the genes, and map the gene indices used in the matrix file to GeneIds.
+    vector<GeneId> mtxGeneIds(mtxGeneNames.size());
+    for(size_t i=0; i<mtxGeneNames.size(); i++) {
+        addGene(mtxGeneNames[i]);
+        mtxGeneIds[i] = geneNames(mtxGeneNames[i]);
+        CZI_ASSERT(mtxGeneIds[i] != geneNames.invalidStringId);
+    }
+
+    // Temporary storage for the expression counts of each cell.
+    // It is removed when we are done, even if an exception is thrown.
+    MemoryMapped::VectorOfVectors<pair<GeneId, float>, uint64_t> counts;
+    counts.createNew(directoryName + "/tmp-AddCellsFromMtx-ExpressionCounts");
+    size_t addedCellsCount = 0;
+
+
+
+    try {
+        // Pass 1: count the non-zero expression counts of each cell,
+        // and compute the total expression count of each cell.
+        cout << timestamp << "Pass 1 begins." << endl;
+        uint64_t entryCount;
+        vector<double> totalExpressionCounts(barcodeCount, 0.);
+        counts.beginPass1(barcodeCount);
+        {
+            GzipLineReader reader(matrixFileName);
+            entryCount = readMatrixHeader(reader);
+            uint64_t entriesFound = 0;
+            GeneId mtxGeneIndex;
+            CellId mtxCellIndex;
+            float count;
+            while(reader.getLine(line, length)) {
+                if(length == 0) {
+                    continue;
+                }
+                parseEntry(reader, mtxGeneIndex, mtxCellIndex, count);
+                ++entriesFound;
+                if(count != 0.) {
+                    counts.incrementCount(mtxCellIndex);
+                    totalExpressionCounts[mtxCellIndex] += count;
+                }
+            }
+            if(entriesFound != entryCount) {
+                throw runtime_error("Expected " + lexical_cast<string>(entryCount) + " entries in " +
+                    matrixFileName + ", found " + lexical_cast<string>(entriesFound));
+            }
+        }
+
+        // Decide which cells will be kept.
+        // For the cells that will not be kept, we don't store expression counts.
+        vector<bool> isKept(barcodeCount, false);
+        for(size_t i=0; i<barcodeCount; i++) {
+            isKept[i] = (totalExpressionCounts[i] >= totalExpressionCountThreshold);
+            if(!isKept[i]) {
+                counts.count[i] = 0;
+            }
+        }
+
+
+
+        // Pass 2: store the expression counts of the cells that will be kept.
+        cout << timestamp << "Pass 2 begins." << endl;
+        counts.beginPass2();
+        {
+            GzipLineReader reader(matrixFileName);
+            readMatrixHeader(reader);
+            GeneId mtxGeneIndex;
+            CellId mtxCellIndex;
+            float count;
+            while(reader.getLine(line, length)) {
+                if(length == 0) {
+                    continue;
+                }
+                parseEntry(reader, mtxGeneIndex, mtxCellIndex, count);
+                if(count!=0. && isKept[mtxCellIndex]) {
+                    counts.store(mtxCellIndex, make_pair(mtxGeneIds[mtxGeneIndex], count));
+                }
+            }
+        }
+        counts.endPass2();
+
+
+
+        // Add the cells.
+        cout << timestamp << "Storing expression counts." << endl;
+        vector<pair<string, string> > cellMetaData(cellMetaDataArgument.size()+1);
+        cellMetaData.front().first = "CellName";
+        copy(cellMetaDataArgument.begin(), cellMetaDataArgument.end(), cellMetaData.begin()+1);
+        vector<pair<GeneId, float> > expressionCounts;
+        for(size_t i=0; i<barcodeCount; i++) {
+            if(!isKept[i]) {
+                continue;
+            }
+            cellMetaData.front().second = cellNamePrefix + "-" + mtxCellNames[i];
+            if(skipCellDuringIngestion(cellMetaData.front().second)) {
+                continue;
+            }
+            expressionCounts.assign(counts.begin(i), counts.end(i));
+            sort(expressionCounts.begin(), expressionCounts.end());
+            addCellUsingGeneIds(cellMetaData, expressionCounts);
+            commitIngestionIfNeeded();
+            ++addedCellsCount;
+        }
+    } catch(...) {
+        counts.remove();
+        throw;
+    }
+    counts.remove();
+    ingestion.commit();
+
+    cout << "Added " << addedCellsCount << " cells from " << barcodeCount << " barcodes." << endl;
+    cout << timestamp << "End addCellsFromMtx: " << cellCount() <<" cells, "
+        << geneCount() << " genes." << endl;
+}
@@ -10,7 +10,8 @@ ExpressionMatrixSubset::ExpressionMatrixSubset(
     const string& name,
     const GeneSet& geneSet,
     const CellSet& cellSet,
-    const CellExpressionCounts& globalExpressionCounts) :
+    const CellExpressionCounts& globalExpressionCounts,
+    const CompressedExpressionCounts& compressedGlobalExpressionCounts) :
         geneSet(geneSet), cellSet(cellSet)
 {
     // Sanity checks.
@@ -21,19 +22,31 @@ ExpressionMatrixSubset::ExpressionMatrixSubset(
     cellExpressionCounts.createNew(name);
 
     // Loop over cells in the subset.
+    vector< pair<GeneId, float> > decodedCounts;
     for(CellId localCellId=0; localCellId!=cellSet.size(); localCellId++) {
         const CellId globalCellId = cellSet[localCellId];
         cellExpressionCounts.appendVector();
 
         // Loop over all expression counts for this cell.
-        for(const auto& p: globalExpressionCounts[globalCellId]) {
-            const GeneId globalGeneId = p.first;
-            const GeneId localGeneId = geneSet.getLocalGeneId(globalGeneId);
-            if(localGeneId == invalidGeneId) {
-                continue;   // This gene is not in the gene set
+        if(compressedGlobalExpressionCounts.isOpen()) {
+            compressedGlobalExpressionCounts.decode(globalCellId, decodedCounts);
+            for(const auto& p: decodedCounts) {
+                const GeneId localGeneId = geneSet.getLocalGeneId(p.first);
+                if(localGeneId == invalidGeneId) {
+                    continue;   // This gene is not in the gene set
+                }
+                cellExpressionCounts.append(make_pair(localGeneId, p.second));
+            }
+        } else {
+            for(const auto& p: globalExpressionCounts[globalCellId]) {
+                const GeneId globalGeneId = p.first;
+                const GeneId localGeneId = geneSet.getLocalGeneId(globalGeneId);
+                if(localGeneId == invalidGeneId) {
+                    continue;   // This gene is not in the gene set
+                }
+                const float count = p.second;
+                cellExpressionCounts.append(make_pair(localGeneId, count));
             }
-            const float count = p.second;
-            cellExpressionCounts.append(make_pair(localGeneId, count));
         }
     }
 
@@ -106,6 +119,18 @@ double ExpressionMatrixSubset::computeCellSimilarity(CellId localCellId0, CellId
         }
     }
 
+    return computeCellSimilarity(localCellId0, localCellId1, scalarProduct);
+}
+
+
+
+// Same as above, but using a scalar product of the expression counts
+// of the two cells that was already computed by the caller.
+double ExpressionMatrixSubset::computeCellSimilarity(
+    CellId localCellId0,
+    CellId localCellId1,
+    double scalarProduct) const
+{
     // Compute the correlation coefficient.
     // See, for example, https://en.wikipedia.org/wiki/Correlation_and_dependence
     const double n = double(geneSet.size());
@@ -13,6 +13,7 @@ It uses temporary files for all of its mapped files, so it is not persistent.
 *******************************************************************************/
 
 #include "CellSets.hpp"
+#include "CompressedExpressionCounts.hpp"
 #include "GeneSet.hpp"
 #include "Ids.hpp"
 #include "MemoryMappedVectorOfVectors.hpp"
@@ -33,12 +34,15 @@ public:
     // the base name to be used for the supporting files files,
     // plus the GeneSet and CellSet to be used
     // and the expression counts for the global expression matrix.
+    // If the compressed expression counts of the global expression matrix
+    // are available, they are used instead of the uncompressed ones.
     using CellExpressionCounts = MemoryMapped::VectorOfVectors<pair<GeneId, float>, uint64_t>;
     ExpressionMatrixSubset(
         const string& name,
         const GeneSet& geneSet,
         const CellSet& cellSet,
-        const CellExpressionCounts& globalExpressionCounts);
+        const CellExpressionCounts& globalExpressionCounts,
+        const CompressedExpressionCounts& compressedGlobalExpressionCounts);
     ~ExpressionMatrixSubset();
 
     // The set of genes used by this ExpressionMatrixSubset.
@@ -88,6 +92,10 @@ public:
     // instead of the global expression counts stored by class ExpressionMatrix.
     double computeCellSimilarity(CellId localCellId0, CellId localCellId1) const;
 
+    // Same as above, but using a scalar product of the expression counts
+    // of the two cells that was already computed by the caller.
+    double computeCellSimilarity(CellId localCellId0, CellId localCellId1, double scalarProduct) const;
+
     // Close and remove the supporting files.
     void remove();
 
@@ -0,0 +1,145 @@
+// Class GeneExpressionIndex stores a gene-major copy of the expression counts.
+// See GeneExpressionIndex.hpp for more information.
+
+#include "GeneExpressionIndex.hpp"
+#include "CZI_ASSERT.hpp"
+#include "runThreads.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include "algorithm.hpp"
+#include "vector.hpp"
+
+
+
+// Create the index from the cell-major expression counts, using multiple threads.
+// Each thread processes a contiguous range of cells.
+// In pass 1 each thread counts the entries of each gene in its range.
+// From these counts we compute where each thread stores the entries of each gene,
+// so in pass 2 the entries are stored already sorted by CellId,
+// without any synchronization between threads.
+void GeneExpressionIndex::createNew(
+    const string& name,
+    GeneId geneCount,
+    const CellExpressionCounts& cellExpressionCounts,
+    size_t threadCount)
+{
+    const CellId cellCount = CellId(cellExpressionCounts.size());
+    threadCount = min(getThreadCount(threadCount), max(size_t(cellCount), size_t(1)));
+
+    counts.createNew(name + "-Counts");
+
+    // The range of cells processed by each thread.
+    const auto cellBegin = [&](size_t threadId)
+    {
+        return CellId((uint64_t(cellCount) * threadId) / threadCount);
+    };
+
+    // Pass 1: count.
+    vector< vector<uint64_t> > threadCounts(threadCount);
+    runThreads(threadCount, [&](size_t threadId)
+    {
+        vector<uint64_t>& threadCount0 = threadCounts[threadId];
+        threadCount0.resize(geneCount, 0);
+        for(CellId cellId=cellBegin(threadId); cellId!=cellBegin(threadId+1); cellId++) {
+            for(const auto& p: cellExpressionCounts[cellId]) {
+                CZI_ASSERT(p.first < geneCount);
+                ++threadCount0[p.first];
+            }
+        }
+    });
+
+    // Compute the total count for each gene, and transform
+    // the thread counts into offsets relative to the beginning of each gene.
+    counts.beginPass1(geneCount);
+    for(GeneId geneId=0; geneId!=geneCount; geneId++) {
+        uint64_t offset = 0;
+        for(size_t threadId=0; threadId!=threadCount; threadId++) {
+            const uint64_t n = threadCounts[threadId][geneId];
+            threadCounts[threadId][geneId] = offset;
+            offset += n;
+        }
+        counts.incrementCount(geneId, offset);
+    }
+    counts.beginPass2();
+
+    // Pass 2: store.
+    runThreads(threadCount, [&](size_t threadId)
+    {
+        vector<uint64_t>& offsets = threadCounts[threadId];
+        for(CellId cellId=cellBegin(threadId); cellId!=cellBegin(threadId+1); cellId++) {
+            for(const auto& p: cellExpressionCounts[cellId]) {
+                counts.begin(p.first)[offsets[p.first]++] = make_pair(cellId, p.second);
+            }
+        }
+    });
+
+    // The entries were stored directly at their final positions,
+    // so the counts used by store() are no longer needed.
+    fill(counts.count.begin(), counts.count.end(), uint64_t(0));
+    counts.endPass2();
+    counts.syncToDisk();
+
+    // Now that the counts are complete, create the Info file.
+    info.createNew(name + "-Info");
+    info->cellCount = cellCount;
+    info->geneCount = geneCount;
+    info.syncToDisk();
+    overlay.clear();
+    overlayCellCount = 0;
+}
+
+
+
+void GeneExpressionIndex::accessExisting(const string& name)
+{
+    info.accessExistingReadOnly(name + "-Info");
+    counts.accessExistingReadOnly(name + "-Counts");
+    overlay.clear();
+    overlayCellCount = 0;
+}
+
+
+
+void GeneExpressionIndex::remove()
+{
+    info.remove();
+    counts.remove();
+    overlay.clear();
+    overlayCellCount = 0;
+}
+
+
+
+// Append a cell to the overlay.
+// Cells are appended in order of increasing cell id,
+// so the pairs of each gene remain sorted by CellId.
+void GeneExpressionIndex::appendCell(
+    CellId cellId,
+    const pair<GeneId, float>* begin,
+    const pair<GeneId, float>* end)
+{
+    CZI_ASSERT(cellId == cellCount());
+    for(const pair<GeneId, float>* it=begin; it!=end; ++it) {
+        if(overlay.size() <= it->first) {
+            overlay.resize(it->first + 1);
+        }
+        overlay[it->first].push_back(make_pair(cellId, it->second));
+    }
+    ++overlayCellCount;
+}
+
+
+
+// Remove cells from the overlay.
+void GeneExpressionIndex::truncate(CellId cellCountArgument)
+{
+    CZI_ASSERT(cellCountArgument >= storedCellCount());
+    CZI_ASSERT(cellCountArgument <= cellCount());
+    for(auto& v: overlay) {
+        while(!v.empty() && v.back().first >= cellCountArgument) {
+            v.pop_back();
+        }
+    }
+    overlayCellCount = cellCountArgument - storedCellCount();
+}
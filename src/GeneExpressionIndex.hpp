@@ -0,0 +1,123 @@
+#ifndef CZI_EXPRESSION_MATRIX2_GENE_EXPRESSION_INDEX_HPP
+#define CZI_EXPRESSION_MATRIX2_GENE_EXPRESSION_INDEX_HPP
+
+
+// Class GeneExpressionIndex stores a gene-major copy of the expression counts
+// (compressed sparse column format): for each gene, the non-zero
+// expression counts as pairs (CellId, count), sorted by CellId.
+// It is used by queries that need the expression counts of a few genes
+// for many cells, which would otherwise have to look up each gene
+// in the expression counts of each cell.
+
+// The index stored on disk covers cells with ids less than storedCellCount()
+// and genes with ids less than storedGeneCount(). Since the expression counts
+// of a cell never change after it is added, a gene added after the index
+// was created has no expression counts in these cells.
+// Cells added later are appended one at a time, using appendCell,
+// to an overlay kept in memory, which contains for each gene
+// the (CellId, count) pairs of these cells, sorted by CellId.
+// Appending a cell costs time proportional to its number of expression counts.
+// The overlay is not stored: when the index is accessed again,
+// the cells that are not in the stored index are appended again.
+// The overlay is merged into the stored index by creating the index again.
+// See ExpressionMatrix::getExpressionCountsForGene
+// and ExpressionMatrix::updateGeneExpressionIndex.
+
+// The Info file is created last and removed first, so an index
+// that was interrupted while being created or removed
+// is not accessed.
+
+#include "Ids.hpp"
+#include "MemoryAsContainer.hpp"
+#include "MemoryMappedObject.hpp"
+#include "MemoryMappedVectorOfVectors.hpp"
+
+#include "cstddef.hpp"
+#include "cstdint.hpp"
+#include "string.hpp"
+#include "utility.hpp"
+#include "vector.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        class GeneExpressionIndex;
+    }
+}
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::GeneExpressionIndex {
+public:
+
+    // Create the index from the cell-major expression counts, using multiple threads.
+    using CellExpressionCounts = MemoryMapped::VectorOfVectors<pair<GeneId, float>, uint64_t>;
+    void createNew(
+        const string& name,         // Name prefix for memory mapped files.
+        GeneId geneCount,
+        const CellExpressionCounts&,
+        size_t threadCount);
+
+    // Access an existing index. The stored index is never modified after
+    // it is created, so it is always accessed read-only.
+    void accessExisting(const string& name);
+
+    // Remove the memory mapped files.
+    void remove();
+
+    bool isOpen() const
+    {
+        return info.isOpen;
+    }
+    // The number of cells in the stored index and in the overlay.
+    CellId storedCellCount() const
+    {
+        return CellId(info->cellCount);
+    }
+    CellId cellCount() const
+    {
+        return storedCellCount() + overlayCellCount;
+    }
+    GeneId storedGeneCount() const
+    {
+        return GeneId(info->geneCount);
+    }
+
+    // Return the (CellId, count) pairs for a gene in the stored index, sorted by CellId.
+    // The gene id must be less than storedGeneCount().
+    MemoryAsContainer<const pair<CellId, float> > operator[](GeneId geneId) const
+    {
+        return counts[geneId];
+    }
+
+    // Return the (CellId, count) pairs for a gene in the overlay, sorted by CellId.
+    MemoryAsContainer<const pair<CellId, float> > getOverlay(GeneId geneId) const
+    {
+        if(geneId >= overlay.size()) {
+            return MemoryAsContainer<const pair<CellId, float> >(0, 0);
+        }
+        const vector< pair<CellId, float> >& v = overlay[geneId];
+        return MemoryAsContainer<const pair<CellId, float> >(v.data(), v.data() + v.size());
+    }
+
+    // Append a cell to the overlay. The cell id must equal cellCount().
+    void appendCell(CellId, const pair<GeneId, float>* begin, const pair<GeneId, float>* end);
+
+    // Remove from the overlay the cells with ids greater than or equal to cellCount,
+    // which must not be less than storedCellCount().
+    void truncate(CellId cellCount);
+
+private:
+    class Info {
+    public:
+        uint64_t cellCount;
+        uint64_t geneCount;
+    };
+    MemoryMapped::Object<Info> info;
+    MemoryMapped::VectorOfVectors<pair<CellId, float>, uint64_t> counts;
+
+    // The overlay, indexed by GeneId.
+    vector< vector< pair<CellId, float> > > overlay;
+    CellId overlayCellCount = 0;
+};
+
+#endif
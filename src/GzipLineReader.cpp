@@ -0,0 +1,109 @@
+// Class GzipLineReader reads a text file one line at a time,
+// decompressing it on the fly if it is compressed with gzip.
+// See GzipLineReader.hpp for more information.
+
+#include "GzipLineReader.hpp"
+#include "CZI_ASSERT.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include "stdexcept.hpp"
+#include <cstring>
+#include <zlib.h>
+
+
+
+GzipLineReader::GzipLineReader(const string& fileName) :
+    fileName(fileName),
+    file(0),
+    buffer(1<<20),
+    begin(0),
+    end(0),
+    endOfFile(false),
+    lineCount(0)
+{
+    gzFile gzipFile = gzopen(fileName.c_str(), "rb");
+    if(!gzipFile) {
+        throw runtime_error("Error opening " + fileName);
+    }
+    gzbuffer(gzipFile, 1<<18);
+    file = gzipFile;
+}
+
+
+
+GzipLineReader::~GzipLineReader()
+{
+    if(file) {
+        gzclose(static_cast<gzFile>(file));
+    }
+}
+
+
+
+bool GzipLineReader::getLine(char*& line, size_t& length)
+{
+    while(true) {
+
+        // If the buffer contains a complete line, return it.
+        char* lineBegin = buffer.data() + begin;
+        char* lineEnd = static_cast<char*>(memchr(lineBegin, '\n', end - begin));
+        if(lineEnd || (endOfFile && begin != end)) {
+            if(lineEnd) {
+                begin = size_t(lineEnd - buffer.data()) + 1;
+            } else {
+                // The last line of the file does not have a line end.
+                // There is always room for the terminator, see fill().
+                lineEnd = buffer.data() + end;
+                begin = end;
+            }
+            if(lineEnd!=lineBegin && *(lineEnd-1)==13) {
+                --lineEnd; // Remove Windows style line end if necessary.
+            }
+            *lineEnd = 0;
+            line = lineBegin;
+            length = size_t(lineEnd - lineBegin);
+            ++lineCount;
+            return true;
+        }
+
+        if(endOfFile) {
+            return false;
+        }
+        fill();
+    }
+}
+
+
+
+bool GzipLineReader::fill()
+{
+    // Move the data not yet returned to the beginning of the buffer.
+    const size_t n = end - begin;
+    if(begin != 0) {
+        memmove(buffer.data(), buffer.data() + begin, n);
+        begin = 0;
+        end = n;
+    }
+
+    // If the buffer is full, the line is longer than the buffer. Make it larger.
+    // We always keep one byte available for the terminator of the last line.
+    if(end + 1 >= buffer.size()) {
+        buffer.resize(2 * buffer.size());
+    }
+
+    // Read as much as fits in the buffer.
+    const int bytesRead = gzread(static_cast<gzFile>(file), buffer.data() + end,
+        unsigned(buffer.size() - end - 1));
+    if(bytesRead < 0) {
+        int errorNumber;
+        const char* message = gzerror(static_cast<gzFile>(file), &errorNumber);
+        throw runtime_error("Error reading " + fileName + ": " + string(message));
+    }
+    if(bytesRead == 0) {
+        endOfFile = true;
+        return false;
+    }
+    end += size_t(bytesRead);
+    return true;
+}
@@ -0,0 +1,75 @@
+#ifndef CZI_EXPRESSION_MATRIX2_GZIP_LINE_READER_HPP
+#define CZI_EXPRESSION_MATRIX2_GZIP_LINE_READER_HPP
+
+
+// Class GzipLineReader reads a text file one line at a time,
+// decompressing it on the fly if it is compressed with gzip.
+// Uncompressed files are read transparently, so the same code
+// can be used for both (for example matrix.mtx and matrix.mtx.gz).
+// Only a fixed size buffer is kept in memory,
+// regardless of the size of the file.
+
+#include "cstddef.hpp"
+#include "string.hpp"
+#include "vector.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        class GzipLineReader;
+    }
+}
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::GzipLineReader {
+public:
+
+    // Open the given file. Throws an exception if the file cannot be opened.
+    GzipLineReader(const string& fileName);
+    ~GzipLineReader();
+
+    // Get the next line.
+    // On return, line points to a null terminated copy of the line,
+    // without the line end (Unix or Windows style), which remains valid
+    // until the next call. The caller is allowed to modify it.
+    // Returns false when the end of the file is reached.
+    bool getLine(char*& line, size_t& length);
+
+    // Return the number of the line returned by the last call to getLine,
+    // starting at 1. Useful for error messages.
+    size_t lineNumber() const
+    {
+        return lineCount;
+    }
+
+    const string& getFileName() const
+    {
+        return fileName;
+    }
+
+private:
+    string fileName;
+
+    // The zlib file handle, stored as a void pointer to avoid
+    // exposing zlib.h to users of this class.
+    void* file;
+
+    // The buffer containing decompressed data.
+    // The data not yet returned are in [begin, end).
+    vector<char> buffer;
+    size_t begin;
+    size_t end;
+    bool endOfFile;
+    size_t lineCount;
+
+    // Read more data into the buffer, after moving the data not yet returned
+    // to the beginning of the buffer.
+    // Returns false if no more data could be read.
+    bool fill();
+
+    // Prevent copying.
+    GzipLineReader(const GzipLineReader&);
+    GzipLineReader& operator=(const GzipLineReader&);
+};
+
+#endif
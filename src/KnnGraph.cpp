@@ -0,0 +1,323 @@
+#include "KnnGraph.hpp"
+#include "heap.hpp"
+#include "Lsh.hpp"
+#include "runThreads.hpp"
+#include "timestamp.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include "algorithm.hpp"
+#include "iostream.hpp"
+#include "utility.hpp"
+#include "vector.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+
+
+
+// Create a new KnnGraph object from the signatures of an Lsh object.
+KnnGraph::KnnGraph(
+    const string& name,             // Name prefix for memory mapped files.
+    Lsh& lsh,                       // The Lsh object containing the cell signatures.
+    size_t k,                       // The number of neighbors of each cell.
+    size_t maxIterationCount,       // The maximum number of NN-descent iterations.
+    double delta,                   // Stop when fewer than delta*k*cellCount neighbors are updated in an iteration.
+    uint32_t seed,                  // Seed used to generate the initial random graph.
+    size_t threadCount              // Number of threads used to build the graph.
+    )
+{
+    const CellId cellCount = lsh.cellCount();
+
+    // Store the Info object.
+    info.createNew(name + "-Info");
+    info->cellCount = cellCount;
+    info->k = (cellCount == 0) ? 0 : min(k, size_t(cellCount - 1));
+    info->lshCount = lsh.lshCount();
+    info->iterationCount = 0;
+    neighbors.createNew(name + "-Neighbors", size_t(cellCount) * info->k);
+
+    // Build the graph.
+    if(info->k > 0) {
+        build(lsh, maxIterationCount, delta, seed, getThreadCount(threadCount));
+    }
+    neighbors.syncToDisk();
+    info.syncToDisk();
+}
+
+
+
+// Access an existing KnnGraph object.
+KnnGraph::KnnGraph(
+    const string& name              // Name prefix for memory mapped files.
+    )
+{
+    info.accessExistingReadOnly(name + "-Info");
+    neighbors.accessExistingReadOnly(name + "-Neighbors");
+}
+
+
+
+// Remove the memory mapped files.
+void KnnGraph::remove()
+{
+    neighbors.remove();
+    info.remove();
+}
+
+
+
+// Build the graph using NN-descent.
+// During the build, the neighbors of each cell are kept in memory
+// as a max-heap ordered by (mismatchCount, cellId), so the worst neighbor
+// is at the top and can be replaced cheaply.
+// Each neighbor also has a flag that is set if the neighbor was added
+// since the cell was last used in a local join.
+// In each iteration:
+// - For each cell, a sample of the new neighbors and all the old neighbors
+//   are extracted, together with reverse neighbors.
+// - For each cell, all pairs of cells in these lists that involve
+//   at least one new cell are checked, and each of the two cells is
+//   used to try and improve the neighbors of the other one (local join).
+// Each cell has a mutex (shared by groups of cells) that protects its
+// neighbors during the local join.
+void KnnGraph::build(
+    Lsh& lsh,
+    size_t maxIterationCount,
+    double delta,
+    uint32_t seed,
+    size_t threadCount)
+{
+    const CellId cellCount = this->cellCount();
+    const size_t k = this->k();
+    const size_t sampleCount = max(size_t(1), k / 2);
+    cout << timestamp << "Building k-NN graph for " << cellCount << " cells with k = " << k <<
+        " using " << threadCount << " threads." << endl;
+    const auto t0 = std::chrono::steady_clock::now();
+
+    // The neighbors of each cell during the build.
+    class Entry {
+    public:
+        uint32_t mismatchCount;
+        CellId cellId;
+        bool isNew;
+        bool operator<(const Entry& that) const
+        {
+            return make_pair(mismatchCount, cellId) < make_pair(that.mismatchCount, that.cellId);
+        }
+    };
+    vector<Entry> entries(size_t(cellCount) * k);
+    const std::less<Entry> comparator;
+
+    // The mutexes that protect the neighbors of each cell.
+    const size_t mutexCount = 4096;
+    vector<std::mutex> mutexes(mutexCount);
+
+    // Try and add cellId1 as a neighbor of cellId0.
+    // Returns 1 if the neighbors of cellId0 were updated, 0 otherwise.
+    const auto update = [&](CellId cellId0, CellId cellId1, uint32_t mismatchCount) -> size_t
+    {
+        const Entry entry({mismatchCount, cellId1, true});
+        Entry* begin = entries.data() + size_t(cellId0) * k;
+        Entry* end = begin + k;
+        std::lock_guard<std::mutex> lock(mutexes[cellId0 % mutexCount]);
+        if(!(entry < *begin)) {
+            return 0;
+        }
+        for(const Entry* e=begin; e!=end; ++e) {
+            if(e->cellId == cellId1) {
+                return 0;
+            }
+        }
+        popAndPushHeap(begin, end, entry, comparator);
+        return 1;
+    };
+
+
+
+    // Initialize the graph with random neighbors.
+    // The random generator for each cell is seeded using the cell id,
+    // so the initial graph does not depend on the number of threads.
+    cout << timestamp << "Initializing k-NN graph with random neighbors." << endl;
+    const size_t batchSize = 1000;
+    {
+        BatchDispatcher batchDispatcher(cellCount, batchSize);
+        runThreads(threadCount, [&](size_t)
+        {
+            vector<CellId> cellIds1;
+            vector<uint32_t> mismatchCounts;
+            size_t begin, end;
+            while(batchDispatcher.getBatch(begin, end)) {
+                for(CellId cellId0=CellId(begin); cellId0!=CellId(end); cellId0++) {
+                    std::seed_seq seedSequence({seed, cellId0});
+                    std::mt19937 randomGenerator(seedSequence);
+                    std::uniform_int_distribution<CellId> distribution(0, cellCount-1);
+                    cellIds1.clear();
+                    while(cellIds1.size() < k) {
+                        const CellId cellId1 = distribution(randomGenerator);
+                        if(cellId1!=cellId0 && find(cellIds1.begin(), cellIds1.end(), cellId1)==cellIds1.end()) {
+                            cellIds1.push_back(cellId1);
+                        }
+                    }
+                    lsh.computeMismatchCounts(cellId0, cellIds1, mismatchCounts);
+                    Entry* neighbors0 = entries.data() + size_t(cellId0) * k;
+                    for(size_t i=0; i<k; i++) {
+                        neighbors0[i] = Entry({mismatchCounts[i], cellIds1[i], true});
+                    }
+                    std::make_heap(neighbors0, neighbors0 + k, comparator);
+                }
+            }
+        });
+    }
+
+
+
+    // NN-descent iterations.
+    vector< vector<CellId> > newNeighbors(cellCount);
+    vector< vector<CellId> > oldNeighbors(cellCount);
+    vector< vector<CellId> > newReverseNeighbors(cellCount);
+    vector< vector<CellId> > oldReverseNeighbors(cellCount);
+    size_t iteration = 0;
+    for(; iteration<maxIterationCount; iteration++) {
+
+        // Extract new and old neighbors of each cell.
+        // The new neighbors used are a random sample of size at most sampleCount,
+        // and only those are marked as old.
+        // This only touches the neighbors of each cell, so it can be done in parallel.
+        {
+            BatchDispatcher batchDispatcher(cellCount, batchSize);
+            runThreads(threadCount, [&](size_t)
+            {
+                vector<Entry*> newEntries;
+                size_t begin, end;
+                while(batchDispatcher.getBatch(begin, end)) {
+                    for(CellId cellId0=CellId(begin); cellId0!=CellId(end); cellId0++) {
+                        std::seed_seq seedSequence({seed, cellId0, uint32_t(iteration + 1)});
+                        std::mt19937 randomGenerator(seedSequence);
+                        Entry* neighbors0 = entries.data() + size_t(cellId0) * k;
+                        newNeighbors[cellId0].clear();
+                        oldNeighbors[cellId0].clear();
+                        newEntries.clear();
+                        for(size_t i=0; i<k; i++) {
+                            Entry& entry = neighbors0[i];
+                            if(entry.isNew) {
+                                newEntries.push_back(&entry);
+                            } else {
+                                oldNeighbors[cellId0].push_back(entry.cellId);
+                            }
+                        }
+                        if(newEntries.size() > sampleCount) {
+                            std::shuffle(newEntries.begin(), newEntries.end(), randomGenerator);
+                            newEntries.resize(sampleCount);
+                        }
+                        for(Entry* entry: newEntries) {
+                            newNeighbors[cellId0].push_back(entry->cellId);
+                            entry->isNew = false;
+                        }
+                    }
+                }
+            });
+        }
+
+        // Compute reverse neighbors, keeping at most sampleCount of each.
+        // This is done sequentially, so the result does not depend on the number of threads.
+        for(CellId cellId0=0; cellId0<cellCount; cellId0++) {
+            newReverseNeighbors[cellId0].clear();
+            oldReverseNeighbors[cellId0].clear();
+        }
+        for(CellId cellId0=0; cellId0<cellCount; cellId0++) {
+            for(const CellId cellId1: newNeighbors[cellId0]) {
+                if(newReverseNeighbors[cellId1].size() < sampleCount) {
+                    newReverseNeighbors[cellId1].push_back(cellId0);
+                }
+            }
+            for(const CellId cellId1: oldNeighbors[cellId0]) {
+                if(oldReverseNeighbors[cellId1].size() < sampleCount) {
+                    oldReverseNeighbors[cellId1].push_back(cellId0);
+                }
+            }
+        }
+
+        // Local join.
+        std::atomic<size_t> updateCount(0);
+        {
+            BatchDispatcher batchDispatcher(cellCount, batchSize);
+            runThreads(threadCount, [&](size_t)
+            {
+                vector<CellId> newCells;
+                vector<CellId> oldCells;
+                vector<CellId> cellIds2;
+                vector<uint32_t> mismatchCounts;
+                size_t threadUpdateCount = 0;
+                size_t begin, end;
+                while(batchDispatcher.getBatch(begin, end)) {
+                    for(CellId cellId0=CellId(begin); cellId0!=CellId(end); cellId0++) {
+
+                        // Gather the new and old cells for this cell,
+                        // including reverse neighbors, without duplicates.
+                        newCells = newNeighbors[cellId0];
+                        newCells.insert(newCells.end(),
+                            newReverseNeighbors[cellId0].begin(), newReverseNeighbors[cellId0].end());
+                        sort(newCells.begin(), newCells.end());
+                        newCells.erase(unique(newCells.begin(), newCells.end()), newCells.end());
+                        oldCells = oldNeighbors[cellId0];
+                        oldCells.insert(oldCells.end(),
+                            oldReverseNeighbors[cellId0].begin(), oldReverseNeighbors[cellId0].end());
+                        sort(oldCells.begin(), oldCells.end());
+                        oldCells.erase(unique(oldCells.begin(), oldCells.end()), oldCells.end());
+
+                        // Check all pairs of new cells, and all pairs
+                        // made of a new cell and an old cell.
+                        for(size_t i=0; i<newCells.size(); i++) {
+                            const CellId cellId1 = newCells[i];
+                            cellIds2.clear();
+                            for(size_t j=i+1; j<newCells.size(); j++) {
+                                cellIds2.push_back(newCells[j]);
+                            }
+                            for(const CellId cellId2: oldCells) {
+                                if(cellId2 != cellId1) {
+                                    cellIds2.push_back(cellId2);
+                                }
+                            }
+                            lsh.computeMismatchCounts(cellId1, cellIds2, mismatchCounts);
+                            for(size_t j=0; j<cellIds2.size(); j++) {
+                                const CellId cellId2 = cellIds2[j];
+                                threadUpdateCount += update(cellId1, cellId2, mismatchCounts[j]);
+                                threadUpdateCount += update(cellId2, cellId1, mismatchCounts[j]);
+                            }
+                        }
+                    }
+                }
+                updateCount += threadUpdateCount;
+            });
+        }
+
+        cout << timestamp << "NN-descent iteration " << iteration <<
+            ": " << updateCount << " neighbor updates." << endl;
+        if(double(updateCount) < delta * double(k) * double(cellCount)) {
+            ++iteration;
+            break;
+        }
+    }
+    info->iterationCount = iteration;
+
+
+
+    // Store the neighbors of each cell, sorted.
+    for(CellId cellId0=0; cellId0<cellCount; cellId0++) {
+        Entry* neighbors0 = entries.data() + size_t(cellId0) * k;
+        std::sort_heap(neighbors0, neighbors0 + k, comparator);
+        Neighbor* neighbor = neighbors.begin() + size_t(cellId0) * k;
+        for(size_t i=0; i<k; i++, ++neighbor) {
+            neighbor->cellId = neighbors0[i].cellId;
+            neighbor->mismatchCount = neighbors0[i].mismatchCount;
+        }
+    }
+
+    const auto t1 = std::chrono::steady_clock::now();
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    cout << timestamp << "k-NN graph build completed in " << iteration <<
+        " iterations. Took " << t01 << " s." << endl;
+}
@@ -0,0 +1,114 @@
+#ifndef CZI_EXPRESSION_MATRIX2_KNN_GRAPH_HPP
+#define CZI_EXPRESSION_MATRIX2_KNN_GRAPH_HPP
+
+
+// Class KnnGraph is a persistent approximate k-nearest neighbor graph
+// of cells, using the Hamming distance between cell LSH signatures
+// (number of mismatching signature bits).
+// It is built using the NN-descent algorithm:
+// W. Dong, M. Charikar, K. Li,
+// "Efficient K-Nearest Neighbor Graph Construction for Generic Similarity Measures", 2011.
+// NN-descent starts from a random graph and repeatedly
+// improves the neighbors of each cell by looking at neighbors of neighbors.
+// The cost of each iteration is linear in the number of cells
+// and the number of iterations grows slowly with the number of cells.
+
+// The graph is stored in memory mapped files, so it can be
+// accessed again cheaply after it is created.
+
+#include "Ids.hpp"
+#include "MemoryMappedObject.hpp"
+#include "MemoryMappedVector.hpp"
+
+#include "cstddef.hpp"
+#include "cstdint.hpp"
+#include "string.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        class KnnGraph;
+        class Lsh;
+    }
+}
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::KnnGraph {
+public:
+
+    // Create a new KnnGraph object from the signatures of an Lsh object
+    // and store it on disk.
+    // The graph is built using the specified number of threads
+    // (0 to use all available hardware threads).
+    // Because of concurrent updates, the result can depend
+    // slightly on thread scheduling when using more than one thread.
+    KnnGraph(
+        const string& name,             // Name prefix for memory mapped files.
+        Lsh&,                           // The Lsh object containing the cell signatures.
+        size_t k,                       // The number of neighbors of each cell.
+        size_t maxIterationCount,       // The maximum number of NN-descent iterations.
+        double delta,                   // Stop when fewer than delta*k*cellCount neighbors are updated in an iteration.
+        uint32_t seed,                  // Seed used to generate the initial random graph.
+        size_t threadCount              // Number of threads used to build the graph.
+        );
+
+    // Access an existing KnnGraph object.
+    KnnGraph(
+        const string& name              // Name prefix for memory mapped files.
+        );
+
+    // Remove the memory mapped files.
+    void remove();
+
+    // A neighbor of a cell.
+    class Neighbor {
+    public:
+        CellId cellId;
+        uint32_t mismatchCount;
+    };
+
+    CellId cellCount() const
+    {
+        return CellId(info->cellCount);
+    }
+    size_t k() const
+    {
+        return info->k;
+    }
+    size_t lshCount() const
+    {
+        return info->lshCount;
+    }
+
+    // Access the neighbors of a cell,
+    // sorted by increasing mismatch count, then by cell id.
+    const Neighbor* begin(CellId cellId) const
+    {
+        return neighbors.begin() + cellId * k();
+    }
+    const Neighbor* end(CellId cellId) const
+    {
+        return begin(cellId) + k();
+    }
+
+private:
+
+    // The neighbors of all cells. The neighbors of cellId
+    // are stored beginning at position cellId*k().
+    MemoryMapped::Vector<Neighbor> neighbors;
+
+    // Other information for this KnnGraph object.
+    class Info {
+    public:
+        size_t cellCount;
+        size_t k;           // This can be less than the k requested, if there are few cells.
+        size_t lshCount;
+        size_t iterationCount;
+    };
+    MemoryMapped::Object<Info> info;
+
+    // Build the graph using NN-descent.
+    void build(Lsh&, size_t maxIterationCount, double delta, uint32_t seed, size_t threadCount);
+};
+
+#endif
@@ -1,6 +1,8 @@
 #include "Lsh.hpp"
 #include "ExpressionMatrixSubset.hpp"
+#include "mismatchCounts.hpp"
 #include "SimilarPairs.hpp"
+#include "runThreads.hpp"
 #include "timestamp.hpp"
 using namespace ChanZuckerberg;
 using namespace ExpressionMatrix2;
@@ -12,6 +14,7 @@ using namespace ExpressionMatrix2;
 
 #include <chrono>
 #include "fstream.hpp"
+#include "stdexcept.hpp"
 
 
 
@@ -19,13 +22,16 @@ Lsh::Lsh(
     const string& name,             // Name prefix for memory mapped files.
     const ExpressionMatrixSubset& expressionMatrixSubset,
     size_t lshCount,                // Number of LSH hyperplanes
-    uint32_t seed                   // Seed to generate LSH hyperplanes.
+    uint32_t seed,                  // Seed to generate LSH hyperplanes.
+    size_t threadCount              // Number of threads used to compute the signatures.
     )
 {
     // Store the Info object.
     info.createNew(name + "-Info");
     info->lshCount = lshCount;
     info->cellCount = expressionMatrixSubset.cellCount();
+    info->geneCount = expressionMatrixSubset.geneCount();
+    info->seed = seed;
 
     // Generate the LSH vectors.
     cout << timestamp << "Generating LSH vectors." << endl;
@@ -33,7 +39,7 @@ Lsh::Lsh(
 
     // Compute cell signatures.
     cout << timestamp << "Computing cell LSH signatures." << endl;
-    computeCellLshSignatures(name, expressionMatrixSubset);
+    computeCellLshSignatures(name, expressionMatrixSubset, threadCount);
 
     // Compute the similarity table.
     // This is a look up table indexed by the number of mismatching bits.
@@ -46,12 +52,21 @@ Lsh::Lsh(
 
 // Access an existing Lsh object.
 Lsh::Lsh(
-    const string& name              // Name prefix for memory mapped files.
+    const string& name,             // Name prefix for memory mapped files.
+    bool readWriteAccess
     )
 {
     // Access the memory mapped data.
-    info.accessExistingReadOnly(name + "-Info");
-    signatures.accessExistingReadOnly(name + "-Signatures");
+    try {
+        info.accessExisting(name + "-Info", readWriteAccess);
+    } catch(const runtime_error&) {
+        if(hasInfoVersion0(name)) {
+            throw runtime_error("LSH object " + name +
+                " was created by an older version of the code and must be recreated using computeLshSignatures.");
+        }
+        throw;
+    }
+    signatures.accessExisting(name + "-Signatures", readWriteAccess);
 
     // Compute the number of 64 bit words in each cell signature.
     signatureWordCount = (lshCount()-1)/64 + 1;
@@ -64,6 +79,21 @@ Lsh::Lsh(
 }
 
 
+// Return true if the Info object of the Lsh object with the given name
+// uses the layout of class InfoVersion0.
+bool Lsh::hasInfoVersion0(const string& name)
+{
+    MemoryMapped::Object<InfoVersion0> infoVersion0;
+    try {
+        infoVersion0.accessExisting(name + "-Info", false);
+    } catch(const runtime_error&) {
+        return false;
+    }
+    return true;
+}
+
+
+
 // Generate the LSH vectors.
 void Lsh::generateLshVectors(
     size_t geneCount,
@@ -115,9 +145,17 @@ void Lsh::generateLshVectors(
 
 
 // Compute the LSH signatures of all cells in the cell set we are using.
+// If threadCount is not 1, the cells are processed in batches
+// by multiple threads. Each cell signature occupies its own
+// signatureWordCount words in the signatures vector,
+// so threads always write to disjoint portions of it.
+// The computation for each cell is the same regardless
+// of which thread does it, so the signatures are identical
+// to the ones computed using a single thread.
 void Lsh::computeCellLshSignatures(
     const string& name,             // Name prefix for memory mapped files.
-    const ExpressionMatrixSubset& expressionMatrixSubset)
+    const ExpressionMatrixSubset& expressionMatrixSubset,
+    size_t threadCount)
 {
     // Get the number of LSH vectors.
     CZI_ASSERT(!lshVectors.empty());
@@ -131,81 +169,64 @@ void Lsh::computeCellLshSignatures(
     const auto cellCount = expressionMatrixSubset.cellCount();
     CZI_ASSERT(lshVectors.size() == geneCount);
 
-    // Compute the sum of the components of each lsh vector.
-    // It is needed below to compute the contribution of the
-    // expression counts that are zero.
-    vector<double> lshVectorsSums(lshCount, 0.);
-    for(GeneId localGeneId=0; localGeneId!=geneCount; localGeneId++) {
-        const auto& v = lshVectors[localGeneId]; // Components of all LSH vectors for this gene.
-        CZI_ASSERT(v.size() == lshCount);
-        for(size_t i=0; i<lshCount; i++) {
-            lshVectorsSums[i] += v[i];
-        }
-    }
-
     // Initialize the cell signatures.
     cout << timestamp << "Initializing cell LSH signatures." << endl;
     signatures.createNew(name + "-Signatures", cellCount*signatureWordCount);
 
-    // Vector to contain, for a single cell, the scalar products of the shifted
-    // expression vector for the cell with all of the LSH vectors.
-    vector<double> scalarProducts(lshCount);
+    // Compute the signatures.
+    computeCellLshSignatures(expressionMatrixSubset, 0, threadCount);
+}
 
 
 
-    // Loop over all the cells in the cell set we are using.
-    // The CellId is local to the cell set we are using.
-    const CellId messageFrequency = CellId(1.e7 / double(lshCount));
-    cout << timestamp << "Computation of cell LSH signatures begins." << endl;
-    const auto t0 = std::chrono::steady_clock::now();
-    for(CellId localCellId=0; localCellId<cellCount; localCellId++) {
-        if((localCellId % messageFrequency) == 0) {
-            cout << timestamp << "Working on cell " << localCellId << " of " << cellCount << endl;
-        }
+// Compute the signatures of all cells of an ExpressionMatrixSubset
+// and store them beginning at the signature of cell firstCellId.
+// The signatures vector must already have been sized accordingly
+// and the signatures of these cells must be all zero.
+void Lsh::computeCellLshSignatures(
+    const ExpressionMatrixSubset& expressionMatrixSubset,
+    CellId firstCellId,
+    size_t threadCount)
+{
+    const size_t lshCount = info->lshCount;
+    const auto geneCount = expressionMatrixSubset.geneCount();
+    const auto cellCount = expressionMatrixSubset.cellCount();
+    CZI_ASSERT(lshVectors.size() == geneCount);
+    CZI_ASSERT((size_t(firstCellId) + size_t(cellCount)) * signatureWordCount <= signatures.size());
 
-        // Compute the mean of the expression vector for this cell.
-        const ExpressionMatrixSubset::Sum& sum = expressionMatrixSubset.sums[localCellId];
-        const double mean = sum.sum1 / double(geneCount);
-
-        // If U is one of the LSH vectors, we need to compute the scalar product
-        // s = X*U, where X is the cell expression vector, shifted to zero mean:
-        // X = x - mean,
-        // mean = sum(x)/geneCount (computed above).
-        // We get:
-        // s = (x-mean)*U = x*U - mean*U = x*U - mean*sum(U)
-        // We computed sum(U) above and stored it in lshVectorSums for
-        // each of the LSH vectors.
-        // Initialize the scalar products for this cell
-        // with all of the LSH vectors to -mean*sum(U).
-        for(size_t i=0; i<lshCount; i++) {
-            scalarProducts[i] = -mean * lshVectorsSums[i];
-        }
+    // Compute the sum of the components of each lsh vector.
+    // It is needed to compute the contribution of the
+    // expression counts that are zero.
+    const vector<double> lshVectorsSums = computeLshVectorsSums();
 
-        // Now add to each scalar product the x*U portion.
-        // For performance, the loop over genes is outside,
-        // which gives better memory locality.
-        // Add the contributions of the non-zero expression counts for this cell.
-        for(const auto& p : expressionMatrixSubset.cellExpressionCounts[localCellId]) {
-            const GeneId localGeneId = p.first;
-            const double count = double(p.second);
-
-            // Add the contribution of this gene to the scalar products.
-            const auto& v = lshVectors[localGeneId];
-            CZI_ASSERT(v.size() == lshCount);
-            for(size_t i=0; i<lshCount; i++) {
-                scalarProducts[i] += count * v[i];
-            }
-        }
 
-        // Set to 1 the signature bits corresponding to positive scalar products.
-        BitSetPointer cellSignature = getSignature(localCellId);
-        for(size_t i=0; i<lshCount; i++) {
-            if(scalarProducts[i]>0.) {
-                cellSignature.set(i);
+
+    // Loop over all the cells in the cell set we are using.
+    // The CellId is local to the cell set we are using.
+    threadCount = getThreadCount(threadCount);
+    const CellId messageFrequency = max(CellId(1), CellId(1.e7 / double(lshCount)));
+    cout << timestamp << "Computation of cell LSH signatures begins using " <<
+        threadCount << " threads." << endl;
+    const auto t0 = std::chrono::steady_clock::now();
+    const size_t batchSize = 1024;
+    BatchDispatcher batchDispatcher(cellCount, batchSize);
+    runThreads(threadCount, [&](size_t threadId)
+    {
+        // Vector to contain, for a single cell, the scalar products of the shifted
+        // expression vector for the cell with all of the LSH vectors.
+        vector<double> scalarProducts(lshCount);
+
+        size_t begin, end;
+        while(batchDispatcher.getBatch(begin, end)) {
+            for(CellId localCellId=CellId(begin); localCellId!=CellId(end); localCellId++) {
+                if(threadId==0 && (localCellId % messageFrequency) == 0) {
+                    cout << timestamp << "Working on cell " << localCellId << " of " << cellCount << endl;
+                }
+                computeCellLshSignature(expressionMatrixSubset, lshVectorsSums,
+                    localCellId, firstCellId + localCellId, scalarProducts);
             }
         }
-
-    }
+    });
     const auto t1 = std::chrono::steady_clock::now();
     cout << timestamp << "Computation of cell LSH signatures ends." << endl;
     const size_t nonZeroExpressionCount = expressionMatrixSubset.totalExpressionCounts();
@@ -225,6 +246,107 @@ void Lsh::computeCellLshSignatures(
 
 
 
+// Compute the sum of the components of each LSH vector.
+vector<double> Lsh::computeLshVectorsSums() const
+{
+    const size_t lshCount = info->lshCount;
+    vector<double> lshVectorsSums(lshCount, 0.);
+    for(const auto& v: lshVectors) {    // Components of all LSH vectors for one gene.
+        CZI_ASSERT(v.size() == lshCount);
+        for(size_t i=0; i<lshCount; i++) {
+            lshVectorsSums[i] += v[i];
+        }
+    }
+    return lshVectorsSums;
+}
+
+
+
+// Compute signatures for additional cells and append them
+// to an existing Lsh object.
+void Lsh::appendCells(
+    const ExpressionMatrixSubset& expressionMatrixSubset,   // For the new cells only.
+    size_t threadCount)
+{
+    if(expressionMatrixSubset.geneCount() != info->geneCount) {
+        throw runtime_error("Cannot append cells to an Lsh object using a different gene set.");
+    }
+
+    // Regenerate the LSH vectors, if necessary.
+    if(lshVectors.empty()) {
+        generateLshVectors(info->geneCount, info->lshCount, info->seed);
+    }
+
+    // Make space for the new signatures. The new space is zero-initialized.
+    const CellId oldCellCount = cellCount();
+    const CellId newCellCount = CellId(oldCellCount + expressionMatrixSubset.cellCount());
+    signatures.resize(size_t(newCellCount) * signatureWordCount);
+
+    // Compute the new signatures.
+    computeCellLshSignatures(expressionMatrixSubset, oldCellCount, threadCount);
+    info->cellCount = newCellCount;
+    signatures.syncToDisk();
+    info.syncToDisk();
+}
+
+
+// Compute the LSH signature of a single cell.
+void Lsh::computeCellLshSignature(
+    const ExpressionMatrixSubset& expressionMatrixSubset,
+    const vector<double>& lshVectorsSums,
+    CellId localCellId,
+    CellId cellId,
+    vector<double>& scalarProducts)
+{
+    const size_t lshCount = info->lshCount;
+    const auto geneCount = expressionMatrixSubset.geneCount();
+    CZI_ASSERT(scalarProducts.size() == lshCount);
+
+    // Compute the mean of the expression vector for this cell.
+    const ExpressionMatrixSubset::Sum& sum = expressionMatrixSubset.sums[localCellId];
+    const double mean = sum.sum1 / double(geneCount);
+
+    // If U is one of the LSH vectors, we need to compute the scalar product
+    // s = X*U, where X is the cell expression vector, shifted to zero mean:
+    // X = x - mean,
+    // mean = sum(x)/geneCount (computed above).
+    // We get:
+    // s = (x-mean)*U = x*U - mean*U = x*U - mean*sum(U)
+    // We computed sum(U) above and stored it in lshVectorSums for
+    // each of the LSH vectors.
+    // Initialize the scalar products for this cell
+    // with all of the LSH vectors to -mean*sum(U).
+    for(size_t i=0; i<lshCount; i++) {
+        scalarProducts[i] = -mean * lshVectorsSums[i];
+    }
+
+    // Now add to each scalar product the x*U portion.
+    // For performance, the loop over genes is outside,
+    // which gives better memory locality.
+    // Add the contributions of the non-zero expression counts for this cell.
+    for(const auto& p : expressionMatrixSubset.cellExpressionCounts[localCellId]) {
+        const GeneId localGeneId = p.first;
+        const double count = double(p.second);
+
+        // Add the contribution of this gene to the scalar products.
+        const auto& v = lshVectors[localGeneId];
+        CZI_ASSERT(v.size() == lshCount);
+        for(size_t i=0; i<lshCount; i++) {
+            scalarProducts[i] += count * v[i];
+        }
+    }
+
+    // Set to 1 the signature bits corresponding to positive scalar products.
+    BitSetPointer cellSignature = getSignature(cellId);
+    for(size_t i=0; i<lshCount; i++) {
+        if(scalarProducts[i]>0.) {
+            cellSignature.set(i);
+        }
+    }
+}
+
+
+
 // Compute the similarity (cosine of the angle) corresponding to each number of mismatching bits.
 void Lsh::computeSimilarityTable()
 {
@@ -275,6 +397,44 @@ size_t Lsh::computeMismatchCount(CellId localCellId0, CellId localCellId1)
 
 
 
+// Compute the number of mismatching signature bits between one cell
+// and a range of cells.
+void Lsh::computeMismatchCounts(
+    CellId localCellId0,
+    CellId localCellId1Begin,
+    CellId localCellId1End,
+    uint32_t* mismatchCounts)
+{
+    CZI_ASSERT(localCellId1Begin <= localCellId1End);
+    ExpressionMatrix2::computeMismatchCounts(
+        getSignature(localCellId0).begin,
+        getSignature(localCellId1Begin).begin,
+        signatureWordCount,
+        localCellId1End - localCellId1Begin,
+        mismatchCounts);
+}
+
+
+
+// Compute the number of mismatching signature bits between one cell
+// and a given list of cells.
+void Lsh::computeMismatchCounts(
+    CellId localCellId0,
+    const vector<CellId>& localCellIds1,
+    vector<uint32_t>& mismatchCounts)
+{
+    mismatchCounts.resize(localCellIds1.size());
+    ExpressionMatrix2::computeMismatchCounts(
+        getSignature(localCellId0).begin,
+        signatures.begin(),
+        signatureWordCount,
+        localCellIds1.data(),
+        localCellIds1.size(),
+        mismatchCounts.data());
+}
+
+
+
 // Write to a csv file statistics of the cell LSH signatures..
 void Lsh::writeSignatureStatistics(const string& csvFileName)
 {
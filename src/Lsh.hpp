@@ -38,16 +38,34 @@ public:
     // Create a new Lsh object and store it on disk.
     // This can be expensive as it requires creating LSH signatures
     // for all cells in the specified cell set.
+    // The signatures are computed using the specified number of threads
+    // (0 to use all available hardware threads).
+    // The signatures are identical regardless of the number of threads used.
     Lsh(
         const string& name,             // Name prefix for memory mapped files.
         const ExpressionMatrixSubset&,  // For a subset of genes and cells.
         size_t lshCount,                // Number of LSH hyperplanes
-        uint32_t seed                   // Seed to generate LSH hyperplanes.
+        uint32_t seed,                  // Seed to generate LSH hyperplanes.
+        size_t threadCount = 1          // Number of threads used to compute the signatures.
         );
 
     // Access an existing Lsh object.
+    // Write access is only needed to append cells.
     Lsh(
-        const string& name              // Name prefix for memory mapped files.
+        const string& name,             // Name prefix for memory mapped files.
+        bool readWriteAccess = false
+        );
+
+    // Compute signatures for additional cells and append them
+    // to an existing Lsh object, which must have been accessed with write access.
+    // The ExpressionMatrixSubset must contain only the new cells,
+    // and must use the same gene set used to create the Lsh object.
+    // The LSH vectors are regenerated from the seed used to create the Lsh object,
+    // so the new signatures are consistent with the existing ones.
+    // The cost is proportional to the number of new cells.
+    void appendCells(
+        const ExpressionMatrixSubset&,  // For the new cells only.
+        size_t threadCount              // Number of threads used to compute the signatures.
         );
 
     // Remove the memory mapped files.
@@ -58,6 +76,23 @@ public:
     double computeCellSimilarity(CellId localCellId0, CellId localCellId1);
     size_t computeMismatchCount(CellId localCellId0, CellId localCellId1);
 
+    // Compute the number of mismatching signature bits between one cell
+    // and many cells, using the fastest kernel supported by the cpu
+    // (see mismatchCounts.hpp).
+    // The first version computes mismatch counts for cells in the range
+    // [localCellId1Begin, localCellId1End), whose signatures
+    // are contiguous in memory.
+    // The second version computes mismatch counts for the given cells.
+    void computeMismatchCounts(
+        CellId localCellId0,
+        CellId localCellId1Begin,
+        CellId localCellId1End,
+        uint32_t* mismatchCounts);
+    void computeMismatchCounts(
+        CellId localCellId0,
+        const vector<CellId>& localCellIds1,
+        vector<uint32_t>& mismatchCounts);
+
 
     // Get the signature corresponding to a given CellId (local to the cell set).
     BitSetPointer getSignature(CellId cellId)
@@ -94,6 +129,22 @@ public:
         CZI_ASSERT(0);
     }
 
+    // Return the number of mismatching bits below which
+    // the similarity is greater than the given threshold, that is,
+    // the first mismatch count for which the similarity is not.
+    // Returns 0 if no mismatch count qualifies (threshold 1 or more),
+    // and lshCount()+1 if all of them do (threshold less than -1).
+    // The similarity table is a decreasing function of the mismatch count.
+    uint32_t computeMismatchCountBound(double similarityThreshold) const
+    {
+        uint32_t mismatchCountBound = 0;
+        while(mismatchCountBound<similarityTable.size() &&
+            similarityTable[mismatchCountBound]>similarityThreshold) {
+            ++mismatchCountBound;
+        }
+        return mismatchCountBound;
+    }
+
     double getSimilarity(size_t mismatchCount) const
     {
         return similarityTable[mismatchCount];
@@ -126,7 +177,32 @@ private:
     // with the LSH vector corresponding to the bit position is positive,
     // and negative otherwise.
     MemoryMapped::Vector<uint64_t> signatures;
-    void computeCellLshSignatures(const string& name, const ExpressionMatrixSubset&);
+    void computeCellLshSignatures(
+        const string& name,
+        const ExpressionMatrixSubset&,
+        size_t threadCount);
+
+    // Compute the signatures of all cells of an ExpressionMatrixSubset
+    // and store them beginning at the signature of cell firstCellId.
+    void computeCellLshSignatures(
+        const ExpressionMatrixSubset&,
+        CellId firstCellId,
+        size_t threadCount);
+
+    // Compute the sum of the components of each LSH vector.
+    vector<double> computeLshVectorsSums() const;
+
+    // Compute the LSH signature of a single cell
+    // and store it as the signature of cellId.
+    // This only writes to the portion of the signatures vector
+    // that belongs to this cell, so it can be called
+    // concurrently for distinct cells.
+    void computeCellLshSignature(
+        const ExpressionMatrixSubset&,
+        const vector<double>& lshVectorsSums,   // The sum of the components of each LSH vector.
+        CellId localCellId,                     // The cell id in the ExpressionMatrixSubset.
+        CellId cellId,                          // The cell id in this Lsh object.
+        vector<double>& scalarProducts);        // Work area of size lshCount.
 
     // The similarity (cosine of the angle) corresponding to each number of mismatching bits.
     vector<double> similarityTable;
@@ -137,9 +213,24 @@ private:
     public:
         size_t cellCount;
         size_t lshCount;
+
+        // The number of genes and the seed used to generate the LSH vectors.
+        // They are used to regenerate the LSH vectors when appending cells.
+        size_t geneCount;
+        uint32_t seed;
     };
     MemoryMapped::Object<Info> info;
 
+    // The Info layout used before geneCount and seed were added.
+    // Lsh objects that use it are detected, so we can
+    // report that they must be recreated.
+    class InfoVersion0 {
+    public:
+        size_t cellCount;
+        size_t lshCount;
+    };
+    static bool hasInfoVersion0(const string& name);
+
 
 
     // Private data and functions used for computations on GPUs using OpenCL.
@@ -0,0 +1,735 @@
+// Class LshBuckets stores the assignment of cells to LSH buckets.
+// See LshBuckets.hpp for more information.
+
+#include "LshBuckets.hpp"
+#include "BitSet.hpp"
+#include "CZI_ASSERT.hpp"
+#include "filesystem.hpp"
+#include "Lsh.hpp"
+#include "MurmurHash2.hpp"
+#include "runThreads.hpp"
+#include "timestamp.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include "algorithm.hpp"
+#include "iostream.hpp"
+#include "stdexcept.hpp"
+#include "utility.hpp"
+
+#include <chrono>
+
+
+
+// Return the name prefix of the memory mapped files for the buckets
+// of the Lsh object with the given name prefix and the given parameters.
+// For example, for slice lengths 32, 16, 8 and log2BucketCount 20
+// the name is lshName + "-Buckets-32_16_8-20".
+string LshBuckets::getName(
+    const string& lshName,
+    const vector<int>& lshSliceLengths,
+    size_t log2BucketCount)
+{
+    string name = lshName + "-Buckets-";
+    for(size_t i=0; i<lshSliceLengths.size(); i++) {
+        if(i != 0) {
+            name += "_";
+        }
+        name += std::to_string(lshSliceLengths[i]);
+    }
+    name += "-" + std::to_string(log2BucketCount);
+    return name;
+}
+
+
+
+// Access the buckets if they exist and are consistent with the Lsh object
+// and parameters, adding any cells that were appended to the Lsh object.
+// Otherwise, create them.
+void LshBuckets::accessOrCreate(
+    const string& name,
+    Lsh& lsh,
+    const vector<int>& lshSliceLengths,
+    size_t log2BucketCount,
+    size_t threadCount)
+{
+    if(filesystem::exists(name + "-Info")) {
+
+        // Access the existing buckets with write access, which is needed
+        // to add cells. If that fails (for example, in a read-only directory),
+        // try read-only access, which is sufficient if no cells need to be added.
+        bool isConsistent = true;
+        bool readWriteAccess = true;
+        try {
+            accessExisting(name, true);
+        } catch(const runtime_error&) {
+            close();
+            readWriteAccess = false;
+            try {
+                accessExisting(name, false);
+            } catch(const runtime_error&) {
+                isConsistent = false;
+            }
+        }
+
+        // Check that the existing buckets were created with the
+        // same parameters and for the same Lsh object.
+        isConsistent = isConsistent &&
+            info->lshCount == lsh.lshCount() &&
+            info->log2BucketCount == log2BucketCount &&
+            info->cellCount <= lsh.cellCount() &&
+            info->checksumCellCount <= info->cellCount &&
+            sliceLengths.size() == lshSliceLengths.size() &&
+            equal(sliceLengths.begin(), sliceLengths.end(), lshSliceLengths.begin());
+        if(isConsistent) {
+            isConsistent = (info->signatureChecksum ==
+                updateSignatureChecksum(lsh, 0, CellId(info->checksumCellCount), signatureChecksumSeed));
+        }
+
+        if(isConsistent) {
+            if(!readWriteAccess && (info->checksumCellCount < cellCount() || cellCount() < lsh.cellCount())) {
+                throw runtime_error("LSH buckets " + name + " need to be updated "
+                    "but cannot be accessed with write access.");
+            }
+            if(info->checksumCellCount < cellCount()) {
+                updateSignatureChecksum(lsh, cellCount());
+                info.syncToDisk();
+            }
+            if(cellCount() < lsh.cellCount()) {
+                appendCells(lsh, threadCount);
+            } else {
+                cout << timestamp << "Using existing LSH buckets " << name << endl;
+            }
+            return;
+        }
+
+        // The existing buckets cannot be used. Recreate them.
+        cout << timestamp << "Existing LSH buckets " << name <<
+            " are inconsistent with the LSH object and will be recreated." << endl;
+        remove();
+    }
+
+    createNew(name, lsh, lshSliceLengths, log2BucketCount, threadCount);
+}
+
+
+
+// Create new buckets for all cells of the Lsh object.
+void LshBuckets::createNew(
+    const string& name,
+    Lsh& lsh,
+    const vector<int>& lshSliceLengths,
+    size_t log2BucketCount,
+    size_t threadCount)
+{
+    // Check that the slice lengths are in decreasing order.
+    const size_t sliceLengthCount = lshSliceLengths.size();
+    for(size_t i=1; i<sliceLengthCount; i++) {
+        if(lshSliceLengths[i] >= lshSliceLengths[i-1]) {
+            throw runtime_error("The slice lengths are not in decreasing order.");
+        }
+    }
+
+    // Check that the slice lengths are between 1 and 64.
+    for(size_t i=0; i<sliceLengthCount; i++) {
+        if(lshSliceLengths[i]<1 || lshSliceLengths[i]>64) {
+            throw runtime_error("Each slice length must be between 1 and 64 bits.");
+        }
+    }
+    if(log2BucketCount > 32) {
+        throw runtime_error("log2BucketCount can be at most 32.");
+    }
+
+    cout << timestamp << "Creating LSH buckets " << name << endl;
+    const auto t0 = std::chrono::steady_clock::now();
+    this->name = name;
+
+    // Store the Info object and the slice lengths.
+    // The Info object is created under a temporary name
+    // and renamed after all the other files are complete,
+    // so accessOrCreate never sees partially filled buckets.
+    info.createNew(name + "-Info-tmp");
+    info->cellCount = lsh.cellCount();
+    info->lshCount = lsh.lshCount();
+    info->log2BucketCount = log2BucketCount;
+    info->checksumCellCount = 0;
+    info->signatureChecksum = signatureChecksumSeed;
+    updateSignatureChecksum(lsh, lsh.cellCount());
+    sliceLengths.createNew(name + "-SliceLengths", sliceLengthCount);
+    copy(lshSliceLengths.begin(), lshSliceLengths.end(), sliceLengths.begin());
+    computeDerivedData();
+    for(size_t sliceLengthId=0; sliceLengthId<sliceLengthCount; sliceLengthId++) {
+        cout << "Number of slices of length " << sliceLength(sliceLengthId) << " is " << sliceCount(sliceLengthId);
+        cout << ". Table size is " << tableSizes[sliceLengthId] << endl;
+    }
+
+    // Assign cells to buckets.
+    buckets.createNew(name + "-Cells");
+    fill(lsh, 0, lsh.cellCount(), buckets, 0, getThreadCount(threadCount));
+    mainCellCount = lsh.cellCount();
+    segments.clear();
+    writeSegmentRanges(cellCount());
+    buckets.syncToDisk();
+    sliceLengths.syncToDisk();
+    info.close();
+    filesystem::rename(name + "-Info-tmp", name + "-Info");
+    info.accessExisting(name + "-Info", true);
+
+    const auto t1 = std::chrono::steady_clock::now();
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    cout << timestamp << "Creation of LSH buckets took " << t01 << " s." << endl;
+}
+
+
+
+// Access existing buckets.
+// This throws if the segments are missing or inconsistent with the main buckets.
+void LshBuckets::accessExisting(const string& name, bool readWriteAccess)
+{
+    this->name = name;
+    info.accessExisting(name + "-Info", readWriteAccess);
+    sliceLengths.accessExisting(name + "-SliceLengths", false);
+    buckets.accessExisting(name + "-Cells", false);
+    computeDerivedData();
+
+    const size_t tableCount = this->tableCount();
+    if(tableCount == 0 || buckets.totalSize() % tableCount != 0) {
+        throw runtime_error("LSH buckets " + name + " are inconsistent.");
+    }
+    mainCellCount = CellId(buckets.totalSize() / tableCount);
+
+    // If mergeIntoMainBuckets was interrupted after replacing the main buckets,
+    // they contain more cells than info->cellCount.
+    // The Lsh object already contains these cells, so we can use them.
+    if(mainCellCount > cellCount()) {
+        if(!readWriteAccess) {
+            throw runtime_error("LSH buckets " + name + " are inconsistent.");
+        }
+        info->cellCount = mainCellCount;
+        info.syncToDisk();
+    }
+
+    accessSegments();
+}
+
+
+
+// Access the segments that contain the cells in [mainCellCount, cellCount()).
+// Segments that start before mainCellCount were merged into the main buckets
+// and are ignored.
+void LshBuckets::accessSegments()
+{
+    segments.clear();
+    const string segmentsName = getSegmentsName(cellCount());
+    if(filesystem::exists(segmentsName)) {
+        segmentRanges.accessExisting(segmentsName, false);
+        for(const auto& range: segmentRanges) {
+            if(range.first < mainCellCount) {
+                continue;
+            }
+            const CellId expectedCellIdBegin = segments.empty() ? mainCellCount : segments.back()->cellIdEnd;
+            if(range.first != expectedCellIdBegin || range.second <= range.first) {
+                throw runtime_error("LSH buckets " + name + " have inconsistent segments.");
+            }
+            const shared_ptr<Segment> segment = std::make_shared<Segment>();
+            segment->cellIdBegin = range.first;
+            segment->cellIdEnd = range.second;
+            const string segmentName = getSegmentName(range.first, range.second);
+            segment->bucketIndexes.accessExisting(segmentName + "-BucketIndexes", false);
+            segment->cellIds.accessExisting(segmentName + "-CellIds", false);
+            segments.push_back(segment);
+        }
+    }
+
+    const CellId segmentsCellIdEnd = segments.empty() ? mainCellCount : segments.back()->cellIdEnd;
+    if(segmentsCellIdEnd != cellCount()) {
+        throw runtime_error("LSH buckets " + name + " have missing segments.");
+    }
+}
+
+
+
+// Write the cell id ranges of the segments to the file for the given cell count.
+void LshBuckets::writeSegmentRanges(CellId cellCount)
+{
+    if(segmentRanges.isOpen) {
+        segmentRanges.close();
+    }
+    segmentRanges.createNew(getSegmentsName(cellCount), segments.size());
+    for(size_t i=0; i<segments.size(); i++) {
+        segmentRanges[i] = make_pair(segments[i]->cellIdBegin, segments[i]->cellIdEnd);
+    }
+    segmentRanges.syncToDisk();
+}
+
+
+
+string LshBuckets::getSegmentsName(CellId cellCount) const
+{
+    return name + "-Segments-" + std::to_string(cellCount);
+}
+string LshBuckets::getSegmentName(CellId cellIdBegin, CellId cellIdEnd) const
+{
+    return name + "-Segment-" + std::to_string(cellIdBegin) + "-" + std::to_string(cellIdEnd);
+}
+
+
+
+// Add to the buckets the cells of the Lsh object that are not already present.
+// The new cells are stored in a new segment, which is then merged
+// with the preceding segments that are not larger.
+// When the segments contain more than a quarter as many cells as the
+// main buckets, they are merged into the main buckets instead.
+// Rewriting the main buckets then costs at most a constant
+// amount per cell added since the last time they were rewritten.
+// The new files are written before info->cellCount is updated,
+// and the files they replace are removed after that,
+// so the buckets are not left in an inconsistent state
+// if this is interrupted.
+void LshBuckets::appendCells(Lsh& lsh, size_t threadCount)
+{
+    const CellId oldCellCount = cellCount();
+    const CellId newCellCount = lsh.cellCount();
+    CZI_ASSERT(newCellCount >= oldCellCount);
+    if(newCellCount == oldCellCount) {
+        return;
+    }
+    cout << timestamp << "Adding " << newCellCount-oldCellCount << " cells to LSH buckets " << name << endl;
+    threadCount = getThreadCount(threadCount);
+
+    if(4 * size_t(newCellCount - mainCellCount) > size_t(mainCellCount)) {
+        mergeIntoMainBuckets(lsh, newCellCount, threadCount);
+        return;
+    }
+
+    // Create a segment for the new cells, then merge it with
+    // the preceding segments that are not larger.
+    vector< shared_ptr<Segment> > obsoleteSegments;
+    shared_ptr<Segment> segment = createSegment(lsh, oldCellCount, newCellCount, threadCount);
+    while(!segments.empty() && segments.back()->cellCount() <= segment->cellCount()) {
+        const shared_ptr<Segment> mergedSegment = mergeSegments(*segments.back(), *segment);
+        obsoleteSegments.push_back(segments.back());
+        obsoleteSegments.push_back(segment);
+        segments.pop_back();
+        segment = mergedSegment;
+    }
+    segments.push_back(segment);
+    cout << "The LSH buckets now have " << segments.size() << " segments." << endl;
+
+    // Store the new segment ranges, then update the cell count.
+    const string oldSegmentsName = getSegmentsName(oldCellCount);
+    writeSegmentRanges(newCellCount);
+    updateSignatureChecksum(lsh, newCellCount);
+    info->cellCount = newCellCount;
+    info.syncToDisk();
+
+    // Remove the files that are no longer used.
+    for(const auto& obsoleteSegment: obsoleteSegments) {
+        obsoleteSegment->remove();
+    }
+    if(filesystem::exists(oldSegmentsName)) {
+        filesystem::remove(oldSegmentsName);
+    }
+}
+
+
+
+// Merge the segments into the main buckets and add the cells
+// up to newCellCount. The new main buckets are constructed in temporary files
+// which then replace the old ones.
+void LshBuckets::mergeIntoMainBuckets(Lsh& lsh, CellId newCellCount, size_t threadCount)
+{
+    const CellId oldCellCount = cellCount();
+    cout << timestamp << "Rewriting the main LSH buckets " << name << endl;
+
+    // The segment cells are obtained again from the Lsh signatures.
+    MemoryMapped::VectorOfVectors<CellId, uint64_t> newBuckets;
+    newBuckets.createNew(name + "-Cells-tmp");
+    fill(lsh, mainCellCount, newCellCount, newBuckets, &buckets, threadCount);
+    newBuckets.close();
+    buckets.close();
+    filesystem::rename(name + "-Cells-tmp.toc", name + "-Cells.toc");
+    filesystem::rename(name + "-Cells-tmp.data", name + "-Cells.data");
+    buckets.accessExisting(name + "-Cells", false);
+    mainCellCount = newCellCount;
+
+    const vector< shared_ptr<Segment> > obsoleteSegments = segments;
+    segments.clear();
+    const string oldSegmentsName = getSegmentsName(oldCellCount);
+    writeSegmentRanges(newCellCount);
+    updateSignatureChecksum(lsh, newCellCount);
+    info->cellCount = newCellCount;
+    info.syncToDisk();
+
+    for(const auto& obsoleteSegment: obsoleteSegments) {
+        obsoleteSegment->remove();
+    }
+    if(filesystem::exists(oldSegmentsName)) {
+        filesystem::remove(oldSegmentsName);
+    }
+}
+
+
+
+// Create a segment for the cells in [cellIdBegin, cellIdEnd).
+// The entries of each table are computed and sorted by a single thread.
+// Since global bucket indexes increase with the table,
+// the entries end up sorted by global bucket index, then by cell id.
+shared_ptr<LshBuckets::Segment> LshBuckets::createSegment(
+    Lsh& lsh,
+    CellId cellIdBegin,
+    CellId cellIdEnd,
+    size_t threadCount)
+{
+    const vector< pair<size_t, size_t> > tables = getTables();
+    const size_t n = cellIdEnd - cellIdBegin;
+    vector< pair<uint64_t, CellId> > entries(tables.size() * n);
+    BatchDispatcher batchDispatcher(tables.size(), 1);
+    runThreads(threadCount, [&](size_t)
+    {
+        size_t begin, end;
+        while(batchDispatcher.getBatch(begin, end)) {
+            for(size_t table=begin; table!=end; table++) {
+                const size_t sliceLengthId = tables[table].first;
+                const size_t sliceId = tables[table].second;
+                const size_t tableBegin = getTableBegin(sliceLengthId, sliceId);
+                const auto& sliceBits1 = sliceBits[sliceLengthId][sliceId];
+                const auto tableEntriesBegin = entries.begin() + table * n;
+                for(size_t i=0; i<n; i++) {
+                    const CellId cellId = CellId(cellIdBegin + i);
+                    const uint64_t signatureSlice = lsh.getSignature(cellId).getBits(sliceBits1);
+                    tableEntriesBegin[i] = make_pair(tableBegin + getBucketId(sliceLengthId, signatureSlice), cellId);
+                }
+                sort(tableEntriesBegin, tableEntriesBegin + n);
+            }
+        }
+    });
+
+    const shared_ptr<Segment> segment = std::make_shared<Segment>();
+    segment->cellIdBegin = cellIdBegin;
+    segment->cellIdEnd = cellIdEnd;
+    const string segmentName = getSegmentName(cellIdBegin, cellIdEnd);
+    segment->bucketIndexes.createNew(segmentName + "-BucketIndexes", entries.size());
+    segment->cellIds.createNew(segmentName + "-CellIds", entries.size());
+    for(size_t i=0; i<entries.size(); i++) {
+        segment->bucketIndexes[i] = entries[i].first;
+        segment->cellIds[i] = entries[i].second;
+    }
+    segment->bucketIndexes.syncToDisk();
+    segment->cellIds.syncToDisk();
+    return segment;
+}
+
+
+
+// Merge two adjacent segments into a new segment.
+// All cells of the first segment precede those of the second,
+// so for equal bucket indexes the entries of the first segment go first.
+shared_ptr<LshBuckets::Segment> LshBuckets::mergeSegments(const Segment& segment0, const Segment& segment1)
+{
+    CZI_ASSERT(segment0.cellIdEnd == segment1.cellIdBegin);
+    const shared_ptr<Segment> segment = std::make_shared<Segment>();
+    segment->cellIdBegin = segment0.cellIdBegin;
+    segment->cellIdEnd = segment1.cellIdEnd;
+    const size_t size0 = segment0.bucketIndexes.size();
+    const size_t size1 = segment1.bucketIndexes.size();
+    const string segmentName = getSegmentName(segment->cellIdBegin, segment->cellIdEnd);
+    segment->bucketIndexes.createNew(segmentName + "-BucketIndexes", size0 + size1);
+    segment->cellIds.createNew(segmentName + "-CellIds", size0 + size1);
+
+    size_t i0 = 0;
+    size_t i1 = 0;
+    for(size_t i=0; i<size0+size1; i++) {
+        if(i1 == size1 || (i0 != size0 && segment0.bucketIndexes[i0] <= segment1.bucketIndexes[i1])) {
+            segment->bucketIndexes[i] = segment0.bucketIndexes[i0];
+            segment->cellIds[i] = segment0.cellIds[i0];
+            ++i0;
+        } else {
+            segment->bucketIndexes[i] = segment1.bucketIndexes[i1];
+            segment->cellIds[i] = segment1.cellIds[i1];
+            ++i1;
+        }
+    }
+    segment->bucketIndexes.syncToDisk();
+    segment->cellIds.syncToDisk();
+    return segment;
+}
+
+
+
+// Add at the end of the given vector the cells in a bucket:
+// first those in the main buckets, then those in each segment.
+void LshBuckets::getBucket(
+    size_t sliceLengthId,
+    size_t sliceId,
+    uint64_t bucketId,
+    vector< MemoryAsContainer<const CellId> >& bucketRanges) const
+{
+    const uint64_t bucketIndex = getTableBegin(sliceLengthId, sliceId) + bucketId;
+    bucketRanges.push_back(buckets[bucketIndex]);
+    for(const auto& segmentPointer: segments) {
+        const Segment& segment = *segmentPointer;
+        const uint64_t* bucketIndexes = segment.bucketIndexes.begin();
+        const auto range = std::equal_range(bucketIndexes, segment.bucketIndexes.end(), bucketIndex);
+        if(range.first != range.second) {
+            const CellId* cellIds = segment.cellIds.begin();
+            bucketRanges.push_back(MemoryAsContainer<const CellId>(
+                cellIds + (range.first - bucketIndexes),
+                cellIds + (range.second - bucketIndexes)));
+        }
+    }
+}
+
+
+
+// Remove the memory mapped files.
+// This can be called after accessExisting failed, so files
+// that could not be opened are removed by name.
+void LshBuckets::remove()
+{
+    for(const auto& segment: segments) {
+        segment->remove();
+    }
+    segments.clear();
+    if(segmentRanges.isOpen) {
+        segmentRanges.remove();
+    }
+    const auto removeIfExists = [](const string& fileName)
+    {
+        if(filesystem::exists(fileName)) {
+            filesystem::remove(fileName);
+        }
+    };
+    if(buckets.isOpen()) {
+        buckets.remove();
+    } else {
+        removeIfExists(name + "-Cells.toc");
+        removeIfExists(name + "-Cells.data");
+    }
+    if(sliceLengths.isOpen) {
+        sliceLengths.remove();
+    } else {
+        removeIfExists(name + "-SliceLengths");
+    }
+    if(info.isOpen) {
+        info.remove();
+    } else {
+        removeIfExists(name + "-Info");
+    }
+}
+
+
+
+// Close the memory mapped files that are open.
+void LshBuckets::close()
+{
+    segments.clear();
+    if(segmentRanges.isOpen) {
+        segmentRanges.close();
+    }
+    if(buckets.isOpen()) {
+        buckets.close();
+    }
+    if(sliceLengths.isOpen) {
+        sliceLengths.close();
+    }
+    if(info.isOpen) {
+        info.close();
+    }
+}
+
+
+
+// Return the bucket that corresponds to a given signature slice.
+uint64_t LshBuckets::getBucketId(size_t sliceLengthId, uint64_t signatureSlice) const
+{
+    const size_t log2BucketCount = info->log2BucketCount;
+    if(sliceLength(sliceLengthId) < log2BucketCount) {
+        return signatureSlice;
+    } else {
+        const uint64_t bucketMask = (1ULL << log2BucketCount) - 1ULL;
+        return MurmurHash64A(&signatureSlice, 8, 231) & bucketMask;
+    }
+}
+
+
+
+// Compute sliceBits, tableSizes, and tableBegins.
+void LshBuckets::computeDerivedData()
+{
+    const size_t sliceLengthCount = this->sliceLengthCount();
+    const uint64_t bucketCount = (1ULL << info->log2BucketCount);
+    sliceBits.resize(sliceLengthCount);
+    tableSizes.resize(sliceLengthCount);
+    tableBegins.resize(sliceLengthCount);
+    size_t tableBegin = 0;
+    for(size_t sliceLengthId=0; sliceLengthId<sliceLengthCount; sliceLengthId++) {
+        const size_t sliceLength = this->sliceLength(sliceLengthId);
+        const size_t sliceCount = this->sliceCount(sliceLengthId);
+        tableSizes[sliceLengthId] = (sliceLength < 64) ? min(uint64_t(1ULL<<sliceLength), bucketCount) : bucketCount;
+        tableBegins[sliceLengthId] = tableBegin;
+        tableBegin += sliceCount * tableSizes[sliceLengthId];
+
+        // Gather the signature bits of each slice.
+        auto& sliceBits2 = sliceBits[sliceLengthId];
+        sliceBits2.resize(sliceCount);
+        for(size_t sliceId=0; sliceId<sliceCount; sliceId++) {
+            auto& sliceBits1 = sliceBits2[sliceId];
+            sliceBits1.resize(sliceLength);
+            size_t bitPosition = sliceId * sliceLength;
+            for(size_t bitId=0; bitId<sliceLength; bitId++, ++bitPosition) {
+                sliceBits1[bitId] = bitPosition;
+            }
+        }
+    }
+}
+
+
+
+// The number of tables, that is, of pairs (sliceLengthId, sliceId).
+size_t LshBuckets::tableCount() const
+{
+    size_t n = 0;
+    for(size_t sliceLengthId=0; sliceLengthId<sliceLengthCount(); sliceLengthId++) {
+        n += sliceCount(sliceLengthId);
+    }
+    return n;
+}
+
+
+
+// The total number of buckets in all tables.
+size_t LshBuckets::totalBucketCount() const
+{
+    return sliceLengthCount()==0 ? 0 : getTableBegin(sliceLengthCount()-1, sliceCount(sliceLengthCount()-1));
+}
+
+
+
+// The sliceLengthId and sliceId of each table.
+vector< pair<size_t, size_t> > LshBuckets::getTables() const
+{
+    vector< pair<size_t, size_t> > tables;
+    for(size_t sliceLengthId=0; sliceLengthId<sliceLengthCount(); sliceLengthId++) {
+        for(size_t sliceId=0; sliceId<sliceCount(sliceLengthId); sliceId++) {
+            tables.push_back(make_pair(sliceLengthId, sliceId));
+        }
+    }
+    return tables;
+}
+
+
+
+// Store in newBuckets the cells in [cellIdBegin, cellIdEnd),
+// preceded in each bucket by the contents of the same bucket
+// of oldBuckets, if not null.
+// This uses the two-pass construction of VectorOfVectors.
+// Each table (that is, each sliceLengthId and sliceId)
+// is processed by a single thread, and tables don't share buckets,
+// so no synchronization is necessary.
+void LshBuckets::fill(
+    Lsh& lsh,
+    CellId cellIdBegin,
+    CellId cellIdEnd,
+    MemoryMapped::VectorOfVectors<CellId, uint64_t>& newBuckets,
+    const MemoryMapped::VectorOfVectors<CellId, uint64_t>* oldBuckets,
+    size_t threadCount)
+{
+    cout << timestamp << "Assigning cells to buckets using " << threadCount << " threads." << endl;
+
+    const vector< pair<size_t, size_t> > tables = getTables();
+    const size_t totalBucketCount = this->totalBucketCount();
+    if(oldBuckets) {
+        CZI_ASSERT(oldBuckets->size() == totalBucketCount);
+    }
+
+    // Pass 1: count the cells in each bucket.
+    newBuckets.beginPass1(totalBucketCount);
+    {
+        BatchDispatcher batchDispatcher(tables.size(), 1);
+        runThreads(threadCount, [&](size_t)
+        {
+            size_t begin, end;
+            while(batchDispatcher.getBatch(begin, end)) {
+                for(size_t table=begin; table!=end; table++) {
+                    const size_t sliceLengthId = tables[table].first;
+                    const size_t sliceId = tables[table].second;
+                    const size_t tableBegin = getTableBegin(sliceLengthId, sliceId);
+                    const auto& sliceBits1 = sliceBits[sliceLengthId][sliceId];
+                    for(CellId cellId=cellIdBegin; cellId!=cellIdEnd; cellId++) {
+                        const uint64_t signatureSlice = lsh.getSignature(cellId).getBits(sliceBits1);
+                        newBuckets.incrementCount(tableBegin + getBucketId(sliceLengthId, signatureSlice));
+                    }
+                    if(oldBuckets) {
+                        for(uint64_t bucketId=0; bucketId<tableSizes[sliceLengthId]; bucketId++) {
+                            newBuckets.incrementCount(tableBegin + bucketId, oldBuckets->size(tableBegin + bucketId));
+                        }
+                    }
+                }
+            }
+        });
+    }
+
+    // Pass 2: store the cells.
+    // VectorOfVectors::store fills each vector starting at the end,
+    // so we store the new cells in decreasing order, followed by the old cells,
+    // also in decreasing order. This way each bucket ends up sorted by cell id.
+    newBuckets.beginPass2();
+    {
+        BatchDispatcher batchDispatcher(tables.size(), 1);
+        runThreads(threadCount, [&](size_t)
+        {
+            size_t begin, end;
+            while(batchDispatcher.getBatch(begin, end)) {
+                for(size_t table=begin; table!=end; table++) {
+                    const size_t sliceLengthId = tables[table].first;
+                    const size_t sliceId = tables[table].second;
+                    const size_t tableBegin = getTableBegin(sliceLengthId, sliceId);
+                    const auto& sliceBits1 = sliceBits[sliceLengthId][sliceId];
+                    for(CellId cellId=cellIdEnd; cellId!=cellIdBegin; ) {
+                        --cellId;
+                        const uint64_t signatureSlice = lsh.getSignature(cellId).getBits(sliceBits1);
+                        newBuckets.store(tableBegin + getBucketId(sliceLengthId, signatureSlice), cellId);
+                    }
+                    if(oldBuckets) {
+                        for(uint64_t bucketId=0; bucketId<tableSizes[sliceLengthId]; bucketId++) {
+                            const uint64_t index = tableBegin + bucketId;
+                            for(const CellId* it=oldBuckets->end(index); it!=oldBuckets->begin(index); ) {
+                                --it;
+                                newBuckets.store(index, *it);
+                            }
+                        }
+                    }
+                }
+            }
+        });
+    }
+    newBuckets.endPass2();
+}
+
+
+
+// Extend a checksum of the signatures of an Lsh object
+// with the signatures of the cells in [cellIdBegin, cellIdEnd).
+// Each signature is hashed using the checksum so far as the seed,
+// so the checksum of all cells can be extended when cells are appended.
+uint64_t LshBuckets::updateSignatureChecksum(Lsh& lsh, CellId cellIdBegin, CellId cellIdEnd, uint64_t checksum)
+{
+    CZI_ASSERT(cellIdBegin <= cellIdEnd);
+    CZI_ASSERT(cellIdEnd <= lsh.cellCount());
+    for(CellId cellId=cellIdBegin; cellId!=cellIdEnd; cellId++) {
+        const BitSetPointer signature = lsh.getSignature(cellId);
+        checksum = MurmurHash64A(signature.begin, int(signature.wordCount() * sizeof(uint64_t)), checksum);
+    }
+    return checksum;
+}
+
+
+
+// Extend the stored checksum to cover the first newCellCount cells.
+void LshBuckets::updateSignatureChecksum(Lsh& lsh, CellId newCellCount)
+{
+    const CellId oldChecksumCellCount = CellId(info->checksumCellCount);
+    info->signatureChecksum = updateSignatureChecksum(lsh, oldChecksumCellCount, newCellCount, info->signatureChecksum);
+    info->checksumCellCount = newCellCount;
+}
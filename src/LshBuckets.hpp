@@ -0,0 +1,245 @@
+#ifndef CZI_EXPRESSION_MATRIX2_LSH_BUCKETS_HPP
+#define CZI_EXPRESSION_MATRIX2_LSH_BUCKETS_HPP
+
+
+// Class LshBuckets stores the assignment of cells to LSH buckets
+// used by findSimilarPairs7 and related functions.
+
+// For each slice length and signature slice of that length,
+// each cell is assigned to a bucket based on the value of its signature slice.
+// - Slice lengths are stored in decreasing order and identified by sliceLengthId.
+// - For each slice length, sliceId identifies the particular slice of that length
+//   (we have a total lshCount bits, which can be used
+//   to form lshCount/sliceLength possible signature
+//   slices each sliceLength bits in length).
+// - bucketId identifies the bucket. If the slice length is less than
+//   log2BucketCount, the bucketId is the signature slice itself.
+//   Otherwise it is obtained by hashing the signature slice.
+
+// The buckets are stored in memory mapped files, with names that depend on the
+// slice lengths and the number of buckets (see getName), so they can be reused
+// by later calls that use the same Lsh object and the same parameters.
+// They also store a checksum of the Lsh signatures, to detect
+// Lsh objects that were recreated with the same name.
+
+// Cells appended after the buckets were created are not added to the main
+// buckets, which would require rewriting all of them. Instead, they are stored
+// in segments, each covering a range of cell ids, that contain only
+// the bucket entries of those cells, sorted by bucket.
+// The segments are merged in the same way as the digits of a binary counter,
+// so their sizes decrease and there are at most a logarithmic number of them.
+// When the segments contain more than a fraction of the cells
+// in the main buckets, they are merged into the main buckets.
+
+#include "Ids.hpp"
+#include "MemoryAsContainer.hpp"
+#include "MemoryMappedObject.hpp"
+#include "MemoryMappedVector.hpp"
+#include "MemoryMappedVectorOfVectors.hpp"
+
+#include "cstddef.hpp"
+#include "cstdint.hpp"
+#include "string.hpp"
+#include "memory.hpp"
+#include "utility.hpp"
+#include "vector.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        class Lsh;
+        class LshBuckets;
+    }
+}
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::LshBuckets {
+public:
+
+    // Return the name prefix of the memory mapped files for the buckets
+    // of the Lsh object with the given name prefix and the given parameters.
+    static string getName(
+        const string& lshName,              // Name prefix of the Lsh object.
+        const vector<int>& lshSliceLengths,
+        size_t log2BucketCount);
+
+    // Access the buckets with the given name prefix if they exist
+    // and are consistent with the Lsh object and parameters.
+    // If they exist but were created for only some of the cells
+    // of the Lsh object (because cells were appended to it),
+    // the missing cells are added.
+    // Otherwise, create them.
+    void accessOrCreate(
+        const string& name,                 // Name prefix for memory mapped files.
+        Lsh&,
+        const vector<int>& lshSliceLengths, // The number of bits in each LSH signature slice, in decreasing order.
+        size_t log2BucketCount,
+        size_t threadCount);                // Number of threads used to create the buckets.
+
+    // Create new buckets for all cells of the Lsh object.
+    void createNew(
+        const string& name,                 // Name prefix for memory mapped files.
+        Lsh&,
+        const vector<int>& lshSliceLengths, // The number of bits in each LSH signature slice, in decreasing order.
+        size_t log2BucketCount,
+        size_t threadCount);                // Number of threads used to create the buckets.
+
+    // Access existing buckets.
+    // The buckets themselves are always accessed read-only.
+    void accessExisting(const string& name, bool readWriteAccess=false);
+
+    // Add to the buckets the cells of the Lsh object that are not already present
+    // (cells that were appended to the Lsh object after the buckets were created).
+    // The existing buckets are not modified: the new cells are stored
+    // in a new segment. The amortized cost is proportional to the number
+    // of new cells, times the logarithm of the number of cells.
+    void appendCells(Lsh&, size_t threadCount);
+
+    // Remove the memory mapped files.
+    void remove();
+
+    // Close the memory mapped files.
+    void close();
+
+    CellId cellCount() const
+    {
+        return CellId(info->cellCount);
+    }
+    size_t sliceLengthCount() const
+    {
+        return sliceLengths.size();
+    }
+    size_t sliceLength(size_t sliceLengthId) const
+    {
+        return size_t(sliceLengths[sliceLengthId]);
+    }
+    size_t sliceCount(size_t sliceLengthId) const
+    {
+        return info->lshCount / sliceLength(sliceLengthId);
+    }
+
+    // Return the signature bits of each slice.
+    // Indexed by [sliceLengthId][sliceId].
+    const vector< vector< vector<size_t> > >& getSliceBits() const
+    {
+        return sliceBits;
+    }
+
+    // Return the bucket that corresponds to a given signature slice.
+    uint64_t getBucketId(size_t sliceLengthId, uint64_t signatureSlice) const;
+
+    // Add at the end of the given vector the cells in a bucket,
+    // as one range for the main buckets followed by one range
+    // for each segment that has cells in this bucket.
+    // Taken together, the cells are in increasing order.
+    void getBucket(
+        size_t sliceLengthId,
+        size_t sliceId,
+        uint64_t bucketId,
+        vector< MemoryAsContainer<const CellId> >&) const;
+
+private:
+
+    // Small size information stored in a memory mapped object.
+    class Info {
+    public:
+        size_t cellCount;
+        size_t lshCount;
+        size_t log2BucketCount;
+
+        // Checksum of the signatures of the first checksumCellCount cells,
+        // used to detect Lsh objects recreated with the same name.
+        // It covers all cells, except briefly after an interrupted
+        // mergeIntoMainBuckets (see accessExisting).
+        size_t checksumCellCount;
+        uint64_t signatureChecksum;
+    };
+    MemoryMapped::Object<Info> info;
+
+    // The slice lengths, in decreasing order.
+    MemoryMapped::Vector<int> sliceLengths;
+
+    // The cells in each bucket. The buckets of each table
+    // (that is, of each sliceLengthId and sliceId) are stored contiguously.
+    // This only contains the first mainCellCount cells. Each cell
+    // is in exactly one bucket of each table, so this is
+    // the total size divided by the number of tables.
+    MemoryMapped::VectorOfVectors<CellId, uint64_t> buckets;
+    CellId mainCellCount;
+
+    // A segment contains the bucket entries for the cells in [cellIdBegin, cellIdEnd),
+    // sorted by global bucket index (getTableBegin(sliceLengthId, sliceId) + bucketId),
+    // then by cell id.
+    class Segment {
+    public:
+        CellId cellIdBegin;
+        CellId cellIdEnd;
+        MemoryMapped::Vector<uint64_t> bucketIndexes;
+        MemoryMapped::Vector<CellId> cellIds;
+        CellId cellCount() const
+        {
+            return cellIdEnd - cellIdBegin;
+        }
+        void remove()
+        {
+            bucketIndexes.remove();
+            cellIds.remove();
+        }
+    };
+    vector< shared_ptr<Segment> > segments;
+
+    // The cell id ranges of the segments are stored in a file
+    // whose name includes the cell count (see getSegmentsName).
+    // This way, updating info->cellCount is the last step of appendCells,
+    // and leaves the buckets in a consistent state if appendCells is interrupted.
+    MemoryMapped::Vector< pair<CellId, CellId> > segmentRanges;
+    string getSegmentsName(CellId cellCount) const;
+    string getSegmentName(CellId cellIdBegin, CellId cellIdEnd) const;
+    void accessSegments();
+    void writeSegmentRanges(CellId cellCount);
+
+    // Create a segment for the cells in [cellIdBegin, cellIdEnd).
+    shared_ptr<Segment> createSegment(Lsh&, CellId cellIdBegin, CellId cellIdEnd, size_t threadCount);
+
+    // Merge two adjacent segments into a new segment.
+    shared_ptr<Segment> mergeSegments(const Segment&, const Segment&);
+
+    // Merge the segments into the main buckets.
+    void mergeIntoMainBuckets(Lsh&, CellId cellCount, size_t threadCount);
+
+    // Data computed from the above when creating or accessing the buckets.
+    vector< vector< vector<size_t> > > sliceBits;
+    vector<uint64_t> tableSizes;                // Indexed by sliceLengthId.
+    vector<size_t> tableBegins;                 // Indexed by sliceLengthId.
+    void computeDerivedData();
+    size_t getTableBegin(size_t sliceLengthId, size_t sliceId) const
+    {
+        return tableBegins[sliceLengthId] + sliceId * tableSizes[sliceLengthId];
+    }
+    size_t tableCount() const;
+    size_t totalBucketCount() const;
+
+    // The sliceLengthId and sliceId of each table.
+    vector< pair<size_t, size_t> > getTables() const;
+
+    // Store in newBuckets the cells in [cellIdBegin, cellIdEnd).
+    // If oldBuckets is not null, its contents are stored first.
+    void fill(
+        Lsh&,
+        CellId cellIdBegin,
+        CellId cellIdEnd,
+        MemoryMapped::VectorOfVectors<CellId, uint64_t>& newBuckets,
+        const MemoryMapped::VectorOfVectors<CellId, uint64_t>* oldBuckets,
+        size_t threadCount);
+
+    // Extend a checksum of the signatures of an Lsh object
+    // with the signatures of the cells in [cellIdBegin, cellIdEnd).
+    // The checksum for no cells is signatureChecksumSeed.
+    static const uint64_t signatureChecksumSeed = 231;
+    static uint64_t updateSignatureChecksum(Lsh&, CellId cellIdBegin, CellId cellIdEnd, uint64_t checksum);
+    void updateSignatureChecksum(Lsh&, CellId newCellCount);
+
+    string name;
+};
+
+#endif
@@ -0,0 +1,140 @@
+// Class to map to memory an existing file for read-only access.
+// Unlike MemoryMapped::Vector, this does not require the file to have a header,
+// so it can be used to read input files, such as csv files, without copying them.
+
+#ifndef CZI_EXPRESSION_MATRIX2_MEMORY_MAPPED_FILE_HPP
+#define CZI_EXPRESSION_MATRIX2_MEMORY_MAPPED_FILE_HPP
+
+// CZI.
+#include "CZI_ASSERT.hpp"
+
+// Boost libraries, partially injected into the ExpressionMatrix2 namespace,
+#include "boost_lexical_cast.hpp"
+
+// Standard libraries, partially injected into the ExpressionMatrix2 namespace.
+#include <cstring>
+#include "cstddef.hpp"
+#include "stdexcept.hpp"
+#include "string.hpp"
+
+// Linux.
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Forward declarations.
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace MemoryMapped {
+            class File;
+        }
+    }
+}
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::MemoryMapped::File {
+public:
+
+    File() : data(0), fileSize(0), isOpen(false) {}
+    ~File()
+    {
+        if(isOpen) {
+            close();
+        }
+    }
+
+    // Map the file with the given name.
+    // If sequentialAccess is true, the kernel is advised
+    // that the file will be read sequentially, which enables aggressive read-ahead.
+    void open(const string& name, bool sequentialAccess);
+    void close();
+
+    const char* begin() const
+    {
+        return data;
+    }
+    const char* end() const
+    {
+        return data + fileSize;
+    }
+    size_t size() const
+    {
+        return fileSize;
+    }
+
+private:
+    const char* data;
+    size_t fileSize;
+    bool isOpen;
+    string fileName;
+
+    // Prevent copying.
+    File(const File&);
+    File& operator=(const File&);
+};
+
+
+
+inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::File::open(const string& name, bool sequentialAccess)
+{
+    CZI_ASSERT(!isOpen);
+
+    // Open the file.
+    const int fileDescriptor = ::open(name.c_str(), O_RDONLY);
+    if(fileDescriptor == -1) {
+        throw runtime_error("Error " + lexical_cast<string>(errno)
+            + " opening " + name + ": " + string(strerror(errno)));
+    }
+
+    // Find the size of the file.
+    struct stat fileInformation;
+    if(::fstat(fileDescriptor, &fileInformation) == -1) {
+        ::close(fileDescriptor);
+        throw runtime_error("Error during fstat for " + name);
+    }
+    fileSize = fileInformation.st_size;
+
+    // Map it. A file of size zero cannot be mapped, but we can still treat it as empty.
+    if(fileSize == 0) {
+        data = 0;
+    } else {
+        void* pointer = ::mmap(0, fileSize, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+        if(pointer == reinterpret_cast<void*>(-1LL)) {
+            ::close(fileDescriptor);
+            throw runtime_error("Error " + lexical_cast<string>(errno)
+                + " during mmap for " + name + ": " + string(strerror(errno)));
+        }
+        data = static_cast<const char*>(pointer);
+        if(sequentialAccess) {
+            ::madvise(pointer, fileSize, MADV_SEQUENTIAL);
+        }
+    }
+
+    // There is no need to keep the file descriptor open.
+    ::close(fileDescriptor);
+
+    isOpen = true;
+    fileName = name;
+}
+
+
+
+inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::File::close()
+{
+    CZI_ASSERT(isOpen);
+    if(data) {
+        const int munmapReturnCode = ::munmap(const_cast<char*>(data), fileSize);
+        if(munmapReturnCode == -1) {
+            throw runtime_error("Error unmapping " + fileName);
+        }
+    }
+    data = 0;
+    fileSize = 0;
+    isOpen = false;
+    fileName = "";
+}
+
+#endif
@@ -0,0 +1,234 @@
+// Mapping policies for memory mapped files.
+// See MemoryMappedPolicy.hpp for more information.
+
+#include "MemoryMappedPolicy.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+using namespace MemoryMapped;
+
+#include "cstdint.hpp"
+#include "fstream.hpp"
+#include "map.hpp"
+#include <mutex>
+#include "utility.hpp"
+
+// Linux.
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Memory policy constants from linux/mempolicy.h.
+// They are defined here to avoid a dependency on libnuma.
+#ifndef MPOL_DEFAULT
+#define MPOL_DEFAULT 0
+#endif
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1<<1)
+#endif
+
+
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace MemoryMapped {
+            namespace MappingPolicies {
+
+                // The policies and their owners, keyed by file name prefix.
+                map<string, pair<const void*, MappingPolicy> > policies;
+
+                // The memory currently mapped by Vector objects,
+                // keyed by the start address. For each we store
+                // the file name and the size of the mapping.
+                map<void*, pair<string, size_t> > mappings;
+
+                // Mutex that protects the above.
+                std::mutex mutex;
+
+                // Find the policy that applies to a file name
+                // (the one with the longest matching prefix),
+                // or return 0 if there is none.
+                const MappingPolicy* find(const string& fileName);
+
+                // Return the mask of online NUMA nodes
+                // (up to 64, which is plenty for our purposes).
+                uint64_t getOnlineNodeMask();
+            }
+        }
+    }
+}
+
+
+
+const MappingPolicy* MappingPolicies::find(const string& fileName)
+{
+    const MappingPolicy* policy = 0;
+    size_t prefixLength = 0;
+    for(const auto& p: policies) {
+        const string& prefix = p.first;
+        if(prefix.size() >= prefixLength &&
+            fileName.compare(0, prefix.size(), prefix) == 0) {
+            policy = &p.second.second;
+            prefixLength = prefix.size();
+        }
+    }
+    return policy;
+}
+
+
+
+// The online nodes are listed in /sys/devices/system/node/online
+// as a comma separated list of node ids or ranges of node ids,
+// for example "0-1" or "0,2-3".
+uint64_t MappingPolicies::getOnlineNodeMask()
+{
+    uint64_t mask = 0;
+    ifstream file("/sys/devices/system/node/online");
+    string line;
+    if(!getline(file, line)) {
+        return mask;
+    }
+    size_t i = 0;
+    while(i < line.size()) {
+        size_t j = line.find(',', i);
+        if(j == string::npos) {
+            j = line.size();
+        }
+        const string range = line.substr(i, j-i);
+        const size_t dashPosition = range.find('-');
+        try {
+            const int first = std::stoi(range.substr(0, dashPosition));
+            const int last = (dashPosition == string::npos) ? first : std::stoi(range.substr(dashPosition+1));
+            for(int node=first; node<=last && node<64; node++) {
+                mask |= (uint64_t(1) << node);
+            }
+        } catch(...) {
+            return 0;
+        }
+        i = j + 1;
+    }
+    return mask;
+}
+
+
+
+void MappingPolicy::apply(void* pointer, size_t size) const
+{
+    int advice = MADV_NORMAL;
+    switch(accessPattern) {
+    case AccessPattern::normal:     advice = MADV_NORMAL; break;
+    case AccessPattern::random:     advice = MADV_RANDOM; break;
+    case AccessPattern::sequential: advice = MADV_SEQUENTIAL; break;
+    }
+    ::madvise(pointer, size, advice);
+
+#ifdef MADV_HUGEPAGE
+    if(useHugePages) {
+        ::madvise(pointer, size, MADV_HUGEPAGE);
+    }
+#endif
+
+    // Only change the memory policy on machines with more than one NUMA node.
+    // The node mask is computed only once.
+    static const uint64_t nodeMask = MappingPolicies::getOnlineNodeMask();
+    if(__builtin_popcountll(nodeMask) > 1) {
+        const unsigned long mask = nodeMask;
+        if(interleave) {
+            ::syscall(SYS_mbind, pointer, size, MPOL_INTERLEAVE, &mask, 8*sizeof(mask)+1, MPOL_MF_MOVE);
+        } else {
+            ::syscall(SYS_mbind, pointer, size, MPOL_DEFAULT, 0, 0, 0);
+        }
+    }
+
+    if(willNeed) {
+        ::madvise(pointer, size, MADV_WILLNEED);
+    }
+}
+
+
+
+void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::setMappingPolicy(
+    const string& fileNamePrefix,
+    const MappingPolicy& policy,
+    const void* owner)
+{
+    std::lock_guard<std::mutex> lock(MappingPolicies::mutex);
+    auto& p = MappingPolicies::policies[fileNamePrefix];
+    p = make_pair(owner, policy);
+
+    // Apply it to the files that are already mapped.
+    for(const auto& q: MappingPolicies::mappings) {
+        const string& fileName = q.second.first;
+        if(MappingPolicies::find(fileName) == &p.second) {
+            policy.apply(q.first, q.second.second);
+        }
+    }
+}
+
+
+
+void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::removeMappingPolicy(
+    const string& fileNamePrefix,
+    const void* owner)
+{
+    std::lock_guard<std::mutex> lock(MappingPolicies::mutex);
+    const auto it = MappingPolicies::policies.find(fileNamePrefix);
+    if(it == MappingPolicies::policies.end() || it->second.first != owner) {
+        return;
+    }
+    MappingPolicies::policies.erase(it);
+
+    // Apply the policy that now applies to the files that used it.
+    const MappingPolicy defaultPolicy;
+    for(const auto& q: MappingPolicies::mappings) {
+        const string& fileName = q.second.first;
+        if(fileName.compare(0, fileNamePrefix.size(), fileNamePrefix) == 0) {
+            const MappingPolicy* policy = MappingPolicies::find(fileName);
+            (policy ? *policy : defaultPolicy).apply(q.first, q.second.second);
+        }
+    }
+}
+
+
+
+void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::registerMapping(
+    const string& fileName,
+    void* pointer,
+    size_t size)
+{
+    std::lock_guard<std::mutex> lock(MappingPolicies::mutex);
+    MappingPolicies::mappings[pointer] = make_pair(fileName, size);
+    const MappingPolicy* policy = MappingPolicies::find(fileName);
+    if(policy) {
+        policy->apply(pointer, size);
+    }
+}
+
+
+
+void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::unregisterMapping(void* pointer)
+{
+    std::lock_guard<std::mutex> lock(MappingPolicies::mutex);
+    MappingPolicies::mappings.erase(pointer);
+}
+
+
+
+void ScopedMappingPolicies::set(
+    const string& fileNamePrefix,
+    const MappingPolicy& policy)
+{
+    setMappingPolicy(fileNamePrefix, policy, this);
+    fileNamePrefixes.push_back(fileNamePrefix);
+}
+
+
+
+ScopedMappingPolicies::~ScopedMappingPolicies()
+{
+    for(const string& fileNamePrefix: fileNamePrefixes) {
+        removeMappingPolicy(fileNamePrefix, this);
+    }
+}
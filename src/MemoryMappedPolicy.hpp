@@ -0,0 +1,100 @@
+#ifndef CZI_EXPRESSION_MATRIX2_MEMORY_MAPPED_POLICY_HPP
+#define CZI_EXPRESSION_MATRIX2_MEMORY_MAPPED_POLICY_HPP
+
+
+// Mapping policies for memory mapped files.
+// A MappingPolicy describes hints given to the kernel for the
+// memory mapped by a MemoryMapped::Vector:
+// - The expected access pattern (madvise MADV_NORMAL, MADV_RANDOM, MADV_SEQUENTIAL).
+//   MADV_RANDOM disables read ahead, which is useful for large arrays
+//   that are accessed at random and do not fit in memory.
+// - Whether to use transparent huge pages (madvise MADV_HUGEPAGE),
+//   which reduces TLB misses for random access to large arrays.
+//   The kernel only backs file mappings with huge pages for files on tmpfs
+//   (for example /dev/shm, if mounted with huge=advise or huge=within_size),
+//   and, with CONFIG_READ_ONLY_THP_FOR_FS, for files mapped read-only.
+//   To use this for an expression matrix, create or copy its directory on such a file system.
+//   hugetlbfs is not supported, because MemoryMapped::Vector
+//   rounds file sizes to 4 KB pages.
+// - Whether to start reading the file into memory immediately (madvise MADV_WILLNEED).
+// - Whether to interleave the memory across all NUMA nodes (mbind MPOL_INTERLEAVE),
+//   so that arrays accessed by threads running on all nodes
+//   don't all reside in the memory of a single node. For files on tmpfs the policy
+//   is used when pages are allocated. For other files the kernel
+//   allocates page cache using the memory policy of the process,
+//   so use "numactl --interleave=all" instead.
+//   mbind is called with MPOL_MF_MOVE, so pages already in memory are also moved,
+//   but only those mapped by this process alone. Pages shared with other
+//   processes (for example, page cache of a file also mapped elsewhere)
+//   stay where they are (moving them requires MPOL_MF_MOVE_ALL and CAP_SYS_NICE).
+//   To avoid moving pages, set policies before the files are mapped
+//   (see ScopedMappingPolicies below).
+
+// Policies are set for all files with a given name prefix,
+// and are applied to the files that are already mapped
+// and to files mapped later, including when a Vector is remapped
+// because it grows beyond its capacity. If more than one prefix matches
+// a file name, the longest one is used.
+// Policies are process-wide. A policy can have an owner,
+// and is then only removed by that owner. Class ScopedMappingPolicies
+// uses this to keep policies only for its lifetime.
+// All of these are hints. Errors are ignored, so
+// policies can be used on systems that don't support them.
+
+#include "cstddef.hpp"
+#include "string.hpp"
+#include "vector.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace MemoryMapped {
+            class MappingPolicy;
+            class ScopedMappingPolicies;
+
+            // Set the mapping policy for files with names beginning with the given prefix.
+            // This replaces any policy previously set for the same prefix.
+            void setMappingPolicy(const string& fileNamePrefix, const MappingPolicy&, const void* owner = 0);
+
+            // Remove the mapping policy for a prefix, if it was set by the given owner.
+            // Files already mapped that used it get the policy that now applies to them,
+            // or the default policy.
+            void removeMappingPolicy(const string& fileNamePrefix, const void* owner = 0);
+
+            // Functions called by Vector when it maps or unmaps a file.
+            void registerMapping(const string& fileName, void* pointer, size_t size);
+            void unregisterMapping(void* pointer);
+        }
+    }
+}
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::MemoryMapped::MappingPolicy {
+public:
+    enum class AccessPattern {normal, random, sequential};
+    AccessPattern accessPattern = AccessPattern::normal;
+    bool useHugePages = false;
+    bool willNeed = false;
+    bool interleave = false;
+
+    // Apply this policy to a range of mapped memory.
+    void apply(void* pointer, size_t size) const;
+};
+
+
+
+// Mapping policies that are removed when this object is destroyed.
+class ChanZuckerberg::ExpressionMatrix2::MemoryMapped::ScopedMappingPolicies {
+public:
+    ScopedMappingPolicies() {}
+    ~ScopedMappingPolicies();
+    ScopedMappingPolicies(const ScopedMappingPolicies&) = delete;
+    ScopedMappingPolicies& operator=(const ScopedMappingPolicies&) = delete;
+
+    void set(const string& fileNamePrefix, const MappingPolicy&);
+
+private:
+    vector<string> fileNamePrefixes;
+};
+
+#endif
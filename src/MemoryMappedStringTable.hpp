@@ -19,12 +19,27 @@ determines the maximum number of strings that can be stored.
 The class provides two versions of operator[] that can be used
 to find the string corresponding to a given id and vice versa.
 
+The hash table used to find the string id corresponding to a given string
+grows automatically: when adding a string would make its load factor
+greater than 1/2, its size is doubled. The strings are rehashed
+incrementally: the old hash table is kept, and each subsequent addition
+moves a few strings to the new hash table, in order of StringId,
+so no single addition has to rehash all the strings.
+While this is in progress, lookups check both hash tables.
+If the table is closed before this completes, the move starts again
+from the first string the next time the table is accessed with write access.
+For each slot, the hash table also stores a fingerprint (the high 32 bits
+of the hash of the string in that slot), so most collisions
+are resolved without accessing the strings.
+
 *******************************************************************************/
 
 
 
 // CZI.
+#include "algorithm.hpp"
 #include "MemoryAsContainer.hpp"
+#include "filesystem.hpp"
 #include "MemoryMappedVectorOfVectors.hpp"
 #include "nextPowerOfTwo.hpp"
 
@@ -48,7 +63,9 @@ public:
 
     // Create a new StringTable.
     // The name will be used as a base name for memory mapped files.
-    // The specified capacity should be at least double the expected number of
+    // The specified capacity is the initial size of the hash table.
+    // It grows automatically as needed, but for best performance
+    // it should be at least double the expected number of
     // strings we are going to put in the table.
     void createNew(const string& name, size_t capacity);
 
@@ -78,10 +95,29 @@ public:
     // Return the number of strings currently stored in the table.
     size_t size() const;
 
-    // Return the maximum number of strings that can be stored.
-    // For performance, we should stay below half this value.
+    // Return the current size of the hash table.
+    // The hash table grows when the number of strings exceeds half this value.
     size_t capacity() const;
 
+    // Sync the strings and the hash table to disk.
+    void syncToDisk()
+    {
+        strings.syncToDisk();
+        hashTable.syncToDisk();
+        if(fingerprints.isOpen) {
+            fingerprints.syncToDisk();
+        }
+        if(oldHashTable.isOpen) {
+            oldHashTable.syncToDisk();
+            oldFingerprints.syncToDisk();
+        }
+    }
+
+    // Keep only the first n strings, and rebuild the hash table.
+    // Rebuilding the hash table also removes any slots
+    // referring to a string that was not completely added.
+    void truncate(size_t n);
+
     // The strings are stored using a MemoryMapped::VectorOfVectors.
     // The i-th string is stored in the open range of characters
     // strings.begin(i) through strings.end(i).
@@ -98,6 +134,69 @@ private:
     Vector<StringId> hashTable;
     uint64_t mask;
 
+    // The fingerprint of the string in each slot of the hash table.
+    // String tables created before fingerprints were introduced
+    // don't have them if accessed read-only. In that case
+    // this is not open and lookups always compare strings.
+    Vector<uint32_t> fingerprints;
+    void accessFingerprints(const string& name);
+
+    // The hash table before the last time it was doubled,
+    // while the strings it contains are being moved to hashTable.
+    // Not open when that is complete. Strings with StringId less than
+    // nextStringIdToMove were already moved. The old hash table
+    // is not modified, so lookups in it remain valid.
+    // The strings are moved in order of StringId rather than in
+    // slot order, so they are accessed sequentially.
+    Vector<StringId> oldHashTable;
+    Vector<uint32_t> oldFingerprints;
+    uint64_t oldMask = 0;
+    StringId nextStringIdToMove = 0;
+    StringId oldStringCount = 0;
+    void accessOldHashTable(const string& name, bool readWriteAccess);
+
+    // The number of strings moved each time a string is added.
+    // When the hash table is doubled it contains at most 1/4 as many
+    // strings as the new hash table has slots, and at least as many
+    // are added before it is doubled again, so this guarantees
+    // that the move is complete by then.
+    static const StringId stringsMovedPerAddition = 2;
+
+    // Move up to n strings from the old hash table to the new one.
+    void moveOldStrings(StringId n);
+
+    // Double the size of the hash table. Its old contents
+    // are moved to the new hash table incrementally.
+    void doubleHashTable();
+
+    // Find a string in a hash table.
+    // Returns invalidStringId if not found. In that case, bucketIndex
+    // is set to the empty slot where the string can be stored.
+    StringId find(
+        const Vector<StringId>& table,
+        const Vector<uint32_t>& tableFingerprints,
+        uint64_t tableMask,
+        const string&,
+        uint64_t hashValue,
+        uint64_t& bucketIndex) const;
+
+    static uint64_t hash(const char* begin, size_t size)
+    {
+        return MurmurHash64A(begin, int(size), 237);
+    }
+    static uint32_t fingerprint(uint64_t hashValue)
+    {
+        return uint32_t(hashValue >> 32);
+    }
+
+    // Store a string in the first empty slot of its probe sequence,
+    // unless it is already in the hash table.
+    void insert(StringId, uint64_t hashValue);
+
+    // Resize the hash table and store in it all the strings.
+    // This also removes the old hash table, if any.
+    void rehash(uint64_t capacity);
+
 };
 
 
@@ -122,6 +221,7 @@ template<class StringId> inline
     // Initially fill the hash table with InvalidStringId.
     hashTable.createNew(name + "-hashTable", n);
     fill(hashTable.begin(), hashTable.end(), invalidStringId);
+    fingerprints.createNew(name + "-fingerprints", n);
 }
 
 
@@ -133,6 +233,8 @@ template<class StringId> inline
     strings.accessExistingReadOnly(name + "-strings");
     hashTable.accessExistingReadOnly(name + "-hashTable");
     mask = hashTable.size() - 1ULL;
+    accessFingerprints(name);
+    accessOldHashTable(name, false);
 }
 
 
@@ -143,8 +245,77 @@ template<class StringId> inline
         bool allowReadOnly)
 {
     strings.accessExistingReadWrite(name + "-strings", allowReadOnly);
-    hashTable.accessExistingReadWrite(name + "-hashTable", allowReadOnly);
+
+    // If doubling the hash table was interrupted after the old hash table
+    // was renamed but before the new one was created, go back to the old one.
+    const string hashTableName = name + "-hashTable";
+    if(!filesystem::exists(hashTableName) && filesystem::exists(hashTableName + "-old")) {
+        filesystem::rename(hashTableName + "-old", hashTableName);
+        if(filesystem::exists(name + "-fingerprints-old")) {
+            filesystem::rename(name + "-fingerprints-old", name + "-fingerprints");
+        }
+    }
+
+    hashTable.accessExistingReadWrite(hashTableName, allowReadOnly);
     mask = hashTable.size() - 1ULL;
+    accessFingerprints(name);
+    accessOldHashTable(name, hashTable.isOpenWithWriteAccess);
+}
+
+
+
+// Access the old hash table, if moving its strings
+// to the new hash table was not complete when the table was last closed.
+// The move starts again from the first string. Strings
+// that were already moved are skipped by insert.
+template<class StringId> inline
+    void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::StringTable<StringId>::accessOldHashTable(
+        const string& name,
+        bool readWriteAccess)
+{
+    const string oldHashTableName = name + "-hashTable-old";
+    const string oldFingerprintsName = name + "-fingerprints-old";
+    if(!filesystem::exists(oldHashTableName)) {
+        return;
+    }
+
+    // If the fingerprints were rebuilt (see accessFingerprints), the hash table
+    // was rebuilt with them and already contains all the strings.
+    if(!fingerprints.isOpen || !filesystem::exists(oldFingerprintsName)) {
+        if(readWriteAccess) {
+            filesystem::remove(oldHashTableName);
+        }
+        return;
+    }
+
+    oldHashTable.accessExisting(oldHashTableName, readWriteAccess);
+    oldFingerprints.accessExisting(oldFingerprintsName, readWriteAccess);
+    CZI_ASSERT(oldFingerprints.size() == oldHashTable.size());
+    oldMask = oldHashTable.size() - 1ULL;
+    nextStringIdToMove = 0;
+    oldStringCount = StringId(strings.size());
+}
+
+
+
+// Access the fingerprints, creating them if they are missing
+// and we have write access.
+template<class StringId> inline
+    void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::StringTable<StringId>::accessFingerprints(
+        const string& name)
+{
+    const string fileName = name + "-fingerprints";
+    if(filesystem::exists(fileName)) {
+        fingerprints.accessExisting(fileName, hashTable.isOpenWithWriteAccess);
+        CZI_ASSERT(fingerprints.size() == hashTable.size());
+    } else if(hashTable.isOpenWithWriteAccess) {
+        fingerprints.createNew(fileName, hashTable.size());
+
+        // The hash table of an old table can have a load factor
+        // above 1/2 (the old code allowed filling it completely),
+        // so make sure it is large enough before rehashing.
+        rehash(max(uint64_t(hashTable.size()), uint64_t(2) * nextPowerOfTwoGreaterThanOrEqual(strings.size() + 1ULL)));
+    }
 }
 
 
@@ -165,82 +336,225 @@ template<class StringId> inline
 
 
 
-// Return the StringId corresponding to a given string, creating it if necessary.
+// Keep only the first n strings, and rebuild the hash table.
 template<class StringId> inline
-    StringId ChanZuckerberg::ExpressionMatrix2::MemoryMapped::StringTable<StringId>::operator[](const string& s)
+    void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::StringTable<StringId>::truncate(size_t n)
+{
+    strings.truncate(n);
+    rehash(hashTable.size());
+}
+
+
+
+// Find a string in a hash table.
+template<class StringId> inline
+    StringId ChanZuckerberg::ExpressionMatrix2::MemoryMapped::StringTable<StringId>::find(
+        const Vector<StringId>& table,
+        const Vector<uint32_t>& tableFingerprints,
+        uint64_t tableMask,
+        const string& s,
+        uint64_t hashValue,
+        uint64_t& bucketIndex) const
 {
-    uint64_t bucketIndex = MurmurHash64A(s.data(), int(s.size()), 237) & mask;
+    const uint32_t stringFingerprint = fingerprint(hashValue);
+    bucketIndex = hashValue & tableMask;
 
     while(true) {
-        StringId& stringId = hashTable[bucketIndex];
+        const StringId stringId = table[bucketIndex];
         if(stringId == invalidStringId) {
 
-            // The bucket is empty. This means that this string is not already in the table. Add it.
-            stringId = StringId(strings.size());
-            if(stringId > hashTable.size()/2) {
-                throw runtime_error(
-                    hashTable.fileName +
-                    ": string table capacity " +
-                    lexical_cast<string>(hashTable.size()) +
-                    " exceeded.");
-            }
-            strings.appendVector(s.begin(), s.end());
-            return stringId;
+            // The bucket is empty. This means that this string is not in this hash table.
+            return invalidStringId;
 
         } else {
 
             // The bucket is not empty. See if it contains the string we are looking for.
-
-            if((s.size() == strings.size(stringId)) && std::equal(s.begin(), s.end(), strings.begin(stringId))) {
+            // Check the fingerprint first, to avoid accessing the string in most cases.
+            if((!tableFingerprints.isOpen || tableFingerprints[bucketIndex] == stringFingerprint) &&
+                (s.size() == strings.size(stringId)) && std::equal(s.begin(), s.end(), strings.begin(stringId))) {
                 // The bucket contains this string.
                 return stringId;
             } else {
                 // The bucket contains another string. Try the next bucket.
                 ++bucketIndex;
-                bucketIndex &= mask;
+                bucketIndex &= tableMask;
             }
 
         }
     }
 
-    // Note that this will loop forever if the capacity of the hash table is exceeded.
+}
+
+
 
+// Store a string in the first empty slot of its probe sequence,
+// unless it is already in the hash table. This only compares
+// StringIds, so it does not access the strings.
+template<class StringId> inline
+    void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::StringTable<StringId>::insert(
+        StringId stringId,
+        uint64_t hashValue)
+{
+    uint64_t bucketIndex = hashValue & mask;
+    while(hashTable[bucketIndex] != invalidStringId) {
+        if(hashTable[bucketIndex] == stringId) {
+            return;
+        }
+        ++bucketIndex;
+        bucketIndex &= mask;
+    }
+    hashTable[bucketIndex] = stringId;
+    if(fingerprints.isOpen) {
+        fingerprints[bucketIndex] = fingerprint(hashValue);
+    }
 }
 
 
-// Return the StringId corresponding to a given string.
-// Returns invalidStringId if the table does not contain the given string
+
+// Resize the hash table and store in it all the strings.
+// The strings are processed in order of increasing StringId,
+// so they are accessed sequentially.
 template<class StringId> inline
-    StringId ChanZuckerberg::ExpressionMatrix2::MemoryMapped::StringTable<StringId>::operator()(const string& s) const
+    void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::StringTable<StringId>::rehash(uint64_t capacity)
 {
-    uint64_t bucketIndex = MurmurHash64A(s.data(), int(s.size()), 237) & mask;
+    if(oldHashTable.isOpen) {
+        oldHashTable.remove();
+        oldFingerprints.remove();
+    }
+    const uint64_t n = nextPowerOfTwoGreaterThanOrEqual(capacity);
+    CZI_ASSERT(strings.size() <= n/2);
+    hashTable.resize(n);
+    fill(hashTable.begin(), hashTable.end(), invalidStringId);
+    if(fingerprints.isOpen) {
+        fingerprints.resize(n);
+    }
+    mask = n - 1ULL;
+    for(StringId stringId=0; stringId!=StringId(strings.size()); stringId++) {
+        insert(stringId, hash(strings.begin(stringId), strings.size(stringId)));
+    }
+}
 
-    while(true) {
-        const StringId& stringId = hashTable[bucketIndex];
-        if(stringId == invalidStringId) {
 
-            // The bucket is empty. This means that this string is not already in the table.
-            return invalidStringId;
 
-        } else {
+// Double the size of the hash table. The current hash table
+// becomes the old hash table, and its strings are moved
+// to the new hash table incrementally by moveOldStrings.
+template<class StringId> inline
+    void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::StringTable<StringId>::doubleHashTable()
+{
+    // Normally the previous move was completed long ago,
+    // but not if the table was closed and accessed again since.
+    if(oldHashTable.isOpen) {
+        moveOldStrings(oldStringCount);
+    }
+
+    // Without fingerprints, just rehash everything.
+    if(!fingerprints.isOpen) {
+        rehash(2 * hashTable.size());
+        return;
+    }
+
+    // Rename the current hash table and fingerprints
+    // and access them as the old ones.
+    const string hashTableName = hashTable.fileName;
+    const string fingerprintsName = fingerprints.fileName;
+    const uint64_t n = 2 * hashTable.size();
+    hashTable.close();
+    fingerprints.close();
+    filesystem::rename(fingerprintsName, fingerprintsName + "-old");
+    filesystem::rename(hashTableName, hashTableName + "-old");
+    oldHashTable.accessExistingReadWrite(hashTableName + "-old", false);
+    oldFingerprints.accessExistingReadWrite(fingerprintsName + "-old", false);
+    oldMask = mask;
+    nextStringIdToMove = 0;
+    oldStringCount = StringId(strings.size());
+
+    // Create the new hash table, initially empty.
+    fingerprints.createNew(fingerprintsName, n);
+    hashTable.createNew(hashTableName, n);
+    fill(hashTable.begin(), hashTable.end(), invalidStringId);
+    mask = n - 1ULL;
+}
 
-            // The bucket is not empty. See if it contains the string we are looking for.
 
-            if((s.size() == strings.size(stringId)) && std::equal(s.begin(), s.end(), strings.begin(stringId))) {
-                // The bucket contains this string.
-                return stringId;
-            } else {
-                // The bucket contains another string. Try the next bucket.
-                ++bucketIndex;
-                bucketIndex &= mask;
-            }
 
+// Move up to n strings from the old hash table to the new one.
+// When all strings have been moved, the old hash table is removed.
+template<class StringId> inline
+    void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::StringTable<StringId>::moveOldStrings(StringId n)
+{
+    const StringId end = StringId(min(uint64_t(oldStringCount), uint64_t(nextStringIdToMove) + n));
+    for(; nextStringIdToMove!=end; ++nextStringIdToMove) {
+        insert(nextStringIdToMove, hash(strings.begin(nextStringIdToMove), strings.size(nextStringIdToMove)));
+    }
+    if(nextStringIdToMove == oldStringCount) {
+        oldHashTable.remove();
+        oldFingerprints.remove();
+    }
+}
+
+
+
+// Return the StringId corresponding to a given string, creating it if necessary.
+template<class StringId> inline
+    StringId ChanZuckerberg::ExpressionMatrix2::MemoryMapped::StringTable<StringId>::operator[](const string& s)
+{
+    const uint64_t hashValue = hash(s.data(), s.size());
+
+    // Look for it in the hash table, then in the old hash table, if any.
+    uint64_t bucketIndex;
+    StringId stringId = find(hashTable, fingerprints, mask, s, hashValue, bucketIndex);
+    if(stringId != invalidStringId) {
+        return stringId;
+    }
+    if(oldHashTable.isOpen) {
+        uint64_t oldTableBucketIndex;
+        stringId = find(oldHashTable, oldFingerprints, oldMask, s, hashValue, oldTableBucketIndex);
+        if(stringId != invalidStringId) {
+            return stringId;
         }
     }
 
-    // Note that this will loop forever if the hash table is full and does not
-    // contain the string we are looking for.
+    // This string is not already in the table. Add it.
+    const StringId newStringId = StringId(strings.size());
+    if(newStringId == invalidStringId) {
+        throw runtime_error(hashTable.fileName + ": string table is full.");
+    }
+
+    // If adding the string makes the load factor greater than 1/2,
+    // double the size of the hash table first.
+    if(2 * (uint64_t(newStringId) + 1) > hashTable.size()) {
+        doubleHashTable();
+        insert(newStringId, hashValue);
+    } else {
+        hashTable[bucketIndex] = newStringId;
+        if(fingerprints.isOpen) {
+            fingerprints[bucketIndex] = fingerprint(hashValue);
+        }
+    }
+    strings.appendVector(s.begin(), s.end());
+
+    // Continue moving the slots of the old hash table, if any.
+    if(oldHashTable.isOpen) {
+        moveOldStrings(stringsMovedPerAddition);
+    }
+
+    return newStringId;
+}
 
+
+// Return the StringId corresponding to a given string.
+// Returns invalidStringId if the table does not contain the given string
+template<class StringId> inline
+    StringId ChanZuckerberg::ExpressionMatrix2::MemoryMapped::StringTable<StringId>::operator()(const string& s) const
+{
+    const uint64_t hashValue = hash(s.data(), s.size());
+    uint64_t bucketIndex;
+    const StringId stringId = find(hashTable, fingerprints, mask, s, hashValue, bucketIndex);
+    if(stringId != invalidStringId || !oldHashTable.isOpen) {
+        return stringId;
+    }
+    return find(oldHashTable, oldFingerprints, oldMask, s, hashValue, bucketIndex);
 }
 
 
@@ -6,6 +6,7 @@
 // CZI.
 #include "CZI_ASSERT.hpp"
 #include "filesystem.hpp"
+#include "MemoryMappedPolicy.hpp"
 #include "touchMemory.hpp"
 
 // Boost libraries, partially injected into the ExpressionMatrix2 namespace,
@@ -224,8 +225,10 @@ private:
     // Truncate the given file descriptor to the specified size.
     static void truncate(int fileDescriptor, size_t fileSize);
 
-    // Map to memory the given file descriptor for the specified size.
-    static void* map(int fileDescriptor, size_t fileSize, bool writeAccess);
+    // Map to memory the given file descriptor for the specified size,
+    // and apply the mapping policy for the given file name, if any
+    // (see MemoryMappedPolicy.hpp).
+    static void* map(int fileDescriptor, size_t fileSize, bool writeAccess, const string& name);
 
     // Find the size of the file corresponding to an open file descriptor.
     size_t getFileSize(int fileDescriptor);
@@ -379,13 +382,15 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
 }
 
 // Map to memory the given file descriptor for the specified size.
-template<class T> inline void* ChanZuckerberg::ExpressionMatrix2::MemoryMapped::Vector<T>::map(int fileDescriptor, size_t fileSize, bool writeAccess)
+template<class T> inline void* ChanZuckerberg::ExpressionMatrix2::MemoryMapped::Vector<T>::map(
+    int fileDescriptor, size_t fileSize, bool writeAccess, const string& name)
 {
     void* pointer = ::mmap(0, fileSize, PROT_READ | (writeAccess ? PROT_WRITE : 0), MAP_SHARED, fileDescriptor, 0);
     if(pointer == reinterpret_cast<void*>(-1LL)) {
         ::close(fileDescriptor);
         throw runtime_error("Error during mmap.");
     }
+    registerMapping(name, pointer, fileSize);
     return pointer;
 }
 
@@ -428,7 +433,7 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
         truncate(fileDescriptor, fileSize);
 
         // Map it in memory.
-        void* pointer = map(fileDescriptor, fileSize, true);
+        void* pointer = map(fileDescriptor, fileSize, true, name);
 
         // There is no need to keep the file descriptor open.
         // Closing the file descriptor as early as possible will make it possible to use large
@@ -476,7 +481,7 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
         const size_t fileSize = getFileSize(fileDescriptor);
 
         // Now map it in memory.
-        void* pointer = map(fileDescriptor, fileSize, readWriteAccess);
+        void* pointer = map(fileDescriptor, fileSize, readWriteAccess, name);
 
         // There is no need to keep the file descriptor open.
         // Closing the file descriptor as early as possible will make it possible to use large
@@ -542,6 +547,7 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
 {
     CZI_ASSERT(isOpen);
 
+    unregisterMapping(header);
     const int munmapReturnCode = ::munmap(header, header->fileSize);
     if(munmapReturnCode == -1) {
         throw runtime_error("Error unmapping " + fileName);
@@ -626,7 +632,7 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
             truncate(fileDescriptor, headerOnStack.fileSize);
 
             // Remap it.
-            void* pointer = map(fileDescriptor, headerOnStack.fileSize, true);
+            void* pointer = map(fileDescriptor, headerOnStack.fileSize, true, name);
             ::close(fileDescriptor);
 
             // Figure out where the data and the header are.
@@ -679,7 +685,7 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
     truncate(fileDescriptor, headerOnStack.fileSize);
 
     // Remap it.
-    void* pointer = map(fileDescriptor, headerOnStack.fileSize, true);
+    void* pointer = map(fileDescriptor, headerOnStack.fileSize, true, name);
     ::close(fileDescriptor);
 
     // Figure out where the data and the header are.
@@ -1,9 +1,21 @@
 // A vector of lists stored in mapped memory.
 
+// Each list is stored as a doubly linked list of nodes, so elements can be
+// inserted and erased anywhere, but iterating over a list requires
+// following links across the data vector.
+// After most of the lists are built, compact() can be called to store
+// all lists contiguously in compressed sparse row (CSR) format, without links.
+// Iteration over a compacted list then reads contiguous memory.
+// Compacted lists can still be modified in place through iterators.
+// Inserting or erasing elements in a compacted list moves it back to
+// the linked representation, which therefore only holds lists added
+// or modified since the last compaction.
+
 #ifndef CZI_EXPRESSION_MATRIX2_MEMORY_MAPPED_VECTOR_OF_LISTS_HPP
 #define CZI_EXPRESSION_MATRIX2_MEMORY_MAPPED_VECTOR_OF_LISTS_HPP
 
 // CZI.
+#include "filesystem.hpp"
 #include "MemoryMappedVector.hpp"
 
 // Standard libraries.
@@ -12,6 +24,7 @@
 #include <limits>
 #include "string.hpp"
 #include "utility.hpp"
+#include "vector.hpp"
 
 // Forward declarations.
 namespace ChanZuckerberg {
@@ -33,6 +46,7 @@ public:
         toc.createNew(name + ".toc");
         data.createNew(name + ".data");
         freeSlots.createNew(name + ".freeSlots");
+        createCompacted(name);
     }
 
     void accessExisting(const string& name, bool readWriteAccess)
@@ -40,6 +54,15 @@ public:
         toc.accessExisting(name + ".toc", readWriteAccess);
         data.accessExisting(name + ".data", readWriteAccess);
         freeSlots.accessExisting(name + ".freeSlots", readWriteAccess);
+
+        // Vectors of lists created before compaction was introduced
+        // don't have the compacted representation.
+        if(filesystem::exists(name + ".compactedToc")) {
+            compactedToc.accessExisting(name + ".compactedToc", readWriteAccess);
+            compactedData.accessExisting(name + ".compactedData", readWriteAccess);
+        } else if(readWriteAccess) {
+            createCompacted(name);
+        }
     }
     void accessExistingReadOnly(const string& name)
     {
@@ -64,6 +87,60 @@ public:
         toc.close();
         data.close();
         freeSlots.close();
+        if(compactedToc.isOpen) {
+            compactedToc.close();
+            compactedData.close();
+        }
+    }
+    void syncToDisk()
+    {
+        toc.syncToDisk();
+        data.syncToDisk();
+        freeSlots.syncToDisk();
+        if(compactedToc.isOpen) {
+            compactedToc.syncToDisk();
+            compactedData.syncToDisk();
+        }
+    }
+
+    // The number of allocated nodes of the linked representation,
+    // including free ones.
+    size_t dataSize() const
+    {
+        return data.size();
+    }
+
+    // Return to a previous state in which there were only n lists
+    // and dataSize() was dataSizeArgument.
+    // This is only valid if, since that state, lists were only added
+    // at the end and elements were only inserted in the added lists.
+    // The free slots are recomputed as all nodes not used by the remaining lists.
+    // Compacted lists are not affected.
+    void truncate(size_t n, size_t dataSizeArgument)
+    {
+        CZI_ASSERT(n <= toc.size());
+        CZI_ASSERT(dataSizeArgument <= data.size());
+        toc.resize(n);
+        data.resize(dataSizeArgument);
+
+        vector<bool> isUsed(dataSizeArgument, false);
+        for(size_t i=0; i<n; i++) {
+            if(isCompacted(i)) {
+                continue;
+            }
+            size_t slot = toc[i];
+            do {
+                CZI_ASSERT(slot < dataSizeArgument);
+                isUsed[slot] = true;
+                slot = data[slot].next;
+            } while(slot != toc[i]);
+        }
+        freeSlots.resize(0);
+        for(size_t slot=0; slot<dataSizeArgument; slot++) {
+            if(!isUsed[slot]) {
+                freeSlots.push_back(slot);
+            }
+        }
     }
 
     // Return the number of lists.
@@ -93,74 +170,105 @@ public:
 
     // An iterator stores a pointer to the VectorOfLists and the index of the item pointed to.
     // We don't store pointers so the iterator remains valid if a reallocation occurs.
+    // For a list in the linked representation, the index is the index of a node
+    // in the data vector. For a compacted list, it is an index in the compactedData
+    // vector, and the iterator also stores the index of the list.
     // It comes in const and non-const versions.
     class iterator {
     public:
         iterator(
             VectorOfLists<T>* container=0,
-            size_t nodeIndex=std::numeric_limits<size_t>::max()) :
-            container(container), nodeIndex(nodeIndex) {}
+            size_t index=std::numeric_limits<size_t>::max(),
+            size_t compactedListIndex=std::numeric_limits<size_t>::max()) :
+            container(container), index(index), compactedListIndex(compactedListIndex) {}
         void operator++()
         {
-            nodeIndex = node().next;
+            if(isCompacted()) {
+                ++index;
+            } else {
+                index = node().next;
+            }
         }
         void operator--()
         {
-            nodeIndex = node().previous;
+            if(isCompacted()) {
+                --index;
+            } else {
+                index = node().previous;
+            }
         }
         bool operator==(iterator that) const
         {
-            return container==that.container && nodeIndex==that.nodeIndex;
+            return container==that.container && index==that.index && compactedListIndex==that.compactedListIndex;
         }
         bool operator!=(iterator that) const
         {
-            return container!=that.container || nodeIndex!=that.nodeIndex;
+            return !(*this == that);
         }
         T& operator*() const
         {
-            return node().t;
+            return isCompacted() ? (*container).compactedData[index] : node().t;
         }
         friend class VectorOfLists<T>;
     private:
         VectorOfLists<T>* container;
-        size_t nodeIndex;    // Index of the node in the data vector.
+        size_t index;
+        size_t compactedListIndex;  // Only used for compacted lists.
+        bool isCompacted() const
+        {
+            return compactedListIndex != std::numeric_limits<size_t>::max();
+        }
         Node& node() const
         {
-            return (*container).data[nodeIndex];
+            return (*container).data[index];
         }
     };
     class const_iterator {
     public:
         const_iterator(
             const VectorOfLists<T>* container=0,
-            size_t nodeIndex=std::numeric_limits<size_t>::max()) :
-            container(container), nodeIndex(nodeIndex) {}
+            size_t index=std::numeric_limits<size_t>::max(),
+            size_t compactedListIndex=std::numeric_limits<size_t>::max()) :
+            container(container), index(index), compactedListIndex(compactedListIndex) {}
         void operator++()
         {
-            nodeIndex = node().next;
+            if(isCompacted()) {
+                ++index;
+            } else {
+                index = node().next;
+            }
         }
         void operator--()
         {
-            nodeIndex = node().previous;
+            if(isCompacted()) {
+                --index;
+            } else {
+                index = node().previous;
+            }
         }
         bool operator==(const_iterator that) const
         {
-            return container==that.container && nodeIndex==that.nodeIndex;
+            return container==that.container && index==that.index && compactedListIndex==that.compactedListIndex;
         }
         bool operator!=(const_iterator that) const
         {
-            return container!=that.container || nodeIndex!=that.nodeIndex;
+            return !(*this == that);
         }
         const T& operator*() const
         {
-            return node().t;
+            return isCompacted() ? (*container).compactedData[index] : node().t;
         }
     private:
         const VectorOfLists<T>* container;
-        size_t nodeIndex;    // Index of the node in the data vector.
+        size_t index;
+        size_t compactedListIndex;  // Only used for compacted lists.
+        bool isCompacted() const
+        {
+            return compactedListIndex != std::numeric_limits<size_t>::max();
+        }
         const Node& node() const
         {
-            return (*container).data[nodeIndex];
+            return (*container).data[index];
         }
     };
 
@@ -170,22 +278,34 @@ public:
     // Return begin/end iterators for one of the lists.
     iterator begin(size_t i)
     {
+        if(isCompacted(i)) {
+            return iterator(this, compactedToc[i], i);
+        }
         iterator it = end(i);
         ++it;
         return it;
     }
     iterator end(size_t i)
     {
+        if(isCompacted(i)) {
+            return iterator(this, compactedToc[i+1], i);
+        }
         return iterator(this, toc[i]);
     }
     const_iterator begin(size_t i) const
     {
+        if(isCompacted(i)) {
+            return const_iterator(this, compactedToc[i], i);
+        }
         const_iterator it = end(i);
         ++it;
         return it;
     }
     const_iterator end(size_t i) const
     {
+        if(isCompacted(i)) {
+            return const_iterator(this, compactedToc[i+1], i);
+        }
         return const_iterator(this, toc[i]);
     }
 
@@ -205,6 +325,9 @@ public:
     // Insert a T before a given iterator position.
     iterator insert(iterator it, const T& t)
     {
+        if(it.isCompacted()) {
+            it = moveToLinked(it);
+        }
 
         // Store this t in an available slot.
         const size_t slot = allocateSlot();
@@ -215,9 +338,9 @@ public:
         iterator itPrevious = it;
         --itPrevious;
         itPrevious.node().next = slot;
-        node.previous = itPrevious.nodeIndex;
+        node.previous = itPrevious.index;
         it.node().previous = slot;
-        node.next = it.nodeIndex;
+        node.next = it.index;
 
         // Return an iterator pointing to the element we just inserted.
         return iterator(this, slot);
@@ -246,8 +369,12 @@ public:
     // Remove the element pointed to by an iterator.
     void erase(iterator it)
     {
+        if(it.isCompacted()) {
+            it = moveToLinked(it);
+        }
+
         // Add this slot to the list of free slots.
-        it.container->freeSlots.push_back(it.nodeIndex);
+        freeSlots.push_back(it.index);
 
         // Make the previous and next list elements point to each other.
         iterator itPrevious = it;
@@ -256,8 +383,50 @@ public:
         iterator itNext = it;
         ++itNext;
         Node& nextNode = itNext.node();
-        previousNode.next = itNext.nodeIndex;
-        nextNode.previous = itPrevious.nodeIndex;
+        previousNode.next = itNext.index;
+        nextNode.previous = itPrevious.index;
+    }
+
+
+
+    // Store all lists contiguously in the compacted representation.
+    // After this, the linked representation is empty.
+    void compact()
+    {
+        CZI_ASSERT(compactedToc.isOpen);
+
+        // Gather the contents of all lists, in order.
+        vector<size_t> newToc;
+        newToc.reserve(size() + 1);
+        newToc.push_back(0);
+        vector<T> newData;
+        for(size_t i=0; i<size(); i++) {
+            for(auto it=begin(i); it!=end(i); ++it) {
+                newData.push_back(*it);
+            }
+            newToc.push_back(newData.size());
+        }
+
+        // Store them.
+        compactedToc.resize(newToc.size());
+        copy(newToc.begin(), newToc.end(), compactedToc.begin());
+        compactedData.resize(newData.size());
+        copy(newData.begin(), newData.end(), compactedData.begin());
+        fill(toc.begin(), toc.end(), compactedListMarker);
+        data.resize(0);
+        freeSlots.resize(0);
+    }
+
+    // Return the number of lists in the linked representation.
+    size_t linkedListCount() const
+    {
+        size_t n = 0;
+        for(size_t i=0; i<size(); i++) {
+            if(!isCompacted(i)) {
+                ++n;
+            }
+        }
+        return n;
     }
 
 
@@ -344,6 +513,52 @@ private:
     // Offsets in the data vector to elements that are currently not used.
     Vector<size_t> freeSlots;
 
+    // The compacted representation. The elements of compacted list i
+    // are compactedData[compactedToc[i]] through compactedData[compactedToc[i+1]-1].
+    // For a compacted list, toc contains compactedListMarker.
+    Vector<size_t> compactedToc;
+    Vector<T> compactedData;
+    static const size_t compactedListMarker = std::numeric_limits<size_t>::max();
+    bool isCompacted(size_t i) const
+    {
+        return toc[i] == compactedListMarker;
+    }
+    void createCompacted(const string& name)
+    {
+        compactedToc.createNew(name + ".compactedToc");
+        compactedToc.push_back(0);
+        compactedData.createNew(name + ".compactedData");
+    }
+
+    // Move a compacted list to the linked representation, so elements
+    // can be inserted or erased, and return the iterator in the linked representation
+    // corresponding to an iterator in the compacted representation.
+    // The space used by the list in the compacted representation is
+    // not reused until the next call to compact().
+    iterator moveToLinked(iterator it)
+    {
+        const size_t i = it.compactedListIndex;
+        const size_t offset = it.index - compactedToc[i];
+
+        // Create the end node for this list.
+        const size_t slot = allocateSlot();
+        Node& node = data[slot];
+        node.previous = slot;
+        node.next = slot;
+        toc[i] = slot;
+
+        // Copy the elements.
+        for(size_t j=compactedToc[i]; j!=compactedToc[i+1]; j++) {
+            push_back(i, compactedData[j]);
+        }
+
+        iterator jt = begin(i);
+        for(size_t k=0; k<offset; k++) {
+            ++jt;
+        }
+        return jt;
+    }
+
 
 
     // Allocate a slot to be added to an existing list.
@@ -369,6 +584,11 @@ private:
 
 
 
+template<class T> const size_t
+    ChanZuckerberg::ExpressionMatrix2::MemoryMapped::VectorOfLists<T>::compactedListMarker;
+
+
+
 // Unit test.
 inline void ChanZuckerberg::ExpressionMatrix2::testMemoryMappedVectorOfLists()
 {
@@ -38,7 +38,13 @@ public:
     void accessExisting(const string& name, bool readWriteAccess)
     {
         toc.accessExisting(name + ".toc", readWriteAccess);
-        data.accessExisting(name + ".data", readWriteAccess);
+        try {
+            data.accessExisting(name + ".data", readWriteAccess);
+        } catch(...) {
+            // Leave this closed, so the caller can try again or remove the files.
+            toc.close();
+            throw;
+        }
     }
     void accessExistingReadOnly(const string& name)
     {
@@ -64,6 +70,11 @@ public:
         data.remove();
     }
 
+    bool isOpen() const
+    {
+        return toc.isOpen;
+    }
+
     size_t size() const
     {
         return toc.size() - 1;
@@ -77,6 +88,19 @@ public:
         toc.close();
         data.close();
     }
+    void syncToDisk()
+    {
+        toc.syncToDisk();
+        data.syncToDisk();
+    }
+
+    // Keep only the first n vectors.
+    void truncate(size_t n)
+    {
+        CZI_ASSERT(n < toc.size());
+        toc.resize(n + 1);
+        data.resize(toc[n]);
+    }
     bool empty() const
     {
         return toc.size() == 1;
@@ -177,6 +201,13 @@ public:
     void store(Int index, const T&);            // Called during pass 2.
     void endPass2();
 
+    // Versions of incrementCount and store that can be called
+    // concurrently by multiple threads.
+    // The order in which the entries of each vector are stored
+    // then depends on thread timing.
+    void incrementCountMultithreaded(Int index, Int m=1);
+    void storeMultithreaded(Int index, const T&);
+
     // Touch the memory in order to cause the
     // supporting pages of virtual memory to be loaded in real memory.
     size_t touchMemory() const
@@ -211,7 +242,7 @@ template<class T, class Int>
     for(Int i=0; i<n; i++) {
         toc[i+1] = toc[i] + count[i];
     }
-    const size_t  dataSize = toc.back() - 1ULL;
+    const size_t  dataSize = toc.back();
     data.reserve(dataSize);
     data.resize(dataSize);
 }
@@ -249,4 +280,19 @@ template<class T, class Int>
 
 
 
+template<class T, class Int>
+    void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::VectorOfVectors<T, Int>::incrementCountMultithreaded(Int index, Int m)
+{
+    __sync_fetch_and_add(&count[index], m);
+}
+
+
+template<class T, class Int>
+    void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::VectorOfVectors<T, Int>::storeMultithreaded(Int index, const T& t)
+{
+    (*this)[index][__sync_sub_and_fetch(&count[index], Int(1))] = t;
+}
+
+
+
 #endif
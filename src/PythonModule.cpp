@@ -11,12 +11,14 @@
 
 
 // CZI.
+#include "CellSetBitmap.hpp"
 #include "ClusterGraph.hpp"
 #include "ExpressionMatrix.hpp"
 #include "ExpressionMatrixSubset.hpp"
 #include "heap.hpp"
 #include "MemoryMappedVector.hpp"
 #include "MemoryMappedVectorOfLists.hpp"
+#include "mismatchCounts.hpp"
 #include "multipleSetUnion.hpp"
 using namespace ChanZuckerberg;
 using namespace ExpressionMatrix2;
@@ -102,7 +104,7 @@ pybind11::array ExpressionMatrix::getDenseExpressionMatrix(
     const string expressionMatrixSubsetName =
         directoryName + "/tmp-ExpressionMatrixSubset";
     ExpressionMatrixSubset expressionMatrixSubset(
-        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts);
+        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts, compressedCellExpressionCounts);
 
 
 
@@ -152,6 +154,42 @@ pybind11::array ExpressionMatrix::getDenseExpressionMatrix(
 
 
 
+// Version of addCellBlock that takes the CSR arrays as numpy arrays.
+void ExpressionMatrix::addCellBlockFromNumpy(
+    const vector<string>& blockGeneNames,
+    const vector<string>& blockCellNames,
+    pybind11::array indptr,
+    pybind11::array geneIndexes,
+    pybind11::array values,
+    const vector< pair<string, string> >& blockCellMetaData)
+{
+    // Convert the arrays to contiguous arrays of the required types.
+    // This does not make a copy if they already are.
+    const auto indptrArray = array_t<uint64_t, array::c_style | array::forcecast>::ensure(indptr);
+    const auto geneIndexesArray = array_t<uint32_t, array::c_style | array::forcecast>::ensure(geneIndexes);
+    const auto valuesArray = array_t<float, array::c_style | array::forcecast>::ensure(values);
+    if(!indptrArray || !geneIndexesArray || !valuesArray) {
+        throw runtime_error("Invalid array passed to addCellBlock.");
+    }
+
+    // Check the array sizes.
+    if(indptrArray.ndim()!=1 || geneIndexesArray.ndim()!=1 || valuesArray.ndim()!=1) {
+        throw runtime_error("Arrays passed to addCellBlock must be one-dimensional.");
+    }
+    if(size_t(indptrArray.size()) != blockCellNames.size() + 1) {
+        throw runtime_error("The indptr array passed to addCellBlock must have size equal to the number of cells plus one.");
+    }
+    const uint64_t countSize = indptrArray.data()[blockCellNames.size()];
+    if(size_t(geneIndexesArray.size()) != countSize || size_t(valuesArray.size()) != countSize) {
+        throw runtime_error("Inconsistent array sizes passed to addCellBlock.");
+    }
+
+    addCellBlock(blockGeneNames, blockCellNames, blockCellMetaData,
+        indptrArray.data(), geneIndexesArray.data(), valuesArray.data());
+}
+
+
+
 PYBIND11_MODULE(ExpressionMatrix2, module)
 {
     // Enum class NormalizationMethod.
@@ -173,6 +211,31 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
 
 
 
+    // Class ExpressionMatrixMappingPolicy.
+    class_<ExpressionMatrixMappingPolicy>(
+        module,
+        "ExpressionMatrixMappingPolicy",
+        "A mapping policy for the memory mapped files of an ExpressionMatrix "
+        "with names beginning with a given prefix, for example CellExpressionCounts or Lsh-. "
+        "A list of these can be passed to the ExpressionMatrix constructors, "
+        "so the policies are used from the start. "
+        "See ExpressionMatrix.setMappingPolicy.")
+        .def(init<string, string, bool, bool, bool>(),
+            arg("fileNamePrefix"),
+            arg("accessPattern") = "normal",
+            arg("useHugePages") = false,
+            arg("willNeed") = false,
+            arg("interleave") = false)
+        .def_readwrite("fileNamePrefix", &ExpressionMatrixMappingPolicy::fileNamePrefix)
+        .def_readwrite("accessPattern", &ExpressionMatrixMappingPolicy::accessPattern,
+            "The expected access pattern: normal, random, or sequential.")
+        .def_readwrite("useHugePages", &ExpressionMatrixMappingPolicy::useHugePages)
+        .def_readwrite("willNeed", &ExpressionMatrixMappingPolicy::willNeed)
+        .def_readwrite("interleave", &ExpressionMatrixMappingPolicy::interleave)
+        ;
+
+
+
     // Class ExpressionMatrix.
     class_<ExpressionMatrix>(
         module,
@@ -181,7 +244,8 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
         "Most high level functionality is provided by this class. "
         "Binary data files for an instance of this class are stored "
         "in a single directory on disk. They are accessed as memory mapped files. ")
-       .def(init<string, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t>(),
+       .def(init<string, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t,
+           const vector<ExpressionMatrixMappingPolicy>&>(),
            "This constructor creates a new (empty) ExpressionMatrix object "
            "in the specified directory. "
            "The directory must not exists. "
@@ -192,9 +256,10 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            arg("cellMetaDataNameCapacity"),
            arg("cellMetaDataValueCapacity"),
            arg("geneMetaDataNameCapacity") = 1<<16,
-           arg("geneMetaDataValueCapacity") = 1<<16
+           arg("geneMetaDataValueCapacity") = 1<<16,
+           arg("mappingPolicies") = vector<ExpressionMatrixMappingPolicy>()
        )
-       .def(init<string, bool>(),
+       .def(init<string, bool, const vector<ExpressionMatrixMappingPolicy>&>(),
            "This constructor can be used to access an existing ExpressionMatrix object "
            "in the specified directory. The directory must exist. "
            "If write access is not permitted on some of the data, "
@@ -207,7 +272,8 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            "except in circumstances where limited functionality "
            "with read-only access to the data is desired. ",
            arg("directoryName"),
-           arg("allowReadOnly")=false
+           arg("allowReadOnly")=false,
+           arg("mappingPolicies") = vector<ExpressionMatrixMappingPolicy>()
        )
 
        // Get the total number of genes or cells currently in the system.
@@ -280,6 +346,83 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            "Cell ids begin at zero and increment by one each time a cell is added. ",
            arg("jsonString")
        )
+       .def("addCellsFromJsonLines",
+           &ExpressionMatrix::addCellsFromJsonLines,
+           "Adds cells from a file (optionally gzip compressed) containing one JSON cell per line, "
+           "in the format used by addCellFromJson. "
+           "Lines with errors are reported and skipped. "
+           "Returns the number of cells added.",
+           arg("fileName"),
+           arg("batchSize") = 10000
+       )
+       .def("computeCellStatistics",
+           (
+               void (ExpressionMatrix::*)
+               (size_t, double)
+           )
+           &ExpressionMatrix::computeCellStatistics,
+           "Recompute the sums and norms of the expression counts of all cells, "
+           "using multiple threads. Expression counts greater than or equal to "
+           "largeExpressionCountThreshold are also summed separately.",
+           arg("threadCount") = 0,
+           arg("largeExpressionCountThreshold") = std::numeric_limits<double>::infinity()
+       )
+       .def("createGeneExpressionIndex",
+           &ExpressionMatrix::createGeneExpressionIndex,
+           "Create a gene-major copy of the expression counts, used to speed up "
+           "queries that need the expression counts of a gene for many cells. "
+           "Cells added later are appended to an overlay of the index kept in memory, "
+           "which ingestion functions merge into the stored index when it becomes large. "
+           "Call this again to merge cells added with addCell.",
+           arg("threadCount") = 0
+       )
+       .def("removeGeneExpressionIndex",
+           &ExpressionMatrix::removeGeneExpressionIndex,
+           "Remove the gene expression index."
+       )
+       .def("createCompressedExpressionCounts",
+           &ExpressionMatrix::createCompressedExpressionCounts,
+           "Create a compressed copy of the expression counts, used by cell similarity "
+           "computations and when creating expression matrix subsets. "
+           "Once created, it is kept up to date as cells are added."
+       )
+       .def("removeCompressedExpressionCounts",
+           &ExpressionMatrix::removeCompressedExpressionCounts,
+           "Remove the compressed copy of the expression counts."
+       )
+       .def("setMappingPolicy",
+           &ExpressionMatrix::setMappingPolicy,
+           "Set the mapping policy for memory mapped files of this expression matrix "
+           "with names beginning with the given prefix, for example CellExpressionCounts or Lsh-. "
+           "accessPattern can be normal, random, or sequential. "
+           "The policy is applied to files already open and to files opened later, "
+           "and is removed when this ExpressionMatrix is destroyed. "
+           "To avoid moving pages already in memory, pass the policies "
+           "to the constructor instead (see ExpressionMatrixMappingPolicy).",
+           arg("fileNamePrefix"),
+           arg("accessPattern") = "normal",
+           arg("useHugePages") = false,
+           arg("willNeed") = false,
+           arg("interleave") = false
+       )
+       .def("addCellBlock",
+           &ExpressionMatrix::addCellBlockFromNumpy,
+           "Adds a block of cells to the system. The expression counts are given "
+           "in compressed sparse row (CSR) format as three numpy arrays: "
+           "the expression counts of cell i are at positions indptr[i] through indptr[i+1]-1 "
+           "of geneIndexes and values, and geneIndexes are indexes into geneNames. "
+           "For example, these can be the indptr, indices, and data arrays of a "
+           "scipy.sparse.csr_matrix with a row for each cell and a column for each gene. "
+           "Gene names are only resolved once for the entire block. "
+           "cellMetaData is a list of (name, value) pairs added to all cells. "
+           "The entire block is validated before any cell is added.",
+           arg("geneNames"),
+           arg("cellNames"),
+           arg("indptr"),
+           arg("geneIndexes"),
+           arg("values"),
+           arg("cellMetaData") = vector< pair<string, string> >()
+       )
        .def("addCells",
            &ExpressionMatrix::addCells,
            "Adds cells to the system, reading expression counts and cell meta data from files. "
@@ -288,7 +431,8 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            arg("expressionCountsFileSeparators") = ",",
            arg("cellMetaDataFileName"),
            arg("cellMetaDataFileSeparators") = ",",
-           arg("additionalCellMetaData") = vector< pair<string, string> >()
+           arg("additionalCellMetaData") = vector< pair<string, string> >(),
+           arg("threadCount") = 0
        )
 #ifndef CZI_EXPRESSION_MATRIX2_SKIP_HDF5
        .def("addCellsFromHdf5",
@@ -302,7 +446,46 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            arg("cellMetaData"),
            arg("totalExpressionCountThreshold")
        )
+       .def("addCellsFromHdf5Batch",
+           &ExpressionMatrix::addCellsFromHdf5Batch,
+           "Adds cells from a list of HDF5 files, as created by the 10X Genomics pipeline. "
+           "Files are read in parallel, and cells are added in the order of the files. "
+           "This functon is only available in a build that includes HDF5 support.",
+           arg("fileNames"),
+           arg("cellNamePrefixes"),
+           arg("cellMetaData"),
+           arg("totalExpressionCountThreshold"),
+           arg("threadCount") = 0
+       )
 #endif
+       .def("addCellsFromMtx",
+           &ExpressionMatrix::addCellsFromMtx,
+           "Adds cells to the system, reading expression counts "
+           "from files in Matrix Market format as created by the 10X Genomics pipeline "
+           "(matrix.mtx, features.tsv or genes.tsv, and barcodes.tsv). "
+           "The files can be compressed with gzip. "
+           "Cell names are generated by prefixing each barcode with cellNamePrefix. "
+           "Only cells with total expression count at least totalExpressionCountThreshold are added.",
+           arg("matrixFileName"),
+           arg("featuresFileName"),
+           arg("barcodesFileName"),
+           arg("cellNamePrefix"),
+           arg("cellMetaData"),
+           arg("totalExpressionCountThreshold")
+       )
+       .def("addCellsFrom10xDirectory",
+           &ExpressionMatrix::addCellsFrom10xDirectory,
+           "Adds cells to the system, reading expression counts "
+           "from a directory created by the 10X Genomics pipeline, containing "
+           "matrix.mtx.gz, features.tsv.gz, and barcodes.tsv.gz "
+           "(or matrix.mtx, genes.tsv, and barcodes.tsv for older versions). "
+           "Cell names are generated by prefixing each barcode with cellNamePrefix. "
+           "Only cells with total expression count at least totalExpressionCountThreshold are added.",
+           arg("directoryName"),
+           arg("cellNamePrefix"),
+           arg("cellMetaData"),
+           arg("totalExpressionCountThreshold")
+       )
        .def("addCellsFromBioHub1",
            &ExpressionMatrix::addCellsFromBioHub1,
            "Add to the system cells created by the BioHub pipeline "
@@ -319,9 +502,11 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            "Add to the system cells created by the BioHub pipeline "
            "(September 2017 version, for 10X data). "
            "See `here <../../../PythonApi.html#addCellsFromBioHub2>`__ for more information. "
+           "Plates are downloaded and read in parallel, and cells are added in the order of the plates. "
            "This functon is only available in a build that includes HDF5 support.",
            arg("plateFileName"),
-           arg("totalExpressionCountThreshold")
+           arg("totalExpressionCountThreshold"),
+           arg("threadCount") = 0
        )
 #endif
 	   .def("addCellsFromBioHub3",
@@ -333,6 +518,16 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            arg("expressionCountsFileSeparators") = ",",
            arg("plateMetaData")
        )
+       .def("addCellsFromBioHub3Batch",
+           &ExpressionMatrix::addCellsFromBioHub3Batch,
+           "Add to the system cells from a list of plates created by the BioHub pipeline "
+           "(November 2017 version, for Illumina data). "
+           "Plates are read in parallel, and cells are added in the order of the plates.",
+           arg("expressionCountsFileNames"),
+           arg("expressionCountsFileSeparators") = ",",
+           arg("plateMetaData"),
+           arg("threadCount") = 0
+       )
        .def("addCellMetaData",
            &ExpressionMatrix::addCellMetaData,
            "Add cell meta data reading it from a csv file. "
@@ -392,6 +587,12 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            arg("cellSetName"),
            arg("metaDataName")
        )
+       .def("compactMetaData",
+           &ExpressionMatrix::compactMetaData,
+           "Stores the cell and gene meta data contiguously, which speeds up "
+           "functions that scan the meta data of many cells. "
+           "Best called after adding cells."
+       )
        .def("cellIdFromString",
            &ExpressionMatrix::cellIdFromString,
            "Returns the cell id corresponding to a given name, "
@@ -760,7 +961,7 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
        .def("findSimilarPairs0",
            (
                void (ExpressionMatrix::*)
-               (const string&, const string&, const string&, size_t, double)
+               (const string&, const string&, const string&, size_t, double, size_t)
            )
            &ExpressionMatrix::findSimilarPairs0,
            "Creates and stores a new object similarPairsName "
@@ -771,22 +972,26 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            "taking into account only genes in geneSetName. "
            "For each cell, only the best (most similar) k or fewer similar cells are stored, "
            "among those that exceed the specified similarityThreshold. "
+           "Each cell gets its own best k pairs, so a pair stored for one cell "
+           "is not necessarily stored for the other cell. "
            "This computational cost of this function grows "
            "with the square of the number of cells in cellSetName. "
            "The required computing time will typically be a few minutes "
            "for a few thousand cells or several hours for a few tens of thousands cells. "
            "When the number of cells exceeds a few thousands, "
-           "it is more practical to perform an approximate computation using findSimilarPairs4. ",
+           "it is more practical to perform an approximate computation using findSimilarPairs4. "
+           "The computation runs on threadCount threads (0 to use all available hardware threads). ",
            arg("geneSetName") = "AllGenes",
            arg("cellSetName") = "AllCells",
            arg("similarPairsName"),
            arg("k") = 100,
-           arg("similarityThreshold") = 0.2
+           arg("similarityThreshold") = 0.2,
+           arg("threadCount") = 0
        )
        .def("findSimilarPairs4",
            (
                void (ExpressionMatrix::*)
-               (const string&, const string&, const string&, size_t, double, size_t, unsigned int)
+               (const string&, const string&, const string&, size_t, double, size_t, unsigned int, size_t)
            )
            &ExpressionMatrix::findSimilarPairs4,
            "Like findSimilarPairs0, but uses Locality-Sensitive Hashing (LSH) "
@@ -797,14 +1002,17 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            "However the computation is orders of magnitudes faster. "
            "The computation is approximate, and the error decreases as lshCount increases. "
            "For the suggested value lshCount=1024, "
-           "the standard deviation of the pair similarity computed in this way is 0.05 or less.",
+           "the standard deviation of the pair similarity computed in this way is 0.05 or less. "
+           "The computation runs on threadCount threads (0 to use all available hardware threads) "
+           "and its result does not depend on the number of threads.",
            arg("geneSetName") = "AllGenes",
            arg("cellSetName") = "AllCells",
            arg("similarPairsName"),
            arg("k") = 100,
            arg("similarityThreshold") = 0.2,
            arg("lshCount") = 1024,
-           arg("seed") = 231
+           arg("seed") = 231,
+           arg("threadCount") = 0
        )
 #if CZI_EXPRESSION_MATRIX2_BUILD_FOR_GPU
        .def("findSimilarPairs4Gpu",
@@ -836,7 +1044,7 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
        .def("findSimilarPairs5",
            &ExpressionMatrix::findSimilarPairs5,
            "LSH-based computation of similar cell pairs "
-           "without looping over all possible pairs of cells."
+           "without looping over all possible pairs of cells. "
            "Prototype code. Use findSimilarPairs4 instead.",
            arg("geneSetName") = "AllGenes",
            arg("cellSetName") = "AllCells",
@@ -866,7 +1074,10 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
        .def("findSimilarPairs7",
            &ExpressionMatrix::findSimilarPairs7,
            "LSH-based computation of similar cell pairs "
-           "without looping over all possible pairs of cells."
+           "without looping over all possible pairs of cells. "
+           "If cellExpressionCacheName is not empty, the best rerankCount candidates "
+           "of each cell are reranked by exact similarity using that cell expression cache "
+           "(see createCellExpressionCache). "
            "Prototype code. Use findSimilarPairs4 instead.",
            arg("geneSetName") = "AllGenes",
            arg("cellSetName") = "AllCells",
@@ -876,13 +1087,54 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            arg("similarityThreshold") = 0.2,
            arg("lshSliceLengths"),
            arg("maxCheck"),
-           arg("log2BucketCount")
+           arg("log2BucketCount"),
+           arg("cellExpressionCacheName") = "",
+           arg("rerankCount") = 0,
+           arg("threadCount") = 0
+       )
+       .def("updateSimilarPairs7",
+           &ExpressionMatrix::updateSimilarPairs7,
+           "Update a SimilarPairs object created by findSimilarPairs7 "
+           "after cells were appended to the cell set it was created for. "
+           "The Lsh object used to create it is extended with signatures for the new cells, "
+           "and only the new cells are searched for neighbors. "
+           "The similar pairs of existing cells are updated in place. "
+           "Prototype code.",
+           arg("geneSetName") = "AllGenes",
+           arg("cellSetName") = "AllCells",
+           arg("lshName"),
+           arg("similarPairsName"),
+           arg("similarityThreshold") = 0.2,
+           arg("lshSliceLengths"),
+           arg("maxCheck"),
+           arg("log2BucketCount"),
+           arg("threadCount") = 0
+       )
+       .def("findSimilarPairs8",
+           &ExpressionMatrix::findSimilarPairs8,
+           "Multi-probe LSH-based computation of similar cell pairs "
+           "without looping over all possible pairs of cells. "
+           "For each signature slice, also probes buckets whose keys differ "
+           "from the signature slice of the cell by up to probeRadius bits (at most 2). "
+           "Use compareSimilarPairs to compute the recall relative to findSimilarPairs4. "
+           "Prototype code. Use findSimilarPairs4 instead.",
+           arg("geneSetName") = "AllGenes",
+           arg("cellSetName") = "AllCells",
+           arg("lshName"),
+           arg("similarPairsName"),
+           arg("k") = 100,
+           arg("similarityThreshold") = 0.2,
+           arg("lshSliceLength"),
+           arg("probeRadius") = 1,
+           arg("maxCheck"),
+           arg("log2BucketCount"),
+           arg("threadCount") = 0
        )
 #if CZI_EXPRESSION_MATRIX2_BUILD_FOR_GPU
        .def("findSimilarPairs7Gpu",
            &ExpressionMatrix::findSimilarPairs7Gpu,
            "LSH-based computation of similar cell pairs "
-           "without looping over all possible pairs of cells."
+           "without looping over all possible pairs of cells. "
            "Prototype code. Use findSimilarPairs4 instead.",
            arg("geneSetName") = "AllGenes",
            arg("cellSetName") = "AllCells",
@@ -919,12 +1171,56 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
        )
        .def("computeLshSignatures",
            &ExpressionMatrix::computeLshSignatures,
-           "Compute cell LSH signatures and store them.",
+           "Compute cell LSH signatures and store them. "
+           "The signatures are computed using threadCount threads "
+           "(0 to use all available hardware threads). "
+           "The signatures do not depend on the number of threads used.",
            arg("geneSetName") = "AllGenes",
            arg("cellSetName") = "AllCells",
            arg("lshName"),
            arg("lshCount") = 1024,
-           arg("seed") = 231
+           arg("seed") = 231,
+           arg("threadCount") = 0
+       )
+       .def("createCellExpressionCache",
+           &ExpressionMatrix::createCellExpressionCache,
+           "Create a compact copy of the expression counts of cellSetName, "
+           "restricted to the genes in geneSetName, together with "
+           "precomputed sums and sums of squares. "
+           "If quantize is true, each expression count is stored as an 8-bit code. "
+           "The code is exact if all counts of the cell are integers no greater than 255, "
+           "and logarithmic otherwise, with a relative error of about 2%. "
+           "Used by findSimilarPairs7 to rerank LSH candidates by exact similarity.",
+           arg("geneSetName") = "AllGenes",
+           arg("cellSetName") = "AllCells",
+           arg("cellExpressionCacheName"),
+           arg("quantize") = false
+       )
+       .def("createKnnGraph",
+           &ExpressionMatrix::createKnnGraph,
+           "Create a persistent approximate k-NN graph of cells "
+           "from the signatures of an existing Lsh object, using NN-descent. "
+           "The graph is built using threadCount threads "
+           "(0 to use all available hardware threads). "
+           "Use findSimilarPairs9 to create a SimilarPairs object from it.",
+           arg("lshName"),
+           arg("knnGraphName"),
+           arg("k") = 100,
+           arg("maxIterationCount") = 20,
+           arg("seed") = 231,
+           arg("threadCount") = 0
+       )
+       .def("findSimilarPairs9",
+           &ExpressionMatrix::findSimilarPairs9,
+           "Find similar cell pairs using a k-NN graph created by createKnnGraph. "
+           "Prototype code. Use findSimilarPairs4 instead.",
+           arg("geneSetName") = "AllGenes",
+           arg("cellSetName") = "AllCells",
+           arg("lshName"),
+           arg("knnGraphName"),
+           arg("similarPairsName"),
+           arg("k") = 100,
+           arg("similarityThreshold") = 0.2
        )
        .def("analyzeLshSignatures",
            &ExpressionMatrix::analyzeLshSignatures,
@@ -1178,6 +1474,16 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
         "Only intended to be used for testing. "
         "See the source code in the ExpressionMatrix2/src directory for more information. "
         );
+    module.def("testMismatchCounts",
+        testMismatchCounts,
+        "Only intended to be used for testing. "
+        "See the source code in the ExpressionMatrix2/src directory for more information. "
+        );
+    module.def("testCellSetBitmap",
+        testCellSetBitmap,
+        "Only intended to be used for testing. "
+        "See the source code in the ExpressionMatrix2/src directory for more information. "
+        );
     module.def("multipleSetUnionTest",
         multipleSetUnionTest,
         "Only intended to be used for testing. "
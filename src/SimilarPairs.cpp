@@ -39,13 +39,39 @@ SimilarPairs::SimilarPairs(
 
 
 // Access an existing SimilarPairs object.
-SimilarPairs::SimilarPairs(const string& name, bool allowReadOnly)
+SimilarPairs::SimilarPairs(const string& name, bool allowReadOnly, bool readWriteAccess)
 {
-    info.accessExistingReadOnly(name + "-Info");
-    similarPairs.accessExistingReadOnly(name + "-Pairs");
-    cellInfo.accessExistingReadOnly(name + "-CellInfo");
+    info.accessExisting(name + "-Info", readWriteAccess);
+    similarPairs.accessExisting(name + "-Pairs", readWriteAccess);
+    cellInfo.accessExisting(name + "-CellInfo", readWriteAccess);
     geneSet.accessExisting(name + "-GeneSet", allowReadOnly);
-    cellSet.accessExistingReadOnly(name + "-CellSet");
+    cellSet.accessExisting(name + "-CellSet", readWriteAccess);
+}
+
+
+
+// Extend this SimilarPairs object to a new cell set, obtained by appending
+// new cells to the cell set used by this SimilarPairs object.
+void SimilarPairs::appendCells(const CellSet& newCellSet)
+{
+    const CellId oldCellCount = cellCount();
+    const CellId newCellCount = CellId(newCellSet.size());
+    if(newCellCount < oldCellCount ||
+        !std::equal(cellSet.begin(), cellSet.end(), newCellSet.begin())) {
+        throw runtime_error("The new cell set must be obtained by appending cells "
+            "to the cell set used by this SimilarPairs object.");
+    }
+
+    similarPairs.resize(k() * size_t(newCellCount));
+    cellInfo.resize(newCellCount);
+    for(CellId cellId=oldCellCount; cellId<newCellCount; cellId++) {
+        CellInfo& info = cellInfo[cellId];
+        info.usedCount = 0;
+        info.lowestSimilarityIndex = std::numeric_limits<uint32_t>::max();
+        info.lowestSimilarity = std::numeric_limits<CellSimilarity>::max();
+        cellSet.push_back(newCellSet[cellId]);
+    }
+    info->cellCount = newCellCount;
 }
 
 
@@ -239,6 +265,26 @@ void SimilarPairs::addUnsymmetricNoCheck(CellId cellId0, CellId cellId1, double
 }
 
 
+// Add a group of pairs to the list for cellId0.
+// The new pairs and the list must both be sorted by decreasing similarity,
+// using the same ordering as sort().
+// The two sorted sequences are merged and only the best k pairs are kept.
+void SimilarPairs::addUnsymmetricSorted(CellId cellId0, const vector<Pair>& newPairs)
+{
+    CellInfo& info0 = cellInfo[cellId0];
+    uint32_t& n0 = info0.usedCount;
+    const OrderPairsBySecondGreaterThenByFirstLess<Pair> comparator;
+    CZI_ASSERT(std::is_sorted(newPairs.begin(), newPairs.end(), comparator));
+
+    Pair* b = begin(cellId0);
+    vector<Pair> mergedPairs(n0 + newPairs.size());
+    std::merge(b, b + n0, newPairs.begin(), newPairs.end(), mergedPairs.begin(), comparator);
+    n0 = uint32_t(min(k(), mergedPairs.size()));
+    std::copy(mergedPairs.begin(), mergedPairs.begin() + n0, b);
+}
+
+
+
 // Version that uses a heap to avoid linear searches.
 void SimilarPairs::addNoDuplicateCheckUsingHeap(CellId cellId, Pair pair)
 {
@@ -42,7 +42,8 @@ public:
         const CellSet& cellSet);
 
     // Access an existing SimilarPairs object.
-    SimilarPairs(const string& name, bool allowReadOnly);
+    // Write access is only needed to append cells or update pairs in place.
+    SimilarPairs(const string& name, bool allowReadOnly, bool readWriteAccess = false);
 
     // The type used to store a cell similarity.
     typedef float CellSimilarity;
@@ -102,6 +103,19 @@ public:
     void addUnsymmetricNoDuplicateCheckUsingHeap(CellId cellId0, CellId cellId1, double similarity);
     void addUnsymmetricNoCheck(CellId cellId0, CellId cellId1, double similarity);
 
+    // This adds a group of pairs to the list for cellId0, which must be sorted
+    // by decreasing similarity, in a single pass, and keeps it sorted.
+    // The new pairs must be sorted in the same order as the list.
+    // Only the k pairs with the highest similarity are kept.
+    // Does not check whether the pairs already exist.
+    // The cost is proportional to k plus the number of new pairs.
+    void addUnsymmetricSorted(CellId cellId0, const vector<Pair>& newPairs);
+
+    // Extend this SimilarPairs object to a new cell set, obtained by appending
+    // new cells to the cell set used by this SimilarPairs object.
+    // The new cells have no pairs.
+    void appendCells(const CellSet&);
+
     // Return true if CellId1 is currently listed among the pairs
     // similar to CellId0.
     // Note that this function is not symmetric under a swap of cellId0 and cellid1.
@@ -19,6 +19,7 @@ using namespace ChanZuckerberg;
 using namespace ExpressionMatrix2;
 using namespace ChanZuckerberg::ExpressionMatrix2::filesystem;
 
+#include <cstdio>
 #include <dirent.h>
 #include <sys/stat.h>
 
@@ -77,6 +78,17 @@ void ChanZuckerberg::ExpressionMatrix2::filesystem::remove(const string& path)
 
 
 
+// Rename a path, replacing the target if it exists.
+// In case of failure, throw an exception.
+void ChanZuckerberg::ExpressionMatrix2::filesystem::rename(const string& oldPath, const string& newPath)
+{
+    if(::rename(oldPath.c_str(), newPath.c_str()) == -1) {
+        throw runtime_error("Unable to rename " + oldPath + " to " + newPath);
+    }
+}
+
+
+
 // Return the contents of a directory. In case of failure, throw an exception.
 vector<string> ChanZuckerberg::ExpressionMatrix2::filesystem::directoryContents(const string& path)
 {
@@ -37,6 +37,10 @@ namespace ChanZuckerberg {
             // Remove the specified path. In case of failure, throw an exception.
             void remove(const string&);
 
+            // Rename a path, replacing the target if it exists.
+            // In case of failure, throw an exception.
+            void rename(const string& oldPath, const string& newPath);
+
             // Return the contents of a directory. In case of failure, throw an exception.
             vector<string> directoryContents(const string&);
 
@@ -0,0 +1,333 @@
+// Batched computation of the number of mismatching bits (Hamming distance)
+// between one bit set and many other bit sets.
+// See mismatchCounts.hpp for more information.
+
+#include "mismatchCounts.hpp"
+#include "CZI_ASSERT.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include "iostream.hpp"
+#include <random>
+#include "vector.hpp"
+
+// The SIMD kernels are only compiled for x86-64 using gcc or compatible compilers.
+// They are compiled using target attributes, so the rest of the code
+// does not require AVX2 or AVX-512 support from the cpu.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CZI_EXPRESSION_MATRIX2_MISMATCH_COUNTS_X86 1
+#include <immintrin.h>
+#else
+#define CZI_EXPRESSION_MATRIX2_MISMATCH_COUNTS_X86 0
+#endif
+
+
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace MismatchCounts {
+
+            // A kernel provides a contiguous and an indexed version
+            // of the batched computation.
+            class Kernel {
+            public:
+                const char* name;
+                void (*contiguous)(const uint64_t*, const uint64_t*, uint64_t, uint64_t, uint32_t*);
+                void (*indexed)(const uint64_t*, const uint64_t*, uint64_t, const uint32_t*, uint64_t, uint32_t*);
+            };
+
+            // Return all the kernels supported by the cpu,
+            // in order of increasing speed.
+            // The first one is always the portable kernel.
+            vector<Kernel> getSupportedKernels();
+
+            // Return the kernel selected at run time (the fastest supported one).
+            const Kernel& getKernel();
+        }
+    }
+}
+
+
+
+// The portable kernel.
+static inline uint32_t countMismatchesPortable(
+    const uint64_t* x,
+    const uint64_t* y,
+    uint64_t wordCount)
+{
+    uint64_t mismatchCount = 0;
+    for(uint64_t i=0; i<wordCount; i++) {
+        mismatchCount += __builtin_popcountll(x[i] ^ y[i]);
+    }
+    return uint32_t(mismatchCount);
+}
+static void computeMismatchCountsPortable(
+    const uint64_t* query,
+    const uint64_t* bitSets,
+    uint64_t wordCount,
+    uint64_t n,
+    uint32_t* mismatchCounts)
+{
+    for(uint64_t i=0; i<n; i++) {
+        mismatchCounts[i] = countMismatchesPortable(query, bitSets + i*wordCount, wordCount);
+    }
+}
+static void computeMismatchCountsPortable(
+    const uint64_t* query,
+    const uint64_t* bitSets,
+    uint64_t wordCount,
+    const uint32_t* indexes,
+    uint64_t n,
+    uint32_t* mismatchCounts)
+{
+    for(uint64_t i=0; i<n; i++) {
+        mismatchCounts[i] = countMismatchesPortable(query, bitSets + uint64_t(indexes[i])*wordCount, wordCount);
+    }
+}
+
+
+
+#if CZI_EXPRESSION_MATRIX2_MISMATCH_COUNTS_X86
+
+// The AVX2 kernel.
+// The population count of each byte is computed using two
+// lookups (one for each nibble) in a 16-entry table,
+// and the bytes are then summed into 64-bit lanes using vpsadbw.
+// See W. Mula, N. Kurz, D. Lemire, "Faster Population Counts
+// Using AVX2 Instructions", The Computer Journal 61 (2018).
+__attribute__((target("avx2")))
+static inline uint32_t countMismatchesAvx2(
+    const uint64_t* x,
+    const uint64_t* y,
+    uint64_t wordCount)
+{
+    const __m256i lookup = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowMask = _mm256_set1_epi8(0x0f);
+    __m256i sum = _mm256_setzero_si256();
+
+    uint64_t i = 0;
+    for(; i+4<=wordCount; i+=4) {
+        const __m256i v = _mm256_xor_si256(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x+i)),
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(y+i)));
+        const __m256i low = _mm256_and_si256(v, lowMask);
+        const __m256i high = _mm256_and_si256(_mm256_srli_epi16(v, 4), lowMask);
+        const __m256i byteCounts = _mm256_add_epi8(
+            _mm256_shuffle_epi8(lookup, low),
+            _mm256_shuffle_epi8(lookup, high));
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(byteCounts, _mm256_setzero_si256()));
+    }
+
+    uint64_t mismatchCount =
+        uint64_t(_mm256_extract_epi64(sum, 0)) +
+        uint64_t(_mm256_extract_epi64(sum, 1)) +
+        uint64_t(_mm256_extract_epi64(sum, 2)) +
+        uint64_t(_mm256_extract_epi64(sum, 3));
+    for(; i<wordCount; i++) {
+        mismatchCount += __builtin_popcountll(x[i] ^ y[i]);
+    }
+    return uint32_t(mismatchCount);
+}
+__attribute__((target("avx2")))
+static void computeMismatchCountsAvx2(
+    const uint64_t* query,
+    const uint64_t* bitSets,
+    uint64_t wordCount,
+    uint64_t n,
+    uint32_t* mismatchCounts)
+{
+    for(uint64_t i=0; i<n; i++) {
+        mismatchCounts[i] = countMismatchesAvx2(query, bitSets + i*wordCount, wordCount);
+    }
+}
+__attribute__((target("avx2")))
+static void computeMismatchCountsAvx2(
+    const uint64_t* query,
+    const uint64_t* bitSets,
+    uint64_t wordCount,
+    const uint32_t* indexes,
+    uint64_t n,
+    uint32_t* mismatchCounts)
+{
+    for(uint64_t i=0; i<n; i++) {
+        mismatchCounts[i] = countMismatchesAvx2(query, bitSets + uint64_t(indexes[i])*wordCount, wordCount);
+    }
+}
+
+
+
+// The AVX-512 kernel, using the VPOPCNTDQ instruction
+// which computes the population count of each of
+// the eight 64-bit lanes of a 512-bit register.
+// The last partial group of 8 words, if any, is processed using a masked load.
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static inline uint32_t countMismatchesAvx512(
+    const uint64_t* x,
+    const uint64_t* y,
+    uint64_t wordCount)
+{
+    __m512i sum = _mm512_setzero_si512();
+    uint64_t i = 0;
+    for(; i+8<=wordCount; i+=8) {
+        const __m512i v = _mm512_xor_si512(
+            _mm512_loadu_si512(x+i),
+            _mm512_loadu_si512(y+i));
+        sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(v));
+    }
+    if(i < wordCount) {
+        const __mmask8 mask = __mmask8((1U << (wordCount-i)) - 1U);
+        const __m512i v = _mm512_xor_si512(
+            _mm512_maskz_loadu_epi64(mask, x+i),
+            _mm512_maskz_loadu_epi64(mask, y+i));
+        sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(v));
+    }
+
+    // Reduce through memory. _mm512_reduce_add_epi64 generates
+    // spurious -Wmaybe-uninitialized warnings with some gcc versions.
+    uint64_t lanes[8];
+    _mm512_storeu_si512(lanes, sum);
+    uint64_t mismatchCount = 0;
+    for(int lane=0; lane<8; lane++) {
+        mismatchCount += lanes[lane];
+    }
+    return uint32_t(mismatchCount);
+}
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static void computeMismatchCountsAvx512(
+    const uint64_t* query,
+    const uint64_t* bitSets,
+    uint64_t wordCount,
+    uint64_t n,
+    uint32_t* mismatchCounts)
+{
+    for(uint64_t i=0; i<n; i++) {
+        mismatchCounts[i] = countMismatchesAvx512(query, bitSets + i*wordCount, wordCount);
+    }
+}
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static void computeMismatchCountsAvx512(
+    const uint64_t* query,
+    const uint64_t* bitSets,
+    uint64_t wordCount,
+    const uint32_t* indexes,
+    uint64_t n,
+    uint32_t* mismatchCounts)
+{
+    for(uint64_t i=0; i<n; i++) {
+        mismatchCounts[i] = countMismatchesAvx512(query, bitSets + uint64_t(indexes[i])*wordCount, wordCount);
+    }
+}
+
+#endif
+
+
+
+// Return all the kernels supported by the cpu,
+// in order of increasing speed.
+vector<MismatchCounts::Kernel> MismatchCounts::getSupportedKernels()
+{
+    vector<Kernel> kernels;
+    kernels.push_back(Kernel({"portable", computeMismatchCountsPortable, computeMismatchCountsPortable}));
+
+#if CZI_EXPRESSION_MATRIX2_MISMATCH_COUNTS_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        kernels.push_back(Kernel({"avx2", computeMismatchCountsAvx2, computeMismatchCountsAvx2}));
+    }
+    if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")) {
+        kernels.push_back(Kernel({"avx512vpopcntdq", computeMismatchCountsAvx512, computeMismatchCountsAvx512}));
+    }
+#endif
+
+    return kernels;
+}
+
+
+
+// Return the kernel selected at run time.
+// The selection is done only once, the first time this is called.
+const MismatchCounts::Kernel& MismatchCounts::getKernel()
+{
+    static const Kernel kernel = getSupportedKernels().back();
+    return kernel;
+}
+
+
+
+void ChanZuckerberg::ExpressionMatrix2::computeMismatchCounts(
+    const uint64_t* query,
+    const uint64_t* bitSets,
+    uint64_t wordCount,
+    uint64_t n,
+    uint32_t* mismatchCounts)
+{
+    MismatchCounts::getKernel().contiguous(query, bitSets, wordCount, n, mismatchCounts);
+}
+
+
+
+void ChanZuckerberg::ExpressionMatrix2::computeMismatchCounts(
+    const uint64_t* query,
+    const uint64_t* bitSets,
+    uint64_t wordCount,
+    const uint32_t* indexes,
+    uint64_t n,
+    uint32_t* mismatchCounts)
+{
+    MismatchCounts::getKernel().indexed(query, bitSets, wordCount, indexes, n, mismatchCounts);
+}
+
+
+
+string ChanZuckerberg::ExpressionMatrix2::getMismatchCountKernelName()
+{
+    return MismatchCounts::getKernel().name;
+}
+
+
+
+void ChanZuckerberg::ExpressionMatrix2::testMismatchCounts()
+{
+    const vector<MismatchCounts::Kernel> kernels = MismatchCounts::getSupportedKernels();
+    cout << "Selected mismatch count kernel is " << getMismatchCountKernelName() << endl;
+
+    std::mt19937_64 randomGenerator(231);
+    const uint64_t n = 100;
+    for(uint64_t wordCount=1; wordCount<=40; wordCount++) {
+
+        // Generate a query and n bit sets at random.
+        vector<uint64_t> query(wordCount);
+        vector<uint64_t> bitSets(n*wordCount);
+        for(uint64_t& word: query) {
+            word = randomGenerator();
+        }
+        for(uint64_t& word: bitSets) {
+            word = randomGenerator();
+        }
+        vector<uint32_t> indexes(n);
+        for(uint32_t& index: indexes) {
+            index = uint32_t(randomGenerator() % n);
+        }
+
+        // Compute expected results using the portable kernel.
+        vector<uint32_t> expected(n);
+        vector<uint32_t> expectedIndexed(n);
+        kernels.front().contiguous(query.data(), bitSets.data(), wordCount, n, expected.data());
+        kernels.front().indexed(query.data(), bitSets.data(), wordCount, indexes.data(), n, expectedIndexed.data());
+
+        // Check that all other kernels give the same results.
+        for(const MismatchCounts::Kernel& kernel: kernels) {
+            vector<uint32_t> mismatchCounts(n);
+            kernel.contiguous(query.data(), bitSets.data(), wordCount, n, mismatchCounts.data());
+            CZI_ASSERT(mismatchCounts == expected);
+            kernel.indexed(query.data(), bitSets.data(), wordCount, indexes.data(), n, mismatchCounts.data());
+            CZI_ASSERT(mismatchCounts == expectedIndexed);
+        }
+    }
+
+    for(const MismatchCounts::Kernel& kernel: kernels) {
+        cout << "Mismatch count kernel " << kernel.name << " passed." << endl;
+    }
+}
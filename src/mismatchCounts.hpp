@@ -0,0 +1,51 @@
+#ifndef CZI_EXPRESSION_MATRIX2_MISMATCH_COUNTS_HPP
+#define CZI_EXPRESSION_MATRIX2_MISMATCH_COUNTS_HPP
+
+// Batched computation of the number of mismatching bits (Hamming distance)
+// between one bit set (the query) and many other bit sets,
+// all with the same number of 64-bit words.
+// This is the inner loop of all the LSH-based findSimilarPairs functions.
+
+// Several kernels are available:
+// - A portable kernel that uses __builtin_popcountll.
+// - An AVX2 kernel that uses the nibble lookup table popcount.
+// - An AVX-512 kernel that uses the VPOPCNTDQ instruction.
+// The fastest kernel supported by the cpu is selected at run time
+// the first time one of these functions is called.
+
+#include "cstddef.hpp"
+#include "cstdint.hpp"
+#include "string.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+
+        // Compute mismatch counts between the query and
+        // n bit sets stored contiguously beginning at bitSets.
+        void computeMismatchCounts(
+            const uint64_t* query,
+            const uint64_t* bitSets,
+            uint64_t wordCount,         // Number of 64-bit words in each bit set.
+            uint64_t n,                 // Number of bit sets to compare against the query.
+            uint32_t* mismatchCounts);  // The n mismatch counts are stored here.
+
+        // Same as above, but only for the bit sets at the given indexes
+        // (the i-th bit set begins at bitSets + i*wordCount).
+        void computeMismatchCounts(
+            const uint64_t* query,
+            const uint64_t* bitSets,
+            uint64_t wordCount,         // Number of 64-bit words in each bit set.
+            const uint32_t* indexes,    // The indexes of the bit sets to compare against the query.
+            uint64_t n,                 // Number of indexes.
+            uint32_t* mismatchCounts);  // The n mismatch counts are stored here.
+
+        // Return the name of the kernel selected at run time.
+        string getMismatchCountKernelName();
+
+        // Unit test: check that all kernels supported by this cpu
+        // give the same results as the portable kernel.
+        void testMismatchCounts();
+    }
+}
+
+#endif
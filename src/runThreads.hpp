@@ -0,0 +1,115 @@
+#ifndef CZI_EXPRESSION_MATRIX2_RUN_THREADS_HPP
+#define CZI_EXPRESSION_MATRIX2_RUN_THREADS_HPP
+
+// Minimal support for multithreaded loops.
+// A function is run on a given number of threads, and each thread
+// grabs batches of a range of indexes until the range is exhausted.
+// Exceptions thrown by any of the threads are rethrown in the calling thread
+// after all threads have completed.
+
+#include "CZI_ASSERT.hpp"
+#include "algorithm.hpp"
+#include "cstddef.hpp"
+#include "vector.hpp"
+
+#include <atomic>
+#include <exception>
+#include <thread>
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+
+        // Return the number of threads to be used,
+        // given the number requested by the caller.
+        // Zero means use all available hardware threads.
+        inline size_t getThreadCount(size_t requestedThreadCount);
+
+        // Run a function on the specified number of threads.
+        // The function is called with the thread id (0 to threadCount-1) as its only argument.
+        // If threadCount is 1, the function is called in the calling thread.
+        template<class Function> void runThreads(size_t threadCount, const Function&);
+
+        // Class used by threads to obtain batches of indexes
+        // in a range [0, n).
+        class BatchDispatcher;
+    }
+}
+
+
+
+inline size_t ChanZuckerberg::ExpressionMatrix2::getThreadCount(size_t requestedThreadCount)
+{
+    if(requestedThreadCount == 0) {
+        requestedThreadCount = std::thread::hardware_concurrency();
+    }
+    return max(requestedThreadCount, size_t(1));
+}
+
+
+
+template<class Function> void ChanZuckerberg::ExpressionMatrix2::runThreads(
+    size_t threadCount,
+    const Function& function)
+{
+    CZI_ASSERT(threadCount > 0);
+    if(threadCount == 1) {
+        function(size_t(0));
+        return;
+    }
+
+    // Each thread stores here the exception it threw, if any.
+    // An exception escaping a std::thread would terminate the process.
+    vector<std::exception_ptr> exceptions(threadCount);
+
+    vector<std::thread> threads;
+    threads.reserve(threadCount);
+    for(size_t threadId=0; threadId<threadCount; threadId++) {
+        threads.push_back(std::thread([&function, &exceptions, threadId]()
+        {
+            try {
+                function(threadId);
+            } catch(...) {
+                exceptions[threadId] = std::current_exception();
+            }
+        }));
+    }
+    for(std::thread& thread: threads) {
+        thread.join();
+    }
+
+    for(const std::exception_ptr& exception: exceptions) {
+        if(exception) {
+            std::rethrow_exception(exception);
+        }
+    }
+}
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::BatchDispatcher {
+public:
+    BatchDispatcher(size_t n, size_t batchSize) :
+        n(n), batchSize(batchSize), nextBegin(0)
+    {
+        CZI_ASSERT(batchSize > 0);
+    }
+
+    // Get the next batch [begin, end).
+    // Returns false if there are no more batches.
+    bool getBatch(size_t& begin, size_t& end)
+    {
+        begin = nextBegin.fetch_add(batchSize);
+        if(begin >= n) {
+            return false;
+        }
+        end = min(begin + batchSize, n);
+        return true;
+    }
+
+private:
+    const size_t n;
+    const size_t batchSize;
+    std::atomic<size_t> nextBegin;
+};
+
+#endif
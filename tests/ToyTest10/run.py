@@ -0,0 +1,121 @@
+#!/usr/bin/python3
+
+
+# Import the shared library, which behaves as a Python module.
+import ExpressionMatrix2
+import gzip
+import json
+import random
+
+
+
+# Create the expression matrix.
+# This creates directory "data" to contain the binary data for this expression matrix.
+e = ExpressionMatrix2.ExpressionMatrix(
+    directoryName = 'data',
+    geneCapacity = 1<<18,                # Maximum number of genes.
+    cellCapacity = 1<<16,                # Maximum number of cells.
+    cellMetaDataNameCapacity = 1<<12,    # Maximum number of distinct cell meta data name strings.
+    cellMetaDataValueCapacity = 1<<20    # Maximum number of distinct cell meta data value strings.
+    )
+
+
+
+# Generate random cells, as dictionaries in the format used by addCellFromJson.
+# Expression counts are multiples of 1/4, so they are exactly representable.
+random.seed(231)
+def generateCell(cellName):
+    expressionCounts = {}
+    for gene in random.sample(range(50), 10):
+        expressionCounts['Gene%i' % gene] = random.randint(1, 400) / 4.
+    metaData = {'CellName': cellName, 'Type': 'Type%i' % random.randint(0, 3)}
+    return {'metaData': metaData, 'expressionCounts': expressionCounts}
+
+
+
+# Write the first file. Each valid line is preceded by an invalid line.
+# The invalid lines that have expression counts use gene names
+# that don't appear on any valid line.
+invalidLines = [
+    '{"metaData": {"CellName": "BadCell0"}, "expressionCounts": {"BadGene0": 1}',
+    '{"metaData": {"Type": "Type0"}, "expressionCounts": {"BadGene1": 1}}',
+    '{"metaData": {"CellName": "BadCell2"}}',
+    '{"expressionCounts": {"BadGene3": 1}}',
+    '{"metaData": {"CellName": "BadCell4"}, "expressionCounts": {"BadGene4": -1}}',
+    '{"metaData": {"CellName": "BadCell5"}, "expressionCounts": {"BadGene5": 1e39}}',
+    '{"metaData": {"CellName": "BadCell6"}, "expressionCounts": {"BadGene6": "1"}}',
+    '{"metaData": {"CellName": "BadCell7"}, "expressionCounts": {"BadGene7": 01}}',
+    '{"metaData": {"CellName": "BadCell8"}, "expressionCounts": {"BadGene8": 1, "BadGene8": 2}}',
+    '{"metaData": {"CellName": "BadCell9"}, "expressionCounts": {"BadGene9": 1}} x',
+    '{"metaData": {"CellName": "BadCell10", "Type": {"A": "B"}}, "expressionCounts": {"BadGene10": 1}}',
+    '{"metaData": {"CellName": "Cell0"}, "expressionCounts": {"BadGene11": 1}}',
+    '',
+    ]
+cells = []
+with open('Cells1.jsonl', 'w') as file:
+    for i in range(len(invalidLines)):
+        file.write(invalidLines[i] + '\n')
+        cell = generateCell('Cell%i' % i)
+        if i == 1:
+            # Meta data values that are numbers or keywords are stored as text,
+            # and unknown keys are ignored.
+            cell['metaData']['Age'] = 3.5
+            cell['metaData']['Valid'] = True
+            cell['comment'] = ['This', {'is': 'ignored'}]
+        cells.append(cell)
+        file.write(json.dumps(cell) + '\n')
+
+
+
+# Write the second file, gzip compressed.
+with gzip.open('Cells2.jsonl.gz', 'wt') as file:
+    for i in range(len(cells), len(cells) + 30):
+        cell = generateCell('Cell%i' % i)
+        cells.append(cell)
+        file.write(json.dumps(cell) + '\n')
+
+
+
+# Add the cells, using a small batch size for the first file
+# and the default batch size for the second file.
+addedCount = e.addCellsFromJsonLines(fileName = 'Cells1.jsonl', batchSize = 3)
+assert addedCount == len(invalidLines)
+addedCount = e.addCellsFromJsonLines(fileName = 'Cells2.jsonl.gz')
+assert addedCount == 30
+assert e.cellCount() == len(cells)
+print('There are %i genes and %i cells.' % (e.geneCount(), e.cellCount()))
+
+
+
+# Genes that only appear on invalid lines were not added.
+for geneId in range(e.geneCount()):
+    assert e.geneName(geneId).startswith('Gene')
+
+
+
+# Check the expression counts and meta data of each cell.
+for cellId in range(len(cells)):
+    cell = cells[cellId]
+    expressionCounts = dict((e.geneName(geneId), count) for geneId, count in e.getCellExpressionCounts(cellId))
+    assert expressionCounts == cell['expressionCounts']
+    metaData = dict(e.getCellMetaData(cellId))
+    expectedMetaData = dict((name, str(value)) for name, value in cell['metaData'].items())
+    if 'Valid' in expectedMetaData:
+        expectedMetaData['Valid'] = 'true'
+    assert metaData == expectedMetaData
+    assert e.cellIdFromString(cell['metaData']['CellName']) == cellId
+print('The expression counts and meta data of all cells are correct.')
+
+
+
+# A file that does not exist does not change the expression matrix.
+cellCount = e.cellCount()
+geneCount = e.geneCount()
+try:
+    e.addCellsFromJsonLines(fileName = 'Missing.jsonl')
+except RuntimeError as error:
+    print('addCellsFromJsonLines failed as expected: %s' % error)
+else:
+    raise Exception('addCellsFromJsonLines did not fail for a missing file.')
+assert e.cellCount() == cellCount
+assert e.geneCount() == geneCount
@@ -0,0 +1,113 @@
+#!/usr/bin/python3
+
+
+# Import the shared library, which behaves as a Python module.
+import ExpressionMatrix2
+import glob
+import json
+import os
+
+
+
+# Unit test of the string table.
+ExpressionMatrix2.testMemoryMappedStringTable()
+
+
+
+# Create the expression matrix, with initial sizes of the string tables
+# much smaller than the number of strings they will contain.
+# This creates directory "data" to contain the binary data for this expression matrix.
+e = ExpressionMatrix2.ExpressionMatrix(
+    directoryName = 'data',
+    geneCapacity = 16,                   # Initial size of the gene name table.
+    cellCapacity = 16,                   # Initial size of the cell name table.
+    cellMetaDataNameCapacity = 4,        # Initial size of the cell meta data name table.
+    cellMetaDataValueCapacity = 16       # Initial size of the cell meta data value table.
+    )
+
+
+
+# Add cells with ids in [begin, end).
+# Each cell has a unique name and a unique Barcode meta data value,
+# one of 20 meta data names, and expression counts for 3 of 500 genes.
+def addCells(e, begin, end):
+    with open('Cells.jsonl', 'w') as file:
+        for i in range(begin, end):
+            metaData = {'CellName': 'Cell%i' % i, 'Barcode': 'Barcode%i' % (7 * i), 'Field%i' % (i % 20): 'Value'}
+            expressionCounts = dict(('Gene%i' % ((i + j * 97) % 500), float(j + 1)) for j in range(3))
+            file.write(json.dumps({'metaData': metaData, 'expressionCounts': expressionCounts}) + '\n')
+    assert e.addCellsFromJsonLines(fileName = 'Cells.jsonl', batchSize = 100) == end - begin
+    assert e.cellCount() == end
+
+
+
+# Check that all strings can be found.
+def check(e):
+    cellCount = e.cellCount()
+    assert e.geneCount() == 500
+    for i in range(500):
+        geneId = e.geneIdFromName('Gene%i' % i)
+        assert geneId != ExpressionMatrix2.invalidGeneId
+        assert e.geneName(geneId) == 'Gene%i' % i
+    for i in range(cellCount):
+        assert e.cellIdFromString('Cell%i' % i) == i
+        assert e.getCellMetaDataValue(i, 'Barcode') == 'Barcode%i' % (7 * i)
+        assert e.getCellMetaDataValue(i, 'Field%i' % (i % 20)) == 'Value'
+    assert e.cellIdFromString('Cell%i' % cellCount) == ExpressionMatrix2.invalidCellId
+    assert e.geneIdFromName('Gene500') == ExpressionMatrix2.invalidGeneId
+    print('All strings were found for %i genes and %i cells.' % (e.geneCount(), cellCount))
+
+
+
+# Add cells until the hash table of the cell names has doubled from 2048 to 4096 slots,
+# at 1024 cells, and its strings are still being moved, which takes 512 more cells.
+addCells(e, 0, 1100)
+assert os.path.exists('data/CellNames-hashTable-old')
+check(e)
+
+
+
+# Access the expression matrix again. The move starts again from the first string
+# and includes the strings added since the doubling, so it completes after 550 more cells.
+del e
+e = ExpressionMatrix2.ExpressionMatrix(directoryName = 'data', allowReadOnly = False)
+assert os.path.exists('data/CellNames-hashTable-old')
+check(e)
+addCells(e, 1100, 1500)
+assert os.path.exists('data/CellNames-hashTable-old')
+check(e)
+addCells(e, 1500, 1700)
+assert not os.path.exists('data/CellNames-hashTable-old')
+check(e)
+
+
+
+# Simulate a doubling of the hash table of the cell names that was interrupted
+# after renaming the old hash table, but before creating the new one.
+# The old hash table is used.
+del e
+os.rename('data/CellNames-hashTable', 'data/CellNames-hashTable-old')
+os.rename('data/CellNames-fingerprints', 'data/CellNames-fingerprints-old')
+e = ExpressionMatrix2.ExpressionMatrix(directoryName = 'data', allowReadOnly = False)
+assert os.path.exists('data/CellNames-hashTable')
+assert not os.path.exists('data/CellNames-hashTable-old')
+check(e)
+
+
+
+# Remove the fingerprints of all string tables, as in string tables
+# created before they were introduced. They are created again.
+del e
+fingerprintsFileNames = glob.glob('data/*-fingerprints')
+assert len(fingerprintsFileNames) == 6
+for fileName in fingerprintsFileNames:
+    os.remove(fileName)
+e = ExpressionMatrix2.ExpressionMatrix(directoryName = 'data', allowReadOnly = False)
+for fileName in fingerprintsFileNames:
+    assert os.path.exists(fileName)
+check(e)
+addCells(e, 1700, 2100)
+check(e)
+del e
+e = ExpressionMatrix2.ExpressionMatrix(directoryName = 'data', allowReadOnly = False)
+check(e)
@@ -0,0 +1,113 @@
+#!/usr/bin/python3
+
+
+# Import the shared library, which behaves as a Python module.
+import ExpressionMatrix2
+import random
+
+
+
+# Create the expression matrix.
+# This creates directory "data" to contain the binary data for this expression matrix.
+e = ExpressionMatrix2.ExpressionMatrix(
+    directoryName = 'data',
+    geneCapacity = 1<<18,                # Maximum number of genes.
+    cellCapacity = 1<<16,                # Maximum number of cells.
+    cellMetaDataNameCapacity = 1<<12,    # Maximum number of distinct cell meta data name strings.
+    cellMetaDataValueCapacity = 1<<20    # Maximum number of distinct cell meta data value strings.
+    )
+
+
+
+# Add random cells with a few meta data fields.
+# The expected meta data of each cell are kept in a list
+# of (name, value) pairs, in the order in which they are stored.
+random.seed(231)
+expectedMetaData = []
+def addCells(n):
+    for i in range(n):
+        cellId = len(expectedMetaData)
+        metaData = [('CellName', 'Cell%i' % cellId), ('Type', 'Type%i' % random.randint(0, 3))]
+        if random.randint(0, 1):
+            metaData.append(('Tissue', 'Tissue%i' % random.randint(0, 2)))
+        expressionCounts = [('Gene%i' % gene, float(random.randint(1, 10))) for gene in random.sample(range(20), 5)]
+        assert e.addCell(metaData = metaData, expressionCounts = expressionCounts) == cellId
+        expectedMetaData.append(metaData)
+
+# Check the meta data of all cells, and the cells of the cell set
+# created from meta data Type.
+def check():
+    assert e.cellCount() == len(expectedMetaData)
+    assert e.getCellsMetaData(list(range(e.cellCount()))) == expectedMetaData
+    e.createCellSetUsingMetaData('Type0-Check', 'Type', 'Type0', False)
+    assert e.getCellSet('Type0-Check') == \
+        [cellId for cellId in range(e.cellCount()) if ('Type', 'Type0') in expectedMetaData[cellId]]
+    e.removeCellSet('Type0-Check')
+
+# Access the expression matrix again.
+def accessAgain():
+    global e
+    del e
+    e = ExpressionMatrix2.ExpressionMatrix(directoryName = 'data', allowReadOnly = False)
+
+
+
+# Add cells and compact the meta data.
+addCells(200)
+check()
+e.compactMetaData()
+check()
+accessAgain()
+check()
+print('The meta data of %i cells are unchanged after compactMetaData.' % e.cellCount())
+
+
+
+# Replace the Type and add a Score for some cells.
+with open('MetaData1.csv', 'w') as file:
+    file.write('Cell,Type,Score\n')
+    for cellId in range(0, 200, 3):
+        file.write('Cell%i,NewType,%i\n' % (cellId, cellId))
+        expectedMetaData[cellId][1] = ('Type', 'NewType')
+        expectedMetaData[cellId].append(('Score', str(cellId)))
+e.addCellMetaData(cellMetaDataFileName = 'MetaData1.csv')
+check()
+
+
+
+# Remove the Tissue of all cells.
+e.removeCellMetaData(cellSetName = 'AllCells', metaDataName = 'Tissue')
+for metaData in expectedMetaData:
+    metaData[:] = [(name, value) for name, value in metaData if name != 'Tissue']
+check()
+
+
+
+# Add more cells.
+addCells(100)
+check()
+
+
+
+# An ingestion function that fails because of a duplicate gene
+# does not change the meta data.
+with open('ExpressionMatrix2.csv', 'w') as file:
+    file.write('Gene,NewCell0,NewCell1\nGene0,1,2\nGene1,3,0\nGene0,0,5\n')
+with open('MetaData2.csv', 'w') as file:
+    file.write('Cell,Type\nNewCell0,Type0\nNewCell1,Type1\n')
+try:
+    e.addCells(expressionCountsFileName = 'ExpressionMatrix2.csv', cellMetaDataFileName = 'MetaData2.csv')
+except RuntimeError as error:
+    print('addCells failed as expected: %s' % error)
+else:
+    raise Exception('addCells did not fail.')
+check()
+
+
+
+# Compact the meta data again, then access the expression matrix again.
+e.compactMetaData()
+check()
+accessAgain()
+check()
+print('The meta data of %i cells are correct after changes and a second compactMetaData.' % e.cellCount())
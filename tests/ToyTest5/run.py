@@ -0,0 +1,51 @@
+#!/usr/bin/python3
+
+
+# Import the shared library, which behaves as a Python module.
+import ExpressionMatrix2 
+
+
+
+# Create the expression matrix and add the cells.
+# This creates directory "data" to contain the binary data for this expression matrix.
+e = ExpressionMatrix2.ExpressionMatrix(
+    directoryName = 'data',
+    geneCapacity = 1<<18,                # Maximum number of genes.
+    cellCapacity = 1<<16,                # Maximum number of cells.           
+    cellMetaDataNameCapacity = 1<<12,    # Maximum number of distinct cell meta data name strings.
+    cellMetaDataValueCapacity = 1<<20    # Maximum number of distinct cell meta data value strings.
+    )
+e.addCells(
+    expressionCountsFileName = 'ExpressionMatrix1.csv', 
+    cellMetaDataFileName = 'MetaData1.csv'
+    )
+cellCount = e.cellCount()
+geneCount = e.geneCount()
+print('There are %i genes and %i cells.' % (geneCount, cellCount))
+
+
+
+# Each of these fails, and should not change the expression matrix.
+for expressionCountsFileName, cellMetaDataFileName in [
+    ('ExpressionMatrix2.csv', 'MetaData2.csv'),
+    ('ExpressionMatrix3.csv', 'MetaData3.csv')]:
+    try:
+        e.addCells(
+            expressionCountsFileName = expressionCountsFileName, 
+            cellMetaDataFileName = cellMetaDataFileName
+            )
+    except RuntimeError as error:
+        print('addCells failed as expected for %s: %s' % (expressionCountsFileName, error))
+    else:
+        raise Exception('addCells did not fail for %s.' % expressionCountsFileName)
+    assert e.cellCount() == cellCount
+    assert e.geneCount() == geneCount
+
+
+
+# Access the expression matrix again and check that it is unchanged.
+del e
+e = ExpressionMatrix2.ExpressionMatrix(directoryName = 'data', allowReadOnly = False)
+assert e.cellCount() == cellCount
+assert e.geneCount() == geneCount
+print('There are %i genes and %i cells after accessing the expression matrix again.' % (e.geneCount(), e.cellCount()))
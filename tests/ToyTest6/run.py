@@ -0,0 +1,115 @@
+#!/usr/bin/python3
+
+
+# Import the shared library, which behaves as a Python module.
+import ExpressionMatrix2
+import csv
+import random
+
+
+
+# Create the expression matrix.
+# This creates directory "data" to contain the binary data for this expression matrix.
+e = ExpressionMatrix2.ExpressionMatrix(
+    directoryName = 'data',
+    geneCapacity = 1<<18,                # Maximum number of genes.
+    cellCapacity = 1<<16,                # Maximum number of cells.
+    cellMetaDataNameCapacity = 1<<12,    # Maximum number of distinct cell meta data name strings.
+    cellMetaDataValueCapacity = 1<<20    # Maximum number of distinct cell meta data value strings.
+    )
+
+
+
+# Add random cells in clusters.
+# Each cluster has its own set of highly expressed genes,
+# and all cells also have low counts for a set of shared genes.
+# There are enough cells for findSimilarPairs4 to use several tiles.
+random.seed(231)
+clusterCount = 6
+cellsPerCluster = 120
+clusterGeneCount = 30
+sharedGeneCount = 100
+for cluster in range(clusterCount):
+    for i in range(cellsPerCluster):
+        expressionCounts = []
+        for gene in range(clusterGeneCount):
+            expressionCounts.append(('ClusterGene%i-%i' % (cluster, gene), float(random.randint(20, 30))))
+        for gene in range(sharedGeneCount):
+            count = random.randint(0, 3)
+            if count > 0:
+                expressionCounts.append(('SharedGene%i' % gene, float(count)))
+        e.addCell(
+            metaData = [('CellName', 'Cell%i-%i' % (cluster, i)), ('Cluster', str(cluster))],
+            expressionCounts = expressionCounts)
+cellCount = e.cellCount()
+assert cellCount == clusterCount * cellsPerCluster
+print('There are %i genes and %i cells.' % (e.geneCount(), cellCount))
+
+
+
+# Read the similar pairs written by writeSimilarPairs.
+# Returns a list that gives, for each cell, the list of its similar cells
+# in the order in which they are stored, as tuples
+# (cellId1, computed similarity, exact similarity).
+def readSimilarPairs(similarPairsName):
+    e.writeSimilarPairs(similarPairsName)
+    similarPairs = [[] for cellId in range(cellCount)]
+    with open('SimilarPairs-%s.csv' % similarPairsName) as csvFile:
+        reader = csv.reader(csvFile)
+        next(reader)
+        for row in reader:
+            similarPairs[int(row[0])].append((int(row[1]), float(row[2]), float(row[3])))
+    return similarPairs
+
+
+
+# Find similar pairs exactly and using LSH with different numbers of threads.
+# k is larger than the cluster size, so all similar cells of each cell are stored.
+k = 200
+similarityThreshold = 0.5
+e.findSimilarPairs0(similarPairsName = 'Exact', k = k, similarityThreshold = similarityThreshold)
+for threadCount in [1, 3, 8]:
+    e.findSimilarPairs4(
+        similarPairsName = 'Lsh-%i' % threadCount,
+        k = k,
+        similarityThreshold = similarityThreshold,
+        threadCount = threadCount)
+exactPairs = readSimilarPairs('Exact')
+lshPairs = readSimilarPairs('Lsh-1')
+
+
+
+# The result does not depend on the number of threads.
+for threadCount in [3, 8]:
+    assert readSimilarPairs('Lsh-%i' % threadCount) == lshPairs
+print('findSimilarPairs4 gives the same result for 1, 3, and 8 threads.')
+
+
+
+# Check the similar pairs found using LSH.
+maxError = 0.
+for cellId0 in range(cellCount):
+    pairs = lshPairs[cellId0]
+    assert len(pairs) <= k
+    similarities = [computed for cellId1, computed, exact in pairs]
+    assert similarities == sorted(similarities, reverse = True)
+    for cellId1, computed, exact in pairs:
+        assert cellId1 != cellId0
+        assert computed >= similarityThreshold
+        maxError = max(maxError, abs(computed - exact))
+        for cellId2, computed2, exact2 in lshPairs[cellId1]:
+            if cellId2 == cellId0:
+                assert computed2 == computed
+print('Maximum error of the similarities computed using LSH: %f' % maxError)
+assert maxError < 0.25
+
+
+
+# Cells in the same cluster are found by both methods,
+# and no other cells are found.
+for cellId0 in range(cellCount):
+    cluster = cellId0 // cellsPerCluster
+    sameCluster = set(range(cluster * cellsPerCluster, (cluster + 1) * cellsPerCluster)) - {cellId0}
+    assert set(cellId1 for cellId1, computed, exact in exactPairs[cellId0]) == sameCluster
+    assert set(cellId1 for cellId1, computed, exact in lshPairs[cellId0]) == sameCluster
+print('findSimilarPairs0 and findSimilarPairs4 found the same pairs of similar cells.')
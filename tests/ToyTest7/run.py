@@ -0,0 +1,145 @@
+#!/usr/bin/python3
+
+
+# Import the shared library, which behaves as a Python module.
+import ExpressionMatrix2
+import csv
+import random
+
+
+
+# Create the expression matrix.
+# This creates directory "data" to contain the binary data for this expression matrix.
+e = ExpressionMatrix2.ExpressionMatrix(
+    directoryName = 'data',
+    geneCapacity = 1<<18,                # Maximum number of genes.
+    cellCapacity = 1<<16,                # Maximum number of cells.
+    cellMetaDataNameCapacity = 1<<12,    # Maximum number of distinct cell meta data name strings.
+    cellMetaDataValueCapacity = 1<<20    # Maximum number of distinct cell meta data value strings.
+    )
+
+
+
+# Add random cells in clusters.
+# Each cluster has its own set of highly expressed genes,
+# and all cells also have low counts for a set of shared genes.
+random.seed(231)
+clusterCount = 8
+cellsPerCluster = 60
+clusterGeneCount = 30
+sharedGeneCount = 100
+for cluster in range(clusterCount):
+    for i in range(cellsPerCluster):
+        expressionCounts = []
+        for gene in range(clusterGeneCount):
+            expressionCounts.append(('ClusterGene%i-%i' % (cluster, gene), float(random.randint(20, 30))))
+        for gene in range(sharedGeneCount):
+            count = random.randint(0, 3)
+            if count > 0:
+                expressionCounts.append(('SharedGene%i' % gene, float(count)))
+        e.addCell(
+            metaData = [('CellName', 'Cell%i-%i' % (cluster, i)), ('Cluster', str(cluster))],
+            expressionCounts = expressionCounts)
+cellCount = e.cellCount()
+print('There are %i genes and %i cells.' % (e.geneCount(), cellCount))
+
+
+
+# Read the similar pairs written by writeSimilarPairs.
+# Returns a list that gives, for each cell, the list of its similar cells
+# in the order in which they are stored, as tuples
+# (cellId1, computed similarity, exact similarity).
+def readSimilarPairs(e, similarPairsName):
+    e.writeSimilarPairs(similarPairsName)
+    similarPairs = [[] for cellId in range(cellCount)]
+    with open('SimilarPairs-%s.csv' % similarPairsName) as csvFile:
+        reader = csv.reader(csvFile)
+        next(reader)
+        for row in reader:
+            similarPairs[int(row[0])].append((int(row[1]), float(row[2]), float(row[3])))
+    return similarPairs
+
+
+
+# Find similar pairs using findSimilarPairs4, which is the reference,
+# and using a k-NN graph created with the same LSH vectors.
+k = 20
+similarityThreshold = 0.5
+lshCount = 1024
+seed = 231
+e.findSimilarPairs4(
+    similarPairsName = 'Reference',
+    k = k,
+    similarityThreshold = similarityThreshold,
+    lshCount = lshCount,
+    seed = seed)
+e.computeLshSignatures(lshName = 'Lsh', lshCount = lshCount, seed = seed)
+e.createKnnGraph(lshName = 'Lsh', knnGraphName = 'Knn', k = k, seed = seed)
+e.findSimilarPairs9(
+    lshName = 'Lsh',
+    knnGraphName = 'Knn',
+    similarPairsName = 'Knn',
+    k = k,
+    similarityThreshold = similarityThreshold)
+referencePairs = readSimilarPairs(e, 'Reference')
+knnPairs = readSimilarPairs(e, 'Knn')
+
+
+
+# Check the similar pairs found using the k-NN graph.
+# Cells in different clusters are not similar, so all pairs
+# are in the same cluster.
+for cellId0 in range(cellCount):
+    pairs = knnPairs[cellId0]
+    assert len(pairs) <= k
+    similarities = [computed for cellId1, computed, exact in pairs]
+    assert similarities == sorted(similarities, reverse = True)
+    for cellId1, computed, exact in pairs:
+        assert cellId1 != cellId0
+        assert cellId1 // cellsPerCluster == cellId0 // cellsPerCluster
+        assert computed >= similarityThreshold
+
+
+
+# Compute the recall relative to findSimilarPairs4.
+# Because of ties, a pair found using the k-NN graph is counted as correct
+# if it is at least as similar as the least similar reference pair of the cell.
+foundCount = 0
+referenceCount = 0
+for cellId0 in range(cellCount):
+    reference = referencePairs[cellId0]
+    referenceCount += len(reference)
+    if len(reference) > 0:
+        minSimilarity = reference[-1][1]
+        foundCount += len([pair for pair in knnPairs[cellId0] if pair[1] >= minSimilarity])
+recall = float(foundCount) / float(referenceCount)
+print('Recall of the k-NN graph relative to findSimilarPairs4: %f' % recall)
+assert recall > 0.95
+
+
+
+# Access the expression matrix again.
+# The k-NN graph can still be used, to find the same pairs
+# or fewer pairs per cell, but not more.
+del e
+e = ExpressionMatrix2.ExpressionMatrix(directoryName = 'data', allowReadOnly = False)
+e.findSimilarPairs9(
+    lshName = 'Lsh',
+    knnGraphName = 'Knn',
+    similarPairsName = 'Knn-Fewer',
+    k = k // 2,
+    similarityThreshold = similarityThreshold)
+fewerPairs = readSimilarPairs(e, 'Knn-Fewer')
+for cellId0 in range(cellCount):
+    assert fewerPairs[cellId0] == knnPairs[cellId0][:k // 2]
+try:
+    e.findSimilarPairs9(
+        lshName = 'Lsh',
+        knnGraphName = 'Knn',
+        similarPairsName = 'Knn-More',
+        k = 2 * k,
+        similarityThreshold = similarityThreshold)
+except RuntimeError as error:
+    print('findSimilarPairs9 failed as expected: %s' % error)
+else:
+    raise Exception('findSimilarPairs9 did not fail for k = %i.' % (2 * k))
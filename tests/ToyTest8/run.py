@@ -0,0 +1,179 @@
+#!/usr/bin/python3
+
+
+# Import the shared library, which behaves as a Python module.
+import ExpressionMatrix2
+import csv
+import random
+
+
+
+# Create the expression matrix.
+# This creates directory "data" to contain the binary data for this expression matrix.
+e = ExpressionMatrix2.ExpressionMatrix(
+    directoryName = 'data',
+    geneCapacity = 1<<18,                # Maximum number of genes.
+    cellCapacity = 1<<16,                # Maximum number of cells.
+    cellMetaDataNameCapacity = 1<<12,    # Maximum number of distinct cell meta data name strings.
+    cellMetaDataValueCapacity = 1<<20    # Maximum number of distinct cell meta data value strings.
+    )
+
+
+
+# Add random cells in clusters.
+# Each cluster has its own set of highly expressed genes,
+# and all cells also have low counts for a set of shared genes.
+# The cells of each batch are added in turn from each cluster,
+# so the cluster of cell i is i % clusterCount.
+random.seed(231)
+clusterCount = 8
+clusterGeneCount = 30
+sharedGeneCount = 100
+def addCells(e, cellsPerCluster):
+    for i in range(cellsPerCluster):
+        for cluster in range(clusterCount):
+            expressionCounts = []
+            for gene in range(clusterGeneCount):
+                expressionCounts.append(('ClusterGene%i-%i' % (cluster, gene), float(random.randint(20, 30))))
+            for gene in range(sharedGeneCount):
+                count = random.randint(0, 3)
+                if count > 0:
+                    expressionCounts.append(('SharedGene%i' % gene, float(count)))
+            e.addCell(
+                metaData = [('CellName', 'Cell%i' % e.cellCount()), ('Cluster', str(cluster))],
+                expressionCounts = expressionCounts)
+
+
+
+# Read the similar pairs written by writeSimilarPairs.
+# Returns a list that gives, for each cell, the list of its similar cells
+# in the order in which they are stored, as tuples
+# (cellId1, computed similarity, exact similarity).
+def readSimilarPairs(e, similarPairsName):
+    e.writeSimilarPairs(similarPairsName)
+    similarPairs = [[] for cellId in range(e.cellCount())]
+    with open('SimilarPairs-%s.csv' % similarPairsName) as csvFile:
+        reader = csv.reader(csvFile)
+        next(reader)
+        for row in reader:
+            similarPairs[int(row[0])].append((int(row[1]), float(row[2]), float(row[3])))
+    return similarPairs
+
+
+
+# Check similar pairs and return their recall relative to reference similar pairs.
+# Because of ties, a pair is counted as correct
+# if it is at least as similar as the least similar reference pair of the cell.
+def computeRecall(pairs, referencePairs):
+    foundCount = 0
+    referenceCount = 0
+    for cellId0 in range(len(pairs)):
+        assert len(pairs[cellId0]) <= k
+        similarities = [computed for cellId1, computed, exact in pairs[cellId0]]
+        assert similarities == sorted(similarities, reverse = True)
+        for cellId1, computed, exact in pairs[cellId0]:
+            assert cellId1 != cellId0
+            assert cellId1 % clusterCount == cellId0 % clusterCount
+            assert computed >= similarityThreshold
+        reference = referencePairs[cellId0]
+        referenceCount += len(reference)
+        if len(reference) > 0:
+            minSimilarity = reference[-1][1]
+            foundCount += len([pair for pair in pairs[cellId0] if pair[1] >= minSimilarity])
+    return float(foundCount) / float(referenceCount)
+
+
+
+# Parameters used to find similar pairs.
+k = 20
+similarityThreshold = 0.5
+lshSliceLengths = [16, 8]
+maxCheck = 100
+log2BucketCount = 16
+
+
+
+# Find similar pairs for the first batch of cells.
+addCells(e, 30)
+oldCellCount = e.cellCount()
+e.computeLshSignatures(lshName = 'Lsh')
+e.findSimilarPairs7(
+    lshName = 'Lsh',
+    similarPairsName = 'Incremental',
+    k = k,
+    similarityThreshold = similarityThreshold,
+    lshSliceLengths = lshSliceLengths,
+    maxCheck = maxCheck,
+    log2BucketCount = log2BucketCount)
+oldPairs = readSimilarPairs(e, 'Incremental')
+
+
+
+# Append a second batch of cells and update the similar pairs.
+addCells(e, 15)
+e.updateSimilarPairs7(
+    lshName = 'Lsh',
+    similarPairsName = 'Incremental',
+    similarityThreshold = similarityThreshold,
+    lshSliceLengths = lshSliceLengths,
+    maxCheck = maxCheck,
+    log2BucketCount = log2BucketCount)
+
+
+
+# Access the expression matrix again, append a third batch of cells,
+# and update the similar pairs again.
+del e
+e = ExpressionMatrix2.ExpressionMatrix(directoryName = 'data', allowReadOnly = False)
+addCells(e, 15)
+cellCount = e.cellCount()
+print('There are %i genes and %i cells.' % (e.geneCount(), cellCount))
+for i in range(2):
+    e.updateSimilarPairs7(
+        lshName = 'Lsh',
+        similarPairsName = 'Incremental',
+        similarityThreshold = similarityThreshold,
+        lshSliceLengths = lshSliceLengths,
+        maxCheck = maxCheck,
+        log2BucketCount = log2BucketCount)
+    if i == 0:
+        incrementalPairs = readSimilarPairs(e, 'Incremental')
+    else:
+        # The second update has no new cells and does nothing.
+        assert readSimilarPairs(e, 'Incremental') == incrementalPairs
+
+
+
+# Some of the existing cells now have new cells among their similar cells.
+updatedCount = 0
+for cellId0 in range(oldCellCount):
+    assert len(incrementalPairs[cellId0]) >= len(oldPairs[cellId0])
+    if any(cellId1 >= oldCellCount for cellId1, computed, exact in incrementalPairs[cellId0]):
+        updatedCount += 1
+print('%i of %i existing cells have new similar cells.' % (updatedCount, oldCellCount))
+assert updatedCount > oldCellCount // 2
+
+
+
+# Find similar pairs for all cells at once, using findSimilarPairs7
+# with a new Lsh object, and using findSimilarPairs4, which is the reference.
+e.computeLshSignatures(lshName = 'LshAll')
+e.findSimilarPairs7(
+    lshName = 'LshAll',
+    similarPairsName = 'All',
+    k = k,
+    similarityThreshold = similarityThreshold,
+    lshSliceLengths = lshSliceLengths,
+    maxCheck = maxCheck,
+    log2BucketCount = log2BucketCount)
+e.findSimilarPairs4(
+    similarPairsName = 'Reference',
+    k = k,
+    similarityThreshold = similarityThreshold)
+referencePairs = readSimilarPairs(e, 'Reference')
+incrementalRecall = computeRecall(incrementalPairs, referencePairs)
+allRecall = computeRecall(readSimilarPairs(e, 'All'), referencePairs)
+print('Recall relative to findSimilarPairs4: %f with updateSimilarPairs7, %f with findSimilarPairs7.' %
+    (incrementalRecall, allRecall))
+assert incrementalRecall > 0.95
+assert incrementalRecall > allRecall - 0.02
@@ -0,0 +1,164 @@
+#!/usr/bin/python3
+
+
+# Import the shared library, which behaves as a Python module.
+import ExpressionMatrix2
+import csv
+import glob
+import os
+import random
+
+
+
+# Create the expression matrix.
+# This creates directory "data" to contain the binary data for this expression matrix.
+e = ExpressionMatrix2.ExpressionMatrix(
+    directoryName = 'data',
+    geneCapacity = 1<<18,                # Maximum number of genes.
+    cellCapacity = 1<<16,                # Maximum number of cells.
+    cellMetaDataNameCapacity = 1<<12,    # Maximum number of distinct cell meta data name strings.
+    cellMetaDataValueCapacity = 1<<20    # Maximum number of distinct cell meta data value strings.
+    )
+
+
+
+# Add random cells in clusters.
+# Each cluster has its own set of highly expressed genes,
+# and all cells also have low counts for a set of shared genes.
+# The cells are added in turn from each cluster.
+random.seed(231)
+clusterCount = 8
+clusterGeneCount = 30
+sharedGeneCount = 100
+def addCells(cellsPerCluster):
+    for i in range(cellsPerCluster):
+        for cluster in range(clusterCount):
+            expressionCounts = []
+            for gene in range(clusterGeneCount):
+                expressionCounts.append(('ClusterGene%i-%i' % (cluster, gene), float(random.randint(20, 30))))
+            for gene in range(sharedGeneCount):
+                count = random.randint(0, 3)
+                if count > 0:
+                    expressionCounts.append(('SharedGene%i' % gene, float(count)))
+            e.addCell(
+                metaData = [('CellName', 'Cell%i' % e.cellCount()), ('Cluster', str(cluster))],
+                expressionCounts = expressionCounts)
+
+
+
+# Read the similar pairs written by writeSimilarPairs.
+# Returns a list that gives, for each cell, the list of its similar cells
+# in the order in which they are stored, as tuples
+# (cellId1, computed similarity, exact similarity).
+def readSimilarPairs(similarPairsName):
+    e.writeSimilarPairs(similarPairsName)
+    similarPairs = [[] for cellId in range(e.cellCount())]
+    with open('SimilarPairs-%s.csv' % similarPairsName) as csvFile:
+        reader = csv.reader(csvFile)
+        next(reader)
+        for row in reader:
+            similarPairs[int(row[0])].append((int(row[1]), float(row[2]), float(row[3])))
+    return similarPairs
+
+
+
+# Parameters used to find similar pairs.
+k = 20
+similarityThreshold = 0.5
+lshSliceLengths = [16, 8]
+maxCheck = 40
+log2BucketCount = 16
+
+# Find similar pairs using findSimilarPairs7 and return them.
+def findSimilarPairs7(lshName, similarPairsName):
+    e.findSimilarPairs7(
+        lshName = lshName,
+        similarPairsName = similarPairsName,
+        k = k,
+        similarityThreshold = similarityThreshold,
+        lshSliceLengths = lshSliceLengths,
+        maxCheck = maxCheck,
+        log2BucketCount = log2BucketCount)
+    return readSimilarPairs(similarPairsName)
+
+# Append cells and use updateSimilarPairs7 to add them
+# to Lsh object Lsh and its buckets.
+def appendCells(cellsPerCluster):
+    addCells(cellsPerCluster)
+    e.updateSimilarPairs7(
+        lshName = 'Lsh',
+        similarPairsName = 'Updated',
+        similarityThreshold = similarityThreshold,
+        lshSliceLengths = lshSliceLengths,
+        maxCheck = maxCheck,
+        log2BucketCount = log2BucketCount)
+
+# Check that findSimilarPairs7 gives the same result using the buckets
+# of Lsh object Lsh and using buckets created for all cells at once
+# for a new Lsh object with the same LSH vectors.
+def checkBuckets(name):
+    pairs = findSimilarPairs7('Lsh', name)
+    e.computeLshSignatures(lshName = 'Lsh-' + name)
+    assert findSimilarPairs7('Lsh-' + name, name + '-New') == pairs
+    print('findSimilarPairs7 gives the same result for %i cells using %s LSH buckets.' %
+        (e.cellCount(), name))
+
+# The name prefix of the memory mapped files of the buckets of Lsh object Lsh.
+bucketsName = 'data/Lsh-Lsh-Buckets-16_8-16'
+
+# Return the cell id ranges of the segments of the buckets of Lsh object Lsh.
+def getSegments():
+    segments = []
+    for fileName in glob.glob(bucketsName + '-Segment-*-CellIds'):
+        tokens = fileName[len(bucketsName + '-Segment-'):].split('-')
+        segments.append((int(tokens[0]), int(tokens[1])))
+    return sorted(segments)
+
+
+
+# Create the Lsh object and find similar pairs.
+addCells(50)
+mainCellCount = e.cellCount()
+e.computeLshSignatures(lshName = 'Lsh')
+pairs = findSimilarPairs7('Lsh', 'Updated')
+assert os.path.exists(bucketsName + '-Info')
+modificationTime = os.stat(bucketsName + '-Cells.data').st_mtime_ns
+
+
+
+# Find similar pairs again. The buckets are reused.
+assert findSimilarPairs7('Lsh', 'Reused') == pairs
+assert os.stat(bucketsName + '-Cells.data').st_mtime_ns == modificationTime
+print('findSimilarPairs7 reused the LSH buckets.')
+
+
+
+# Append cells in small batches. They are stored in segments,
+# and each new segment is merged with the preceding segment if it is not larger.
+appendCells(1)
+assert getSegments() == [(400, 408)]
+appendCells(1)
+assert getSegments() == [(400, 416)]
+appendCells(1)
+assert getSegments() == [(400, 416), (416, 424)]
+assert os.path.exists(bucketsName + '-Segments-424')
+assert not os.path.exists(bucketsName + '-Segments-416')
+assert os.stat(bucketsName + '-Cells.data').st_mtime_ns == modificationTime
+checkBuckets('Segments')
+
+
+
+# Append enough cells for the segments to be merged into the main buckets.
+appendCells(10)
+assert e.cellCount() == 504
+assert 4 * (e.cellCount() - mainCellCount) > mainCellCount
+assert getSegments() == []
+assert os.stat(bucketsName + '-Cells.data').st_mtime_ns != modificationTime
+checkBuckets('Merged')
+
+
+
+# Remove one of the files of the buckets. They are recreated.
+os.remove(bucketsName + '-SliceLengths')
+checkBuckets('Recreated')
+assert os.path.exists(bucketsName + '-SliceLengths')